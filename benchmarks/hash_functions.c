@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Lookup cost of a linked_hashtable for several hash functions and key
+ * sizes. Keys are random binary strings, the table is prefilled and then
+ * probed with a random sequence of existing keys.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <getopt.h>
+#endif
+
+#include <crystal.h>
+
+#include "BRCrypto.h"
+
+typedef struct bench_item {
+    linked_hash_entry_t he;
+    uint8_t key[];
+} bench_item;
+
+typedef struct bench_hash {
+    const char *name;
+    uint32_t (*hash_code)(const void *key, size_t len);
+    int flags;
+} bench_hash;
+
+/* The former default: byte at a time, chars sign-extended */
+static uint32_t legacy_hash(const void *key, size_t len)
+{
+    uint32_t h = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = 31 * h + ((const char *)key)[i];
+
+    return h;
+}
+
+static uint32_t murmur3_hash(const void *key, size_t len)
+{
+    return BRMurmur3_32(key, len, 0);
+}
+
+static uint32_t sip_hash(const void *key, size_t len)
+{
+    static const uint8_t sip_key[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+    uint64_t h = BRSip64(sip_key, key, len);
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static bench_hash hashes[] = {
+    { "legacy",         legacy_hash,    0 },
+    { "murmur3_32",     murmur3_hash,   0 },
+    { "siphash",        sip_hash,       0 },
+    { "default",        NULL,           0 },
+    { "random-seed",    NULL,           LINKED_HASHTABLE_RANDOM_SEED },
+    { NULL,             NULL,           0 }
+};
+
+static size_t key_sizes[] = { 4, 8, 16, 32, 64, 128, 256, 0 };
+
+static int nkeys = 100000;
+static int nops = 2000000;
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static bench_item **items_create(size_t keylen)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    bench_item **items;
+    size_t j;
+    int i;
+
+    items = (bench_item **)calloc(nkeys, sizeof(bench_item *));
+    if (!items)
+        return NULL;
+
+    for (i = 0; i < nkeys; i++) {
+        items[i] = (bench_item *)rc_zalloc(sizeof(bench_item) + keylen, NULL);
+        if (!items[i]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+
+        for (j = 0; j < keylen; j++)
+            items[i]->key[j] = (uint8_t)xorshift64(&state);
+
+        items[i]->he.key = items[i]->key;
+        items[i]->he.keylen = keylen;
+        items[i]->he.data = items[i];
+    }
+
+    return items;
+}
+
+static void items_destroy(bench_item **items)
+{
+    int i;
+
+    for (i = 0; i < nkeys; i++)
+        deref(items[i]);
+
+    free(items);
+}
+
+/* Nanoseconds per lookup */
+static double run(bench_hash *hash, bench_item **items)
+{
+    linked_hashtable_t *htab;
+    uint64_t state = 88172645463325252ULL;
+    uint64_t start, elapsed;
+    bench_item *item;
+    int i, misses = 0;
+
+    htab = linked_hashtable_create(nkeys, hash->flags, hash->hash_code, NULL);
+    if (!htab) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < nkeys; i++)
+        linked_hashtable_put(htab, &items[i]->he);
+
+    start = get_monotonic_time();
+
+    for (i = 0; i < nops; i++) {
+        item = items[xorshift64(&state) % nkeys];
+        if (!linked_hashtable_exist(htab, item->key, item->he.keylen))
+            misses++;
+    }
+
+    elapsed = get_monotonic_time() - start;
+
+    deref(htab);
+
+    if (misses)
+        fprintf(stderr, "%s: %d lookups failed\n", hash->name, misses);
+
+    return (double)elapsed * 1000 / nops;
+}
+
+static void usage(void)
+{
+    printf("Usage: hash_functions [OPTION]...\n"
+           "  -k, --keys=N       Number of keys in the table (default 100000)\n"
+           "  -o, --ops=N        Lookups per measurement (default 2000000)\n"
+           "  -h, --help         Show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_item **items;
+    bench_hash *hash;
+    size_t *keylen;
+    int opt;
+
+    struct option options[] = {
+        { "keys",       required_argument,  NULL, 'k' },
+        { "ops",        required_argument,  NULL, 'o' },
+        { "help",       no_argument,        NULL, 'h' },
+        { NULL,         0,                  NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "k:o:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 'o':
+            nops = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage();
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (nkeys < 1 || nops < 1) {
+        usage();
+        return -1;
+    }
+
+    printf("keys: %d, lookups: %d\n\n", nkeys, nops);
+    printf("%-8s", "keylen");
+    for (hash = hashes; hash->name; hash++)
+        printf("%14s", hash->name);
+    printf("\n");
+
+    for (keylen = key_sizes; *keylen; keylen++) {
+        items = items_create(*keylen);
+        if (!items) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+
+        printf("%-8zu", *keylen);
+        for (hash = hashes; hash->name; hash++) {
+            printf("%14.1f", run(hash, items));
+            fflush(stdout);
+        }
+        printf("\n");
+
+        items_destroy(items);
+    }
+
+    printf("\n(nanoseconds per lookup)\n");
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Throughput of a synced linked_hashtable versus the number of threads,
+ * for each of the locking modes. Every thread runs the same mix of
+ * get/put operations over a shared, prefilled key space.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <getopt.h>
+#endif
+
+#include <crystal.h>
+
+typedef struct bench_item {
+    linked_hash_entry_t he;
+    char key[24];
+} bench_item;
+
+typedef struct bench_mode {
+    const char *name;
+    int flags;
+} bench_mode;
+
+typedef struct start_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;
+    int open;
+} start_gate;
+
+typedef struct worker_args {
+    linked_hashtable_t *htab;
+    bench_item **items;
+    start_gate *gate;
+    uint64_t seed;
+} worker_args;
+
+static bench_mode modes[] = {
+    { "rwlock",                 LINKED_HASHTABLE_SYNCED },
+    { "striped",                LINKED_HASHTABLE_STRIPED },
+    { "striped+open",           LINKED_HASHTABLE_STRIPED |
+                                LINKED_HASHTABLE_OPEN_ADDRESSING },
+    { "lockfree",               LINKED_HASHTABLE_LOCKFREE_READ },
+    { "striped+lockfree",       LINKED_HASHTABLE_STRIPED |
+                                LINKED_HASHTABLE_LOCKFREE_READ },
+    { NULL, 0 }
+};
+
+static int nkeys = 100000;
+static int nops = 1000000;
+static int write_percent = 1;
+static int max_threads = 32;
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static void gate_wait(start_gate *gate)
+{
+    pthread_mutex_lock(&gate->lock);
+    gate->ready++;
+    pthread_cond_broadcast(&gate->cond);
+    while (!gate->open)
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static void gate_open(start_gate *gate, int nthreads)
+{
+    pthread_mutex_lock(&gate->lock);
+    while (gate->ready < nthreads)
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    gate->open = 1;
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static void *worker_routine(void *arg)
+{
+    worker_args *args = (worker_args *)arg;
+    uint64_t state = args->seed;
+    bench_item *item;
+    uint64_t r;
+    int i;
+
+    gate_wait(args->gate);
+
+    for (i = 0; i < nops; i++) {
+        r = xorshift64(&state);
+        item = args->items[r % nkeys];
+
+        if ((int)((r >> 32) % 100) < write_percent) {
+            linked_hashtable_put(args->htab, &item->he);
+        } else {
+            void *val = linked_hashtable_get(args->htab, item->key, item->he.keylen);
+            deref(val);
+        }
+    }
+
+    return NULL;
+}
+
+/* Writers put the same entry again, replacing it in place */
+static bench_item **items_create(void)
+{
+    bench_item **items;
+    int i;
+
+    items = (bench_item **)calloc(nkeys, sizeof(bench_item *));
+    if (!items)
+        return NULL;
+
+    for (i = 0; i < nkeys; i++) {
+        items[i] = (bench_item *)rc_zalloc(sizeof(bench_item), NULL);
+        if (!items[i]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+
+        sprintf(items[i]->key, "bench-key-%d", i);
+        items[i]->he.key = items[i]->key;
+        items[i]->he.keylen = strlen(items[i]->key);
+        items[i]->he.data = items[i];
+    }
+
+    return items;
+}
+
+static void items_destroy(bench_item **items)
+{
+    int i;
+
+    for (i = 0; i < nkeys; i++)
+        deref(items[i]);
+
+    free(items);
+}
+
+static double run(bench_mode *mode, int nthreads)
+{
+    linked_hashtable_t *htab;
+    bench_item **items;
+    pthread_t *threads;
+    worker_args *args;
+    start_gate gate;
+    uint64_t start, elapsed;
+    int i;
+
+    items = items_create();
+    htab = linked_hashtable_create(nkeys, mode->flags, NULL, NULL);
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    args = (worker_args *)calloc(nthreads, sizeof(worker_args));
+    if (!items || !htab || !threads || !args) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < nkeys; i++)
+        linked_hashtable_put(htab, &items[i]->he);
+
+    memset(&gate, 0, sizeof(gate));
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].htab = htab;
+        args[i].items = items;
+        args[i].gate = &gate;
+        args[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+
+        pthread_create(&threads[i], NULL, worker_routine, &args[i]);
+    }
+
+    start = get_monotonic_time();
+    gate_open(&gate, nthreads);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    elapsed = get_monotonic_time() - start;
+
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.lock);
+    free(args);
+    free(threads);
+    deref(htab);
+    items_destroy(items);
+
+    // Million operations per second
+    return (double)nops * nthreads / (elapsed ? elapsed : 1);
+}
+
+static void usage(void)
+{
+    printf("Usage: hashtable_scaling [OPTION]...\n"
+           "  -t, --threads=N    Maximum number of threads (default 32)\n"
+           "  -k, --keys=N       Number of keys in the table (default 100000)\n"
+           "  -o, --ops=N        Operations per thread (default 1000000)\n"
+           "  -w, --writes=N     Percentage of put operations (default 1)\n"
+           "  -h, --help         Show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_mode *mode;
+    int nthreads;
+    int opt;
+
+    struct option options[] = {
+        { "threads",    required_argument,  NULL, 't' },
+        { "keys",       required_argument,  NULL, 'k' },
+        { "ops",        required_argument,  NULL, 'o' },
+        { "writes",     required_argument,  NULL, 'w' },
+        { "help",       no_argument,        NULL, 'h' },
+        { NULL,         0,                  NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:k:o:w:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 'o':
+            nops = atoi(optarg);
+            break;
+        case 'w':
+            write_percent = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage();
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (max_threads < 1 || nkeys < 1 || nops < 1 ||
+        write_percent < 0 || write_percent > 100) {
+        usage();
+        return -1;
+    }
+
+    printf("keys: %d, ops/thread: %d, writes: %d%%\n\n", nkeys, nops, write_percent);
+    printf("%-8s", "threads");
+    for (mode = modes; mode->name; mode++)
+        printf("%18s", mode->name);
+    printf("\n");
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads <<= 1) {
+        printf("%-8d", nthreads);
+        for (mode = modes; mode->name; mode++) {
+            printf("%18.2f", run(mode, nthreads));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    printf("\n(million operations per second)\n");
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Cost of rc_alloc()/deref() churn with and without the size class pool,
+ * versus the number of threads. Every thread replaces random objects in
+ * a slot array with new ones of random size; with 'local' slots each
+ * thread has its own, with 'shared' slots most objects are destroyed by
+ * a thread other than the one that allocated them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <getopt.h>
+#endif
+
+#include <crystal.h>
+
+typedef struct bench_mode {
+    const char *name;
+    int pool;
+    int shared;
+} bench_mode;
+
+typedef struct worker_args {
+    void **slots;
+    int nslots;
+    uint64_t seed;
+} worker_args;
+
+static bench_mode modes[] = {
+    { "malloc/local",   0, 0 },
+    { "pool/local",     1, 0 },
+    { "malloc/shared",  0, 1 },
+    { "pool/shared",    1, 1 },
+    { NULL, 0, 0 }
+};
+
+static int nslots = 4096;
+static int nops = 2000000;
+static int max_size = 256;
+static int max_threads = 32;
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static void *worker_routine(void *arg)
+{
+    worker_args *args = (worker_args *)arg;
+    uint64_t state = args->seed;
+    void **slot;
+    void *obj, *old;
+    uint64_t r;
+    int i;
+
+    for (i = 0; i < nops; i++) {
+        r = xorshift64(&state);
+
+        obj = rc_alloc((size_t)((r >> 32) % max_size) + 1, NULL);
+        if (!obj) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+        *(uint64_t *)obj = r;
+
+        slot = &args->slots[r % args->nslots];
+        old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(slot, &old, obj, 1,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            ;
+        deref(old);
+    }
+
+    return NULL;
+}
+
+static double run(bench_mode *mode, int nthreads)
+{
+    pthread_t *threads;
+    worker_args *args;
+    void **slots;
+    uint64_t start, elapsed;
+    int total;
+    int i;
+
+    rc_mem_pool_enable(mode->pool);
+
+    total = mode->shared ? nslots : nslots * nthreads;
+    slots = (void **)calloc(total, sizeof(void *));
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    args = (worker_args *)calloc(nthreads, sizeof(worker_args));
+    if (!slots || !threads || !args) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].slots = mode->shared ? slots : slots + i * nslots;
+        args[i].nslots = nslots;
+        args[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+    }
+
+    start = get_monotonic_time();
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker_routine, &args[i]);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    elapsed = get_monotonic_time() - start;
+
+    for (i = 0; i < total; i++)
+        deref(slots[i]);
+
+    free(args);
+    free(threads);
+    free(slots);
+
+    // Million alloc/deref pairs per second
+    return (double)nops * nthreads / (elapsed ? elapsed : 1);
+}
+
+static void usage(void)
+{
+    printf("Usage: rc_alloc [OPTION]...\n"
+           "  -t, --threads=N    Maximum number of threads (default 32)\n"
+           "  -s, --slots=N      Live objects per slot array (default 4096)\n"
+           "  -o, --ops=N        Allocations per thread (default 2000000)\n"
+           "  -m, --max-size=N   Largest object size (default 256)\n"
+           "  -h, --help         Show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_mode *mode;
+    int nthreads;
+    int opt;
+
+    struct option options[] = {
+        { "threads",    required_argument,  NULL, 't' },
+        { "slots",      required_argument,  NULL, 's' },
+        { "ops",        required_argument,  NULL, 'o' },
+        { "max-size",   required_argument,  NULL, 'm' },
+        { "help",       no_argument,        NULL, 'h' },
+        { NULL,         0,                  NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "t:s:o:m:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 's':
+            nslots = atoi(optarg);
+            break;
+        case 'o':
+            nops = atoi(optarg);
+            break;
+        case 'm':
+            max_size = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage();
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (max_threads < 1 || nslots < 1 || nops < 1 || max_size < 8) {
+        usage();
+        return -1;
+    }
+
+    if (rc_mem_pool_enable(0) < 0) {
+        fprintf(stderr, "libcrystal built without ENABLE_RC_POOL\n");
+        return -1;
+    }
+
+    printf("slots: %d, ops/thread: %d, sizes: 1-%d\n\n", nslots, nops, max_size);
+    printf("%-8s", "threads");
+    for (mode = modes; mode->name; mode++)
+        printf("%16s", mode->name);
+    printf("\n");
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads <<= 1) {
+        printf("%-8d", nthreads);
+        for (mode = modes; mode->name; mode++) {
+            printf("%16.2f", run(mode, nthreads));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    printf("\n(million alloc/deref pairs per second)\n");
+
+    return 0;
+}
@@ -191,6 +191,87 @@ unsigned int __sync_add_and_fetch(unsigned int *ptr, unsigned int value)
     return rc + value;
 }
 
+// Subset of the GCC __atomic builtins, for 4 and 8 byte objects only.
+// Aligned loads and stores are atomic on x86/x64 and already have
+// acquire/release semantics, only the compiler must not reorder them.
+// An 8 byte load or store is two instructions on 32-bit x86 and could
+// tear, so there __atomic_load_n and __atomic_store_n refuse to compile
+// for 8 byte objects: 64-bit counters need an x64 (or ARM64) build.
+#define __ATOMIC_RELAXED    0
+#define __ATOMIC_CONSUME    1
+#define __ATOMIC_ACQUIRE    2
+#define __ATOMIC_RELEASE    3
+#define __ATOMIC_ACQ_REL    4
+#define __ATOMIC_SEQ_CST    5
+
+#define __atomic_thread_fence(order) \
+    ((order) == __ATOMIC_SEQ_CST ? MemoryBarrier() : _ReadWriteBarrier())
+
+#ifdef _WIN64
+#define __atomic_check_size(ptr)    ((void)0)
+#else
+#define __atomic_check_size(ptr) \
+    ((void)sizeof(char[sizeof(*(ptr)) <= sizeof(void *) ? 1 : -1]))
+#endif
+
+#define __atomic_load_n(ptr, order) \
+    (__atomic_check_size(ptr), _ReadWriteBarrier(), *(ptr))
+
+#define __atomic_store_n(ptr, val, order) \
+    do { \
+        __atomic_check_size(ptr); \
+        _ReadWriteBarrier(); \
+        *(ptr) = (val); \
+        if ((order) == __ATOMIC_SEQ_CST) \
+            MemoryBarrier(); \
+    } while (0)
+
+static __inline
+int __atomic_cas_4(volatile LONG *ptr, LONG *expected, LONG desired)
+{
+    LONG old = InterlockedCompareExchange(ptr, desired, *expected);
+    if (old == *expected)
+        return 1;
+    *expected = old;
+    return 0;
+}
+
+static __inline
+int __atomic_cas_8(volatile LONG64 *ptr, LONG64 *expected, LONG64 desired)
+{
+    LONG64 old = InterlockedCompareExchange64(ptr, desired, *expected);
+    if (old == *expected)
+        return 1;
+    *expected = old;
+    return 0;
+}
+
+#define __atomic_compare_exchange_n(ptr, expected, desired, weak, success, failure) \
+    (sizeof(*(ptr)) == 8 ? \
+        __atomic_cas_8((volatile LONG64 *)(ptr), (LONG64 *)(expected), \
+                       (LONG64)(desired)) : \
+        __atomic_cas_4((volatile LONG *)(ptr), (LONG *)(expected), \
+                       (LONG)(desired)))
+
+#define __atomic_fetch_add(ptr, val, order) \
+    (sizeof(*(ptr)) == 8 ? \
+        InterlockedExchangeAdd64((volatile LONG64 *)(ptr), (LONG64)(val)) : \
+        InterlockedExchangeAdd((volatile LONG *)(ptr), (LONG)(val)))
+
+#define __atomic_add_fetch(ptr, val, order) \
+    (sizeof(*(ptr)) == 8 ? \
+        InterlockedExchangeAdd64((volatile LONG64 *)(ptr), (LONG64)(val)) + \
+            (LONG64)(val) : \
+        InterlockedExchangeAdd((volatile LONG *)(ptr), (LONG)(val)) + \
+            (LONG)(val))
+
+#define __atomic_sub_fetch(ptr, val, order) \
+    (sizeof(*(ptr)) == 8 ? \
+        InterlockedExchangeAdd64((volatile LONG64 *)(ptr), -(LONG64)(val)) - \
+            (LONG64)(val) : \
+        InterlockedExchangeAdd((volatile LONG *)(ptr), -(LONG)(val)) - \
+            (LONG)(val))
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,34 +33,199 @@ extern "C" {
 #endif
 
 typedef struct _linked_hashtable_t linked_hashtable_t;
+typedef struct _linked_hashtable_snapshot_t linked_hashtable_snapshot_t;
+typedef struct _linked_hashtable_frozen_t linked_hashtable_frozen_t;
 
+/*
+ * Flags for linked_hashtable_create(). Passing 1, as with the former
+ * 'synced' argument, still creates a synchronized table.
+ */
+// Protect the table with an internal read-write lock.
+#define LINKED_HASHTABLE_SYNCED             0x0001
+// Release buckets again once most entries are removed. The table never
+// shrinks below the capacity given at creation.
+#define LINKED_HASHTABLE_AUTO_SHRINK        0x0002
+// Use the open addressing engine instead of chained buckets: hash tags
+// are kept in a separate control byte array and scanned 16 at a time
+// (SSE2/NEON), which keeps lookups within one or two cache lines even
+// at high load factors.
+#define LINKED_HASHTABLE_OPEN_ADDRESSING    0x0004
+// Synced table split into independently locked segments, with a separate
+// lock for the insertion-order list. Implies LINKED_HASHTABLE_SYNCED.
+#define LINKED_HASHTABLE_STRIPED            0x0008
+// Synced table whose get/exist take no lock at all, even while writers
+// are active. Removed or replaced entries are released only after every
+// reader that might still see them is done, so an entry and its key must
+// stay valid for as long as its data is referenced. Implies
+// LINKED_HASHTABLE_SYNCED; can not be combined with
+// LINKED_HASHTABLE_OPEN_ADDRESSING.
+#define LINKED_HASHTABLE_LOCKFREE_READ      0x0010
+// Hash keys with SipHash under a random per-table key instead of the
+// faster built-in hash, so that colliding keys can not be precomputed
+// (hash flooding). Only applies when no hash_code function is given.
+#define LINKED_HASHTABLE_RANDOM_SEED        0x0020
+// Keep the list in access order instead of insertion order: get() and
+// put() of an existing key move the entry to the tail, so the head is
+// the least recently used entry. Can not be combined with
+// LINKED_HASHTABLE_LOCKFREE_READ.
+#define LINKED_HASHTABLE_ACCESS_ORDER       0x0040
+// Copy short keys into the entry when it is put, so that lookups compare
+// against memory adjacent to the entry, and the caller's key does not
+// need to stay valid. Every entry put must be the 'entry' member of a
+// linked_hash_inline_entry_t, or of a larger object starting with one,
+// and its key pointer is changed to the copy. Longer keys are referenced
+// as usual. Puts fail with EINVAL until the size of the entries is given
+// to linked_hashtable_set_entry_size().
+#define LINKED_HASHTABLE_INLINE_KEYS        0x0080
+// Count operations, key comparisons and lock waits for
+// linked_hashtable_stats(), and keep the occupancy histogram up to date.
+// Each thread adds to its own counter block, which stays allocated until
+// the table is destroyed; the blocks are only summed up when the stats
+// are read.
+#define LINKED_HASHTABLE_STATS              0x0100
+
+#define LINKED_HASHTABLE_INLINE_KEY_MAX     32
+
+// The opaque part holds the list links and the state for costs, TTLs and
+// snapshots, whether the table uses them or not: an entry takes 88 bytes
+// on 64-bit targets. Its size is part of the ABI.
 typedef struct _linked_hash_entry_t
 {
     const void *        key;
     size_t              keylen;
     void *              data;
-    char                __opaque[sizeof(void *) * 4];
+    char                __opaque[sizeof(void *) * 3 + sizeof(uint32_t) * 4 +
+                                 sizeof(uint64_t) * 3];
 } linked_hash_entry_t;
 
+typedef struct _linked_hash_inline_entry_t
+{
+    linked_hash_entry_t entry;
+    char                __key[LINKED_HASHTABLE_INLINE_KEY_MAX];
+} linked_hash_inline_entry_t;
+
 typedef struct linked_hashtable_iterator_t {
     char __opaque[sizeof(void *) * 4];
 } linked_hashtable_iterator_t;
 
+typedef struct linked_hashtable_range_t {
+    uint64_t __opaque[(sizeof(void *) * 5 + sizeof(uint64_t) * 2 +
+                       sizeof(int) * 3 + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+} linked_hashtable_range_t;
+
+#define LINKED_HASHTABLE_STATS_BINS         16
+
+typedef struct linked_hashtable_stats_t {
+    size_t      count;
+    size_t      capacity;       // Buckets, or slots with open addressing
+    double      load_factor;
+    /*
+     * Chained buckets: histogram[i] buckets hold i entries. Open
+     * addressing: histogram[i] entries are found after probing i other
+     * groups. The last bin also counts everything beyond it.
+     */
+    size_t      histogram[LINKED_HASHTABLE_STATS_BINS];
+    size_t      max_chain;      // Longest chain, or most groups probed
+
+    // Collected with LINKED_HASHTABLE_STATS only, zero otherwise.
+    uint64_t    gets;           // get, exist, visit and get_many keys
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    puts;
+    uint64_t    removes;
+    uint64_t    probes;         // Entries compared against a looked up key
+    uint64_t    lock_waits;     // Lock acquisitions that had to block
+    uint64_t    lock_wait_time; // Microseconds spent blocked
+} linked_hashtable_stats_t;
+
+// capacity is only the initial size hint, the bucket array is resized
+// incrementally as entries are added or removed.
 CRYSTAL_API
-linked_hashtable_t *linked_hashtable_create(size_t capacity, int synced,
+linked_hashtable_t *linked_hashtable_create(size_t capacity, int flags,
                                             uint32_t (*hash_code)(const void *key, size_t len),
                                             int (*key_compare)(const void *key1, size_t len1,
                                                                const void *key2, size_t len2));
 
+/*
+ * Bound the table to max_entries entries and/or a total cost of max_cost
+ * (0 means no bound). Whenever a put exceeds a bound, entries are evicted
+ * from the head of the list, i.e. the oldest, or with
+ * LINKED_HASHTABLE_ACCESS_ORDER the least recently used ones.
+ *
+ * cost returns the cost of an entry when it is put, NULL counts every
+ * entry as 1. evicted, if not NULL, is called with each victim before the
+ * table drops its reference to the data, and also with entries removed
+ * because they expired. Both are called under the table's lock and must
+ * not call back into the table.
+ *
+ * Applies to the entries already in the table as well.
+ */
+CRYSTAL_API
+int linked_hashtable_set_limit(linked_hashtable_t *htab,
+                               size_t max_entries, size_t max_cost,
+                               size_t (*cost)(linked_hash_entry_t *entry),
+                               void (*evicted)(linked_hash_entry_t *entry, void *context),
+                               void *context);
+
+/*
+ * Give the size of the entries of a LINKED_HASHTABLE_INLINE_KEYS table:
+ * each one spans at least entry_size bytes from the start of its
+ * linked_hash_inline_entry_t, and everything from __key up to entry_size
+ * is key storage. entry_size is at least sizeof(linked_hash_inline_entry_t);
+ * a larger one takes longer keys inline.
+ *
+ * The table must be empty. Returns 0, or -1 with errno set to EINVAL for
+ * a table without inline keys or a short entry_size, or EBUSY.
+ */
+CRYSTAL_API
+int linked_hashtable_set_entry_size(linked_hashtable_t *htab, size_t entry_size);
+
 CRYSTAL_API
 void *linked_hashtable_put(linked_hashtable_t *htab, linked_hash_entry_t *entry);
 
+// Same as linked_hashtable_put(), but the entry expires ttl milliseconds
+// from now, up to UINT32_MAX (about 49 days). Expired entries are not returned any more,
+// and are removed when accessed, a few with every put, or all at once by
+// linked_hashtable_expire(). Putting the key again without a TTL makes it
+// permanent.
+CRYSTAL_API
+void *linked_hashtable_put_ttl(linked_hashtable_t *htab, linked_hash_entry_t *entry,
+                               uint32_t ttl);
+
+// Remove all expired entries, at a cost proportional to their number.
+// Returns the number of entries removed, or -1 on error.
+CRYSTAL_API
+int linked_hashtable_expire(linked_hashtable_t *htab);
+
 CRYSTAL_API
 void *linked_hashtable_get(linked_hashtable_t *htab, const void *key, size_t keylen);
 
 CRYSTAL_API
 int linked_hashtable_exist(linked_hashtable_t *htab, const void *key, size_t keylen);
 
+/*
+ * Borrowed access to the data, without taking a reference: the visitor
+ * runs while the table holds its lock, or inside the lock-free read
+ * section, and the data must not be used after it returns. The visitor
+ * must be short and must not call back into the table.
+ *
+ * linked_hashtable_visit() returns 1 if the key was found and visited,
+ * 0 if not, or -1 on error. linked_hashtable_foreach() visits entries in
+ * list order until the visitor returns non-zero, and returns the number
+ * of entries visited, or -1 on error. It keeps the whole list locked.
+ */
+CRYSTAL_API
+int linked_hashtable_visit(linked_hashtable_t *htab, const void *key, size_t keylen,
+                           void (*visitor)(const void *key, size_t keylen,
+                                           void *data, void *context),
+                           void *context);
+
+CRYSTAL_API
+int linked_hashtable_foreach(linked_hashtable_t *htab,
+                             int (*visitor)(const void *key, size_t keylen,
+                                            void *data, void *context),
+                             void *context);
+
 CRYSTAL_API
 int linked_hashtable_is_empty(linked_hashtable_t *htab);
 
@@ -70,6 +235,42 @@ void *linked_hashtable_remove(linked_hashtable_t *htab, const void *key, size_t
 CRYSTAL_API
 void linked_hashtable_clear(linked_hashtable_t *htab);
 
+// Hash code of a key as the table computes it, for the hash_codes
+// argument of the batch calls below. Only valid for this table.
+CRYSTAL_API
+uint32_t linked_hashtable_hash_code(linked_hashtable_t *htab,
+                                    const void *key, size_t keylen);
+
+/*
+ * Batch versions of get/put/remove. All keys are hashed up front, the
+ * table is locked once for every 64 keys (each segment of a
+ * LINKED_HASHTABLE_STRIPED table the keys fall into, once), and the
+ * buckets are prefetched ahead of the lookups. Keys are processed in the
+ * given order. hash_codes, if not NULL, holds the precomputed hash
+ * code of every key, from linked_hashtable_hash_code().
+ *
+ * get_many stores a reference to the data of each key in vals, or NULL,
+ * and returns the number of keys found. put_many returns the number of
+ * entries put; if an entry of the same key appears twice the later one
+ * wins. remove_many returns the number of keys removed and, if vals is
+ * not NULL, hands over the removed data like linked_hashtable_remove().
+ * All three return -1 on invalid arguments.
+ */
+CRYSTAL_API
+ssize_t linked_hashtable_get_many(linked_hashtable_t *htab, const void * const *keys,
+                                  const size_t *keylens, const uint32_t *hash_codes,
+                                  size_t count, void **vals);
+
+CRYSTAL_API
+ssize_t linked_hashtable_put_many(linked_hashtable_t *htab,
+                                  linked_hash_entry_t * const *entries,
+                                  const uint32_t *hash_codes, size_t count);
+
+CRYSTAL_API
+ssize_t linked_hashtable_remove_many(linked_hashtable_t *htab, const void * const *keys,
+                                     const size_t *keylens, const uint32_t *hash_codes,
+                                     size_t count, void **vals);
+
 CRYSTAL_API
 linked_hashtable_iterator_t *linked_hashtable_iterate(linked_hashtable_t *htab,
                                                       linked_hashtable_iterator_t *iterator);
@@ -79,13 +280,94 @@ CRYSTAL_API
 int linked_hashtable_iterator_next(linked_hashtable_iterator_t *iterator, void **key,
                                    size_t *keylen, void **data);
 
+// Up to n entries at once, with a single lock round trip. keys and
+// keylens may be NULL. return the number of entries stored, 0 at the end,
+// -1 on modified conflict or error.
+CRYSTAL_API
+int linked_hashtable_iterator_next_n(linked_hashtable_iterator_t *iterator,
+                                     void **keys, size_t *keylens, void **data, int n);
+
 CRYSTAL_API
 int linked_hashtable_iterator_has_next(linked_hashtable_iterator_t *iterator);
 
+/*
+ * Split the table into count disjoint ranges that together cover every
+ * entry, to be scanned by different threads at the same time. A range is
+ * scanned in bucket order, not list order, and only holds a read lock
+ * while linked_hashtable_range_next() runs. Entries put or removed during
+ * the scan may or may not be seen; if a resize moved the entries of the
+ * range meanwhile, the scan can not continue and next returns -1 with
+ * errno EAGAIN.
+ *
+ * return count, or -1 on error.
+ */
+CRYSTAL_API
+int linked_hashtable_split(linked_hashtable_t *htab, linked_hashtable_range_t *ranges,
+                           int count);
+
+// Same as linked_hashtable_iterator_next_n(), for a range.
+CRYSTAL_API
+int linked_hashtable_range_next(linked_hashtable_range_t *range,
+                                void **keys, size_t *keylens, void **data, int n);
+
 // return 1 on success, 0 nothing removed, -1 on modified conflict or error.
 CRYSTAL_API
 int linked_hashtable_iterator_remove(linked_hashtable_iterator_t *iterator);
 
+/*
+ * Open a point-in-time view of the table: the snapshot returns, in list
+ * order, exactly the entries that were in the table when it was taken,
+ * while writers go on without being blocked or making it fail. An entry
+ * removed or replaced meanwhile is referenced by the snapshot until it
+ * has been returned, so its key must stay valid as long as its data is
+ * referenced (as with LINKED_HASHTABLE_LOCKFREE_READ). Writers do a bit
+ * more work while snapshots are open; deref() the snapshot when done.
+ */
+CRYSTAL_API
+linked_hashtable_snapshot_t *linked_hashtable_snapshot(linked_hashtable_t *htab);
+
+// return 1 on success, 0 end of snapshot, -1 on error.
+CRYSTAL_API
+int linked_hashtable_snapshot_next(linked_hashtable_snapshot_t *snapshot, void **key,
+                                   size_t *keylen, void **data);
+
+/*
+ * Build an immutable copy of the current contents, as a perfect hash at
+ * 99% load, one probe per lookup: a lookup hashes the key once, reads one
+ * bucket pilot and one slot, and takes no lock and no reference. The frozen table holds a
+ * reference to the data of every entry, the keys must stay valid as long
+ * as the data is referenced. Entries expired at the time of the call are
+ * left out; TTLs are not kept. Only tables without a key_compare function
+ * can be frozen (EINVAL). deref() the frozen table when done.
+ */
+CRYSTAL_API
+linked_hashtable_frozen_t *linked_hashtable_freeze(linked_hashtable_t *htab);
+
+CRYSTAL_API
+size_t linked_hashtable_frozen_count(linked_hashtable_frozen_t *frozen);
+
+// The data is borrowed, valid as long as the frozen table is referenced.
+CRYSTAL_API
+void *linked_hashtable_frozen_get(linked_hashtable_frozen_t *frozen,
+                                  const void *key, size_t keylen);
+
+CRYSTAL_API
+int linked_hashtable_frozen_exist(linked_hashtable_frozen_t *frozen,
+                                  const void *key, size_t keylen);
+
+/*
+ * Fill in the current structure of the table, and the counters collected
+ * since creation or the last linked_hashtable_stats_reset(). The histogram
+ * of a LINKED_HASHTABLE_STATS table is maintained by every change, and
+ * its max_chain stops at 63 entries or 64 groups; other tables walk every
+ * bucket, under the read lock of one segment at a time.
+ */
+CRYSTAL_API
+int linked_hashtable_stats(linked_hashtable_t *htab, linked_hashtable_stats_t *stats);
+
+CRYSTAL_API
+void linked_hashtable_stats_reset(linked_hashtable_t *htab);
+
 #ifdef __cplusplus
 }
 #endif
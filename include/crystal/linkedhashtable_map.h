@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_LINKED_HASHTABLE_MAP_H__
+#define __CRYSTAL_LINKED_HASHTABLE_MAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <crystal/crystal_config.h>
+#include <crystal/linkedhashtable.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Read-only tables served straight from a memory mapped file, to bring
+ * back a large linked_hashtable without putting every entry again.
+ *
+ * The file holds a bucket index followed by the records, each with the
+ * key and value bytes, all addressed by file offsets. Keys are compared
+ * as bytes and hashed with a fixed function, whatever the hash_code and
+ * key_compare of the saved table were. Records are grouped by bucket, so
+ * a lookup reads the index and then one or two adjacent records.
+ */
+typedef struct _linked_hashtable_map_t linked_hashtable_map_t;
+
+// Flag for linked_hashtable_map(): map the file copy-on-write, so values
+// can be modified in place. Changes are never written back to the file.
+#define LINKED_HASHTABLE_MAP_PRIVATE        0x0001
+
+/*
+ * Write the entries of htab to path, in list order within each bucket.
+ * value returns the bytes to store for the data of an entry, which must
+ * stay valid as long as the data is referenced. The table is read through
+ * a snapshot, writers are not blocked meanwhile. The file is written
+ * under a temporary name and renamed into place when complete.
+ *
+ * return the number of entries saved, or -1 on error.
+ */
+CRYSTAL_API
+ssize_t linked_hashtable_save(linked_hashtable_t *htab, const char *path,
+                              const void *(*value)(void *data, size_t *len,
+                                                   void *context),
+                              void *context);
+
+// deref() the map when done, which unmaps the file.
+CRYSTAL_API
+linked_hashtable_map_t *linked_hashtable_map(const char *path, int flags);
+
+CRYSTAL_API
+size_t linked_hashtable_map_count(linked_hashtable_map_t *map);
+
+// The value is returned in place, it stays valid as long as the map is
+// referenced. return NULL if the key is not found.
+CRYSTAL_API
+void *linked_hashtable_map_get(linked_hashtable_map_t *map,
+                               const void *key, size_t keylen, size_t *vallen);
+
+// Visit every record in bucket order until cb returns 0. return the
+// number of records visited, or -1 if the file is corrupt.
+CRYSTAL_API
+ssize_t linked_hashtable_map_foreach(linked_hashtable_map_t *map,
+                                     int (*cb)(const void *key, size_t keylen,
+                                               void *val, size_t vallen,
+                                               void *context),
+                                     void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRYSTAL_LINKED_HASHTABLE_MAP_H__ */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_LINKED_HASHTABLE_U64_H__
+#define __CRYSTAL_LINKED_HASHTABLE_U64_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <crystal/crystal_config.h>
+#include <crystal/linkedhashtable.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * linked_hashtable keyed by 64-bit integers. Entries keep the insertion
+ * order and the table holds a reference to the data of each, as with
+ * linked_hashtable_t. Keys are stored in the slot array itself and hashed
+ * with a multiply-shift, so a lookup makes no indirect calls and touches
+ * the entry only on a hit.
+ */
+typedef struct _linked_hashtable_u64_t linked_hashtable_u64_t;
+
+typedef struct _linked_hash_u64_entry_t
+{
+    uint64_t            key;
+    void *              data;
+    char                __opaque[sizeof(void *) * 2];
+} linked_hash_u64_entry_t;
+
+typedef struct linked_hashtable_u64_iterator_t {
+    char __opaque[sizeof(void *) * 4];
+} linked_hashtable_u64_iterator_t;
+
+// flags: LINKED_HASHTABLE_SYNCED and LINKED_HASHTABLE_AUTO_SHRINK, other
+// flags are not supported (EINVAL).
+CRYSTAL_API
+linked_hashtable_u64_t *linked_hashtable_u64_create(size_t capacity, int flags);
+
+CRYSTAL_API
+void *linked_hashtable_u64_put(linked_hashtable_u64_t *htab,
+                               linked_hash_u64_entry_t *entry);
+
+CRYSTAL_API
+void *linked_hashtable_u64_get(linked_hashtable_u64_t *htab, uint64_t key);
+
+CRYSTAL_API
+int linked_hashtable_u64_exist(linked_hashtable_u64_t *htab, uint64_t key);
+
+CRYSTAL_API
+int linked_hashtable_u64_is_empty(linked_hashtable_u64_t *htab);
+
+CRYSTAL_API
+void *linked_hashtable_u64_remove(linked_hashtable_u64_t *htab, uint64_t key);
+
+CRYSTAL_API
+void linked_hashtable_u64_clear(linked_hashtable_u64_t *htab);
+
+CRYSTAL_API
+linked_hashtable_u64_iterator_t *linked_hashtable_u64_iterate(linked_hashtable_u64_t *htab,
+                                        linked_hashtable_u64_iterator_t *iterator);
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+CRYSTAL_API
+int linked_hashtable_u64_iterator_next(linked_hashtable_u64_iterator_t *iterator,
+                                       uint64_t *key, void **data);
+
+CRYSTAL_API
+int linked_hashtable_u64_iterator_has_next(linked_hashtable_u64_iterator_t *iterator);
+
+// return 1 on success, 0 nothing removed, -1 on modified conflict or error.
+CRYSTAL_API
+int linked_hashtable_u64_iterator_remove(linked_hashtable_u64_iterator_t *iterator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRYSTAL_LINKED_HASHTABLE_U64_H__ */
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_RC_BUF_H__
+#define __CRYSTAL_RC_BUF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+struct iovec {
+    void   *iov_base;
+    size_t  iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#include <crystal/crystal_config.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A view of a range of bytes in a reference-counted memory object. Each
+ * view holds a reference to its object, so slicing a buffer or passing it
+ * on never copies the bytes, and the object lives as long as any view of
+ * it. Views are plain values: initialize them with one of the functions
+ * below and give them up with rc_buf_release().
+ */
+typedef struct rc_buf {
+    void    *mem;       /**< Memory object the bytes belong to */
+    uint8_t *data;      /**< First byte of the view */
+    size_t  len;        /**< Number of bytes */
+} rc_buf_t;
+
+/**
+ * Make a view of a range of a memory object, taking a new reference to it.
+ *
+ * @param
+ *      buf         The view to initialize
+ * @param
+ *      mem         Reference-counted memory object
+ * @param
+ *      offset      Start of the range in the object
+ * @param
+ *      len         Length of the range, which must lie within the object
+ */
+CRYSTAL_API
+void rc_buf_init(rc_buf_t *buf, void *mem, size_t offset, size_t len);
+
+/**
+ * Allocate a new memory object of len bytes and make a view of all of it.
+ *
+ * @return 0 on success, or -1 when out of memory
+ */
+CRYSTAL_API
+int rc_buf_alloc(rc_buf_t *buf, size_t len);
+
+/**
+ * Make a view of a part of another view, without copying.
+ *
+ * @param
+ *      dst         The view to initialize
+ * @param
+ *      src         Existing view
+ * @param
+ *      offset      Start of the part in src
+ * @param
+ *      len         Length of the part
+ *
+ * @return 0 on success, or -1 (EINVAL) if the part exceeds src
+ */
+CRYSTAL_API
+int rc_buf_slice(rc_buf_t *dst, const rc_buf_t *src, size_t offset, size_t len);
+
+/**
+ * Split a view in two: buf keeps the first at bytes, tail gets the rest.
+ *
+ * @return 0 on success, or -1 (EINVAL) if at exceeds the view
+ */
+CRYSTAL_API
+int rc_buf_split(rc_buf_t *buf, size_t at, rc_buf_t *tail);
+
+/**
+ * Give up a view and the reference it holds. The view becomes empty.
+ */
+CRYSTAL_API
+void rc_buf_release(rc_buf_t *buf);
+
+/**
+ * Sequence of views handled as one run of bytes, for example the header,
+ * payload and trailer of a packet that live in different objects. Views
+ * of adjacent ranges of the same object are merged as they are appended.
+ *
+ * A chain is a reference-counted object, deref() it to release all of its
+ * views. It is not synchronized.
+ */
+typedef struct rc_buf_chain rc_buf_chain_t;
+
+/**
+ * Create an empty chain
+ *
+ * @return The chain, or NULL when out of memory
+ */
+CRYSTAL_API
+rc_buf_chain_t *rc_buf_chain_create(void);
+
+/**
+ * Append a view to a chain. The chain takes its own reference, the caller
+ * keeps the view.
+ *
+ * @return 0 on success, or -1 when out of memory
+ */
+CRYSTAL_API
+int rc_buf_chain_append(rc_buf_chain_t *chain, const rc_buf_t *buf);
+
+/**
+ * Append all views of src to dst. src is unchanged.
+ *
+ * @return 0 on success, or -1 when out of memory
+ */
+CRYSTAL_API
+int rc_buf_chain_append_chain(rc_buf_chain_t *dst, const rc_buf_chain_t *src);
+
+/**
+ * Total number of bytes in a chain
+ */
+CRYSTAL_API
+size_t rc_buf_chain_length(const rc_buf_chain_t *chain);
+
+/**
+ * Number of views in a chain, the number of iovec entries it takes
+ */
+CRYSTAL_API
+int rc_buf_chain_count(const rc_buf_chain_t *chain);
+
+/**
+ * Get a view of a chain
+ *
+ * @param
+ *      chain       The chain
+ * @param
+ *      index       Index of the view, less than rc_buf_chain_count()
+ *
+ * @return The view, owned by the chain; rc_buf_slice() it to keep it
+ */
+CRYSTAL_API
+const rc_buf_t *rc_buf_chain_get(const rc_buf_chain_t *chain, int index);
+
+/**
+ * Create a chain viewing a range of bytes of another, without copying.
+ *
+ * @return The new chain, or NULL with errno set: EINVAL if the range
+ *         exceeds the chain, ENOMEM when out of memory
+ */
+CRYSTAL_API
+rc_buf_chain_t *rc_buf_chain_slice(const rc_buf_chain_t *chain,
+                                   size_t offset, size_t len);
+
+/**
+ * Split a chain in two: the chain keeps the first at bytes, and the rest
+ * moves to a new chain.
+ *
+ * @return The new chain of the remaining bytes, or NULL with errno set:
+ *         EINVAL if at exceeds the chain, ENOMEM when out of memory
+ */
+CRYSTAL_API
+rc_buf_chain_t *rc_buf_chain_split(rc_buf_chain_t *chain, size_t at);
+
+/**
+ * Drop bytes from the front of a chain, typically the part a writev()
+ * has sent. Views emptied on the way are released.
+ *
+ * @return 0 on success, or -1 (EINVAL) if len exceeds the chain
+ */
+CRYSTAL_API
+int rc_buf_chain_consume(rc_buf_chain_t *chain, size_t len);
+
+/**
+ * Copy a range of bytes out of a chain, across view boundaries, e.g. to
+ * parse a header that may be split between two views.
+ *
+ * @return The number of bytes copied, less than len if the chain ends
+ *         before
+ */
+CRYSTAL_API
+size_t rc_buf_chain_copy(const rc_buf_chain_t *chain, size_t offset,
+                         void *dst, size_t len);
+
+/**
+ * Describe the bytes of a chain with an iovec array for writev() or
+ * sendmsg(). The entries point into the chain, which must not change
+ * until the I/O is done.
+ *
+ * @param
+ *      chain       The chain
+ * @param
+ *      iov         Array to fill
+ * @param
+ *      iovcnt      Number of entries in iov
+ *
+ * @return The number of entries filled, at most iovcnt; the chain holds
+ *         more bytes if that is less than rc_buf_chain_count()
+ */
+CRYSTAL_API
+int rc_buf_chain_iovec(const rc_buf_chain_t *chain, struct iovec *iov, int iovcnt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRYSTAL_RC_BUF_H__ */
@@ -24,6 +24,8 @@
 #define __CRYSTAL_RC_MEM_H__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include <crystal/crystal_config.h>
 
@@ -66,6 +68,157 @@ void *rc_alloc(size_t size, rc_mem_destructor *destructor);
 CRYSTAL_API
 void *rc_zalloc(size_t size, rc_mem_destructor *destructor);
 
+/**
+ * Serve further rc_alloc()/rc_zalloc() calls of small objects from
+ * per-thread size class caches instead of malloc(). An object goes back
+ * to the cache of the thread that allocated it when it is destroyed, on
+ * whichever thread. Memory taken by the caches is kept for reuse and not
+ * returned to the system, so the process holds on to the peak amount of
+ * small objects it ever had alive. Objects allocated either way can be
+ * mixed freely, so the pool can be enabled and disabled at any time.
+ *
+ * @param
+ *      enable      Non-zero to enable, 0 to go back to malloc()
+ *
+ * @return 0 on success, or -1 (ENOSYS) if the library was built without
+ *         ENABLE_RC_POOL.
+ */
+CRYSTAL_API
+int rc_mem_pool_enable(int enable);
+
+/**
+ * Allocate a new reference-counted memory object with an aligned address,
+ * e.g. to the cache line size for per-thread counters that must not share
+ * lines. The object header is kept in front of the aligned range.
+ *
+ * @param
+ *      size            Size of memory object
+ * @param
+ *      align           Alignment, a power of two
+ * @param
+ *      destructor      Optional destructor, called when destroyed
+ *
+ * @return Pointer to allocated object, or NULL with errno set: EINVAL if
+ *         align is not a power of two, ENOMEM when out of memory.
+ *
+ * @note rc_realloc() keeps the alignment.
+ */
+CRYSTAL_API
+void *rc_alloc_aligned(size_t size, size_t align, rc_mem_destructor *destructor);
+
+/* Advise transparent huge pages for the mapping */
+#define RC_MEM_HUGEPAGE_THP         0x01
+/* Try reserved huge pages (MAP_HUGETLB) first, falling back to THP */
+#define RC_MEM_HUGEPAGE_HUGETLB     0x02
+
+/**
+ * Back large allocations with huge pages, to cut TLB misses on large
+ * tables. Objects of at least 'threshold' bytes, from rc_alloc(),
+ * rc_zalloc() and rc_alloc_aligned(), are mmap'd on their own instead of
+ * taken from the heap; objects from rc_alloc() are then also aligned to
+ * the cache line. Memory is returned to the system when they are
+ * destroyed.
+ *
+ * @param
+ *      threshold   Minimal size of objects to map, 0 to disable
+ * @param
+ *      flags       RC_MEM_HUGEPAGE_THP and/or RC_MEM_HUGEPAGE_HUGETLB
+ *
+ * @return 0 on success, or -1 and errno: EINVAL if no flag was given,
+ *         ENOSYS on systems without mmap().
+ */
+CRYSTAL_API
+int rc_mem_hugepage_enable(size_t threshold, int flags);
+
+/**
+ * Allocation statistics of one allocation site: the code that called
+ * rc_alloc(), rc_zalloc(), rc_alloc_aligned() or rc_realloc(), together
+ * with the destructor of the object as its type. Numbers are estimates
+ * when sampling.
+ */
+typedef struct rc_mem_site_stats_t {
+    rc_mem_destructor   *destructor;    /**< Type tag, may be NULL */
+    const void          *caller;        /**< Return address of the call */
+    size_t              live_objects;
+    size_t              live_bytes;
+    size_t              peak_bytes;
+    uint64_t            total_objects;  /**< Allocated since started or reset */
+    uint64_t            total_bytes;
+} rc_mem_site_stats_t;
+
+/**
+ * Allocation statistics of all tracked objects
+ */
+typedef struct rc_mem_track_stats_t {
+    size_t              live_objects;
+    size_t              live_bytes;
+    size_t              peak_bytes;
+    uint64_t            total_objects;  /**< Allocated since started or reset */
+    uint64_t            total_bytes;
+    uint64_t            elapsed;        /**< Microseconds since started or reset */
+    double              alloc_rate;     /**< Bytes allocated per second */
+    size_t              nsites;         /**< Number of allocation sites */
+} rc_mem_track_stats_t;
+
+/**
+ * Track allocations of reference-counted objects per allocation site, to
+ * chase memory growth and leaks. Tracking every allocation serializes
+ * them; in production, sample about one allocation per 'sample_period'
+ * bytes allocated, which keeps the cost to a thread-local countdown for
+ * the others. Objects allocated from an arena are not tracked.
+ *
+ * Sampled objects are accounted for until freed even when tracking is
+ * disabled meanwhile, and the statistics stay readable.
+ *
+ * @param
+ *      enable          Non-zero to track allocations from now on
+ * @param
+ *      sample_period   Mean number of bytes between samples, or 0 to
+ *                      track every allocation
+ *
+ * @return 0 on success
+ */
+CRYSTAL_API
+int rc_mem_track_enable(int enable, size_t sample_period);
+
+/**
+ * Read the tracking statistics.
+ *
+ * @param
+ *      stats       Receives the totals
+ * @param
+ *      sites       Optional array receiving the statistics of the sites
+ *                  with the most live bytes, in descending order
+ * @param
+ *      nsites      In: number of entries in sites, out: number filled
+ *
+ * @return 0 on success, or -1 and errno
+ */
+CRYSTAL_API
+int rc_mem_track_stats(rc_mem_track_stats_t *stats,
+                       rc_mem_site_stats_t *sites, size_t *nsites);
+
+/**
+ * Restart the allocation totals, the rate and the peaks; peaks start
+ * over from the live numbers.
+ */
+CRYSTAL_API
+void rc_mem_track_reset(void);
+
+/**
+ * Print the tracking statistics in human readable form. Callers and
+ * destructors are printed as addresses, for addr2line or a debugger.
+ *
+ * @param
+ *      fp          Stream to print to
+ * @param
+ *      max_sites   Number of sites to print, most live bytes first
+ *
+ * @return 0 on success, or -1 and errno
+ */
+CRYSTAL_API
+int rc_mem_track_dump(FILE *fp, size_t max_sites);
+
 /**
  * Re-allocate a reference-counted memory object
  *
@@ -97,6 +250,13 @@ void *ref(void *data);
  * is zero, the destroy handler will be called (if present) and the memory
  * will be freed
  *
+ * The thread that allocated an object counts its references without
+ * atomic operations. When another thread drops the last of the references
+ * that thread handed out, it destroys the object itself. Only when the
+ * allocating thread drops a reference of its own at the same moment, the
+ * object may stay until that thread's next rc_alloc() or exit, or until
+ * other threads released a few more of its objects.
+ *
  * @param
  *      data        Memory object
  *
@@ -116,6 +276,232 @@ void *deref(void *data);
 CRYSTAL_API
 unsigned int nrefs(const void *data);
 
+/**
+ * Defines the copy handler of copy-on-write objects: it creates a new
+ * reference-counted object with the same content as data, holding one
+ * reference.
+ *
+ * @param
+ *      data    Memory object to copy
+ *
+ * @return The copy, or NULL on error
+ */
+typedef void *(rc_mem_copy)(const void *data);
+
+/**
+ * Register the copy handler used by rc_cow() for the objects with the
+ * given destructor. Registering again for the same destructor replaces
+ * the handler.
+ *
+ * @param
+ *      destructor  Destructor of the objects, their type; may be NULL
+ * @param
+ *      copy        Copy handler
+ *
+ * @return 0 on success, or -1 and errno: EINVAL if copy is NULL, ENOSPC
+ *         if too many handlers are registered.
+ */
+CRYSTAL_API
+int rc_mem_copy_register(rc_mem_destructor *destructor, rc_mem_copy *copy);
+
+/**
+ * Whether the caller's reference is the only one to a memory object, weak
+ * references included. This also holds for a reference the allocating
+ * thread handed over to another one.
+ *
+ * @param
+ *      data        Memory object, the caller holds a reference to it
+ *
+ * @return Non-zero if nobody else can reach the object
+ */
+CRYSTAL_API
+int rc_unique(const void *data);
+
+/**
+ * Get a writable version of a shared memory object: the object itself if
+ * the caller holds the only reference, or else a copy, in which case the
+ * caller's reference to the original is dropped.
+ *
+ * @param
+ *      data        Memory object, the caller holds a reference to it
+ * @param
+ *      copy        Copy handler, or NULL for the one registered with
+ *                  rc_mem_copy_register() for the object's destructor
+ *
+ * @return The object to write to, or NULL with the caller's reference to
+ *         data kept: ENOSYS if there is no copy handler, or the error of
+ *         the handler.
+ */
+CRYSTAL_API
+void *rc_cow(void *data, rc_mem_copy *copy);
+
+/**
+ * Turn deferred destruction on or off for the calling thread. While on,
+ * deref() does not destroy an object when dropping its last reference,
+ * but queues it; queued objects are destroyed in batches, after a grace
+ * period, by the reclaimer thread if one was started, or else by the
+ * calling thread later on, at the latest in rc_mem_reclaim() or when it
+ * exits. Objects allocated from an arena are always destroyed at once.
+ *
+ * This keeps tearing down large object graphs, like the entries of a
+ * hash table, off latency-critical threads.
+ *
+ * @param
+ *      enable      Non-zero to defer, 0 to destroy right away again
+ *
+ * @return Whether deferred destruction was on before the call
+ */
+CRYSTAL_API
+int rc_mem_defer(int enable);
+
+/**
+ * Safe point for deferred destruction: hand the objects queued by the
+ * calling thread over to the reclaimer thread, or, if none runs, wait for
+ * a grace period and destroy every object the calling thread queued so
+ * far. Must not be called inside rc_epoch_enter().
+ */
+CRYSTAL_API
+void rc_mem_reclaim(void);
+
+/**
+ * Start a background thread destroying the objects queued by threads in
+ * deferred mode. Starting it again while it runs does nothing.
+ *
+ * @return 0 on success, or -1 and errno if the thread could not be created
+ */
+CRYSTAL_API
+int rc_mem_reclaimer_start(void);
+
+/**
+ * Stop the reclaimer thread, after it destroyed everything handed to it.
+ * Threads in deferred mode destroy their own queued objects from then on.
+ */
+CRYSTAL_API
+void rc_mem_reclaimer_stop(void);
+
+/**
+ * Enter a read-side critical section. Objects destroyed through deferred
+ * destruction are not destroyed while a thread that entered before their
+ * last reference was dropped is still inside, so lock-free readers may
+ * access them without taking references. Sections can be nested, and
+ * should be short: they hold back all deferred destruction.
+ *
+ * @return 0 on success, or -1 if the thread could not be registered
+ */
+CRYSTAL_API
+int rc_epoch_enter(void);
+
+/**
+ * Leave the read-side critical section entered by rc_epoch_enter().
+ */
+CRYSTAL_API
+void rc_epoch_exit(void);
+
+/**
+ * Weak reference to a reference-counted memory object. It does not keep
+ * the object alive, but can be turned into a strong reference as long as
+ * the object has not been destroyed. The memory of the object is
+ * released once both its references and its weak references are gone.
+ */
+typedef struct rc_weak rc_weak_t;
+
+/**
+ * Take a weak reference to a reference-counted memory object
+ *
+ * @param
+ *      data        Memory object, the caller holds a reference to it
+ *
+ * @return The weak reference
+ *
+ * @note An object with weak references can not be passed to rc_realloc()
+ *       (EBUSY). Weak references to arena objects must be dropped before
+ *       the arena is reset.
+ */
+CRYSTAL_API
+rc_weak_t *rc_weak_ref(void *data);
+
+/**
+ * Reference the object of a weak reference, unless it was destroyed
+ *
+ * @param
+ *      weak        Weak reference
+ *
+ * @return The memory object with a new reference, deref() it when done,
+ *         or NULL if the object was destroyed.
+ */
+CRYSTAL_API
+void *rc_weak_get(rc_weak_t *weak);
+
+/**
+ * Drop a weak reference
+ *
+ * @param
+ *      weak        Weak reference
+ */
+CRYSTAL_API
+void rc_weak_deref(rc_weak_t *weak);
+
+/**
+ * Arena that reference-counted objects can be allocated from by bumping
+ * a pointer. The objects live until the arena is reset or destroyed,
+ * which runs the destructors still pending, most recent first, and
+ * releases all memory at once. ref() and deref() work on arena objects
+ * as usual, but dropping the last reference only runs the destructor;
+ * no arena object may be referenced past the reset.
+ *
+ * An arena is not synchronized: allocate from and reset it on one thread
+ * at a time. It is itself a reference-counted object, deref() it to
+ * destroy it.
+ */
+typedef struct rc_arena rc_arena_t;
+
+/**
+ * Create an arena
+ *
+ * @param
+ *      chunk_size    Size of the memory chunks taken from malloc(), or 0
+ *                    for the default. The first one is allocated with
+ *                    the arena and kept across resets.
+ *
+ * @return The arena, or NULL when out of memory
+ */
+CRYSTAL_API
+rc_arena_t *rc_arena_create(size_t chunk_size);
+
+/**
+ * Allocate a new reference-counted memory object from an arena. It can
+ * not be passed to rc_realloc().
+ *
+ * @param
+ *      arena         The arena
+ * @param
+ *      size          Size of memory object
+ * @param
+ *      destructor    Optional destructor, called when destroyed or when
+ *                    the arena is reset
+ *
+ * @return Pointer to allocated object
+ */
+CRYSTAL_API
+void *rc_arena_alloc(rc_arena_t *arena, size_t size, rc_mem_destructor *destructor);
+
+/**
+ * Allocate a new reference-counted memory object from an arena. Memory
+ * is zeroed.
+ */
+CRYSTAL_API
+void *rc_arena_zalloc(rc_arena_t *arena, size_t size, rc_mem_destructor *destructor);
+
+/**
+ * Destroy all objects of an arena, and release the memory of all chunks
+ * but the first for reuse.
+ *
+ * @param
+ *      arena         The arena
+ */
+CRYSTAL_API
+void rc_arena_reset(rc_arena_t *arena);
+
 #ifdef __cplusplus
 }
 #endif
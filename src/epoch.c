@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifdef _MSC_VER
+#include "crystal/builtins.h"
+#endif
+
+#include "epoch.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#else
+#define THREAD_LOCAL        __thread
+#endif
+
+/* Try to advance the global epoch after this many retired objects */
+#define EPOCH_RECLAIM_BATCH 64
+
+/*
+ * While anything is waiting for reclamation, a reader tries to advance
+ * the epoch and reclaim every this many section exits, so objects retired
+ * by a thread that went idle are not kept until it retires again.
+ */
+#define EPOCH_POLL_EXITS    64
+
+/*
+ * Objects retired at epoch e are reclaimed once the global epoch reaches
+ * e + 2: by then every reader active at e has left its section. 'global'
+ * may be a snapshot older than e when reclaiming another thread's list.
+ */
+#define EPOCH_SAFE(e, global)   ((intptr_t)((global) - (e)) >= 2)
+
+typedef struct limbo_node {
+    void *ptr;
+    epoch_reclaim_fn *fn;
+    uintptr_t epoch;
+    struct limbo_node *next;
+} limbo_node;
+
+typedef struct limbo_list {
+    limbo_node *head;
+    limbo_node *tail;
+} limbo_list;
+
+/*
+ * One record per registered thread. 'state' is read by other threads: the
+ * epoch the thread entered at, shifted left by one, with the low bit set
+ * while inside a section. The limbo list is guarded by 'lock' so that any
+ * thread can reclaim the expired part of it; 'npending' lets them skip
+ * empty lists without locking, 'nstolen' counts the objects they are
+ * reclaiming on the owner's behalf. Records of exited threads are reused,
+ * never freed.
+ */
+typedef struct epoch_record {
+    uintptr_t   state;
+    int         in_use;
+    int         depth;
+    size_t      nretired;
+    size_t      nexits;
+    uintptr_t   seen_epoch;
+    size_t      npending;
+    size_t      nstolen;
+    pthread_mutex_t lock;
+    limbo_list  limbo;
+    struct epoch_record *next;
+} epoch_record;
+
+static uintptr_t global_epoch = 1;
+static epoch_record *records;
+
+/* Number of retired objects not reclaimed yet, orphans included */
+static size_t pending;
+
+/* Limbo lists handed over by exited threads */
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static limbo_list orphans;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static THREAD_LOCAL epoch_record *local_record;
+
+static void limbo_append(limbo_list *dst, limbo_list *src)
+{
+    if (!src->head)
+        return;
+
+    if (dst->tail)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+
+    src->head = src->tail = NULL;
+}
+
+static void epoch_record_release(void *arg)
+{
+    epoch_record *rec = (epoch_record *)arg;
+
+    pthread_mutex_lock(&rec->lock);
+    pthread_mutex_lock(&orphans_lock);
+    limbo_append(&orphans, &rec->limbo);
+    pthread_mutex_unlock(&orphans_lock);
+    __atomic_store_n(&rec->npending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rec->lock);
+
+    rec->depth = 0;
+    rec->nretired = 0;
+    rec->nexits = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+
+    local_record = NULL;
+}
+
+static void epoch_init(void)
+{
+    pthread_key_create(&epoch_key, epoch_record_release);
+}
+
+static epoch_record *epoch_record_get(void)
+{
+    epoch_record *rec;
+    int unused;
+
+    if (local_record)
+        return local_record;
+
+    pthread_once(&epoch_once, epoch_init);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unused = 0;
+        if (__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!rec) {
+        rec = (epoch_record *)calloc(1, sizeof(epoch_record));
+        if (!rec)
+            return NULL;
+
+        if (pthread_mutex_init(&rec->lock, NULL) != 0) {
+            free(rec);
+            return NULL;
+        }
+
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (pthread_setspecific(epoch_key, rec) != 0) {
+        __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    local_record = rec;
+    return rec;
+}
+
+int epoch_enter(void)
+{
+    epoch_record *rec = epoch_record_get();
+
+    if (!rec)
+        return -1;
+
+    if (rec->depth++ == 0) {
+        uintptr_t e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&rec->state, (e << 1) | 1, __ATOMIC_RELAXED);
+        /* Announce before any shared pointer is loaded */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+static uintptr_t epoch_try_advance(void);
+static void epoch_reclaim(epoch_record *rec);
+
+void epoch_exit(void)
+{
+    epoch_record *rec = local_record;
+    uintptr_t e;
+
+    assert(rec && rec->depth > 0);
+
+    if (--rec->depth > 0)
+        return;
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+
+    if (!__atomic_load_n(&pending, __ATOMIC_RELAXED))
+        return;
+
+    if (++rec->nexits % EPOCH_POLL_EXITS == 0) {
+        epoch_try_advance();
+        epoch_reclaim(rec);
+        return;
+    }
+
+    /* Reclaim our own objects as soon as the epoch has moved on */
+    e = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    if (e != rec->seen_epoch && __atomic_load_n(&rec->npending, __ATOMIC_RELAXED))
+        epoch_reclaim(rec);
+}
+
+int epoch_active(void)
+{
+    return local_record && local_record->depth > 0;
+}
+
+/*
+ * Advance the global epoch if every thread inside a section has observed
+ * the current one. Returns the (possibly new) global epoch.
+ */
+static uintptr_t epoch_try_advance(void)
+{
+    uintptr_t e, state;
+    epoch_record *rec;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != e)
+            return e;
+    }
+
+    if (__atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        e++;
+
+    return e;
+}
+
+/* Move the leading part of 'list' retired two or more epochs ago to 'ready' */
+static size_t limbo_take(limbo_list *list, limbo_list *ready, uintptr_t e)
+{
+    limbo_node *node;
+    size_t n = 0;
+
+    while ((node = list->head) != NULL && EPOCH_SAFE(node->epoch, e)) {
+        list->head = node->next;
+        node->next = NULL;
+        if (ready->tail)
+            ready->tail->next = node;
+        else
+            ready->head = node;
+        ready->tail = node;
+        n++;
+    }
+    if (!list->head)
+        list->tail = NULL;
+
+    return n;
+}
+
+static void limbo_reclaim(limbo_list *list)
+{
+    limbo_node *node;
+
+    while ((node = list->head) != NULL) {
+        list->head = node->next;
+        node->fn(node->ptr);
+        free(node);
+        __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+    }
+    list->tail = NULL;
+}
+
+/*
+ * Reclaim the expired objects of every thread, starting with the caller's.
+ * Lists of other threads and the orphans are only tried, never waited for.
+ * The reclaim functions run without any lock held, so they may retire
+ * further objects.
+ */
+static void epoch_reclaim(epoch_record *rec)
+{
+    limbo_list ready = { NULL, NULL };
+    limbo_list stolen;
+    epoch_record *r;
+    uintptr_t e;
+    size_t n;
+
+    e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    rec->seen_epoch = e;
+
+    pthread_mutex_lock(&rec->lock);
+    n = limbo_take(&rec->limbo, &ready, e);
+    __atomic_sub_fetch(&rec->npending, n, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rec->lock);
+
+    if (pthread_mutex_trylock(&orphans_lock) == 0) {
+        limbo_take(&orphans, &ready, e);
+        pthread_mutex_unlock(&orphans_lock);
+    }
+
+    limbo_reclaim(&ready);
+
+    for (r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next) {
+        if (r == rec || !__atomic_load_n(&r->npending, __ATOMIC_RELAXED) ||
+            pthread_mutex_trylock(&r->lock) != 0)
+            continue;
+
+        stolen.head = stolen.tail = NULL;
+        n = limbo_take(&r->limbo, &stolen, e);
+        __atomic_add_fetch(&r->nstolen, n, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&r->npending, n, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->lock);
+
+        limbo_reclaim(&stolen);
+        __atomic_sub_fetch(&r->nstolen, n, __ATOMIC_RELEASE);
+    }
+}
+
+/* Wait until every reader active at the time of the call has left */
+static void epoch_synchronize(void)
+{
+    uintptr_t target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+
+    while ((intptr_t)(epoch_try_advance() - target) < 0)
+        sched_yield();
+}
+
+void epoch_retire(void *ptr, epoch_reclaim_fn *fn)
+{
+    epoch_record *rec = epoch_record_get();
+    limbo_node *node;
+
+    assert(fn);
+    assert(!rec || rec->depth == 0);
+
+    node = rec ? (limbo_node *)malloc(sizeof(limbo_node)) : NULL;
+    if (!node) {
+        // Out of memory: wait for the grace period right here.
+        epoch_synchronize();
+        fn(ptr);
+        return;
+    }
+
+    node->ptr = ptr;
+    node->fn = fn;
+    node->next = NULL;
+
+    /* The caller's unlink must be visible before the epoch is sampled */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    node->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&rec->lock);
+    if (rec->limbo.tail)
+        rec->limbo.tail->next = node;
+    else
+        rec->limbo.head = node;
+    rec->limbo.tail = node;
+    __atomic_add_fetch(&rec->npending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rec->lock);
+
+    if (++rec->nretired % EPOCH_RECLAIM_BATCH == 0) {
+        epoch_try_advance();
+        epoch_reclaim(rec);
+    }
+}
+
+void epoch_barrier(void)
+{
+    epoch_record *rec = epoch_record_get();
+
+    assert(!rec || rec->depth == 0);
+
+    epoch_synchronize();
+
+    if (!rec)
+        return;
+
+    epoch_reclaim(rec);
+
+    /* Wait for what other threads took over from us */
+    while (__atomic_load_n(&rec->nstolen, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
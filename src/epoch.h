@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_EPOCH_H__
+#define __CRYSTAL_EPOCH_H__
+
+/*
+ * Epoch based reclamation, internal to the library.
+ *
+ * Lock-free readers bracket their accesses with epoch_enter()/epoch_exit().
+ * A writer that unlinked an object hands it to epoch_retire(), and the
+ * reclaim function runs only once every reader that might still hold a
+ * pointer to the object has left its critical section.
+ */
+
+typedef void (epoch_reclaim_fn)(void *ptr);
+
+/**
+ * Enter a read-side critical section of the calling thread. Sections can
+ * be nested.
+ *
+ * @return 0 on success, or -1 if the thread could not be registered, in
+ *         which case the caller must fall back to locking.
+ */
+int epoch_enter(void);
+
+/**
+ * Leave the read-side critical section entered by epoch_enter(). Leaving
+ * the outermost section may run the reclaim functions of expired objects,
+ * retired by any thread.
+ */
+void epoch_exit(void);
+
+/**
+ * Whether the calling thread is inside a read-side critical section.
+ */
+int epoch_active(void);
+
+/**
+ * Defer fn(ptr) until all current readers have left their critical
+ * sections. Must not be called from inside a read-side critical section.
+ *
+ * @param
+ *      ptr     Object unlinked by the caller
+ * @param
+ *      fn      Reclaim function
+ */
+void epoch_retire(void *ptr, epoch_reclaim_fn *fn);
+
+/**
+ * Wait for a grace period, then reclaim everything retired by the calling
+ * thread so far. Must not be called from inside a read-side critical
+ * section.
+ */
+void epoch_barrier(void);
+
+#endif /* __CRYSTAL_EPOCH_H__ */
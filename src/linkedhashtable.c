@@ -26,14 +26,22 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <fcntl.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#endif
 
 #include "crystal/rc_mem.h"
 #include "crystal/linkedhashtable.h"
+#include "crystal/time_util.h"
 
 #ifdef _MSC_VER
 #include "crystal/builtins.h"
 #endif
 
+#include "epoch.h"
+#include "BRCrypto.h"
+
 
 typedef struct _hash_entry_i
 {
@@ -41,6 +49,16 @@ typedef struct _hash_entry_i
     size_t               keylen;
     void *               data;
     uint32_t             hash_code;
+    uint32_t             cost;
+    /* Position + 1 in the expiry heap, expiry in table milliseconds (0: none) */
+    uint32_t             expiry_idx;
+    uint64_t             expire;
+    /*
+     * Table version the entry was linked at, and its position in the
+     * list, increasing from head to tail. Both are only used by snapshots.
+     */
+    uint64_t             version;
+    uint64_t             pos;
     struct _hash_entry_i *next;
     struct _hash_entry_i *lst_prev;
     struct _hash_entry_i *lst_next;
@@ -53,474 +71,4059 @@ typedef struct hashtable_iterator_i {
     int expected_mod_count;
 } hashtable_iterator_i;
 
+/*
+ * A range covers [begin, end) of the table, in units of 1/65536 of a
+ * segment: unit u is fraction (u & 0xFFFF) of segment (u >> 16). The
+ * fractions are mapped to scan positions when the segment is entered.
+ */
+#define RANGE_UNIT_BITS     16
+
+typedef struct hashtable_range_i {
+    linked_hashtable_t *htab;
+    uint64_t    begin;
+    uint64_t    end;
+    int         seg;
+    int         entered;
+    unsigned int layout;
+    unsigned int moved;
+    size_t      pos_begin;
+    size_t      pos;
+    size_t      pos_end;
+    size_t      skip;
+} hashtable_range_i;
+
 static_assert(sizeof(linked_hash_entry_t) >= sizeof(hash_entry_i),
               "List entry size miss match.");
 static_assert(sizeof(linked_hashtable_iterator_t) >= sizeof(hashtable_iterator_i),
               "List iterator size miss match.");
+static_assert(sizeof(linked_hashtable_range_t) >= sizeof(hashtable_range_i),
+              "Range iterator size miss match.");
 
-struct _linked_hashtable_t {
+/* Bucket array of the chained engine, sized together with its buckets */
+typedef struct bucket_array {
     size_t      capacity;
+    hash_entry_i *buckets[];
+} bucket_array;
+
+/*
+ * Lookup structure over the entries, maintained by one of the engines
+ * below. The insertion-order list is kept by the table itself.
+ */
+typedef struct hash_index {
+    size_t      count;
+    size_t      capacity;
+    /* Retired memory must outlive lock-free readers */
+    int         lockfree;
+    /*
+     * Changed whenever entries may move to other scan positions, except
+     * for the moves reported by the engine's scan_moves()
+     */
+    unsigned int layout;
+    /*
+     * With LINKED_HASHTABLE_STATS, HASHTABLE_HIST_BINS counts kept up to
+     * date by the engine (see its histogram()), NULL otherwise
+     */
+    size_t      *hist;
+
+    /*
+     * Chained engine. The table grows (and optionally shrinks)
+     * incrementally: while a resize is in progress the entries live in
+     * two bucket arrays, and every put/remove moves a few buckets from
+     * 'table' over to 'rehash_table' until the old array is drained.
+     * 'seq' is odd while entries are being moved.
+     */
+    int         size_idx;
+    int         min_size_idx;
+    bucket_array *table;
+
+    size_t      rehash_idx;
+    int         rehash_size_idx;
+    bucket_array *rehash_table;
+    unsigned int seq;
+
+    /*
+     * Open addressing engine. 'ctrl' holds one control byte per slot,
+     * either EMPTY, DELETED or a 7-bit tag of the hash code, followed by
+     * a copy of the first GROUP_WIDTH bytes so that a group can be loaded
+     * from any position without wrapping.
+     */
+    size_t      min_capacity;
+    size_t      growth_left;
+    uint8_t     *ctrl;
+    hash_entry_i **slots;
+} hash_index;
+
+typedef struct hash_engine {
+    int (*init)(hash_index *index, size_t capacity);
+    void (*fini)(hash_index *index);
+    hash_entry_i *(*find)(linked_hashtable_t *htab, hash_index *index,
+                          const void *key, size_t keylen, uint32_t hash_code);
+    /* Optional, lookup without the segment lock inside an epoch section */
+    hash_entry_i *(*find_lockfree)(linked_hashtable_t *htab, hash_index *index,
+                                   const void *key, size_t keylen,
+                                   uint32_t hash_code);
+    int (*insert)(hash_index *index, hash_entry_i *entry);
+    void (*replace)(hash_index *index, hash_entry_i *old_entry,
+                    hash_entry_i *new_entry);
+    void (*erase)(hash_index *index, hash_entry_i *entry);
+    void (*clear)(hash_index *index);
+    void (*resize)(hash_index *index, int shrink);
+    /* Hint the first memory a lookup of hash_code is going to touch */
+    void (*prefetch)(hash_index *index, uint32_t hash_code);
+    /*
+     * Scan positions for range iteration, valid while 'layout' stays the
+     * same. scan() collects up to n entries from positions [*pos, end),
+     * 'skip' counts the entries already taken from position *pos.
+     */
+    size_t (*scan_size)(hash_index *index);
+    size_t (*scan)(hash_index *index, size_t *pos, size_t *skip, size_t end,
+                   void **entries, size_t n);
+    /*
+     * Optional, for engines that move entries without changing 'layout':
+     * the entries of positions [0, *drained) have been moved to positions
+     * from *target on.
+     */
+    void (*scan_moves)(hash_index *index, size_t *drained, size_t *target);
+    /* Add the structure of the index to hist, see linked_hashtable_stats_t */
+    void (*histogram)(hash_index *index, size_t *hist, size_t nbins, size_t *max);
+} hash_engine;
+
+#define CACHE_LINE_SIZE     64
+
+#if defined(__GNUC__)
+#define PREFETCH(p)         __builtin_prefetch(p)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define PREFETCH(p)         _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define PREFETCH(p)         ((void)(p))
+#endif
+
+/* A LINKED_HASHTABLE_STRIPED table has 1 << HASHTABLE_SEGMENT_BITS segments */
+#define HASHTABLE_SEGMENT_BITS  5
+
+/* Occupancy bins of a LINKED_HASHTABLE_STATS index, the last one open-ended */
+#define HASHTABLE_HIST_BINS     64
+
+enum {
+    STAT_GETS,
+    STAT_HITS,
+    STAT_PUTS,
+    STAT_REMOVES,
+    STAT_PROBES,
+    STAT_LOCK_WAITS,
+    STAT_LOCK_WAIT_TIME,
+    STAT_MAX
+};
+
+/*
+ * Operation counters of one thread in a LINKED_HASHTABLE_STATS table.
+ * Only that thread writes them, so no locked instruction is needed; the
+ * blocks of all threads are summed up on read. A block stays on the list
+ * of its table until the table is destroyed, as a reader may be summing
+ * it, and is reused by no other thread.
+ */
+typedef struct hashtable_stats_block {
+    uint64_t    counters[STAT_MAX];
+    struct hashtable_stats_block *next;
+    void        *mem;
+    unsigned int thread;
+    char        __pad[CACHE_LINE_SIZE -
+                      (sizeof(uint64_t) * STAT_MAX + sizeof(void *) * 2 +
+                       sizeof(unsigned int)) % CACHE_LINE_SIZE];
+} hashtable_stats_block;
+
+typedef struct hash_segment {
+    pthread_rwlock_t lock;
+    hash_index  index;
+    /* Keep the locks of neighbouring segments on different cache lines */
+    char        __pad[CACHE_LINE_SIZE -
+                      (sizeof(pthread_rwlock_t) + sizeof(hash_index)) % CACHE_LINE_SIZE];
+} hash_segment;
+
+struct _linked_hashtable_t {
     size_t      count;
     int         mod_count;
     int         synced;
-    pthread_rwlock_t lock;
+    int         flags;
 
+    /* NULL for the built-in hash, see hashtable_hash() */
     uint32_t (*hash_code)(const void *key, size_t len);
     int (*key_compare)(const void *key1, size_t len1,
                        const void *key2, size_t len2);
+    /* SipHash key of a LINKED_HASHTABLE_RANDOM_SEED table */
+    uint64_t    hash_key[2];
+
+    const hash_engine *engine;
+
+    /*
+     * The entries are split into segments by hash code, each one with its
+     * own index and lock. Without LINKED_HASHTABLE_STRIPED there is only
+     * one segment, and its lock protects the whole table. With it, the
+     * insertion-order list, count and mod_count are protected by lst_lock,
+     * which is always taken after a segment lock.
+     */
+    int         segment_bits;
+    int         nsegments;
+    hash_segment *segments;
+    void        *segments_mem;
+    pthread_mutex_t lst_lock;
+
+    /*
+     * LINKED_HASHTABLE_STATS: the counter blocks of the threads that used
+     * the table, pushed without a lock, and their sums at the last reset.
+     */
+    int         stats;
+    uint64_t    stats_id;
+    hashtable_stats_block *stats_blocks;
+    uint64_t    stats_base[STAT_MAX];
+
+    /* Longest key copied into an entry, 0 until the entry size is set */
+    size_t      inline_key_max;
+
+    /* Bounds set by linked_hashtable_set_limit(), kept with the list */
+    size_t      total_cost;
+    size_t      max_entries;
+    size_t      max_cost;
+    size_t (*cost)(linked_hash_entry_t *entry);
+    void (*evicted)(linked_hash_entry_t *entry, void *context);
+    void        *evict_context;
+
+    /*
+     * Entries put with a TTL, in a binary min-heap by expiry time, also
+     * kept with the list. Times are milliseconds since time_base.
+     * expiry_reserved counts slots taken by puts that have not pushed
+     * their entry yet.
+     */
+    uint64_t    time_base;
+    hash_entry_i **expiry_heap;
+    uint32_t    expiry_count;
+    uint32_t    expiry_reserved;
+    uint32_t    expiry_size;
+
+    /* Bumped by every link of an entry, and the open snapshots */
+    uint64_t    version;
+    linked_hashtable_snapshot_t *snapshots;
 
     hash_entry_i lst_head;
-    hash_entry_i *buckets[];
 };
 
-static uint32_t default_hash_code(const void *key, size_t keylen)
+/* An entry a snapshot had not reached yet when it left its position */
+typedef struct snapshot_record {
+    uint64_t    pos;
+    const void  *key;
+    size_t      keylen;
+    void        *data;
+} snapshot_record;
+
+/*
+ * A snapshot sees the entries linked at or before 'version'. It walks the
+ * live list from 'cursor', and merges in, by list position, the records
+ * writers saved for it in a min-heap. Every position up to 'passed' has
+ * been returned already. All fields besides the records are protected
+ * by the list lock.
+ */
+struct _linked_hashtable_snapshot_t {
+    linked_hashtable_t *htab;
+    linked_hashtable_snapshot_t *prev;
+    linked_hashtable_snapshot_t *next;
+    uint64_t    version;
+    uint64_t    passed;
+    uint64_t    now;
+    int         error;
+    hash_entry_i *cursor;
+    snapshot_record *records;
+    uint32_t    nrecords;
+    uint32_t    size;
+};
+
+/*
+ * MurmurHash64A, consuming 8 bytes per step. Keys are often binary (ids,
+ * public keys), so there is no per-byte work outside of the tail.
+ */
+static uint64_t murmur_hash64(const void *key, size_t keylen, uint64_t seed)
 {
-    uint32_t h = 0;
-    size_t i;
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const uint8_t *data = (const uint8_t *)key;
+    const uint8_t *end = data + (keylen & ~(size_t)7);
+    uint64_t h = seed ^ (keylen * m);
+    uint64_t k;
+
+    for (; data != end; data += sizeof(k)) {
+        memcpy(&k, data, sizeof(k));
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (keylen & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; // fall through
+    case 6: h ^= (uint64_t)data[5] << 40; // fall through
+    case 5: h ^= (uint64_t)data[4] << 32; // fall through
+    case 4: h ^= (uint64_t)data[3] << 24; // fall through
+    case 3: h ^= (uint64_t)data[2] << 16; // fall through
+    case 2: h ^= (uint64_t)data[1] << 8;  // fall through
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
 
-    for (i = 0; i < keylen; i++)
-        h = 31 * h + ((const char *)key)[i];
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
 
     return h;
 }
 
-static int default_key_compare(const void *key1, size_t len1,
-                               const void *key2, size_t len2)
+static uint32_t default_hash_code(const void *key, size_t keylen)
 {
-    if (len1 != len2)
-        return len1 < len2 ? -1 : 1;
+    uint64_t h = murmur_hash64(key, keylen, 0x8445d61a4e774912ULL);
 
-    return memcmp(key1, key2, len1);
+    return (uint32_t)(h ^ (h >> 32));
 }
 
-static void hashtable_destroy(void *htab);
-
-static int BUCKET_SIZES[] = {
-    7,      7,      7,      17,     31,     67,     127,    257,
-    509,    1021,   2053,   4093,   8191,   16381,  32771,  65521
-};
+/*
+ * Process wide secret the per-table SipHash keys are derived from. Taken
+ * from /dev/urandom where available, otherwise from whatever differs
+ * between runs.
+ */
+static uint64_t hashtable_secret[2];
+static uint32_t hashtable_seeds;
+static pthread_once_t hashtable_secret_once = PTHREAD_ONCE_INIT;
 
-static size_t bucket_size(size_t capacity)
+static void hashtable_secret_init(void)
 {
-    int msb = (sizeof(unsigned long long) << 3) - __builtin_clzll(capacity) - 1;
+    uint64_t entropy[4] = { 0 };
+#if !defined(_WIN32) && !defined(_WIN64)
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, hashtable_secret, sizeof(hashtable_secret)) != sizeof(hashtable_secret))
+            memset(hashtable_secret, 0, sizeof(hashtable_secret));
+        close(fd);
+    }
+#endif
 
-    if (msb > 15)
-        msb = 15;
+    entropy[0] = get_monotonic_time();
+    entropy[1] = (uint64_t)(uintptr_t)&entropy;
+    entropy[2] = (uint64_t)(uintptr_t)hashtable_secret_init;
+    entropy[3] = (uint64_t)(uintptr_t)malloc;
 
-    return BUCKET_SIZES[msb];
+    hashtable_secret[0] ^= BRSip64(hashtable_secret, entropy, sizeof(entropy));
+    hashtable_secret[1] ^= BRSip64(hashtable_secret, entropy, sizeof(entropy) / 2);
 }
 
-linked_hashtable_t *linked_hashtable_create(size_t capacity, int synced,
-                                            uint32_t (*hash_code)(const void *key, size_t len),
-                                            int (*key_compare)(const void *key1, size_t len1,
-                             const void *key2, size_t len2))
+static void hashtable_seed(linked_hashtable_t *htab)
 {
-    linked_hashtable_t *htab;
+    uint64_t n;
 
-    capacity = bucket_size(capacity ? capacity : 127);
-
-    htab = (linked_hashtable_t *)rc_zalloc(sizeof(linked_hashtable_t)
-                                           + sizeof(hash_entry_i *) * capacity, hashtable_destroy);
-    if (!htab) {
-        errno = ENOMEM;
-        return NULL;
-    }
+    pthread_once(&hashtable_secret_once, hashtable_secret_init);
 
-    if (synced) {
-        if (pthread_rwlock_init(&htab->lock, NULL) != 0) {
-            deref(htab);
-            return NULL;
-        }
-    }
+    n = __atomic_fetch_add(&hashtable_seeds, 1, __ATOMIC_RELAXED);
+    htab->hash_key[0] = BRSip64(hashtable_secret, &n, sizeof(n));
+    n = ~n;
+    htab->hash_key[1] = BRSip64(hashtable_secret, &n, sizeof(n));
+}
 
-    htab->capacity = capacity;
-    htab->count = 0;
-    htab->mod_count = 0;
-    htab->synced = synced;
+static inline uint32_t hashtable_hash(linked_hashtable_t *htab,
+                                      const void *key, size_t keylen)
+{
+    uint64_t h;
 
-    htab->hash_code = hash_code ? hash_code : default_hash_code;
-    htab->key_compare = key_compare ? key_compare : default_key_compare;
+    if (htab->hash_code)
+        return htab->hash_code(key, keylen);
 
-    htab->lst_head.lst_next = &htab->lst_head;
-    htab->lst_head.lst_prev = &htab->lst_head;
+    if (!(htab->flags & LINKED_HASHTABLE_RANDOM_SEED))
+        return default_hash_code(key, keylen);
 
-    return htab;
+    h = BRSip64(htab->hash_key, key, keylen);
+    return (uint32_t)(h ^ (h >> 32));
 }
 
-#ifdef __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#endif
-
-static inline void hashtable_rlock(linked_hashtable_t *htab)
+static int default_key_compare(const void *key1, size_t len1,
+                               const void *key2, size_t len2)
 {
-    if (htab->synced) {
-        int rc = pthread_rwlock_rdlock(&htab->lock);
-        assert(rc == 0);
-    }
+    if (len1 != len2)
+        return len1 < len2 ? -1 : 1;
+
+    return memcmp(key1, key2, len1);
 }
 
-static inline void hashtable_wlock(linked_hashtable_t *htab)
+/*
+ * Spread the caller's hash code over all bits. Used where the low or the
+ * high bits are consumed directly instead of taking a prime modulus.
+ */
+static inline uint32_t hash_mix(uint32_t h)
 {
-    if (htab->synced) {
-        int rc = pthread_rwlock_wrlock(&htab->lock);
-        assert(rc == 0);
-    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
 }
 
-#ifdef __GNUC__
-#pragma GCC diagnostic pop
+#ifdef _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#else
+#define THREAD_LOCAL        __thread
 #endif
 
-static inline void hashtable_unlock(linked_hashtable_t *htab)
-{
-    if (htab->synced) {
-        pthread_rwlock_unlock(&htab->lock);
-    }
-}
+static unsigned int stats_threads;
+static THREAD_LOCAL unsigned int stats_thread;
+/* Tells the stats tables apart, ids are never reused */
+static uint64_t stats_tables;
+/* Block of the calling thread in the stats table it used last */
+static THREAD_LOCAL uint64_t stats_cached_id;
+static THREAD_LOCAL hashtable_stats_block *stats_cached;
+/*
+ * Entries compared by the calling thread in stats tables. An operation
+ * takes the difference over its own run, so no atomic is needed per probe.
+ */
+static THREAD_LOCAL uint64_t stats_probes;
 
-static void hashtable_clear_i(linked_hashtable_t *htab)
+/*
+ * Counter block of the calling thread, added to the table on first use.
+ * NULL if it can not be allocated, the operation is not counted then.
+ */
+static hashtable_stats_block *stats_block(linked_hashtable_t *htab)
 {
-    hash_entry_i *entry;
-    hash_entry_i *cur;
+    hashtable_stats_block *block;
+    void *mem;
 
-    if (htab->count == 0)
-        return;
+    if (stats_cached_id == htab->stats_id)
+        return stats_cached;
 
-    entry = htab->lst_head.lst_next;
-    while (entry != &htab->lst_head) {
-        cur = entry;
-        entry = entry->lst_next;
+    if (!stats_thread)
+        stats_thread = __atomic_fetch_add(&stats_threads, 1, __ATOMIC_RELAXED) + 1;
 
-        deref(cur->data);
-    }
+    block = __atomic_load_n(&htab->stats_blocks, __ATOMIC_ACQUIRE);
+    while (block && block->thread != stats_thread)
+        block = block->next;
 
-    memset(htab->buckets, 0, sizeof(hash_entry_i *) * htab->capacity);
+    if (!block) {
+        mem = calloc(1, sizeof(hashtable_stats_block) + CACHE_LINE_SIZE - 1);
+        if (!mem)
+            return NULL;
 
-    htab->lst_head.lst_next = &htab->lst_head;
-    htab->lst_head.lst_prev = &htab->lst_head;
+        block = (hashtable_stats_block *)(((uintptr_t)mem + CACHE_LINE_SIZE - 1) &
+                                          ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+        block->mem = mem;
+        block->thread = stats_thread;
+        block->next = __atomic_load_n(&htab->stats_blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&htab->stats_blocks, &block->next, block,
+                                            1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
 
-    htab->count = 0;
-    htab->mod_count++;
+    stats_cached_id = htab->stats_id;
+    stats_cached = block;
+    return block;
 }
 
-static void hashtable_destroy(void *obj)
+/* Single writer: a plain add, atomic only so that readers see whole values */
+static inline void stats_add(hashtable_stats_block *block, int counter, uint64_t n)
 {
-    linked_hashtable_t *htab = (linked_hashtable_t *)obj;
+    __atomic_store_n(&block->counters[counter],
+                     __atomic_load_n(&block->counters[counter], __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
 
-    assert(htab);
+static inline uint64_t hashtable_stats_begin(linked_hashtable_t *htab)
+{
+    return htab->stats ? stats_probes : 0;
+}
 
-    if (!htab)
-        return;
+/*
+ * Count 'ops' operations of kind 'op' (STAT_GETS, STAT_PUTS or
+ * STAT_REMOVES) of which 'hits' found their key, and the probes made
+ * since hashtable_stats_begin() returned 'probes'.
+ */
+static inline void hashtable_stats_count(linked_hashtable_t *htab, int op,
+                                         uint64_t ops, uint64_t hits, uint64_t probes)
+{
+    hashtable_stats_block *block;
 
-    if (htab->synced &&
-        pthread_rwlock_wrlock(&htab->lock) != 0) // TODO: Check necessity.
+    if (!htab->stats || !(block = stats_block(htab)))
         return;
 
-    hashtable_clear_i(htab);
+    stats_add(block, op, ops);
+    if (op == STAT_GETS && hits)
+        stats_add(block, STAT_HITS, hits);
+    if (stats_probes != probes)
+        stats_add(block, STAT_PROBES, stats_probes - probes);
+}
 
-    if (htab->synced) {
-        pthread_rwlock_unlock(&htab->lock);
-        pthread_rwlock_destroy(&htab->lock);
-    }
+static inline uint64_t key_load64(const char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-static void hashtable_add(linked_hashtable_t *htab, linked_hash_entry_t *entry)
+static inline uint32_t key_load32(const char *p)
 {
-    hash_entry_i *ent = (hash_entry_i *)entry;
-    int idx;
-    uint32_t hash_code;
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    hash_code = htab->hash_code(ent->key, ent->keylen);
-    idx = hash_code % htab->capacity;
+/*
+ * Equality of keys of the same length. Keys that fit inline are compared
+ * with two to four overlapping loads from each end instead of a memcmp()
+ * call.
+ */
+static inline int key_equal(const void *key1, const void *key2, size_t len)
+{
+    const char *a = (const char *)key1;
+    const char *b = (const char *)key2;
+
+    if (len > LINKED_HASHTABLE_INLINE_KEY_MAX)
+        return memcmp(a, b, len) == 0;
 
-    ent->hash_code = hash_code;
-    ent->next = htab->buckets[idx];
+    if (len >= 16)
+        return ((key_load64(a) ^ key_load64(b)) |
+                (key_load64(a + 8) ^ key_load64(b + 8)) |
+                (key_load64(a + len - 16) ^ key_load64(b + len - 16)) |
+                (key_load64(a + len - 8) ^ key_load64(b + len - 8))) == 0;
 
-    /* Add new entry to linked list tail */
-    ent->lst_prev = htab->lst_head.lst_prev;
-    ent->lst_next = &htab->lst_head;
-    htab->lst_head.lst_prev->lst_next = ent;
-    htab->lst_head.lst_prev = ent;
+    if (len >= 8)
+        return ((key_load64(a) ^ key_load64(b)) |
+                (key_load64(a + len - 8) ^ key_load64(b + len - 8))) == 0;
 
-    htab->buckets[idx] = ent;
+    if (len >= 4)
+        return ((key_load32(a) ^ key_load32(b)) |
+                (key_load32(a + len - 4) ^ key_load32(b + len - 4))) == 0;
 
-    htab->count++;
+    return len == 0 || (a[0] == b[0] && a[len / 2] == b[len / 2] &&
+                        a[len - 1] == b[len - 1]);
 }
 
-static hash_entry_i **hashtable_get_entry(linked_hashtable_t *htab,
-                                          const void *key, size_t keylen)
+static inline int hashtable_match(linked_hashtable_t *htab, hash_entry_i *entry,
+                                  const void *key, size_t keylen, uint32_t hash_code)
 {
-    hash_entry_i **entry;
-    int idx;
-    uint32_t hash_code;
+    if (htab->stats)
+        stats_probes++;
 
-    hash_code = htab->hash_code(key, keylen);
-    idx = hash_code % htab->capacity;
-    entry = &htab->buckets[idx];
-
-    while (*entry) {
-        if ((*entry)->hash_code == hash_code &&
-            htab->key_compare((*entry)->key, (*entry)->keylen, key, keylen) == 0)
-            return entry;
+    if (entry->hash_code != hash_code)
+        return 0;
 
-        entry = &(*entry)->next;
-    }
+    // Built-in comparison inline, without the indirect call
+    if (htab->key_compare == default_key_compare)
+        return entry->keylen == keylen && key_equal(entry->key, key, keylen);
 
-    return NULL;
+    return htab->key_compare(entry->key, entry->keylen, key, keylen) == 0;
 }
 
-void *linked_hashtable_put(linked_hashtable_t *htab, linked_hash_entry_t *entry)
-{
-    hash_entry_i **ent;
-    hash_entry_i *new_entry = (hash_entry_i *)entry;
+/******************************************************************************
+ * Chained engine
+ */
 
-    assert(htab && entry && entry->key && entry->keylen && entry->data);
-    if (!htab || !entry || !entry->key || !entry->keylen || !entry->data) {
-        errno = EINVAL;
-        return NULL;
-    }
+static size_t BUCKET_SIZES[] = {
+    7,          7,          7,          17,         31,         67,
+    127,        257,        509,        1021,       2053,       4093,
+    8191,       16381,      32771,      65521,      131071,     262139,
+    524287,     1048573,    2097143,    4194301,    8388593,    16777213,
+    33554393,   67108859,   134217689,  268435399,  536870909,  1073741789,
+    2147483647
+};
 
-    hashtable_wlock(htab);
+#define MAX_SIZE_IDX \
+    ((int)(sizeof(BUCKET_SIZES) / sizeof(BUCKET_SIZES[0])) - 1)
 
-    ref(entry->data);
+/* Grow when the average chain holds more than one entry */
+#define HASHTABLE_GROW_LOAD(cap)        (cap)
+/* Shrink (if enabled) when less than 1/8 of the buckets are in use */
+#define HASHTABLE_SHRINK_LOAD(cap)      ((cap) >> 3)
+/* Number of non-empty buckets migrated per put/remove while resizing */
+#define HASHTABLE_REHASH_STEP           4
 
-    ent = hashtable_get_entry(htab, entry->key, entry->keylen);
-    if (ent) {
-        new_entry->next = (*ent)->next;
-        new_entry->lst_prev = (*ent)->lst_prev;
-        new_entry->lst_next = (*ent)->lst_next;
-        new_entry->hash_code = (*ent)->hash_code;
+static int bucket_size_idx(size_t capacity)
+{
+    int msb = (sizeof(unsigned long long) << 3) - __builtin_clzll(capacity) - 1;
 
-        new_entry->lst_prev->lst_next = new_entry;
-        new_entry->lst_next->lst_prev = new_entry;
+    if (msb > MAX_SIZE_IDX)
+        msb = MAX_SIZE_IDX;
 
-        deref((*ent)->data);
-        *ent = new_entry;
-    } else {
-        hashtable_add(htab, entry);
-    }
+    return msb;
+}
 
-    htab->mod_count++;
+/*
+ * Bucket heads and chain links are published with release stores, so a
+ * lock-free reader (LINKED_HASHTABLE_LOCKFREE_READ) always sees fully
+ * linked entries. Writers still serialize on the segment lock.
+ */
+#define LINK_LOAD(p)            __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define LINK_STORE(p, v)        __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
 
-    hashtable_unlock(htab);
+static inline size_t hist_bin(size_t n)
+{
+    return n < HASHTABLE_HIST_BINS ? n : HASHTABLE_HIST_BINS - 1;
+}
 
-    return entry->data;
+/* Move one bucket of a stats index from one bin to another */
+static inline void hist_move(hash_index *index, size_t from, size_t to)
+{
+    index->hist[hist_bin(from)]--;
+    index->hist[hist_bin(to)]++;
 }
 
-void *linked_hashtable_get(linked_hashtable_t *htab, const void *key, size_t keylen)
+/*
+ * Add the maintained bins to the nbins of hist; bin i stands for
+ * i + offset in *max.
+ */
+static void hist_fold(hash_index *index, size_t *hist, size_t nbins,
+                      size_t *max, size_t offset)
 {
-    hash_entry_i **entry;
-    void *val;
+    size_t i;
 
-    assert(htab && key && keylen);
-    if (!htab || !key || !keylen) {
-        errno = EINVAL;
-        return NULL;
-    }
+    for (i = 0; i < HASHTABLE_HIST_BINS; i++) {
+        if (!index->hist[i])
+            continue;
 
-    hashtable_rlock(htab);
+        hist[i < nbins ? i : nbins - 1] += index->hist[i];
+        if (i + offset > *max)
+            *max = i + offset;
+    }
+}
 
-    entry = hashtable_get_entry(htab, key, keylen);
-    val = entry ? ref((*entry)->data) : NULL;
+static bucket_array *bucket_array_alloc(int size_idx)
+{
+    bucket_array *table;
 
-    hashtable_unlock(htab);
+    table = (bucket_array *)calloc(1, sizeof(bucket_array) +
+                                   BUCKET_SIZES[size_idx] * sizeof(hash_entry_i *));
+    if (!table)
+        return NULL;
 
-    return val;
+    table->capacity = BUCKET_SIZES[size_idx];
+    return table;
+}
 
+static void bucket_array_free(hash_index *index, bucket_array *table)
+{
+    // Lock-free readers may still be scanning the old array.
+    if (index->lockfree)
+        epoch_retire(table, free);
+    else
+        free(table);
 }
 
-int linked_hashtable_exist(linked_hashtable_t *htab, const void *key, size_t keylen)
+static int chained_init(hash_index *index, size_t capacity)
 {
-    int exist;
+    int size_idx = bucket_size_idx(capacity);
 
-    assert(htab && key && keylen);
-    if (!htab || !key || !keylen) {
-        errno = EINVAL;
-        return 0;
-    }
+    index->table = bucket_array_alloc(size_idx);
+    if (!index->table)
+        return -1;
 
-    hashtable_rlock(htab);
-    exist = hashtable_get_entry(htab, key, keylen) != NULL;
-    hashtable_unlock(htab);
+    index->size_idx = size_idx;
+    index->min_size_idx = size_idx;
+    index->capacity = index->table->capacity;
+    if (index->hist)
+        index->hist[0] = index->capacity;
 
-    return exist;
+    return 0;
 }
 
-int linked_hashtable_is_empty(linked_hashtable_t *htab)
+static void chained_fini(hash_index *index)
 {
-    assert(htab);
-    if (!htab) {
-        errno = EINVAL;
-        return 0;
+    if (index->rehash_table)
+        free(index->rehash_table);
+    if (index->table)
+        free(index->table);
+}
+
+static hash_entry_i *chained_bucket_find(linked_hashtable_t *htab, hash_entry_i *entry,
+                                         const void *key, size_t keylen,
+                                         uint32_t hash_code)
+{
+    for (; entry; entry = entry->next) {
+        if (hashtable_match(htab, entry, key, keylen, hash_code))
+            return entry;
     }
 
-    return htab->count == 0;
+    return NULL;
 }
 
-static void *hashtable_remove_nolock(linked_hashtable_t *htab, const void *key, size_t keylen)
+static hash_entry_i *chained_find(linked_hashtable_t *htab, hash_index *index,
+                                  const void *key, size_t keylen, uint32_t hash_code)
 {
-    hash_entry_i **entry;
-    hash_entry_i *to_remove;
-    void *val = NULL;
+    bucket_array *table = index->table;
+    hash_entry_i *entry;
 
-    entry = hashtable_get_entry(htab, key, keylen);
-    if (entry) {
-        to_remove = *entry;
-        *entry = (*entry)->next;
+    entry = chained_bucket_find(htab, table->buckets[hash_code % table->capacity],
+                                key, keylen, hash_code);
+    if (!entry && (table = index->rehash_table) != NULL)
+        entry = chained_bucket_find(htab, table->buckets[hash_code % table->capacity],
+                                    key, keylen, hash_code);
 
-        /* Remove entry from linkedlist */
-        to_remove->lst_prev->lst_next = to_remove->lst_next;
-        to_remove->lst_next->lst_prev = to_remove->lst_prev;
+    return entry;
+}
 
-        // val = deref(to_remove->data);
-        // Pass reference to caller
-        val = to_remove->data;
+static hash_entry_i *chained_bucket_find_lockfree(linked_hashtable_t *htab,
+                                                  bucket_array *table,
+                                                  const void *key, size_t keylen,
+                                                  uint32_t hash_code)
+{
+    hash_entry_i *entry;
 
-        htab->count--;
-        htab->mod_count++;
+    entry = LINK_LOAD(table->buckets[hash_code % table->capacity]);
+    for (; entry; entry = LINK_LOAD(entry->next)) {
+        if (hashtable_match(htab, entry, key, keylen, hash_code))
+            return entry;
     }
 
-    return val;
+    return NULL;
 }
 
-void *linked_hashtable_remove(linked_hashtable_t *htab, const void *key, size_t keylen)
+/*
+ * Lookup without the segment lock, inside an epoch section. A hit is
+ * always valid. A miss can be spurious while entries are being moved
+ * between the bucket arrays, which is what 'seq' tells, so retry then.
+ */
+static hash_entry_i *chained_find_lockfree(linked_hashtable_t *htab, hash_index *index,
+                                           const void *key, size_t keylen,
+                                           uint32_t hash_code)
 {
-    void *val = NULL;
+    bucket_array *table;
+    hash_entry_i *entry;
+    unsigned int seq;
 
-    assert(htab && key && keylen);
-    if (!htab || !key || !keylen) {
-        errno = EINVAL;
-        return NULL;
-    }
+    do {
+        seq = __atomic_load_n(&index->seq, __ATOMIC_ACQUIRE);
 
-    hashtable_wlock(htab);
-    val = hashtable_remove_nolock(htab, key, keylen);
-    hashtable_unlock(htab);
+        table = LINK_LOAD(index->table);
+        entry = chained_bucket_find_lockfree(htab, table, key, keylen, hash_code);
+        if (entry)
+            return entry;
 
-    return val;
-}
+        table = LINK_LOAD(index->rehash_table);
+        if (table) {
+            entry = chained_bucket_find_lockfree(htab, table, key, keylen, hash_code);
+            if (entry)
+                return entry;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&index->seq, __ATOMIC_RELAXED));
+
+    return NULL;
+}
+
+static inline size_t chained_length(hash_entry_i *entry)
+{
+    size_t len;
+
+    for (len = 0; entry; entry = entry->next)
+        len++;
+
+    return len;
+}
+
+/*
+ * Locate the link pointing at 'entry', in whichever bucket array holds
+ * it, and the head of that bucket if 'bucket' is given.
+ */
+static hash_entry_i **chained_link(hash_index *index, hash_entry_i *entry,
+                                   hash_entry_i ***bucket)
+{
+    bucket_array *table = index->table;
+    hash_entry_i **head;
+    hash_entry_i **link;
+
+    head = link = &table->buckets[entry->hash_code % table->capacity];
+    while (*link && *link != entry)
+        link = &(*link)->next;
+
+    if (!*link && (table = index->rehash_table) != NULL) {
+        head = link = &table->buckets[entry->hash_code % table->capacity];
+        while (*link && *link != entry)
+            link = &(*link)->next;
+    }
+
+    assert(*link == entry);
+    if (bucket)
+        *bucket = head;
+    return link;
+}
+
+static int chained_insert(hash_index *index, hash_entry_i *entry)
+{
+    bucket_array *table;
+    size_t idx;
+
+    /* New entries always go to the new bucket array while resizing */
+    table = index->rehash_table ? index->rehash_table : index->table;
+    idx = entry->hash_code % table->capacity;
+
+    if (index->hist) {
+        size_t len = chained_length(table->buckets[idx]);
+        hist_move(index, len, len + 1);
+    }
+
+    LINK_STORE(entry->next, table->buckets[idx]);
+    LINK_STORE(table->buckets[idx], entry);
+
+    index->count++;
+    return 0;
+}
+
+static void chained_replace(hash_index *index, hash_entry_i *old_entry,
+                            hash_entry_i *new_entry)
+{
+    hash_entry_i **link = chained_link(index, old_entry, NULL);
+
+    LINK_STORE(new_entry->next, old_entry->next);
+    LINK_STORE(*link, new_entry);
+}
+
+static void chained_erase(hash_index *index, hash_entry_i *entry)
+{
+    hash_entry_i **bucket;
+    hash_entry_i **link = chained_link(index, entry, &bucket);
+
+    // entry->next is left intact for readers standing on the entry.
+    LINK_STORE(*link, entry->next);
+    index->count--;
+
+    if (index->hist) {
+        size_t len = chained_length(*bucket);
+        hist_move(index, len + 1, len);
+    }
+}
+
+/*
+ * Bracket moves of entries between the bucket arrays, during which a
+ * lock-free lookup may miss an entry that is present.
+ */
+static inline void chained_move_begin(hash_index *index)
+{
+    __atomic_store_n(&index->seq, index->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void chained_move_end(hash_index *index)
+{
+    __atomic_store_n(&index->seq, index->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void chained_rehash_finish(hash_index *index)
+{
+    bucket_array *table = index->table;
+
+    LINK_STORE(index->table, index->rehash_table);
+    LINK_STORE(index->rehash_table, NULL);
+
+    index->capacity = index->table->capacity;
+    index->size_idx = index->rehash_size_idx;
+    index->rehash_idx = 0;
+    index->layout++;
+    if (index->hist)
+        index->hist[0] -= table->capacity;
+
+    bucket_array_free(index, table);
+}
+
+static void chained_clear(hash_index *index)
+{
+    bucket_array *table;
+    size_t i;
+
+    chained_move_begin(index);
+
+    if (index->rehash_table)
+        chained_rehash_finish(index);
+
+    table = index->table;
+    for (i = 0; i < table->capacity; i++)
+        LINK_STORE(table->buckets[i], NULL);
+    index->count = 0;
+    index->layout++;
+    if (index->hist) {
+        memset(index->hist, 0, sizeof(size_t) * HASHTABLE_HIST_BINS);
+        index->hist[0] = table->capacity;
+    }
+
+    chained_move_end(index);
+}
+
+/*
+ * Move up to 'steps' non-empty buckets from the old bucket array to the
+ * new one. Visiting empty buckets is bounded as well, so a sparse table
+ * being shrunk can not turn a single put/remove into a full scan.
+ */
+static void chained_rehash_step(hash_index *index, int steps)
+{
+    bucket_array *table = index->table;
+    bucket_array *rehash_table = index->rehash_table;
+    int empty_visits = steps * 10;
+
+    chained_move_begin(index);
+
+    while (steps > 0 && index->rehash_idx < table->capacity) {
+        hash_entry_i *entry = table->buckets[index->rehash_idx];
+
+        if (!entry) {
+            index->rehash_idx++;
+            if (--empty_visits == 0)
+                break;
+            continue;
+        }
+
+        if (index->hist)
+            hist_move(index, chained_length(entry), 0);
+
+        while (entry) {
+            hash_entry_i *next = entry->next;
+            size_t idx = entry->hash_code % rehash_table->capacity;
+
+            if (index->hist) {
+                size_t len = chained_length(rehash_table->buckets[idx]);
+                hist_move(index, len, len + 1);
+            }
+
+            LINK_STORE(entry->next, rehash_table->buckets[idx]);
+            LINK_STORE(rehash_table->buckets[idx], entry);
+            entry = next;
+        }
+
+        LINK_STORE(table->buckets[index->rehash_idx++], NULL);
+        steps--;
+    }
+
+    if (index->rehash_idx >= table->capacity)
+        chained_rehash_finish(index);
+
+    chained_move_end(index);
+}
+
+static void chained_resize_start(hash_index *index, int size_idx)
+{
+    bucket_array *table;
+
+    table = bucket_array_alloc(size_idx);
+    if (!table)
+        return; // Keep going with the current buckets, only slower.
+
+    index->rehash_size_idx = size_idx;
+    index->rehash_idx = 0;
+    if (index->hist)
+        index->hist[0] += table->capacity;
+    LINK_STORE(index->rehash_table, table);
+}
+
+/*
+ * Called by every put/remove while holding the write lock: advance a
+ * resize in progress, or start one when the load factor leaves the
+ * [shrink, grow] window.
+ */
+static void chained_resize(hash_index *index, int shrink)
+{
+    int size_idx = index->size_idx;
+
+    if (index->rehash_table) {
+        chained_rehash_step(index, HASHTABLE_REHASH_STEP);
+        return;
+    }
+
+    if (index->count > HASHTABLE_GROW_LOAD(index->capacity)) {
+        while (size_idx < MAX_SIZE_IDX &&
+               index->count > HASHTABLE_GROW_LOAD(BUCKET_SIZES[size_idx]))
+            size_idx++;
+    } else if (shrink && index->count < HASHTABLE_SHRINK_LOAD(index->capacity)) {
+        while (size_idx > index->min_size_idx &&
+               index->count < HASHTABLE_SHRINK_LOAD(BUCKET_SIZES[size_idx]))
+            size_idx--;
+    }
+
+    // Different indexes may map to the same bucket count for tiny tables.
+    if (BUCKET_SIZES[size_idx] != index->capacity)
+        chained_resize_start(index, size_idx);
+}
+
+/* Also called by lock-free readers, hence the atomic load of the table */
+static void chained_prefetch(hash_index *index, uint32_t hash_code)
+{
+    bucket_array *table = LINK_LOAD(index->table);
+
+    PREFETCH(&table->buckets[hash_code % table->capacity]);
+}
+
+/* The buckets of 'table' first, then those of 'rehash_table' */
+static size_t chained_scan_size(hash_index *index)
+{
+    return index->table->capacity +
+           (index->rehash_table ? index->rehash_table->capacity : 0);
+}
+
+/*
+ * Whole chains are returned where they fit, so that entries added to or
+ * removed from a chain between two calls are not returned twice.
+ */
+static size_t chained_scan(hash_index *index, size_t *pos, size_t *skip, size_t end,
+                           void **entries, size_t n)
+{
+    bucket_array *table;
+    hash_entry_i *entry;
+    hash_entry_i *cur;
+    size_t count = 0;
+    size_t len;
+    size_t i;
+
+    while (*pos < end && count < n) {
+        table = index->table;
+        i = *pos;
+        if (i >= table->capacity) {
+            i -= table->capacity;
+            table = index->rehash_table;
+        }
+
+        entry = table->buckets[i];
+        for (i = 0; entry && i < *skip; i++)
+            entry = entry->next;
+
+        for (len = 0, cur = entry; cur; cur = cur->next)
+            len++;
+        if (count && count + len > n)
+            break;
+
+        for (; entry && count < n; entry = entry->next) {
+            entries[count++] = entry;
+            (*skip)++;
+        }
+
+        if (entry)
+            break;
+
+        (*pos)++;
+        *skip = 0;
+    }
+
+    return count;
+}
+
+/*
+ * While resizing, the buckets of the old array below rehash_idx have been
+ * drained into the new one, which follows it in scan positions.
+ */
+static void chained_scan_moves(hash_index *index, size_t *drained, size_t *target)
+{
+    *drained = index->rehash_table ? index->rehash_idx : 0;
+    *target = index->table->capacity;
+}
+
+/* Buckets by chain length, maintained by a stats index and walked otherwise */
+static void chained_histogram(hash_index *index, size_t *hist, size_t nbins,
+                              size_t *max)
+{
+    bucket_array *table = index->table;
+    size_t len;
+    size_t i;
+
+    if (index->hist) {
+        hist_fold(index, hist, nbins, max, 0);
+        return;
+    }
+
+    for (;;) {
+        for (i = 0; i < table->capacity; i++) {
+            len = chained_length(table->buckets[i]);
+
+            hist[len < nbins ? len : nbins - 1]++;
+            if (len > *max)
+                *max = len;
+        }
+
+        if (table != index->table || !index->rehash_table)
+            break;
+        table = index->rehash_table;
+    }
+}
+
+static const hash_engine chained_engine = {
+    chained_init,
+    chained_fini,
+    chained_find,
+    chained_find_lockfree,
+    chained_insert,
+    chained_replace,
+    chained_erase,
+    chained_clear,
+    chained_resize,
+    chained_prefetch,
+    chained_scan_size,
+    chained_scan,
+    chained_scan_moves,
+    chained_histogram
+};
+
+/******************************************************************************
+ * Open addressing engine
+ *
+ * Swiss table layout: the hash code is split into a probe position (H1)
+ * and a 7-bit tag (H2). Slots are probed in groups of GROUP_WIDTH control
+ * bytes which are compared against the tag in one go, so a lookup usually
+ * touches one line of control bytes plus the matching slot.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GROUP_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GROUP_NEON
+#endif
+
+#define GROUP_WIDTH         16
+
+#define CTRL_EMPTY          ((uint8_t)0x80)
+#define CTRL_DELETED        ((uint8_t)0xFE)
+#define CTRL_IS_FULL(c)     (((c) & 0x80) == 0)
+
+/* Keep the load factor below 7/8 */
+#define SWISS_MAX_LOAD(cap)     ((cap) - ((cap) >> 3))
+
+#define H1(h)               ((h) >> 7)
+#define H2(h)               ((uint8_t)((h) & 0x7F))
+
+/* Bit i of the returned mask is set if control byte i of the group matches */
+static inline uint32_t group_match(const uint8_t *group, uint8_t c)
+{
+#if defined(GROUP_SSE2)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#elif defined(GROUP_NEON)
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t eq = vceqq_u8(vld1q_u8(group), vdupq_n_u8(c));
+    uint8x16_t m = vandq_u8(eq, vld1q_u8(bits));
+
+    return (uint32_t)vaddv_u8(vget_low_u8(m)) |
+           ((uint32_t)vaddv_u8(vget_high_u8(m)) << 8);
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == c) << i;
+
+    return mask;
+#endif
+}
+
+static inline uint32_t group_match_empty_or_deleted(const uint8_t *group)
+{
+#if defined(GROUP_SSE2)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP_WIDTH; i++)
+        mask |= (uint32_t)(!CTRL_IS_FULL(group[i])) << i;
+
+    return mask;
+#endif
+}
+
+static inline void swiss_set_ctrl(hash_index *index, size_t i, uint8_t c)
+{
+    index->ctrl[i] = c;
+    if (i < GROUP_WIDTH)
+        index->ctrl[index->capacity + i] = c;
+}
+
+static int swiss_alloc(hash_index *index, size_t capacity)
+{
+    uint8_t *ctrl;
+    hash_entry_i **slots;
+
+    ctrl = (uint8_t *)malloc(capacity + GROUP_WIDTH);
+    slots = (hash_entry_i **)malloc(sizeof(hash_entry_i *) * capacity);
+    if (!ctrl || !slots) {
+        free(ctrl);
+        free(slots);
+        return -1;
+    }
+
+    memset(ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+
+    index->ctrl = ctrl;
+    index->slots = slots;
+    index->capacity = capacity;
+    index->growth_left = SWISS_MAX_LOAD(capacity);
+
+    return 0;
+}
+
+/* Smallest power of two with room for 'count' entries below the max load */
+static size_t swiss_capacity(size_t count)
+{
+    size_t capacity = GROUP_WIDTH;
+
+    while (SWISS_MAX_LOAD(capacity) < count)
+        capacity <<= 1;
+
+    return capacity;
+}
+
+static int swiss_init(hash_index *index, size_t capacity)
+{
+    capacity = swiss_capacity(capacity);
+
+    if (swiss_alloc(index, capacity) < 0)
+        return -1;
+
+    index->min_capacity = capacity;
+    return 0;
+}
+
+static void swiss_fini(hash_index *index)
+{
+    if (index->ctrl)
+        free(index->ctrl);
+    if (index->slots)
+        free(index->slots);
+}
+
+static hash_entry_i *swiss_find(linked_hashtable_t *htab, hash_index *index,
+                                const void *key, size_t keylen, uint32_t hash_code)
+{
+    size_t mask = index->capacity - 1;
+    uint32_t h = hash_mix(hash_code);
+    size_t pos = H1(h) & mask;
+    size_t stride = 0;
+
+    for (;;) {
+        const uint8_t *group = index->ctrl + pos;
+        uint32_t match = group_match(group, H2(h));
+
+        while (match) {
+            size_t i = (pos + __builtin_ctz(match)) & mask;
+            hash_entry_i *entry = index->slots[i];
+
+            if (hashtable_match(htab, entry, key, keylen, hash_code))
+                return entry;
+
+            match &= match - 1;
+        }
+
+        if (group_match(group, CTRL_EMPTY))
+            return NULL;
+
+        stride += GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+}
+
+/* Slot currently holding 'entry', found in the group after 'groups' others */
+static inline size_t swiss_locate(hash_index *index, hash_entry_i *entry,
+                                  size_t *groups)
+{
+    size_t mask = index->capacity - 1;
+    uint32_t h = hash_mix(entry->hash_code);
+    size_t pos = H1(h) & mask;
+    size_t stride = 0;
+
+    for (;;) {
+        uint32_t match = group_match(index->ctrl + pos, H2(h));
+
+        while (match) {
+            size_t i = (pos + __builtin_ctz(match)) & mask;
+
+            if (index->slots[i] == entry) {
+                if (groups)
+                    *groups = stride / GROUP_WIDTH;
+                return i;
+            }
+
+            match &= match - 1;
+        }
+
+        assert(stride < index->capacity);
+
+        stride += GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+}
+
+static size_t swiss_slot(hash_index *index, hash_entry_i *entry)
+{
+    return swiss_locate(index, entry, NULL);
+}
+
+static void swiss_place(hash_index *index, hash_entry_i *entry)
+{
+    size_t mask = index->capacity - 1;
+    uint32_t h = hash_mix(entry->hash_code);
+    size_t pos = H1(h) & mask;
+    size_t stride = 0;
+    uint32_t match;
+    size_t i;
+
+    while (!(match = group_match_empty_or_deleted(index->ctrl + pos))) {
+        stride += GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+
+    i = (pos + __builtin_ctz(match)) & mask;
+    if (index->ctrl[i] == CTRL_EMPTY)
+        index->growth_left--;
+
+    swiss_set_ctrl(index, i, H2(h));
+    index->slots[i] = entry;
+    if (index->hist)
+        index->hist[hist_bin(stride / GROUP_WIDTH)]++;
+}
+
+/*
+ * Rebuild the slot arrays with the given capacity, which also drops all
+ * tombstones. Open addressing can not spread this over several calls the
+ * way the chained engine does, but the cost is amortized by doubling.
+ */
+static int swiss_rehash(hash_index *index, size_t capacity)
+{
+    hash_index old = *index;
+    size_t i;
+
+    if (swiss_alloc(index, capacity) < 0) {
+        *index = old;
+        return -1;
+    }
+
+    if (index->hist)
+        memset(index->hist, 0, sizeof(size_t) * HASHTABLE_HIST_BINS);
+
+    for (i = 0; i < old.capacity; i++) {
+        if (CTRL_IS_FULL(old.ctrl[i]))
+            swiss_place(index, old.slots[i]);
+    }
+
+    swiss_fini(&old);
+    index->layout++;
+    return 0;
+}
+
+static int swiss_insert(hash_index *index, hash_entry_i *entry)
+{
+    if (index->growth_left == 0) {
+        size_t capacity = index->capacity;
+
+        /* Mostly tombstones: clean up in place instead of growing */
+        if (index->count >= SWISS_MAX_LOAD(capacity) / 2)
+            capacity <<= 1;
+
+        if (swiss_rehash(index, capacity) < 0)
+            return -1;
+    }
+
+    swiss_place(index, entry);
+    index->count++;
+
+    return 0;
+}
+
+static void swiss_replace(hash_index *index, hash_entry_i *old_entry,
+                          hash_entry_i *new_entry)
+{
+    index->slots[swiss_slot(index, old_entry)] = new_entry;
+}
+
+static void swiss_erase(hash_index *index, hash_entry_i *entry)
+{
+    size_t mask = index->capacity - 1;
+    size_t groups;
+    size_t i = swiss_locate(index, entry, &groups);
+    uint32_t before, after;
+
+    if (index->hist)
+        index->hist[hist_bin(groups)]--;
+
+    /*
+     * The slot can go back to EMPTY only if no probe sequence could have
+     * seen a full group across it, otherwise it has to stay a tombstone.
+     */
+    before = group_match(index->ctrl + ((i - GROUP_WIDTH) & mask), CTRL_EMPTY);
+    after = group_match(index->ctrl + i, CTRL_EMPTY);
+
+    if (before && after &&
+        (__builtin_clz(before << 16) + __builtin_ctz(after)) < GROUP_WIDTH) {
+        swiss_set_ctrl(index, i, CTRL_EMPTY);
+        index->growth_left++;
+    } else {
+        swiss_set_ctrl(index, i, CTRL_DELETED);
+    }
+
+    index->count--;
+}
+
+static void swiss_clear(hash_index *index)
+{
+    memset(index->ctrl, CTRL_EMPTY, index->capacity + GROUP_WIDTH);
+    index->growth_left = SWISS_MAX_LOAD(index->capacity);
+    index->count = 0;
+    index->layout++;
+    if (index->hist)
+        memset(index->hist, 0, sizeof(size_t) * HASHTABLE_HIST_BINS);
+}
+
+static void swiss_resize(hash_index *index, int shrink)
+{
+    size_t capacity;
+
+    if (!shrink || index->capacity <= index->min_capacity ||
+        index->count >= (index->capacity >> 3))
+        return;
+
+    capacity = swiss_capacity(index->count * 2);
+    if (capacity < index->min_capacity)
+        capacity = index->min_capacity;
+
+    if (capacity < index->capacity)
+        swiss_rehash(index, capacity);
+}
+
+static void swiss_prefetch(hash_index *index, uint32_t hash_code)
+{
+    size_t pos = H1(hash_mix(hash_code)) & (index->capacity - 1);
+
+    PREFETCH(index->ctrl + pos);
+    PREFETCH(&index->slots[pos]);
+}
+
+static size_t swiss_scan_size(hash_index *index)
+{
+    return index->capacity;
+}
+
+static size_t swiss_scan(hash_index *index, size_t *pos, size_t *skip, size_t end,
+                         void **entries, size_t n)
+{
+    size_t count = 0;
+
+    (void)skip;
+
+    for (; *pos < end && count < n; (*pos)++) {
+        if (CTRL_IS_FULL(index->ctrl[*pos]))
+            entries[count++] = index->slots[*pos];
+    }
+
+    return count;
+}
+
+/*
+ * Entries by the number of groups probed before the one holding them,
+ * maintained by a stats index and walked otherwise
+ */
+static void swiss_histogram(hash_index *index, size_t *hist, size_t nbins,
+                            size_t *max)
+{
+    size_t groups;
+    size_t i;
+
+    if (index->hist) {
+        hist_fold(index, hist, nbins, max, 1);
+        return;
+    }
+
+    for (i = 0; i < index->capacity; i++) {
+        if (!CTRL_IS_FULL(index->ctrl[i]))
+            continue;
+
+        swiss_locate(index, index->slots[i], &groups);
+        hist[groups < nbins ? groups : nbins - 1]++;
+        if (groups + 1 > *max)
+            *max = groups + 1;
+    }
+}
+
+static const hash_engine swiss_engine = {
+    swiss_init,
+    swiss_fini,
+    swiss_find,
+    NULL,
+    swiss_insert,
+    swiss_replace,
+    swiss_erase,
+    swiss_clear,
+    swiss_resize,
+    swiss_prefetch,
+    swiss_scan_size,
+    swiss_scan,
+    NULL,
+    swiss_histogram
+};
+
+/******************************************************************************
+ * Linked hashtable
+ */
+
+static void hashtable_destroy(void *htab);
+
+linked_hashtable_t *linked_hashtable_create(size_t capacity, int flags,
+                                            uint32_t (*hash_code)(const void *key, size_t len),
+                                            int (*key_compare)(const void *key1, size_t len1,
+                             const void *key2, size_t len2))
+{
+    linked_hashtable_t *htab;
+    int segment_bits;
+    int i;
+
+    // Lock-free lookups rely on the chained engine's publication order,
+    // and can not reorder the list.
+    if ((flags & LINKED_HASHTABLE_LOCKFREE_READ) &&
+        (flags & (LINKED_HASHTABLE_OPEN_ADDRESSING | LINKED_HASHTABLE_ACCESS_ORDER))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    htab = (linked_hashtable_t *)rc_zalloc(sizeof(linked_hashtable_t), hashtable_destroy);
+    if (!htab) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (flags & (LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_LOCKFREE_READ))
+        flags |= LINKED_HASHTABLE_SYNCED;
+
+    if (flags & LINKED_HASHTABLE_OPEN_ADDRESSING)
+        htab->engine = &swiss_engine;
+    else
+        htab->engine = &chained_engine;
+
+    segment_bits = (flags & LINKED_HASHTABLE_STRIPED) ? HASHTABLE_SEGMENT_BITS : 0;
+    capacity = (capacity ? capacity : 127) >> segment_bits;
+
+    htab->segments_mem = calloc((1 << segment_bits) + 1, sizeof(hash_segment));
+    if (!htab->segments_mem) {
+        deref(htab);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    htab->segments = (hash_segment *)(((uintptr_t)htab->segments_mem +
+                        CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    htab->segment_bits = segment_bits;
+
+    if (flags & LINKED_HASHTABLE_STATS) {
+        htab->stats = 1;
+        htab->stats_id = __atomic_fetch_add(&stats_tables, 1,
+                                            __ATOMIC_RELAXED) + 1;
+    }
+
+    for (i = 0; i < (1 << segment_bits); i++) {
+        htab->segments[i].index.lockfree = (flags & LINKED_HASHTABLE_LOCKFREE_READ) != 0;
+        if (htab->stats) {
+            htab->segments[i].index.hist = (size_t *)calloc(HASHTABLE_HIST_BINS,
+                                                            sizeof(size_t));
+            if (!htab->segments[i].index.hist) {
+                deref(htab);
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+
+        if (htab->engine->init(&htab->segments[i].index, capacity ? capacity : 1) < 0) {
+            deref(htab);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        htab->nsegments++;
+    }
+
+    if (flags & LINKED_HASHTABLE_SYNCED) {
+        for (i = 0; i < htab->nsegments; i++) {
+            if (pthread_rwlock_init(&htab->segments[i].lock, NULL) != 0)
+                break;
+        }
+
+        if (i < htab->nsegments ||
+            ((flags & LINKED_HASHTABLE_STRIPED) &&
+             pthread_mutex_init(&htab->lst_lock, NULL) != 0)) {
+            while (--i >= 0)
+                pthread_rwlock_destroy(&htab->segments[i].lock);
+            deref(htab);
+            return NULL;
+        }
+
+        htab->synced = 1;
+    }
+
+    htab->count = 0;
+    htab->mod_count = 0;
+    htab->flags = flags;
+
+    htab->time_base = get_monotonic_time();
+
+    htab->hash_code = hash_code;
+    if (!hash_code && (flags & LINKED_HASHTABLE_RANDOM_SEED))
+        hashtable_seed(htab);
+    htab->key_compare = key_compare ? key_compare : default_key_compare;
+
+    htab->lst_head.lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev = &htab->lst_head;
+
+    return htab;
+}
+
+static inline int hashtable_segment_idx(linked_hashtable_t *htab,
+                                        uint32_t hash_code)
+{
+    if (!htab->segment_bits)
+        return 0;
+
+    return (int)(hash_mix(hash_code) >> (32 - htab->segment_bits));
+}
+
+static inline hash_segment *hashtable_segment(linked_hashtable_t *htab,
+                                              uint32_t hash_code)
+{
+    return &htab->segments[hashtable_segment_idx(htab, hash_code)];
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#endif
+
+enum {
+    LOCK_READ,
+    LOCK_WRITE,
+    LOCK_LIST
+};
+
+/*
+ * Lock of a stats table: try first, and only when that fails count the
+ * wait and time it.
+ */
+static void hashtable_lock_counted(linked_hashtable_t *htab, void *lock, int kind)
+{
+    hashtable_stats_block *block;
+    uint64_t start;
+    int rc;
+
+    if (kind == LOCK_READ)
+        rc = pthread_rwlock_tryrdlock((pthread_rwlock_t *)lock);
+    else if (kind == LOCK_WRITE)
+        rc = pthread_rwlock_trywrlock((pthread_rwlock_t *)lock);
+    else
+        rc = pthread_mutex_trylock((pthread_mutex_t *)lock);
+
+    if (rc == 0)
+        return;
+
+    start = get_monotonic_time();
+
+    if (kind == LOCK_READ)
+        rc = pthread_rwlock_rdlock((pthread_rwlock_t *)lock);
+    else if (kind == LOCK_WRITE)
+        rc = pthread_rwlock_wrlock((pthread_rwlock_t *)lock);
+    else
+        rc = pthread_mutex_lock((pthread_mutex_t *)lock);
+    assert(rc == 0);
+
+    block = stats_block(htab);
+    if (block) {
+        stats_add(block, STAT_LOCK_WAITS, 1);
+        stats_add(block, STAT_LOCK_WAIT_TIME, get_monotonic_time() - start);
+    }
+}
+
+static inline void segment_rlock(linked_hashtable_t *htab, hash_segment *seg)
+{
+    if (htab->synced) {
+        if (htab->stats) {
+            hashtable_lock_counted(htab, &seg->lock, LOCK_READ);
+        } else {
+            int rc = pthread_rwlock_rdlock(&seg->lock);
+            assert(rc == 0);
+        }
+    }
+}
+
+static inline void segment_wlock(linked_hashtable_t *htab, hash_segment *seg)
+{
+    if (htab->synced) {
+        if (htab->stats) {
+            hashtable_lock_counted(htab, &seg->lock, LOCK_WRITE);
+        } else {
+            int rc = pthread_rwlock_wrlock(&seg->lock);
+            assert(rc == 0);
+        }
+    }
+}
+
+static inline void list_lock(linked_hashtable_t *htab)
+{
+    if (htab->flags & LINKED_HASHTABLE_STRIPED) {
+        if (htab->stats) {
+            hashtable_lock_counted(htab, &htab->lst_lock, LOCK_LIST);
+        } else {
+            int rc = pthread_mutex_lock(&htab->lst_lock);
+            assert(rc == 0);
+        }
+    }
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+static inline void segment_unlock(linked_hashtable_t *htab, hash_segment *seg)
+{
+    if (htab->synced) {
+        pthread_rwlock_unlock(&seg->lock);
+    }
+}
+
+static inline void list_unlock(linked_hashtable_t *htab)
+{
+    if (htab->flags & LINKED_HASHTABLE_STRIPED) {
+        pthread_mutex_unlock(&htab->lst_lock);
+    }
+}
+
+/* Read access to the insertion-order list only, used by the iterators */
+static inline void hashtable_list_rlock(linked_hashtable_t *htab)
+{
+    if (htab->flags & LINKED_HASHTABLE_STRIPED)
+        list_lock(htab);
+    else
+        segment_rlock(htab, htab->segments);
+}
+
+static inline void hashtable_list_runlock(linked_hashtable_t *htab)
+{
+    if (htab->flags & LINKED_HASHTABLE_STRIPED)
+        list_unlock(htab);
+    else
+        segment_unlock(htab, htab->segments);
+}
+
+static inline void hashtable_list_wlock(linked_hashtable_t *htab)
+{
+    if (htab->flags & LINKED_HASHTABLE_STRIPED)
+        list_lock(htab);
+    else
+        segment_wlock(htab, htab->segments);
+}
+
+static void hashtable_wlock_all(linked_hashtable_t *htab)
+{
+    int i;
+
+    for (i = 0; i < htab->nsegments; i++)
+        segment_wlock(htab, &htab->segments[i]);
+
+    list_lock(htab);
+}
+
+static void hashtable_unlock_all(linked_hashtable_t *htab)
+{
+    int i;
+
+    list_unlock(htab);
+
+    for (i = htab->nsegments - 1; i >= 0; i--)
+        segment_unlock(htab, &htab->segments[i]);
+}
+
+static inline void hashtable_resize(linked_hashtable_t *htab, hash_segment *seg)
+{
+    htab->engine->resize(&seg->index,
+                         (htab->flags & LINKED_HASHTABLE_AUTO_SHRINK) != 0);
+}
+
+static inline void list_link_tail(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    entry->version = entry->pos = ++htab->version;
+
+    entry->lst_prev = htab->lst_head.lst_prev;
+    entry->lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev->lst_next = entry;
+    htab->lst_head.lst_prev = entry;
+}
+
+static inline uint32_t hashtable_cost(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    size_t cost;
+
+    if (!htab->cost)
+        return 1;
+
+    cost = htab->cost((linked_hash_entry_t *)entry);
+    return cost > UINT32_MAX ? UINT32_MAX : (uint32_t)cost;
+}
+
+/* Caller holds the list lock */
+static inline int hashtable_over_limit(linked_hashtable_t *htab)
+{
+    return (htab->max_entries && htab->count > htab->max_entries) ||
+           (htab->max_cost && htab->total_cost > htab->max_cost);
+}
+
+/* Proactive expiry done by each put, bounded to keep puts O(1) */
+#define HASHTABLE_EXPIRE_STEP   4
+
+/* 64 bits, so that an entry stays due however long ago it expired */
+static inline uint64_t hashtable_now(linked_hashtable_t *htab)
+{
+    return (get_monotonic_time() - htab->time_base) / 1000;
+}
+
+static inline int expire_due(uint64_t expire, uint64_t now)
+{
+    return expire && expire <= now;
+}
+
+/*
+ * The expiry time is read without the list lock by readers, lock-free
+ * ones included, and only changes by a put of the entry.
+ */
+static inline int hashtable_expired(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    uint64_t expire = __atomic_load_n(&entry->expire, __ATOMIC_RELAXED);
+
+    return expire && expire_due(expire, hashtable_now(htab));
+}
+
+static void snapshot_record_push(linked_hashtable_snapshot_t *snap,
+                                 hash_entry_i *entry)
+{
+    snapshot_record *records;
+    snapshot_record rec;
+    uint32_t size;
+    uint32_t idx;
+    uint32_t parent;
+
+    if (snap->nrecords == snap->size) {
+        size = snap->size ? snap->size * 2 : 16;
+        records = (snapshot_record *)realloc(snap->records,
+                                             size * sizeof(snapshot_record));
+        if (!records) {
+            snap->error = ENOMEM;
+            return;
+        }
+
+        snap->records = records;
+        snap->size = size;
+    }
+
+    rec.pos = entry->pos;
+    rec.key = entry->key;
+    rec.keylen = entry->keylen;
+    rec.data = ref(entry->data);
+
+    for (idx = snap->nrecords++; idx > 0; idx = parent) {
+        parent = (idx - 1) / 2;
+        if (snap->records[parent].pos <= rec.pos)
+            break;
+        snap->records[idx] = snap->records[parent];
+    }
+    snap->records[idx] = rec;
+}
+
+static void snapshot_record_pop(linked_hashtable_snapshot_t *snap,
+                                snapshot_record *rec)
+{
+    snapshot_record last;
+    uint32_t idx = 0;
+    uint32_t child;
+
+    *rec = snap->records[0];
+    last = snap->records[--snap->nrecords];
+
+    while ((child = idx * 2 + 1) < snap->nrecords) {
+        if (child + 1 < snap->nrecords &&
+            snap->records[child + 1].pos < snap->records[child].pos)
+            child++;
+        if (last.pos <= snap->records[child].pos)
+            break;
+
+        snap->records[idx] = snap->records[child];
+        idx = child;
+    }
+
+    if (snap->nrecords)
+        snap->records[idx] = last;
+}
+
+/*
+ * The entry is about to leave its list position, keep it for the open
+ * snapshots that would still return it. Caller holds the list lock.
+ */
+static void snapshot_save(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    linked_hashtable_snapshot_t *snap;
+
+    for (snap = htab->snapshots; snap; snap = snap->next) {
+        if (snap->cursor == entry)
+            snap->cursor = entry->lst_next;
+
+        if (entry->version <= snap->version && entry->pos > snap->passed &&
+            !expire_due(entry->expire, snap->now))
+            snapshot_record_push(snap, entry);
+    }
+}
+
+static inline void list_unlink(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    if (htab->snapshots)
+        snapshot_save(htab, entry);
+
+    entry->lst_prev->lst_next = entry->lst_next;
+    entry->lst_next->lst_prev = entry->lst_prev;
+}
+
+/* The expiry heap, caller holds the list lock */
+static inline int expiry_before(hash_entry_i *a, hash_entry_i *b)
+{
+    return a->expire < b->expire;
+}
+
+static inline void expiry_heap_set(linked_hashtable_t *htab, uint32_t idx,
+                                   hash_entry_i *entry)
+{
+    htab->expiry_heap[idx] = entry;
+    entry->expiry_idx = idx + 1;
+}
+
+static void expiry_heap_up(linked_hashtable_t *htab, uint32_t idx)
+{
+    hash_entry_i *entry = htab->expiry_heap[idx];
+    uint32_t parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (!expiry_before(entry, htab->expiry_heap[parent]))
+            break;
+
+        expiry_heap_set(htab, idx, htab->expiry_heap[parent]);
+        idx = parent;
+    }
+
+    expiry_heap_set(htab, idx, entry);
+}
+
+static void expiry_heap_down(linked_hashtable_t *htab, uint32_t idx)
+{
+    hash_entry_i *entry = htab->expiry_heap[idx];
+    uint32_t child;
+
+    while ((child = idx * 2 + 1) < htab->expiry_count) {
+        if (child + 1 < htab->expiry_count &&
+            expiry_before(htab->expiry_heap[child + 1], htab->expiry_heap[child]))
+            child++;
+        if (!expiry_before(htab->expiry_heap[child], entry))
+            break;
+
+        expiry_heap_set(htab, idx, htab->expiry_heap[child]);
+        idx = child;
+    }
+
+    expiry_heap_set(htab, idx, entry);
+}
+
+/*
+ * Take a slot for a later expiry_heap_push(), or give it back with
+ * expiry_heap_unreserve(). Caller holds the list lock.
+ */
+static int expiry_heap_reserve(linked_hashtable_t *htab)
+{
+    hash_entry_i **heap;
+    uint32_t size;
+
+    if (htab->expiry_count + htab->expiry_reserved >= htab->expiry_size) {
+        size = htab->expiry_size ? htab->expiry_size * 2 : 16;
+        heap = (hash_entry_i **)realloc(htab->expiry_heap,
+                                        size * sizeof(hash_entry_i *));
+        if (!heap)
+            return -1;
+
+        htab->expiry_heap = heap;
+        htab->expiry_size = size;
+    }
+
+    htab->expiry_reserved++;
+    return 0;
+}
+
+static inline void expiry_heap_unreserve(linked_hashtable_t *htab)
+{
+    assert(htab->expiry_reserved > 0);
+    htab->expiry_reserved--;
+}
+
+/* Room was made by expiry_heap_reserve() */
+static void expiry_heap_push(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    expiry_heap_unreserve(htab);
+    assert(htab->expiry_count < htab->expiry_size);
+
+    htab->expiry_heap[htab->expiry_count] = entry;
+    expiry_heap_up(htab, htab->expiry_count++);
+}
+
+static void expiry_heap_remove(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    uint32_t idx = entry->expiry_idx - 1;
+    hash_entry_i *last;
+
+    assert(entry->expiry_idx && htab->expiry_heap[idx] == entry);
+
+    entry->expiry_idx = 0;
+    last = htab->expiry_heap[--htab->expiry_count];
+    if (last == entry)
+        return;
+
+    htab->expiry_heap[idx] = last;
+    if (idx > 0 && expiry_before(last, htab->expiry_heap[(idx - 1) / 2]))
+        expiry_heap_up(htab, idx);
+    else
+        expiry_heap_down(htab, idx);
+}
+
+/* Caller holds the list lock */
+static inline int hashtable_expiry_due(linked_hashtable_t *htab)
+{
+    return htab->expiry_count &&
+           expire_due(htab->expiry_heap[0]->expire, hashtable_now(htab));
+}
+
+static void hashtable_deref(void *data)
+{
+    deref(data);
+}
+
+/*
+ * Drop the table's reference to the data of an unlinked entry. Lock-free
+ * readers may still be looking at the entry, so it has to stay alive
+ * until they are done.
+ */
+static inline void hashtable_release(linked_hashtable_t *htab, void *data)
+{
+    if (htab->flags & LINKED_HASHTABLE_LOCKFREE_READ)
+        epoch_retire(data, hashtable_deref);
+    else
+        deref(data);
+}
+
+static void hashtable_clear_i(linked_hashtable_t *htab)
+{
+    hash_entry_i *entry;
+    hash_entry_i *cur;
+    int i;
+
+    if (htab->count == 0)
+        return;
+
+    entry = htab->lst_head.lst_next;
+    while (entry != &htab->lst_head) {
+        cur = entry;
+        entry = entry->lst_next;
+
+        if (htab->snapshots)
+            snapshot_save(htab, cur);
+        cur->expiry_idx = 0;
+        hashtable_release(htab, cur->data);
+    }
+
+    for (i = 0; i < htab->nsegments; i++)
+        htab->engine->clear(&htab->segments[i].index);
+
+    htab->lst_head.lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev = &htab->lst_head;
+
+    htab->count = 0;
+    htab->total_cost = 0;
+    htab->expiry_count = 0;
+    htab->mod_count++;
+}
+
+static void hashtable_destroy(void *obj)
+{
+    linked_hashtable_t *htab = (linked_hashtable_t *)obj;
+    int i;
+
+    assert(htab);
+
+    if (!htab)
+        return;
+
+    if (htab->synced)
+        hashtable_wlock_all(htab);
+
+    hashtable_clear_i(htab);
+
+    if (htab->synced) {
+        hashtable_unlock_all(htab);
+
+        for (i = 0; i < htab->nsegments; i++)
+            pthread_rwlock_destroy(&htab->segments[i].lock);
+        if (htab->flags & LINKED_HASHTABLE_STRIPED)
+            pthread_mutex_destroy(&htab->lst_lock);
+    }
+
+    for (i = 0; i < htab->nsegments; i++)
+        htab->engine->fini(&htab->segments[i].index);
+
+    // Also a segment whose engine failed to initialize.
+    for (i = 0; htab->segments && i < (1 << htab->segment_bits); i++) {
+        if (htab->segments[i].index.hist)
+            free(htab->segments[i].index.hist);
+    }
+
+    if (htab->segments_mem)
+        free(htab->segments_mem);
+
+    while (htab->stats_blocks) {
+        hashtable_stats_block *block = htab->stats_blocks;
+
+        htab->stats_blocks = block->next;
+        free(block->mem);
+    }
+
+    if (htab->expiry_heap)
+        free(htab->expiry_heap);
+}
+
+/* Caller holds the segment write lock */
+static void hashtable_unlink(linked_hashtable_t *htab, hash_segment *seg,
+                             hash_entry_i *entry)
+{
+    htab->engine->erase(&seg->index, entry);
+
+    list_lock(htab);
+
+    /* Remove entry from linkedlist */
+    list_unlink(htab, entry);
+
+    if (entry->expiry_idx)
+        expiry_heap_remove(htab, entry);
+
+    htab->count--;
+    htab->total_cost -= entry->cost;
+    htab->mod_count++;
+
+    list_unlock(htab);
+
+    hashtable_resize(htab, seg);
+}
+
+/*
+ * Next entry to drop, caller holds the list lock: the earliest expiring
+ * entry once it has expired, if more of those are wanted, otherwise the
+ * head of the list while the table is over a limit.
+ */
+static hash_entry_i *hashtable_victim(linked_hashtable_t *htab, uint64_t now,
+                                      int expire)
+{
+    if (expire && htab->expiry_count &&
+        expire_due(htab->expiry_heap[0]->expire, now))
+        return htab->expiry_heap[0];
+
+    if (htab->lst_head.lst_next != &htab->lst_head && hashtable_over_limit(htab))
+        return htab->lst_head.lst_next;
+
+    return NULL;
+}
+
+/*
+ * Remove up to max_expired expired entries, and evict from the head of
+ * the list until the table is back within its limits. Called without any
+ * lock held; the segment of a victim has to be locked before the list,
+ * so the choice is checked again once both are held.
+ *
+ * Returns the number of expired entries removed.
+ */
+static int hashtable_evict(linked_hashtable_t *htab, int max_expired)
+{
+    hash_entry_i *victim;
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t now = hashtable_now(htab);
+    void *data = NULL;
+    int expired = 0;
+    int evict;
+
+    for (;;) {
+        hashtable_list_rlock(htab);
+        victim = hashtable_victim(htab, now, expired < max_expired);
+        if (!victim) {
+            hashtable_list_runlock(htab);
+            return expired;
+        }
+        hash_code = victim->hash_code;
+        hashtable_list_runlock(htab);
+
+        seg = hashtable_segment(htab, hash_code);
+        segment_wlock(htab, seg);
+
+        /*
+         * The victim may have been removed and its memory reused by an
+         * entry of another segment meanwhile, so check both.
+         */
+        list_lock(htab);
+        evict = hashtable_victim(htab, now, expired < max_expired) == victim &&
+                hashtable_segment(htab, victim->hash_code) == seg;
+        if (evict && expire_due(victim->expire, now))
+            expired++;
+        list_unlock(htab);
+
+        if (evict) {
+            if (htab->evicted)
+                htab->evicted((linked_hash_entry_t *)victim, htab->evict_context);
+
+            data = victim->data;
+            hashtable_unlink(htab, seg, victim);
+        }
+
+        segment_unlock(htab, seg);
+
+        if (evict)
+            hashtable_release(htab, data);
+    }
+}
+
+/* A reader found the entry for the key expired, remove it if it still is */
+static void hashtable_remove_expired(linked_hashtable_t *htab, hash_segment *seg,
+                                     const void *key, size_t keylen,
+                                     uint32_t hash_code)
+{
+    hash_entry_i *entry;
+    void *data = NULL;
+
+    segment_wlock(htab, seg);
+
+    entry = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+    if (entry && hashtable_expired(htab, entry)) {
+        if (htab->evicted)
+            htab->evicted((linked_hash_entry_t *)entry, htab->evict_context);
+
+        data = entry->data;
+        hashtable_unlink(htab, seg, entry);
+    }
+
+    segment_unlock(htab, seg);
+
+    if (data)
+        hashtable_release(htab, data);
+}
+
+/*
+ * Move a hit to the tail of a LINKED_HASHTABLE_ACCESS_ORDER table, caller
+ * holds the segment lock.
+ */
+static void hashtable_touch(linked_hashtable_t *htab, hash_entry_i *entry)
+{
+    list_lock(htab);
+    if (entry != htab->lst_head.lst_prev) {
+        list_unlink(htab, entry);
+        list_link_tail(htab, entry);
+        htab->mod_count++;
+    }
+    list_unlock(htab);
+}
+
+/*
+ * get() of a LINKED_HASHTABLE_ACCESS_ORDER table, which moves the entry
+ * to the tail. Without LINKED_HASHTABLE_STRIPED the list is protected by
+ * the segment lock, so that has to be the write lock.
+ */
+static void *hashtable_get_access(linked_hashtable_t *htab, hash_segment *seg,
+                                  const void *key, size_t keylen, uint32_t hash_code)
+{
+    hash_entry_i *entry;
+    void *val = NULL;
+    int expired = 0;
+
+    if (htab->flags & LINKED_HASHTABLE_STRIPED)
+        segment_rlock(htab, seg);
+    else
+        segment_wlock(htab, seg);
+
+    entry = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+    if (entry && hashtable_expired(htab, entry)) {
+        entry = NULL;
+        expired = 1;
+    }
+
+    if (entry) {
+        hashtable_touch(htab, entry);
+        val = ref(entry->data);
+    }
+
+    segment_unlock(htab, seg);
+
+    if (expired)
+        hashtable_remove_expired(htab, seg, key, keylen, hash_code);
+
+    return val;
+}
+
+/*
+ * Copy the key of an entry of a LINKED_HASHTABLE_INLINE_KEYS table into
+ * the storage that follows it, so lookups compare against memory next to
+ * the entry and the caller's key can go away.
+ */
+static inline void hashtable_inline_key(hash_entry_i *entry)
+{
+    char *buf = ((linked_hash_inline_entry_t *)entry)->__key;
+
+    if (entry->key != buf) {
+        memcpy(buf, entry->key, entry->keylen);
+        entry->key = buf;
+    }
+}
+
+/*
+ * Put with the segment write lock held. Returns 1 if the table is over a
+ * limit or has expired entries afterwards, 0 if not, or -1 with errno set
+ * on error. The data of a replaced entry is handed back in old_data, to
+ * be released once the lock is dropped.
+ */
+static int hashtable_put_locked(linked_hashtable_t *htab, hash_segment *seg,
+                                hash_entry_i *new_entry, uint32_t hash_code,
+                                uint64_t expire, void **old_data)
+{
+    hash_entry_i *ent;
+    uint32_t cost;
+    int evict;
+
+    // Without the entry size the key could be copied past the entry.
+    if ((htab->flags & LINKED_HASHTABLE_INLINE_KEYS) && !htab->inline_key_max) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (expire) {
+        list_lock(htab);
+        evict = expiry_heap_reserve(htab);
+        list_unlock(htab);
+
+        if (evict < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    ref(new_entry->data);
+    cost = hashtable_cost(htab, new_entry);
+
+    ent = htab->engine->find(htab, &seg->index, new_entry->key, new_entry->keylen,
+                             hash_code);
+
+    // Putting the same entry again must not write to it under lock-free readers.
+    if (ent != new_entry) {
+        new_entry->hash_code = hash_code;
+        new_entry->expiry_idx = 0;
+
+        if (new_entry->keylen <= htab->inline_key_max)
+            hashtable_inline_key(new_entry);
+    }
+
+    if (ent) {
+        htab->engine->replace(&seg->index, ent, new_entry);
+
+        list_lock(htab);
+        if (htab->flags & LINKED_HASHTABLE_ACCESS_ORDER) {
+            list_unlink(htab, ent);
+            list_link_tail(htab, new_entry);
+        } else {
+            if (htab->snapshots)
+                snapshot_save(htab, ent);
+
+            new_entry->version = ++htab->version;
+            new_entry->pos = ent->pos;
+            new_entry->lst_prev = ent->lst_prev;
+            new_entry->lst_next = ent->lst_next;
+
+            new_entry->lst_prev->lst_next = new_entry;
+            new_entry->lst_next->lst_prev = new_entry;
+        }
+
+        htab->total_cost += cost;
+        htab->total_cost -= ent->cost;
+        new_entry->cost = cost;
+
+        if (ent->expiry_idx)
+            expiry_heap_remove(htab, ent);
+        __atomic_store_n(&new_entry->expire, expire, __ATOMIC_RELAXED);
+        if (expire)
+            expiry_heap_push(htab, new_entry);
+
+        htab->mod_count++;
+        evict = hashtable_over_limit(htab) || hashtable_expiry_due(htab);
+        list_unlock(htab);
+
+        *old_data = ent->data;
+    } else {
+        __atomic_store_n(&new_entry->expire, expire, __ATOMIC_RELAXED);
+
+        if (htab->engine->insert(&seg->index, new_entry) < 0) {
+            if (expire) {
+                list_lock(htab);
+                expiry_heap_unreserve(htab);
+                list_unlock(htab);
+            }
+
+            deref(new_entry->data);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        /* Add new entry to linked list tail */
+        list_lock(htab);
+        list_link_tail(htab, new_entry);
+        new_entry->cost = cost;
+
+        if (expire)
+            expiry_heap_push(htab, new_entry);
+
+        htab->count++;
+        htab->total_cost += cost;
+        htab->mod_count++;
+        evict = hashtable_over_limit(htab) || hashtable_expiry_due(htab);
+        list_unlock(htab);
+    }
+
+    hashtable_resize(htab, seg);
+
+    return evict;
+}
+
+/* ttl in milliseconds, 0 for none */
+static void *hashtable_put(linked_hashtable_t *htab, linked_hash_entry_t *entry,
+                           uint32_t ttl)
+{
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t expire = 0;
+    void *old_data = NULL;
+    int evict;
+
+    hash_code = hashtable_hash(htab, entry->key, entry->keylen);
+    seg = hashtable_segment(htab, hash_code);
+
+    if (ttl)
+        expire = hashtable_now(htab) + ttl;
+
+    segment_wlock(htab, seg);
+    evict = hashtable_put_locked(htab, seg, (hash_entry_i *)entry, hash_code,
+                                 expire, &old_data);
+    segment_unlock(htab, seg);
+
+    if (evict < 0)
+        return NULL;
+
+    if (old_data)
+        hashtable_release(htab, old_data);
+
+    if (evict)
+        hashtable_evict(htab, HASHTABLE_EXPIRE_STEP);
+
+    return entry->data;
+}
+
+void *linked_hashtable_put(linked_hashtable_t *htab, linked_hash_entry_t *entry)
+{
+    uint64_t probes;
+    void *val;
+
+    assert(htab && entry && entry->key && entry->keylen && entry->data);
+    if (!htab || !entry || !entry->key || !entry->keylen || !entry->data) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    val = hashtable_put(htab, entry, 0);
+    hashtable_stats_count(htab, STAT_PUTS, 1, 0, probes);
+
+    return val;
+}
+
+void *linked_hashtable_put_ttl(linked_hashtable_t *htab, linked_hash_entry_t *entry,
+                               uint32_t ttl)
+{
+    uint64_t probes;
+    void *val;
+
+    assert(htab && entry && entry->key && entry->keylen && entry->data);
+    if (!htab || !entry || !entry->key || !entry->keylen || !entry->data || !ttl) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    val = hashtable_put(htab, entry, ttl);
+    hashtable_stats_count(htab, STAT_PUTS, 1, 0, probes);
+
+    return val;
+}
+
+int linked_hashtable_expire(linked_hashtable_t *htab)
+{
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return hashtable_evict(htab, INT32_MAX);
+}
+
+void *linked_hashtable_get(linked_hashtable_t *htab, const void *key, size_t keylen)
+{
+    hash_entry_i *entry;
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t probes;
+    void *val;
+    int expired;
+
+    assert(htab && key && keylen);
+    if (!htab || !key || !keylen) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    hash_code = hashtable_hash(htab, key, keylen);
+    seg = hashtable_segment(htab, hash_code);
+
+    if (htab->flags & LINKED_HASHTABLE_ACCESS_ORDER) {
+        val = hashtable_get_access(htab, seg, key, keylen, hash_code);
+        hashtable_stats_count(htab, STAT_GETS, 1, val != NULL, probes);
+        return val;
+    }
+
+    if ((htab->flags & LINKED_HASHTABLE_LOCKFREE_READ) && epoch_enter() == 0) {
+        entry = htab->engine->find_lockfree(htab, &seg->index, key, keylen, hash_code);
+        expired = entry && hashtable_expired(htab, entry);
+        val = entry && !expired ? ref(entry->data) : NULL;
+        epoch_exit();
+    } else {
+        segment_rlock(htab, seg);
+
+        entry = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+        expired = entry && hashtable_expired(htab, entry);
+        val = entry && !expired ? ref(entry->data) : NULL;
+
+        segment_unlock(htab, seg);
+    }
+
+    if (expired)
+        hashtable_remove_expired(htab, seg, key, keylen, hash_code);
+
+    hashtable_stats_count(htab, STAT_GETS, 1, val != NULL, probes);
+
+    return val;
+}
+
+int linked_hashtable_exist(linked_hashtable_t *htab, const void *key, size_t keylen)
+{
+    hash_entry_i *entry;
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t probes;
+    int expired;
+
+    assert(htab && key && keylen);
+    if (!htab || !key || !keylen) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    hash_code = hashtable_hash(htab, key, keylen);
+    seg = hashtable_segment(htab, hash_code);
+
+    if ((htab->flags & LINKED_HASHTABLE_LOCKFREE_READ) && epoch_enter() == 0) {
+        entry = htab->engine->find_lockfree(htab, &seg->index, key, keylen, hash_code);
+        expired = entry && hashtable_expired(htab, entry);
+        epoch_exit();
+    } else {
+        segment_rlock(htab, seg);
+        entry = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+        expired = entry && hashtable_expired(htab, entry);
+        segment_unlock(htab, seg);
+    }
+
+    if (expired)
+        hashtable_remove_expired(htab, seg, key, keylen, hash_code);
+
+    hashtable_stats_count(htab, STAT_GETS, 1, entry && !expired, probes);
+
+    return entry && !expired;
+}
+
+int linked_hashtable_visit(linked_hashtable_t *htab, const void *key, size_t keylen,
+                           void (*visitor)(const void *key, size_t keylen,
+                                           void *data, void *context),
+                           void *context)
+{
+    hash_entry_i *entry;
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t probes;
+    int expired;
+    int lockfree = 0;
+
+    assert(htab && key && keylen && visitor);
+    if (!htab || !key || !keylen || !visitor) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    hash_code = hashtable_hash(htab, key, keylen);
+    seg = hashtable_segment(htab, hash_code);
+
+    // Same locking as linked_hashtable_get() and hashtable_get_access()
+    if (htab->flags & LINKED_HASHTABLE_ACCESS_ORDER) {
+        if (htab->flags & LINKED_HASHTABLE_STRIPED)
+            segment_rlock(htab, seg);
+        else
+            segment_wlock(htab, seg);
+    } else if (htab->flags & LINKED_HASHTABLE_LOCKFREE_READ) {
+        lockfree = epoch_enter() == 0;
+        if (!lockfree)
+            segment_rlock(htab, seg);
+    } else {
+        segment_rlock(htab, seg);
+    }
+
+    if (lockfree)
+        entry = htab->engine->find_lockfree(htab, &seg->index, key, keylen, hash_code);
+    else
+        entry = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+
+    expired = entry && hashtable_expired(htab, entry);
+    if (entry && !expired) {
+        if (htab->flags & LINKED_HASHTABLE_ACCESS_ORDER)
+            hashtable_touch(htab, entry);
+
+        visitor(entry->key, entry->keylen, entry->data, context);
+    }
+
+    if (lockfree)
+        epoch_exit();
+    else
+        segment_unlock(htab, seg);
+
+    if (expired)
+        hashtable_remove_expired(htab, seg, key, keylen, hash_code);
+
+    hashtable_stats_count(htab, STAT_GETS, 1, entry && !expired, probes);
+
+    return entry && !expired;
+}
+
+int linked_hashtable_foreach(linked_hashtable_t *htab,
+                             int (*visitor)(const void *key, size_t keylen,
+                                            void *data, void *context),
+                             void *context)
+{
+    hash_entry_i *entry;
+    int count = 0;
+
+    assert(htab && visitor);
+    if (!htab || !visitor) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Unlinked entries are released only after the list lock is dropped.
+    hashtable_list_rlock(htab);
+
+    for (entry = htab->lst_head.lst_next; entry != &htab->lst_head;
+         entry = entry->lst_next) {
+        if (htab->expiry_count && hashtable_expired(htab, entry))
+            continue;
+
+        count++;
+        if (visitor(entry->key, entry->keylen, entry->data, context) != 0)
+            break;
+    }
+
+    hashtable_list_runlock(htab);
+
+    return count;
+}
+
+int linked_hashtable_is_empty(linked_hashtable_t *htab)
+{
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return htab->count == 0;
+}
+
+void *linked_hashtable_remove(linked_hashtable_t *htab, const void *key, size_t keylen)
+{
+    hash_entry_i *to_remove;
+    hash_segment *seg;
+    uint32_t hash_code;
+    uint64_t probes;
+    void *val = NULL;
+
+    assert(htab && key && keylen);
+    if (!htab || !key || !keylen) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    probes = hashtable_stats_begin(htab);
+    hash_code = hashtable_hash(htab, key, keylen);
+    seg = hashtable_segment(htab, hash_code);
+
+    segment_wlock(htab, seg);
+
+    to_remove = htab->engine->find(htab, &seg->index, key, keylen, hash_code);
+    if (to_remove) {
+        hashtable_unlink(htab, seg, to_remove);
+
+        // val = deref(to_remove->data);
+        // Pass reference to caller
+        val = to_remove->data;
+    }
+
+    segment_unlock(htab, seg);
+
+    hashtable_stats_count(htab, STAT_REMOVES, 1, 0, probes);
+
+    // The caller gets its own reference, the table's one is retired.
+    if (val && (htab->flags & LINKED_HASHTABLE_LOCKFREE_READ))
+        hashtable_release(htab, ref(val));
+
+    return val;
+}
+
+uint32_t linked_hashtable_hash_code(linked_hashtable_t *htab,
+                                    const void *key, size_t keylen)
+{
+    assert(htab && key && keylen);
+    if (!htab || !key || !keylen) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return hashtable_hash(htab, key, keylen);
+}
+
+/*
+ * Batch operations work on up to HASHTABLE_BATCH keys at a time. All keys
+ * are hashed before any lock is taken, then every segment the keys fall
+ * into is locked once, in ascending order like hashtable_wlock_all(). The
+ * keys are processed in their given order, which keeps the list order of
+ * put_many, with the buckets prefetched HASHTABLE_PREFETCH_AHEAD keys
+ * ahead of the probes so that the cache misses overlap.
+ */
+#define HASHTABLE_BATCH             64
+#define HASHTABLE_PREFETCH_AHEAD    8
+
+static_assert(HASHTABLE_SEGMENT_BITS <= 5, "Segment mask too small.");
+
+typedef struct hashtable_batch {
+    size_t      count;
+    /* Segments holding any of the keys, one bit each */
+    uint32_t    seg_mask;
+    uint32_t    hash_codes[HASHTABLE_BATCH];
+    hash_segment *segs[HASHTABLE_BATCH];
+} hashtable_batch;
+
+/* Caller sets count and hash_codes */
+static void hashtable_batch_segments(linked_hashtable_t *htab, hashtable_batch *batch)
+{
+    size_t i;
+    int idx;
+
+    batch->seg_mask = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        idx = hashtable_segment_idx(htab, batch->hash_codes[i]);
+        batch->segs[i] = &htab->segments[idx];
+        batch->seg_mask |= (uint32_t)1 << idx;
+    }
+}
+
+static void hashtable_batch_hash(linked_hashtable_t *htab, hashtable_batch *batch,
+                                 const void * const *keys, const size_t *keylens,
+                                 const uint32_t *hash_codes, size_t count)
+{
+    size_t i;
+
+    batch->count = count < HASHTABLE_BATCH ? count : HASHTABLE_BATCH;
+
+    for (i = 0; i < batch->count; i++)
+        batch->hash_codes[i] = hash_codes ? hash_codes[i] :
+                               hashtable_hash(htab, keys[i], keylens[i]);
+
+    hashtable_batch_segments(htab, batch);
+}
+
+static void hashtable_batch_lock(linked_hashtable_t *htab, hashtable_batch *batch,
+                                 int write)
+{
+    uint32_t mask = batch->seg_mask;
+    int idx;
+
+    while (mask) {
+        idx = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        if (write)
+            segment_wlock(htab, &htab->segments[idx]);
+        else
+            segment_rlock(htab, &htab->segments[idx]);
+    }
+}
+
+static void hashtable_batch_unlock(linked_hashtable_t *htab, hashtable_batch *batch)
+{
+    uint32_t mask = batch->seg_mask;
+    int idx;
+
+    while (mask) {
+        idx = 31 - __builtin_clz(mask);
+        mask &= ~((uint32_t)1 << idx);
+
+        segment_unlock(htab, &htab->segments[idx]);
+    }
+}
+
+static inline void hashtable_batch_prefetch(linked_hashtable_t *htab,
+                                            hashtable_batch *batch, size_t k)
+{
+    if (k < batch->count)
+        htab->engine->prefetch(&batch->segs[k]->index, batch->hash_codes[k]);
+}
+
+static int hashtable_keys_valid(const void * const *keys, const size_t *keylens,
+                                size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!keys[i] || !keylens[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+static size_t hashtable_batch_get(linked_hashtable_t *htab, hashtable_batch *batch,
+                                  const void * const *keys, const size_t *keylens,
+                                  void **vals)
+{
+    hash_entry_i *entry;
+    uint8_t expired[HASHTABLE_BATCH];
+    size_t nexpired = 0;
+    size_t found = 0;
+    size_t i;
+    int access = (htab->flags & LINKED_HASHTABLE_ACCESS_ORDER) != 0;
+    int lockfree;
+
+    // Same locking as linked_hashtable_get() and hashtable_get_access()
+    lockfree = (htab->flags & LINKED_HASHTABLE_LOCKFREE_READ) && epoch_enter() == 0;
+    if (!lockfree)
+        hashtable_batch_lock(htab, batch,
+                             access && !(htab->flags & LINKED_HASHTABLE_STRIPED));
+
+    for (i = 0; i < HASHTABLE_PREFETCH_AHEAD; i++)
+        hashtable_batch_prefetch(htab, batch, i);
+
+    for (i = 0; i < batch->count; i++) {
+        hashtable_batch_prefetch(htab, batch, i + HASHTABLE_PREFETCH_AHEAD);
+
+        if (lockfree)
+            entry = htab->engine->find_lockfree(htab, &batch->segs[i]->index,
+                                                keys[i], keylens[i],
+                                                batch->hash_codes[i]);
+        else
+            entry = htab->engine->find(htab, &batch->segs[i]->index, keys[i],
+                                       keylens[i], batch->hash_codes[i]);
+
+        if (entry && hashtable_expired(htab, entry)) {
+            expired[nexpired++] = (uint8_t)i;
+            entry = NULL;
+        }
+
+        if (entry) {
+            if (access)
+                hashtable_touch(htab, entry);
+            vals[i] = ref(entry->data);
+            found++;
+        } else {
+            vals[i] = NULL;
+        }
+    }
+
+    if (lockfree)
+        epoch_exit();
+    else
+        hashtable_batch_unlock(htab, batch);
+
+    while (nexpired > 0) {
+        i = expired[--nexpired];
+        hashtable_remove_expired(htab, batch->segs[i], keys[i], keylens[i],
+                                 batch->hash_codes[i]);
+    }
+
+    return found;
+}
+
+ssize_t linked_hashtable_get_many(linked_hashtable_t *htab, const void * const *keys,
+                                  const size_t *keylens, const uint32_t *hash_codes,
+                                  size_t count, void **vals)
+{
+    hashtable_batch batch;
+    uint64_t probes;
+    size_t base;
+    size_t found = 0;
+
+    assert(htab && (!count || (keys && keylens && vals)));
+    if (!htab || (count && (!keys || !keylens || !vals)) ||
+        !hashtable_keys_valid(keys, keylens, count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    probes = hashtable_stats_begin(htab);
+
+    for (base = 0; base < count; base += batch.count) {
+        hashtable_batch_hash(htab, &batch, keys + base, keylens + base,
+                             hash_codes ? hash_codes + base : NULL, count - base);
+        found += hashtable_batch_get(htab, &batch, keys + base, keylens + base,
+                                     vals + base);
+    }
+
+    hashtable_stats_count(htab, STAT_GETS, count, found, probes);
+
+    return (ssize_t)found;
+}
+
+ssize_t linked_hashtable_put_many(linked_hashtable_t *htab,
+                                  linked_hash_entry_t * const *entries,
+                                  const uint32_t *hash_codes, size_t count)
+{
+    hashtable_batch batch;
+    linked_hash_entry_t *entry;
+    void *old_data[HASHTABLE_BATCH];
+    size_t nold;
+    size_t base, i;
+    size_t put = 0;
+    uint64_t probes;
+    int evict;
+    int rc;
+
+    assert(htab && (!count || entries));
+    if (!htab || (count && !entries)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        entry = entries[i];
+        if (!entry || !entry->key || !entry->keylen || !entry->data) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    probes = hashtable_stats_begin(htab);
+
+    for (base = 0; base < count; base += batch.count) {
+        batch.count = count - base < HASHTABLE_BATCH ? count - base : HASHTABLE_BATCH;
+        for (i = 0; i < batch.count; i++) {
+            entry = entries[base + i];
+            batch.hash_codes[i] = hash_codes ? hash_codes[base + i] :
+                                  hashtable_hash(htab, entry->key, entry->keylen);
+        }
+        hashtable_batch_segments(htab, &batch);
+
+        nold = 0;
+        evict = 0;
+
+        hashtable_batch_lock(htab, &batch, 1);
+        for (i = 0; i < HASHTABLE_PREFETCH_AHEAD; i++)
+            hashtable_batch_prefetch(htab, &batch, i);
+
+        for (i = 0; i < batch.count; i++) {
+            hashtable_batch_prefetch(htab, &batch, i + HASHTABLE_PREFETCH_AHEAD);
+
+            old_data[nold] = NULL;
+            rc = hashtable_put_locked(htab, batch.segs[i],
+                                      (hash_entry_i *)entries[base + i],
+                                      batch.hash_codes[i], 0, &old_data[nold]);
+            if (rc < 0)
+                continue;
+
+            put++;
+            evict |= rc;
+            if (old_data[nold])
+                nold++;
+        }
+
+        hashtable_batch_unlock(htab, &batch);
+
+        while (nold > 0)
+            hashtable_release(htab, old_data[--nold]);
+
+        if (evict)
+            hashtable_evict(htab, HASHTABLE_EXPIRE_STEP * (int)batch.count);
+    }
+
+    hashtable_stats_count(htab, STAT_PUTS, count, 0, probes);
+
+    return (ssize_t)put;
+}
+
+ssize_t linked_hashtable_remove_many(linked_hashtable_t *htab, const void * const *keys,
+                                     const size_t *keylens, const uint32_t *hash_codes,
+                                     size_t count, void **vals)
+{
+    hashtable_batch batch;
+    hash_entry_i *entry;
+    void *removed[HASHTABLE_BATCH];
+    size_t base, i;
+    size_t nremoved = 0;
+    uint64_t probes;
+
+    assert(htab && (!count || (keys && keylens)));
+    if (!htab || (count && (!keys || !keylens)) ||
+        !hashtable_keys_valid(keys, keylens, count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    probes = hashtable_stats_begin(htab);
+
+    for (base = 0; base < count; base += batch.count) {
+        hashtable_batch_hash(htab, &batch, keys + base, keylens + base,
+                             hash_codes ? hash_codes + base : NULL, count - base);
+
+        hashtable_batch_lock(htab, &batch, 1);
+        for (i = 0; i < HASHTABLE_PREFETCH_AHEAD; i++)
+            hashtable_batch_prefetch(htab, &batch, i);
+
+        for (i = 0; i < batch.count; i++) {
+            hashtable_batch_prefetch(htab, &batch, i + HASHTABLE_PREFETCH_AHEAD);
+
+            entry = htab->engine->find(htab, &batch.segs[i]->index, keys[base + i],
+                                       keylens[base + i], batch.hash_codes[i]);
+            removed[i] = entry ? entry->data : NULL;
+            if (entry) {
+                hashtable_unlink(htab, batch.segs[i], entry);
+                nremoved++;
+            }
+        }
+
+        hashtable_batch_unlock(htab, &batch);
+
+        // Same hand over as linked_hashtable_remove() when the caller asks.
+        for (i = 0; i < batch.count; i++) {
+            if (vals) {
+                vals[base + i] = removed[i];
+                if (removed[i] && (htab->flags & LINKED_HASHTABLE_LOCKFREE_READ))
+                    hashtable_release(htab, ref(removed[i]));
+            } else if (removed[i]) {
+                hashtable_release(htab, removed[i]);
+            }
+        }
+    }
+
+    hashtable_stats_count(htab, STAT_REMOVES, count, 0, probes);
+
+    return (ssize_t)nremoved;
+}
+
+void linked_hashtable_clear(linked_hashtable_t *htab)
+{
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return;
+    }
+
+    hashtable_wlock_all(htab);
+    hashtable_clear_i(htab);
+    hashtable_unlock_all(htab);
+}
+
+int linked_hashtable_set_limit(linked_hashtable_t *htab,
+                               size_t max_entries, size_t max_cost,
+                               size_t (*cost)(linked_hash_entry_t *entry),
+                               void (*evicted)(linked_hash_entry_t *entry, void *context),
+                               void *context)
+{
+    hash_entry_i *entry;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hashtable_wlock_all(htab);
+
+    htab->max_entries = max_entries;
+    htab->max_cost = max_cost;
+    htab->cost = cost;
+    htab->evicted = evicted;
+    htab->evict_context = context;
+
+    // The cost function may have changed, recount the current entries.
+    htab->total_cost = 0;
+    for (entry = htab->lst_head.lst_next; entry != &htab->lst_head;
+         entry = entry->lst_next) {
+        entry->cost = hashtable_cost(htab, entry);
+        htab->total_cost += entry->cost;
+    }
+
+    hashtable_unlock_all(htab);
+
+    hashtable_evict(htab, HASHTABLE_EXPIRE_STEP);
+
+    return 0;
+}
+
+int linked_hashtable_set_entry_size(linked_hashtable_t *htab, size_t entry_size)
+{
+    int rc = 0;
+
+    assert(htab);
+    if (!htab || !(htab->flags & LINKED_HASHTABLE_INLINE_KEYS) ||
+        entry_size < sizeof(linked_hash_inline_entry_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hashtable_wlock_all(htab);
+
+    if (htab->count == 0)
+        htab->inline_key_max = entry_size -
+                               offsetof(linked_hash_inline_entry_t, __key);
+    else
+        rc = -1;
+
+    hashtable_unlock_all(htab);
+
+    if (rc < 0)
+        errno = EBUSY;
+
+    return rc;
+}
+
+linked_hashtable_iterator_t *linked_hashtable_iterate(linked_hashtable_t *htab,
+                                                      linked_hashtable_iterator_t *iterator)
+{
+    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+
+    assert(htab && it);
+    if (!htab || !it) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashtable_list_rlock(htab);
+
+    it->htab = htab;
+    it->current = NULL;
+    it->next = htab->lst_head.lst_next;
+    it->expected_mod_count = htab->mod_count;
+
+    hashtable_list_runlock(htab);
+
+    return iterator;
+}
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+int linked_hashtable_iterator_next(linked_hashtable_iterator_t *iterator, void **key,
+                                   size_t *keylen, void **data)
+{
+    int rc;
+    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next && data);
+    if (!it || !it->htab || !it->next || !data) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hashtable_list_rlock(it->htab);
+
+    if (it->expected_mod_count != it->htab->mod_count) {
+        errno = EAGAIN;
+        rc = -1;
+    } else {
+        // Skip entries that have expired but are not removed yet.
+        while (it->htab->expiry_count && it->next != &it->htab->lst_head &&
+               hashtable_expired(it->htab, it->next))
+            it->next = it->next->lst_next;
+
+        if (it->next == &it->htab->lst_head) { // end
+            rc = 0;
+        } else {
+            it->current = it->next;
+            it->next = it->next->lst_next;
+
+            if (key)
+                *key = (void *)it->current->key;
+            if (keylen)
+                *keylen = it->current->keylen;
+
+            *data = it->current->data;
+            ref(*data);
+
+            rc = 1;
+        }
+    }
+
+    hashtable_list_runlock(it->htab);
+
+    return rc;
+}
+
+int linked_hashtable_iterator_next_n(linked_hashtable_iterator_t *iterator,
+                                     void **keys, size_t *keylens, void **data, int n)
+{
+    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+    int count = 0;
+
+    assert(it && it->htab && it->next && data && n > 0);
+    if (!it || !it->htab || !it->next || !data || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hashtable_list_rlock(it->htab);
+
+    if (it->expected_mod_count != it->htab->mod_count) {
+        hashtable_list_runlock(it->htab);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    while (count < n && it->next != &it->htab->lst_head) {
+        it->current = it->next;
+        it->next = it->next->lst_next;
+
+        if (it->htab->expiry_count && hashtable_expired(it->htab, it->current))
+            continue;
+
+        if (keys)
+            keys[count] = (void *)it->current->key;
+        if (keylens)
+            keylens[count] = it->current->keylen;
+
+        data[count++] = ref(it->current->data);
+    }
+
+    hashtable_list_runlock(it->htab);
+
+    return count;
+}
+
+int linked_hashtable_iterator_has_next(linked_hashtable_iterator_t *iterator)
+{
+    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next);
+    if (!it || !it->htab || !it->next) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return it->next != &it->htab->lst_head;
+}
+
+// return 1 on success, 0 nothing removed, -1 on modified conflict or error.
+int linked_hashtable_iterator_remove(linked_hashtable_iterator_t *iterator)
+{
+    linked_hashtable_t *htab;
+    hash_segment *seg;
+    uint32_t hash_code;
+    void *ptr;
+    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next && it->current);
+    if (!it || !it->htab || !it->next || !it->current) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    htab = it->htab;
+
+    /* The segment lock has to be taken first, so find out which one */
+    hashtable_list_rlock(htab);
+    if (it->expected_mod_count != htab->mod_count) {
+        hashtable_list_runlock(htab);
+        errno = EAGAIN;
+        return -1;
+    }
+    hash_code = it->current->hash_code;
+    hashtable_list_runlock(htab);
+
+    seg = hashtable_segment(htab, hash_code);
+    segment_wlock(htab, seg);
+
+    list_lock(htab);
+    if (it->expected_mod_count != htab->mod_count) {
+        list_unlock(htab);
+        segment_unlock(htab, seg);
+        errno = EAGAIN;
+        return -1;
+    }
+    list_unlock(htab);
+
+    /* Unchanged mod_count, the current entry is still in this segment */
+    ptr = it->current->data;
+    hashtable_unlink(htab, seg, it->current);
+
+    it->current = NULL;
+    it->expected_mod_count++;
+
+    segment_unlock(htab, seg);
+
+    hashtable_stats_count(htab, STAT_REMOVES, 1, 0, hashtable_stats_begin(htab));
+
+    hashtable_release(htab, ptr);
+    return 1;
+}
+
+static void snapshot_destroy(void *obj)
+{
+    linked_hashtable_snapshot_t *snap = (linked_hashtable_snapshot_t *)obj;
+    linked_hashtable_t *htab = snap->htab;
+    uint32_t i;
+
+    hashtable_list_wlock(htab);
+
+    if (snap->prev)
+        snap->prev->next = snap->next;
+    else
+        htab->snapshots = snap->next;
+    if (snap->next)
+        snap->next->prev = snap->prev;
+
+    hashtable_list_runlock(htab);
+
+    for (i = 0; i < snap->nrecords; i++)
+        deref(snap->records[i].data);
+    if (snap->records)
+        free(snap->records);
+
+    deref(htab);
+}
+
+linked_hashtable_snapshot_t *linked_hashtable_snapshot(linked_hashtable_t *htab)
+{
+    linked_hashtable_snapshot_t *snap;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snap = (linked_hashtable_snapshot_t *)rc_zalloc(sizeof(linked_hashtable_snapshot_t),
+                                                    snapshot_destroy);
+    if (!snap) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    snap->htab = ref(htab);
+    snap->now = hashtable_now(htab);
+
+    hashtable_list_wlock(htab);
+
+    snap->version = htab->version;
+    snap->cursor = htab->lst_head.lst_next;
+
+    snap->next = htab->snapshots;
+    if (snap->next)
+        snap->next->prev = snap;
+    htab->snapshots = snap;
 
-void linked_hashtable_clear(linked_hashtable_t *htab)
+    hashtable_list_runlock(htab);
+
+    return snap;
+}
+
+int linked_hashtable_snapshot_next(linked_hashtable_snapshot_t *snap, void **key,
+                                   size_t *keylen, void **data)
 {
-    assert(htab);
-    if (!htab) {
+    linked_hashtable_t *htab;
+    snapshot_record rec;
+    hash_entry_i *entry;
+    int rc = 0;
+
+    assert(snap && data);
+    if (!snap || !data) {
         errno = EINVAL;
-        return;
+        return -1;
     }
 
-    hashtable_wlock(htab);
-    hashtable_clear_i(htab);
-    hashtable_unlock(htab);
+    htab = snap->htab;
+    hashtable_list_rlock(htab);
+
+    if (snap->error) {
+        hashtable_list_runlock(htab);
+        errno = snap->error;
+        return -1;
+    }
+
+    for (;;) {
+        entry = snap->cursor;
+
+        // Entries from here on were all linked after the snapshot.
+        if (entry != &htab->lst_head && entry->pos > snap->version)
+            entry = snap->cursor = &htab->lst_head;
+
+        if (entry != &htab->lst_head &&
+            (!snap->nrecords || entry->pos <= snap->records[0].pos)) {
+            snap->cursor = entry->lst_next;
+            snap->passed = entry->pos;
+
+            if (entry->version > snap->version ||
+                expire_due(entry->expire, snap->now))
+                continue;
+
+            if (key)
+                *key = (void *)entry->key;
+            if (keylen)
+                *keylen = entry->keylen;
+            *data = ref(entry->data);
+
+            rc = 1;
+        } else if (snap->nrecords) {
+            snapshot_record_pop(snap, &rec);
+            snap->passed = rec.pos;
+
+            if (key)
+                *key = (void *)rec.key;
+            if (keylen)
+                *keylen = rec.keylen;
+            *data = rec.data;
+
+            rc = 1;
+        }
+
+        break;
+    }
+
+    hashtable_list_runlock(htab);
+
+    return rc;
 }
 
-linked_hashtable_iterator_t *linked_hashtable_iterate(linked_hashtable_t *htab,
-                                                      linked_hashtable_iterator_t *iterator)
+int linked_hashtable_split(linked_hashtable_t *htab, linked_hashtable_range_t *ranges,
+                           int count)
 {
-    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+    hashtable_range_i *range;
+    uint64_t total;
+    int i;
 
-    assert(htab && it);
-    if (!htab || !it) {
+    assert(htab && ranges && count > 0);
+    if (!htab || !ranges || count <= 0) {
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
 
-    hashtable_rlock(htab);
+    total = (uint64_t)htab->nsegments << RANGE_UNIT_BITS;
 
-    it->htab = htab;
-    it->current = NULL;
-    it->next = htab->lst_head.lst_next;
-    it->expected_mod_count = htab->mod_count;
+    for (i = 0; i < count; i++) {
+        range = (hashtable_range_i *)&ranges[i];
+        memset(range, 0, sizeof(*range));
+
+        range->htab = htab;
+        range->begin = total * i / count;
+        range->end = total * (i + 1) / count;
+        range->seg = (int)(range->begin >> RANGE_UNIT_BITS);
+    }
 
-    hashtable_unlock(htab);
+    return count;
+}
 
-    return iterator;
+/* Map the part of the current segment inside the range to scan positions */
+static void hashtable_range_enter(hashtable_range_i *range, hash_segment *seg)
+{
+    linked_hashtable_t *htab = range->htab;
+    uint64_t first = (uint64_t)range->seg << RANGE_UNIT_BITS;
+    uint64_t size = htab->engine->scan_size(&seg->index);
+    uint64_t from = 0;
+    uint64_t to = 1 << RANGE_UNIT_BITS;
+    size_t drained;
+    size_t target;
+
+    if (range->begin > first)
+        from = range->begin - first;
+    if (range->end < first + to)
+        to = range->end - first;
+
+    range->pos = (size_t)((from * size) >> RANGE_UNIT_BITS);
+    range->pos_begin = range->pos;
+    range->pos_end = (size_t)((to * size) >> RANGE_UNIT_BITS);
+    range->skip = 0;
+    range->layout = seg->index.layout;
+    range->moved = 0;
+    if (htab->engine->scan_moves) {
+        htab->engine->scan_moves(&seg->index, &drained, &target);
+        range->moved = (unsigned int)drained;
+    }
+    range->entered = 1;
 }
 
-// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
-int linked_hashtable_iterator_next(linked_hashtable_iterator_t *iterator, void **key,
-                                   size_t *keylen, void **data)
+/*
+ * Whether the entries moved by an incremental resize since the last call
+ * leave the range intact. It is not if entries left positions it has yet
+ * to scan, or if it has yet to scan positions that entries it has already
+ * returned may have moved to.
+ */
+static int hashtable_range_valid(hashtable_range_i *range, hash_segment *seg)
 {
-    int rc;
-    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+    linked_hashtable_t *htab = range->htab;
+    size_t drained;
+    size_t target;
+    size_t from;
+    size_t to;
 
-    assert(it && it->htab && it->next && data);
-    if (!it || !it->htab || !it->next || !data) {
+    if (range->layout != seg->index.layout)
+        return 0;
+
+    if (!htab->engine->scan_moves)
+        return 1;
+
+    htab->engine->scan_moves(&seg->index, &drained, &target);
+    if (drained == range->moved)
+        return 1;
+
+    from = range->pos_end > target && range->pos < range->pos_end ?
+           range->pos_begin : range->pos;
+    to = range->pos_end < target ? range->pos_end : target;
+
+    // Positions [range->moved, drained) were drained since the last call.
+    if (range->moved < to && drained > from)
+        return 0;
+
+    range->moved = (unsigned int)drained;
+    return 1;
+}
+
+int linked_hashtable_range_next(linked_hashtable_range_t *iterator,
+                                void **keys, size_t *keylens, void **data, int n)
+{
+    hashtable_range_i *range = (hashtable_range_i *)iterator;
+    linked_hashtable_t *htab;
+    hash_segment *seg;
+    hash_entry_i *entry;
+    size_t got;
+    size_t i;
+    int count = 0;
+
+    assert(range && range->htab && data && n > 0);
+    if (!range || !range->htab || !data || n <= 0) {
         errno = EINVAL;
         return -1;
     }
 
-    hashtable_rlock(it->htab);
+    htab = range->htab;
 
-    if (it->expected_mod_count != it->htab->mod_count) {
-        errno = EAGAIN;
-        rc = -1;
-    } else {
-        if (it->next == &it->htab->lst_head) { // end
-            rc = 0;
-        } else {
-            it->current = it->next;
-            it->next = it->next->lst_next;
+    while (count == 0 &&
+           ((uint64_t)range->seg << RANGE_UNIT_BITS) < range->end) {
+        seg = &htab->segments[range->seg];
+        segment_rlock(htab, seg);
 
-            if (key)
-                *key = (void *)it->current->key;
-            if (keylen)
-                *keylen = it->current->keylen;
+        if (!range->entered) {
+            hashtable_range_enter(range, seg);
+        } else if (!hashtable_range_valid(range, seg)) {
+            segment_unlock(htab, seg);
+            errno = EAGAIN;
+            return -1;
+        }
 
-            *data = it->current->data;
-            ref(*data);
+        // The entries are collected into data, then replaced in place.
+        got = htab->engine->scan(&seg->index, &range->pos, &range->skip,
+                                 range->pos_end, data, n);
 
-            rc = 1;
+        for (i = 0; i < got; i++) {
+            entry = (hash_entry_i *)data[i];
+            if (htab->expiry_count && hashtable_expired(htab, entry))
+                continue;
+
+            if (keys)
+                keys[count] = (void *)entry->key;
+            if (keylens)
+                keylens[count] = entry->keylen;
+
+            data[count++] = ref(entry->data);
+        }
+
+        if (range->pos >= range->pos_end) {
+            range->seg++;
+            range->entered = 0;
+        }
+
+        segment_unlock(htab, seg);
+    }
+
+    return count;
+}
+
+/*
+ * Frozen tables are a perfect hash in the PTHash style: keys are split by
+ * hash into buckets of about FROZEN_BUCKET_KEYS keys, and each bucket gets
+ * a pilot, searched for at build time, such that
+ *
+ *   slot = fastrange((h ^ mix(pilot)) * C, nslots)
+ *
+ * is distinct for every key of every bucket. Buckets are placed largest
+ * first, while most slots are still free. A lookup reads one pilot and
+ * one slot.
+ *
+ * The slots are filled to FROZEN_LOAD_PERCENT only: with every slot
+ * taken, the last buckets to be placed would have to search through
+ * about as many pilots as there are keys. A few spare slots bound that
+ * to about 100 tries per bucket, so a build hardly ever needs another
+ * seed. Small buckets keep the searches in the middle of the build
+ * short, at 4 bytes of pilot per FROZEN_BUCKET_KEYS keys.
+ */
+#define FROZEN_BUCKET_KEYS      3
+#define FROZEN_LOAD_PERCENT     99
+#define FROZEN_MAX_SEEDS        16
+
+typedef struct frozen_slot {
+    const void  *key;
+    size_t      keylen;
+    void        *data;
+} frozen_slot;
+
+struct _linked_hashtable_frozen_t {
+    uint32_t    count;
+    uint32_t    nslots;
+    uint32_t    nbuckets;
+    uint64_t    seed;
+    uint32_t    *pilots;
+    frozen_slot *slots;
+};
+
+static inline uint32_t fastrange32(uint32_t x, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+/* SplitMix64 finalizer, so that consecutive pilots move keys far apart */
+static inline uint64_t pilot_mix(uint32_t pilot)
+{
+    uint64_t z = (pilot + 1ULL) * 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t frozen_bucket(linked_hashtable_frozen_t *frozen, uint64_t h)
+{
+    return fastrange32((uint32_t)(h >> 32), frozen->nbuckets);
+}
+
+/*
+ * fastrange only looks at the high bits, so the low bits are multiplied
+ * into them first: otherwise keys of a bucket would only ever take as
+ * many different placements as there are slots.
+ */
+static inline uint32_t frozen_pos(linked_hashtable_frozen_t *frozen, uint64_t h,
+                                  uint32_t pilot)
+{
+    uint64_t x = (h ^ pilot_mix(pilot)) * 0x9E3779B97F4A7C15ULL;
+
+    return fastrange32((uint32_t)(x >> 32), frozen->nslots);
+}
+
+/*
+ * Find the pilots for the keys hashed to hashes with frozen->seed, and
+ * store the slot of every key in positions. Returns -1 if some bucket has
+ * no pilot, then another seed has to be tried.
+ */
+static int frozen_search(linked_hashtable_frozen_t *frozen, const uint64_t *hashes,
+                         uint32_t *positions, uint32_t *order, uint32_t *starts,
+                         uint32_t *buckets, uint8_t *taken)
+{
+    uint32_t n = frozen->count;
+    uint32_t r = frozen->nbuckets;
+    uint32_t limit = n > (UINT32_MAX >> 5) ? UINT32_MAX : n * 32 + 1024;
+    uint32_t max_size = 0;
+    uint32_t size_counts[FROZEN_BUCKET_KEYS * 8 + 2];
+    uint32_t pos[FROZEN_BUCKET_KEYS * 8];
+    uint32_t b, i, j, k, pilot, size;
+
+    // Keys by bucket
+    memset(starts, 0, (r + 1) * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+        starts[frozen_bucket(frozen, hashes[i]) + 1]++;
+    for (b = 0; b < r; b++) {
+        if (starts[b + 1] > max_size)
+            max_size = starts[b + 1];
+        starts[b + 1] += starts[b];
+    }
+
+    // A bucket this large is hopeless, and unlikely with another seed.
+    if (max_size > FROZEN_BUCKET_KEYS * 8)
+        return -1;
+
+    memcpy(buckets, starts, r * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+        order[buckets[frozen_bucket(frozen, hashes[i])]++] = i;
+
+    // Buckets by size, largest first
+    memset(size_counts, 0, sizeof(size_counts));
+    for (b = 0; b < r; b++)
+        size_counts[max_size - (starts[b + 1] - starts[b]) + 1]++;
+    for (i = 0; i < max_size + 1; i++)
+        size_counts[i + 1] += size_counts[i];
+    for (b = 0; b < r; b++)
+        buckets[size_counts[max_size - (starts[b + 1] - starts[b])]++] = b;
+
+    memset(taken, 0, frozen->nslots);
+
+    for (i = 0; i < r; i++) {
+        b = buckets[i];
+        size = starts[b + 1] - starts[b];
+        if (size == 0)
+            break;
+
+        for (pilot = 0; pilot < limit; pilot++) {
+            for (j = 0; j < size; j++) {
+                pos[j] = frozen_pos(frozen, hashes[order[starts[b] + j]], pilot);
+                if (taken[pos[j]])
+                    break;
+                for (k = 0; k < j && pos[k] != pos[j]; k++)
+                    ;
+                if (k < j)
+                    break;
+            }
+
+            if (j == size)
+                break;
+        }
+
+        if (pilot == limit)
+            return -1;
+
+        frozen->pilots[b] = pilot;
+        for (j = 0; j < size; j++) {
+            taken[pos[j]] = 1;
+            positions[order[starts[b] + j]] = pos[j];
         }
     }
 
-    hashtable_unlock(it->htab);
+    return 0;
+}
+
+static int frozen_build(linked_hashtable_frozen_t *frozen, frozen_slot *entries)
+{
+    uint32_t n = frozen->count;
+    uint32_t r = frozen->nbuckets;
+    uint64_t *hashes;
+    uint32_t *positions;
+    uint32_t *order;
+    uint32_t *starts;
+    uint32_t *buckets;
+    uint8_t *taken;
+    uint32_t i;
+    int seed;
+    int rc = -1;
+
+    hashes = (uint64_t *)malloc(n * sizeof(uint64_t));
+    positions = (uint32_t *)malloc(n * sizeof(uint32_t));
+    order = (uint32_t *)malloc(n * sizeof(uint32_t));
+    starts = (uint32_t *)malloc((r + 1) * sizeof(uint32_t));
+    buckets = (uint32_t *)malloc(r * sizeof(uint32_t));
+    taken = (uint8_t *)malloc(frozen->nslots);
+    if (!hashes || !positions || !order || !starts || !buckets || !taken) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    for (seed = 0; seed < FROZEN_MAX_SEEDS; seed++) {
+        frozen->seed = 0x8445d61a4e774912ULL + seed * 0x9E3779B97F4A7C15ULL;
+
+        for (i = 0; i < n; i++)
+            hashes[i] = murmur_hash64(entries[i].key, entries[i].keylen, frozen->seed);
+
+        if (frozen_search(frozen, hashes, positions, order, starts, buckets,
+                          taken) == 0)
+            break;
+    }
+
+    if (seed == FROZEN_MAX_SEEDS) {
+        errno = EAGAIN;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++)
+        frozen->slots[positions[i]] = entries[i];
+
+    rc = 0;
 
+out:
+    free(taken);
+    free(buckets);
+    free(starts);
+    free(order);
+    free(positions);
+    free(hashes);
     return rc;
 }
 
-int linked_hashtable_iterator_has_next(linked_hashtable_iterator_t *iterator)
+static void frozen_destroy(void *obj)
 {
-    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+    linked_hashtable_frozen_t *frozen = (linked_hashtable_frozen_t *)obj;
+    uint32_t i;
 
-    assert(it && it->htab && it->next);
-    if (!it || !it->htab || !it->next) {
+    if (frozen->slots) {
+        for (i = 0; i < frozen->nslots; i++) {
+            if (frozen->slots[i].data)
+                deref(frozen->slots[i].data);
+        }
+        free(frozen->slots);
+    }
+
+    if (frozen->pilots)
+        free(frozen->pilots);
+}
+
+linked_hashtable_frozen_t *linked_hashtable_freeze(linked_hashtable_t *htab)
+{
+    linked_hashtable_snapshot_t *snap;
+    linked_hashtable_frozen_t *frozen;
+    frozen_slot *entries = NULL;
+    frozen_slot *entry;
+    size_t count = 0;
+    size_t size = 0;
+    void *key;
+    size_t keylen;
+    void *data;
+    size_t i;
+    int rc;
+
+    assert(htab);
+    if (!htab || htab->key_compare != default_key_compare) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snap = linked_hashtable_snapshot(htab);
+    if (!snap)
+        return NULL;
+
+    while ((rc = linked_hashtable_snapshot_next(snap, &key, &keylen, &data)) == 1) {
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            entry = size <= UINT32_MAX ?
+                    (frozen_slot *)realloc(entries, size * sizeof(frozen_slot)) : NULL;
+            if (!entry) {
+                deref(data);
+                errno = ENOMEM;
+                rc = -1;
+                break;
+            }
+            entries = entry;
+        }
+
+        entries[count].key = key;
+        entries[count].keylen = keylen;
+        entries[count].data = data;
+        count++;
+    }
+
+    deref(snap);
+
+    frozen = rc == 0 ? (linked_hashtable_frozen_t *)rc_zalloc(
+                            sizeof(linked_hashtable_frozen_t), frozen_destroy) : NULL;
+    if (!frozen) {
+        if (rc == 0)
+            errno = ENOMEM;
+        goto error;
+    }
+
+    if ((uint64_t)count * 100 / FROZEN_LOAD_PERCENT >= UINT32_MAX) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    frozen->count = (uint32_t)count;
+    frozen->nslots = (uint32_t)((uint64_t)count * 100 / FROZEN_LOAD_PERCENT) + 1;
+    frozen->nbuckets = (uint32_t)(count / FROZEN_BUCKET_KEYS) + 1;
+    frozen->pilots = (uint32_t *)calloc(frozen->nbuckets, sizeof(uint32_t));
+    frozen->slots = (frozen_slot *)calloc(frozen->nslots, sizeof(frozen_slot));
+    if (!frozen->pilots || !frozen->slots) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    if (frozen_build(frozen, entries) < 0)
+        goto error;
+
+    free(entries);
+    return frozen;
+
+error:
+    // The references are still with entries, not the slots.
+    if (frozen) {
+        if (frozen->slots)
+            free(frozen->slots);
+        frozen->slots = NULL;
+        deref(frozen);
+    }
+
+    for (i = 0; i < count; i++)
+        deref(entries[i].data);
+    free(entries);
+
+    return NULL;
+}
+
+size_t linked_hashtable_frozen_count(linked_hashtable_frozen_t *frozen)
+{
+    assert(frozen);
+    if (!frozen) {
         errno = EINVAL;
         return 0;
     }
 
-    return it->next != &it->htab->lst_head;
+    return frozen->count;
 }
 
-// return 1 on success, 0 nothing removed, -1 on modified conflict or error.
-int linked_hashtable_iterator_remove(linked_hashtable_iterator_t *iterator)
+void *linked_hashtable_frozen_get(linked_hashtable_frozen_t *frozen,
+                                  const void *key, size_t keylen)
 {
-    void *ptr;
-    hashtable_iterator_i *it = (hashtable_iterator_i *)iterator;
+    frozen_slot *slot;
+    uint64_t h;
 
-    assert(it && it->htab && it->next && it->current);
-    if (!it || !it->htab || !it->next || !it->current) {
+    assert(frozen && key && keylen);
+    if (!frozen || !key || !keylen) {
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
 
-    hashtable_wlock(it->htab);
+    if (!frozen->count)
+        return NULL;
+
+    h = murmur_hash64(key, keylen, frozen->seed);
+    slot = &frozen->slots[frozen_pos(frozen, h,
+                                     frozen->pilots[frozen_bucket(frozen, h)])];
 
-    if (it->expected_mod_count != it->htab->mod_count) {
-        errno = EAGAIN;
-        hashtable_unlock(it->htab);
+    if (slot->keylen != keylen || memcmp(slot->key, key, keylen) != 0)
+        return NULL;
+
+    return slot->data;
+}
+
+int linked_hashtable_frozen_exist(linked_hashtable_frozen_t *frozen,
+                                  const void *key, size_t keylen)
+{
+    return linked_hashtable_frozen_get(frozen, key, keylen) != NULL;
+}
+
+/* Counters of all threads since the table was created */
+static void stats_sum(linked_hashtable_t *htab, uint64_t *counters)
+{
+    hashtable_stats_block *block;
+    int j;
+
+    memset(counters, 0, sizeof(uint64_t) * STAT_MAX);
+
+    block = __atomic_load_n(&htab->stats_blocks, __ATOMIC_ACQUIRE);
+    for (; block; block = block->next) {
+        for (j = 0; j < STAT_MAX; j++)
+            counters[j] += __atomic_load_n(&block->counters[j], __ATOMIC_RELAXED);
+    }
+}
+
+int linked_hashtable_stats(linked_hashtable_t *htab, linked_hashtable_stats_t *stats)
+{
+    uint64_t counters[STAT_MAX];
+    uint64_t base;
+    hash_segment *seg;
+    int i, j;
+
+    assert(htab && stats);
+    if (!htab || !stats) {
+        errno = EINVAL;
         return -1;
     }
 
-    ptr = hashtable_remove_nolock(it->htab, it->current->key, it->current->keylen);
-    if (ptr) {
-        deref(ptr);
-        it->current = NULL;
-        it->expected_mod_count++;
-        hashtable_unlock(it->htab);
-        return 1;
+    memset(stats, 0, sizeof(*stats));
+
+    for (i = 0; i < htab->nsegments; i++) {
+        seg = &htab->segments[i];
+
+        segment_rlock(htab, seg);
+        stats->capacity += htab->engine->scan_size(&seg->index);
+        htab->engine->histogram(&seg->index, stats->histogram,
+                                LINKED_HASHTABLE_STATS_BINS, &stats->max_chain);
+        segment_unlock(htab, seg);
+    }
+
+    stats->count = htab->count;
+    stats->load_factor = stats->capacity ?
+                         (double)stats->count / stats->capacity : 0;
+
+    if (!htab->stats)
+        return 0;
+
+    stats_sum(htab, counters);
+    for (j = 0; j < STAT_MAX; j++) {
+        base = __atomic_load_n(&htab->stats_base[j], __ATOMIC_RELAXED);
+        counters[j] = counters[j] > base ? counters[j] - base : 0;
     }
 
-    hashtable_unlock(it->htab);
+    stats->gets = counters[STAT_GETS];
+    stats->hits = counters[STAT_HITS];
+    // Counted by different threads, a reader may see a hit before its get.
+    stats->misses = stats->gets > stats->hits ? stats->gets - stats->hits : 0;
+    stats->puts = counters[STAT_PUTS];
+    stats->removes = counters[STAT_REMOVES];
+    stats->probes = counters[STAT_PROBES];
+    stats->lock_waits = counters[STAT_LOCK_WAITS];
+    stats->lock_wait_time = counters[STAT_LOCK_WAIT_TIME];
+
     return 0;
 }
+
+void linked_hashtable_stats_reset(linked_hashtable_t *htab)
+{
+    uint64_t counters[STAT_MAX];
+    int j;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return;
+    }
+
+    if (!htab->stats)
+        return;
+
+    // The blocks belong to their threads, so keep the sums to start from.
+    stats_sum(htab, counters);
+    for (j = 0; j < STAT_MAX; j++)
+        __atomic_store_n(&htab->stats_base[j], counters[j], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "crystal/rc_mem.h"
+#include "crystal/linkedhashtable_map.h"
+
+#ifdef _MSC_VER
+#include "crystal/builtins.h"
+#endif
+
+#include "BRCrypto.h"
+
+#define MAP_MAGIC           "CRYHTMAP"
+#define MAP_VERSION         1
+#define MAP_BYTE_ORDER      0x01020304
+
+#define MAP_ALIGN(n)        (((n) + 7) & ~(uint64_t)7)
+
+/*
+ * File layout, all integers in host byte order and all offsets from the
+ * start of the file:
+ *
+ *   map_header
+ *   uint64_t index[nbuckets + 1]   records of bucket b are in
+ *                                  [index[b], index[b + 1])
+ *   records                        map_record, key, value, each part
+ *                                  padded to 8 bytes
+ */
+typedef struct map_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byte_order;
+    uint64_t    count;
+    uint64_t    nbuckets;
+    uint64_t    index_offset;
+    uint64_t    records_offset;
+    uint64_t    file_size;
+    uint64_t    reserved;
+} map_header;
+
+typedef struct map_record {
+    uint32_t    hash_code;
+    uint32_t    keylen;
+    uint64_t    vallen;
+} map_record;
+
+struct _linked_hashtable_map_t {
+    uint8_t     *base;
+    uint64_t    size;
+    uint64_t    count;
+    uint64_t    mask;
+    const uint64_t *index;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE      mapping;
+#endif
+};
+
+/* An entry collected by linked_hashtable_save() */
+typedef struct save_entry {
+    uint32_t    hash_code;
+    uint32_t    bucket;
+    const void  *key;
+    size_t      keylen;
+    void        *data;
+    const void  *val;
+    size_t      vallen;
+} save_entry;
+
+/* Fixed, so that any process can look up keys of any saved table */
+static inline uint32_t map_hash(const void *key, size_t keylen)
+{
+    return BRMurmur3_32(key, keylen, 0);
+}
+
+static inline uint64_t record_size(size_t keylen, size_t vallen)
+{
+    return sizeof(map_record) + MAP_ALIGN(keylen) + MAP_ALIGN(vallen);
+}
+
+static int write_padded(FILE *fp, const void *buf, size_t len)
+{
+    static const char zeros[8];
+    size_t pad = (size_t)(MAP_ALIGN(len) - len);
+
+    if (len && fwrite(buf, len, 1, fp) != 1)
+        return -1;
+    if (pad && fwrite(zeros, pad, 1, fp) != 1)
+        return -1;
+
+    return 0;
+}
+
+static int save_write(FILE *fp, save_entry *entries, size_t count,
+                      uint64_t nbuckets)
+{
+    map_header header;
+    map_record record;
+    uint64_t *index;
+    size_t *order;
+    size_t *next;
+    uint64_t b;
+    size_t i;
+    int rc = -1;
+
+    index = (uint64_t *)calloc(nbuckets + 1, sizeof(uint64_t));
+    next = (size_t *)calloc(nbuckets + 1, sizeof(size_t));
+    order = (size_t *)malloc((count ? count : 1) * sizeof(size_t));
+    if (!index || !next || !order) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_MAGIC, sizeof(header.magic));
+    header.version = MAP_VERSION;
+    header.byte_order = MAP_BYTE_ORDER;
+    header.count = count;
+    header.nbuckets = nbuckets;
+    header.index_offset = sizeof(map_header);
+    header.records_offset = header.index_offset + (nbuckets + 1) * sizeof(uint64_t);
+
+    // Counting sort by bucket, stable to keep the list order per bucket.
+    for (i = 0; i < count; i++) {
+        next[entries[i].bucket + 1]++;
+        index[entries[i].bucket + 1] += record_size(entries[i].keylen,
+                                                    entries[i].vallen);
+    }
+
+    index[0] = header.records_offset;
+    for (b = 0; b < nbuckets; b++) {
+        index[b + 1] += index[b];
+        next[b + 1] += next[b];
+    }
+    header.file_size = index[nbuckets];
+
+    for (i = 0; i < count; i++)
+        order[next[entries[i].bucket]++] = i;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(index, sizeof(uint64_t), nbuckets + 1, fp) != nbuckets + 1)
+        goto out;
+
+    for (i = 0; i < count; i++) {
+        save_entry *entry = &entries[order[i]];
+
+        record.hash_code = entry->hash_code;
+        record.keylen = (uint32_t)entry->keylen;
+        record.vallen = entry->vallen;
+
+        if (fwrite(&record, sizeof(record), 1, fp) != 1 ||
+            write_padded(fp, entry->key, entry->keylen) < 0 ||
+            write_padded(fp, entry->val, entry->vallen) < 0)
+            goto out;
+    }
+
+    rc = 0;
+
+out:
+    free(order);
+    free(next);
+    free(index);
+    return rc;
+}
+
+/*
+ * Create the file a save is written to, next to 'path' so that it can be
+ * renamed over it, under a name no other save uses: the process id and a
+ * counter, created exclusively like mkstemp() does, but with the usual
+ * permissions.
+ */
+static FILE *save_create(const char *path, char **tmp)
+{
+    static unsigned int counter;
+    size_t len = strlen(path) + 32;
+    unsigned long pid;
+    FILE *fp;
+    int fd = -1;
+    int i;
+
+    *tmp = (char *)malloc(len);
+    if (!*tmp) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    pid = (unsigned long)GetCurrentProcessId();
+#else
+    pid = (unsigned long)getpid();
+#endif
+
+    // A name taken already is a leftover of a crashed save: try the next.
+    for (i = 0; i < 100; i++) {
+        snprintf(*tmp, len, "%s.%lu.%u.tmp", path, pid,
+                 __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+#if defined(_WIN32) || defined(_WIN64)
+        fd = _open(*tmp, _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+#else
+        fd = open(*tmp, O_CREAT | O_EXCL | O_WRONLY, 0666);
+#endif
+        if (fd >= 0 || errno != EEXIST)
+            break;
+    }
+
+    if (fd < 0)
+        return NULL;
+
+#if defined(_WIN32) || defined(_WIN64)
+    fp = _fdopen(fd, "wb");
+    if (!fp)
+        _close(fd);
+#else
+    fp = fdopen(fd, "wb");
+    if (!fp)
+        close(fd);
+#endif
+
+    if (!fp)
+        remove(*tmp);
+
+    return fp;
+}
+
+/* Flush the file down to the disk, so the rename never exposes a hole */
+static int save_sync(FILE *fp)
+{
+    if (fflush(fp) != 0)
+        return -1;
+
+#if defined(_WIN32) || defined(_WIN64)
+    return _commit(_fileno(fp));
+#else
+    return fsync(fileno(fp));
+#endif
+}
+
+ssize_t linked_hashtable_save(linked_hashtable_t *htab, const char *path,
+                              const void *(*value)(void *data, size_t *len,
+                                                   void *context),
+                              void *context)
+{
+    linked_hashtable_snapshot_t *snap;
+    save_entry *entries = NULL;
+    save_entry *entry;
+    size_t count = 0;
+    size_t size = 0;
+    uint64_t nbuckets = 1;
+    char *tmp = NULL;
+    FILE *fp = NULL;
+    void *key;
+    void *data;
+    size_t keylen;
+    size_t i;
+    int rc;
+
+    assert(htab && path && value);
+    if (!htab || !path || !value) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    snap = linked_hashtable_snapshot(htab);
+    if (!snap)
+        return -1;
+
+    while ((rc = linked_hashtable_snapshot_next(snap, &key, &keylen, &data)) == 1) {
+        if (count == size) {
+            size = size ? size * 2 : 1024;
+            entry = (save_entry *)realloc(entries, size * sizeof(save_entry));
+            if (!entry) {
+                deref(data);
+                errno = ENOMEM;
+                rc = -1;
+                break;
+            }
+            entries = entry;
+        }
+
+        entry = &entries[count++];
+        entry->key = key;
+        entry->keylen = keylen;
+        entry->data = data;
+        entry->hash_code = map_hash(key, keylen);
+        entry->val = value(data, &entry->vallen, context);
+
+        if (keylen > UINT32_MAX || (!entry->val && entry->vallen)) {
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+    }
+
+    deref(snap);
+
+    if (rc < 0)
+        goto out;
+
+    while (nbuckets < count)
+        nbuckets <<= 1;
+    for (i = 0; i < count; i++)
+        entries[i].bucket = (uint32_t)(entries[i].hash_code & (nbuckets - 1));
+
+    fp = save_create(path, &tmp);
+    if (!fp) {
+        rc = -1;
+        goto out;
+    }
+
+    rc = save_write(fp, entries, count, nbuckets);
+    if (rc == 0)
+        rc = save_sync(fp);
+    if (fclose(fp) != 0)
+        rc = -1;
+
+    if (rc == 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        if (!MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+            errno = EIO;
+            rc = -1;
+        }
+#else
+        rc = rename(tmp, path);
+#endif
+    }
+
+    if (rc < 0)
+        remove(tmp);
+
+out:
+    for (i = 0; i < count; i++)
+        deref(entries[i].data);
+    free(entries);
+    free(tmp);
+
+    return rc < 0 ? -1 : (ssize_t)count;
+}
+
+static void map_destroy(void *obj)
+{
+    linked_hashtable_map_t *map = (linked_hashtable_map_t *)obj;
+
+    if (!map->base)
+        return;
+
+#if defined(_WIN32) || defined(_WIN64)
+    UnmapViewOfFile(map->base);
+    CloseHandle(map->mapping);
+#else
+    munmap(map->base, (size_t)map->size);
+#endif
+}
+
+static int map_file(linked_hashtable_map_t *map, const char *path, int flags)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER size;
+    HANDLE file;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(map_header)) {
+        CloseHandle(file);
+        errno = EINVAL;
+        return -1;
+    }
+
+    map->mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!map->mapping) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    map->base = (uint8_t *)MapViewOfFile(map->mapping,
+                        (flags & LINKED_HASHTABLE_MAP_PRIVATE) ? FILE_MAP_COPY : FILE_MAP_READ,
+                        0, 0, 0);
+    if (!map->base) {
+        CloseHandle(map->mapping);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    map->size = (uint64_t)size.QuadPart;
+    return 0;
+#else
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if ((uint64_t)st.st_size < sizeof(map_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (flags & LINKED_HASHTABLE_MAP_PRIVATE)
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+    else
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    map->base = (uint8_t *)base;
+    map->size = (uint64_t)st.st_size;
+    return 0;
+#endif
+}
+
+/*
+ * Only the header is checked here, to keep mapping O(1). Records are
+ * checked against the file size as they are read.
+ */
+static int map_check(linked_hashtable_map_t *map)
+{
+    const map_header *header = (const map_header *)map->base;
+    uint64_t index_end;
+
+    if (memcmp(header->magic, MAP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MAP_VERSION ||
+        header->byte_order != MAP_BYTE_ORDER ||
+        header->file_size != map->size ||
+        header->nbuckets == 0 ||
+        (header->nbuckets & (header->nbuckets - 1)) != 0 ||
+        header->index_offset != sizeof(map_header) ||
+        header->nbuckets > (map->size - header->index_offset) / sizeof(uint64_t))
+        return -1;
+
+    index_end = header->index_offset + (header->nbuckets + 1) * sizeof(uint64_t);
+    if (header->records_offset != index_end || index_end > map->size)
+        return -1;
+
+    map->count = header->count;
+    map->mask = header->nbuckets - 1;
+    map->index = (const uint64_t *)(map->base + header->index_offset);
+
+    return 0;
+}
+
+linked_hashtable_map_t *linked_hashtable_map(const char *path, int flags)
+{
+    linked_hashtable_map_t *map;
+
+    assert(path);
+    if (!path || (flags & ~LINKED_HASHTABLE_MAP_PRIVATE)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = (linked_hashtable_map_t *)rc_zalloc(sizeof(linked_hashtable_map_t),
+                                              map_destroy);
+    if (!map) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (map_file(map, path, flags) < 0) {
+        deref(map);
+        return NULL;
+    }
+
+    if (map_check(map) < 0) {
+        deref(map);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return map;
+}
+
+size_t linked_hashtable_map_count(linked_hashtable_map_t *map)
+{
+    assert(map);
+    if (!map) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return (size_t)map->count;
+}
+
+/*
+ * The record at offset pos, if it lies within [pos, end) of the file.
+ * Returns the offset of the next record, or 0 if the record is corrupt.
+ */
+static uint64_t map_record_at(linked_hashtable_map_t *map, uint64_t pos,
+                              uint64_t end, const map_record **record)
+{
+    const map_record *rec;
+    uint64_t size;
+
+    if (end > map->size || pos > end || end - pos < sizeof(map_record) || pos & 7)
+        return 0;
+
+    rec = (const map_record *)(map->base + pos);
+    if (rec->vallen > end - pos)
+        return 0;
+
+    size = record_size(rec->keylen, (size_t)rec->vallen);
+    if (size > end - pos)
+        return 0;
+
+    *record = rec;
+    return pos + size;
+}
+
+static inline const void *record_key(const map_record *rec)
+{
+    return (const uint8_t *)(rec + 1);
+}
+
+static inline void *record_value(const map_record *rec)
+{
+    return (uint8_t *)(rec + 1) + MAP_ALIGN(rec->keylen);
+}
+
+void *linked_hashtable_map_get(linked_hashtable_map_t *map,
+                               const void *key, size_t keylen, size_t *vallen)
+{
+    const map_record *rec;
+    uint32_t hash_code;
+    uint64_t pos, end;
+
+    assert(map && key && keylen);
+    if (!map || !key || !keylen) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hash_code = map_hash(key, keylen);
+    pos = map->index[hash_code & map->mask];
+    end = map->index[(hash_code & map->mask) + 1];
+
+    while (pos < end) {
+        pos = map_record_at(map, pos, end, &rec);
+        if (!pos) {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if (rec->hash_code == hash_code && rec->keylen == keylen &&
+            memcmp(record_key(rec), key, keylen) == 0) {
+            if (vallen)
+                *vallen = (size_t)rec->vallen;
+            return record_value(rec);
+        }
+    }
+
+    return NULL;
+}
+
+ssize_t linked_hashtable_map_foreach(linked_hashtable_map_t *map,
+                                     int (*cb)(const void *key, size_t keylen,
+                                               void *val, size_t vallen,
+                                               void *context),
+                                     void *context)
+{
+    const map_record *rec;
+    uint64_t pos, end;
+    ssize_t count = 0;
+
+    assert(map && cb);
+    if (!map || !cb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pos = map->index[0];
+    end = map->index[map->mask + 1];
+
+    while (pos < end) {
+        pos = map_record_at(map, pos, end, &rec);
+        if (!pos) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        count++;
+        if (!cb(record_key(rec), rec->keylen, record_value(rec),
+                (size_t)rec->vallen, context))
+            break;
+    }
+
+    return count;
+}
@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "crystal/rc_mem.h"
+#include "crystal/linkedhashtable_u64.h"
+
+typedef struct _u64_entry_i
+{
+    uint64_t             key;
+    void *               data;
+    struct _u64_entry_i  *lst_prev;
+    struct _u64_entry_i  *lst_next;
+} u64_entry_i;
+
+typedef struct u64_iterator_i {
+    linked_hashtable_u64_t *htab;
+    u64_entry_i *current;
+    u64_entry_i *next;
+    int expected_mod_count;
+} u64_iterator_i;
+
+static_assert(sizeof(linked_hash_u64_entry_t) >= sizeof(u64_entry_i),
+              "List entry size miss match.");
+static_assert(sizeof(linked_hashtable_u64_iterator_t) >= sizeof(u64_iterator_i),
+              "List iterator size miss match.");
+
+/*
+ * Linear probing over a power of two slot array. The key is kept next to
+ * the entry pointer, so probing compares keys without loading entries.
+ * A slot is empty when its entry is NULL. Removal shifts the following
+ * entries back instead of leaving tombstones.
+ */
+typedef struct u64_slot {
+    uint64_t    key;
+    u64_entry_i *entry;
+} u64_slot;
+
+struct _linked_hashtable_u64_t {
+    size_t      count;
+    int         mod_count;
+    int         synced;
+    int         flags;
+
+    pthread_rwlock_t lock;
+
+    int         bits;
+    int         min_bits;
+    u64_slot    *slots;
+
+    u64_entry_i lst_head;
+};
+
+#define U64_MIN_BITS            4
+#define U64_MAX_BITS            ((int)(sizeof(size_t) << 3) - 2)
+/* Keep the load factor below 3/4 */
+#define U64_MAX_LOAD(cap)       ((cap) - ((cap) >> 2))
+/* Shrink (if enabled) below 1/8 */
+#define U64_SHRINK_LOAD(cap)    ((cap) >> 3)
+
+/* Fibonacci hashing: the top bits of key * 2^64 / phi */
+static inline size_t u64_home(uint64_t key, int bits)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static inline size_t u64_capacity(linked_hashtable_u64_t *htab)
+{
+    return (size_t)1 << htab->bits;
+}
+
+static inline u64_slot *u64_find(linked_hashtable_u64_t *htab, uint64_t key)
+{
+    size_t mask = u64_capacity(htab) - 1;
+    size_t i = u64_home(key, htab->bits);
+    u64_slot *slot;
+
+    for (;;) {
+        slot = &htab->slots[i];
+        if (!slot->entry)
+            return NULL;
+        if (slot->key == key)
+            return slot;
+
+        i = (i + 1) & mask;
+    }
+}
+
+/* The key must not be in the table */
+static void u64_place(u64_slot *slots, int bits, u64_entry_i *entry)
+{
+    size_t mask = ((size_t)1 << bits) - 1;
+    size_t i = u64_home(entry->key, bits);
+
+    while (slots[i].entry)
+        i = (i + 1) & mask;
+
+    slots[i].key = entry->key;
+    slots[i].entry = entry;
+}
+
+static int u64_rehash(linked_hashtable_u64_t *htab, int bits)
+{
+    u64_slot *slots;
+    size_t i;
+
+    slots = (u64_slot *)calloc((size_t)1 << bits, sizeof(u64_slot));
+    if (!slots)
+        return -1;
+
+    for (i = 0; i < u64_capacity(htab); i++) {
+        if (htab->slots[i].entry)
+            u64_place(slots, bits, htab->slots[i].entry);
+    }
+
+    free(htab->slots);
+    htab->slots = slots;
+    htab->bits = bits;
+
+    return 0;
+}
+
+static void u64_erase(linked_hashtable_u64_t *htab, u64_slot *slot)
+{
+    size_t mask = u64_capacity(htab) - 1;
+    size_t i = (size_t)(slot - htab->slots);
+    size_t j = i;
+    size_t home;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!htab->slots[j].entry)
+            break;
+
+        // Move back unless the entry's home lies in (i, j]
+        home = u64_home(htab->slots[j].key, htab->bits);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            htab->slots[i] = htab->slots[j];
+            i = j;
+        }
+    }
+
+    htab->slots[i].entry = NULL;
+}
+
+static void hashtable_u64_destroy(void *obj);
+
+linked_hashtable_u64_t *linked_hashtable_u64_create(size_t capacity, int flags)
+{
+    linked_hashtable_u64_t *htab;
+    int bits = U64_MIN_BITS;
+
+    if (flags & ~(LINKED_HASHTABLE_SYNCED | LINKED_HASHTABLE_AUTO_SHRINK)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while (bits < U64_MAX_BITS && U64_MAX_LOAD((size_t)1 << bits) < capacity)
+        bits++;
+
+    htab = (linked_hashtable_u64_t *)rc_zalloc(sizeof(linked_hashtable_u64_t),
+                                               hashtable_u64_destroy);
+    if (!htab) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    htab->slots = (u64_slot *)calloc((size_t)1 << bits, sizeof(u64_slot));
+    if (!htab->slots) {
+        deref(htab);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    htab->bits = bits;
+    htab->min_bits = bits;
+
+    if (flags & LINKED_HASHTABLE_SYNCED) {
+        if (pthread_rwlock_init(&htab->lock, NULL) != 0) {
+            deref(htab);
+            return NULL;
+        }
+
+        htab->synced = 1;
+    }
+
+    htab->flags = flags;
+
+    htab->lst_head.lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev = &htab->lst_head;
+
+    return htab;
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#endif
+
+static inline void hashtable_u64_rlock(linked_hashtable_u64_t *htab)
+{
+    if (htab->synced) {
+        int rc = pthread_rwlock_rdlock(&htab->lock);
+        assert(rc == 0);
+    }
+}
+
+static inline void hashtable_u64_wlock(linked_hashtable_u64_t *htab)
+{
+    if (htab->synced) {
+        int rc = pthread_rwlock_wrlock(&htab->lock);
+        assert(rc == 0);
+    }
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+static inline void hashtable_u64_unlock(linked_hashtable_u64_t *htab)
+{
+    if (htab->synced)
+        pthread_rwlock_unlock(&htab->lock);
+}
+
+static void hashtable_u64_clear_i(linked_hashtable_u64_t *htab)
+{
+    u64_entry_i *entry;
+    u64_entry_i *cur;
+
+    if (htab->count == 0)
+        return;
+
+    entry = htab->lst_head.lst_next;
+    while (entry != &htab->lst_head) {
+        cur = entry;
+        entry = entry->lst_next;
+
+        deref(cur->data);
+    }
+
+    memset(htab->slots, 0, u64_capacity(htab) * sizeof(u64_slot));
+
+    htab->lst_head.lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev = &htab->lst_head;
+
+    htab->count = 0;
+    htab->mod_count++;
+}
+
+static void hashtable_u64_destroy(void *obj)
+{
+    linked_hashtable_u64_t *htab = (linked_hashtable_u64_t *)obj;
+
+    assert(htab);
+
+    if (!htab)
+        return;
+
+    if (htab->slots) {
+        hashtable_u64_wlock(htab);
+        hashtable_u64_clear_i(htab);
+        hashtable_u64_unlock(htab);
+
+        free(htab->slots);
+    }
+
+    if (htab->synced)
+        pthread_rwlock_destroy(&htab->lock);
+}
+
+/* Caller holds the write lock */
+static void hashtable_u64_unlink(linked_hashtable_u64_t *htab, u64_slot *slot)
+{
+    u64_entry_i *entry = slot->entry;
+
+    u64_erase(htab, slot);
+
+    entry->lst_prev->lst_next = entry->lst_next;
+    entry->lst_next->lst_prev = entry->lst_prev;
+
+    htab->count--;
+    htab->mod_count++;
+
+    if ((htab->flags & LINKED_HASHTABLE_AUTO_SHRINK) && htab->bits > htab->min_bits &&
+        htab->count < U64_SHRINK_LOAD(u64_capacity(htab)))
+        u64_rehash(htab, htab->bits - 1); // Keep the current slots if that fails.
+}
+
+void *linked_hashtable_u64_put(linked_hashtable_u64_t *htab,
+                               linked_hash_u64_entry_t *entry)
+{
+    u64_entry_i *new_entry = (u64_entry_i *)entry;
+    u64_entry_i *ent;
+    u64_slot *slot;
+
+    assert(htab && entry && entry->data);
+    if (!htab || !entry || !entry->data) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashtable_u64_wlock(htab);
+
+    slot = u64_find(htab, entry->key);
+    if (slot) {
+        ent = slot->entry;
+        ref(entry->data);
+
+        slot->entry = new_entry;
+
+        new_entry->lst_prev = ent->lst_prev;
+        new_entry->lst_next = ent->lst_next;
+
+        new_entry->lst_prev->lst_next = new_entry;
+        new_entry->lst_next->lst_prev = new_entry;
+
+        htab->mod_count++;
+
+        hashtable_u64_unlock(htab);
+
+        deref(ent->data);
+        return entry->data;
+    }
+
+    if (htab->count + 1 > U64_MAX_LOAD(u64_capacity(htab)) &&
+        (htab->bits >= U64_MAX_BITS || u64_rehash(htab, htab->bits + 1) < 0) &&
+        htab->count + 1 >= u64_capacity(htab)) {
+        hashtable_u64_unlock(htab);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ref(entry->data);
+    u64_place(htab->slots, htab->bits, new_entry);
+
+    /* Add new entry to linked list tail */
+    new_entry->lst_prev = htab->lst_head.lst_prev;
+    new_entry->lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev->lst_next = new_entry;
+    htab->lst_head.lst_prev = new_entry;
+
+    htab->count++;
+    htab->mod_count++;
+
+    hashtable_u64_unlock(htab);
+
+    return entry->data;
+}
+
+void *linked_hashtable_u64_get(linked_hashtable_u64_t *htab, uint64_t key)
+{
+    u64_slot *slot;
+    void *val;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashtable_u64_rlock(htab);
+
+    slot = u64_find(htab, key);
+    val = slot ? ref(slot->entry->data) : NULL;
+
+    hashtable_u64_unlock(htab);
+
+    return val;
+}
+
+int linked_hashtable_u64_exist(linked_hashtable_u64_t *htab, uint64_t key)
+{
+    int exist;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    hashtable_u64_rlock(htab);
+    exist = u64_find(htab, key) != NULL;
+    hashtable_u64_unlock(htab);
+
+    return exist;
+}
+
+int linked_hashtable_u64_is_empty(linked_hashtable_u64_t *htab)
+{
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return htab->count == 0;
+}
+
+void *linked_hashtable_u64_remove(linked_hashtable_u64_t *htab, uint64_t key)
+{
+    u64_slot *slot;
+    void *val = NULL;
+
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashtable_u64_wlock(htab);
+
+    slot = u64_find(htab, key);
+    if (slot) {
+        // Pass reference to caller
+        val = slot->entry->data;
+        hashtable_u64_unlink(htab, slot);
+    }
+
+    hashtable_u64_unlock(htab);
+
+    return val;
+}
+
+void linked_hashtable_u64_clear(linked_hashtable_u64_t *htab)
+{
+    assert(htab);
+    if (!htab) {
+        errno = EINVAL;
+        return;
+    }
+
+    hashtable_u64_wlock(htab);
+    hashtable_u64_clear_i(htab);
+    hashtable_u64_unlock(htab);
+}
+
+linked_hashtable_u64_iterator_t *linked_hashtable_u64_iterate(linked_hashtable_u64_t *htab,
+                                        linked_hashtable_u64_iterator_t *iterator)
+{
+    u64_iterator_i *it = (u64_iterator_i *)iterator;
+
+    assert(htab && it);
+    if (!htab || !it) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hashtable_u64_rlock(htab);
+
+    it->htab = htab;
+    it->current = NULL;
+    it->next = htab->lst_head.lst_next;
+    it->expected_mod_count = htab->mod_count;
+
+    hashtable_u64_unlock(htab);
+
+    return iterator;
+}
+
+int linked_hashtable_u64_iterator_next(linked_hashtable_u64_iterator_t *iterator,
+                                       uint64_t *key, void **data)
+{
+    int rc;
+    u64_iterator_i *it = (u64_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next && data);
+    if (!it || !it->htab || !it->next || !data) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hashtable_u64_rlock(it->htab);
+
+    if (it->expected_mod_count != it->htab->mod_count) {
+        errno = EAGAIN;
+        rc = -1;
+    } else if (it->next == &it->htab->lst_head) { // end
+        rc = 0;
+    } else {
+        it->current = it->next;
+        it->next = it->next->lst_next;
+
+        if (key)
+            *key = it->current->key;
+
+        *data = ref(it->current->data);
+
+        rc = 1;
+    }
+
+    hashtable_u64_unlock(it->htab);
+
+    return rc;
+}
+
+int linked_hashtable_u64_iterator_has_next(linked_hashtable_u64_iterator_t *iterator)
+{
+    u64_iterator_i *it = (u64_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next);
+    if (!it || !it->htab || !it->next) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    return it->next != &it->htab->lst_head;
+}
+
+int linked_hashtable_u64_iterator_remove(linked_hashtable_u64_iterator_t *iterator)
+{
+    linked_hashtable_u64_t *htab;
+    void *ptr;
+    u64_iterator_i *it = (u64_iterator_i *)iterator;
+
+    assert(it && it->htab && it->next && it->current);
+    if (!it || !it->htab || !it->next || !it->current) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    htab = it->htab;
+    hashtable_u64_wlock(htab);
+
+    if (it->expected_mod_count != htab->mod_count) {
+        hashtable_u64_unlock(htab);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ptr = it->current->data;
+    hashtable_u64_unlink(htab, u64_find(htab, it->current->key));
+
+    it->current = NULL;
+    it->expected_mod_count++;
+
+    hashtable_u64_unlock(htab);
+
+    deref(ptr);
+    return 1;
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "crystal/rc_mem.h"
+#include "crystal/rc_buf.h"
+
+/* Views kept in the chain itself before an array is allocated */
+#define CHAIN_INLINE_VIEWS  4
+
+struct rc_buf_chain {
+    rc_buf_t    *views;     /* views[head .. head + count) are in use */
+    int         head;
+    int         count;
+    int         capacity;
+    size_t      length;
+    rc_buf_t    inline_views[CHAIN_INLINE_VIEWS];
+};
+
+void rc_buf_init(rc_buf_t *buf, void *mem, size_t offset, size_t len)
+{
+    assert(buf && mem);
+
+    buf->mem = ref(mem);
+    buf->data = (uint8_t *)mem + offset;
+    buf->len = len;
+}
+
+int rc_buf_alloc(rc_buf_t *buf, size_t len)
+{
+    assert(buf);
+
+    buf->mem = rc_alloc(len, NULL);
+    if (!buf->mem) {
+        buf->data = NULL;
+        buf->len = 0;
+        return -1;
+    }
+
+    buf->data = (uint8_t *)buf->mem;
+    buf->len = len;
+    return 0;
+}
+
+int rc_buf_slice(rc_buf_t *dst, const rc_buf_t *src, size_t offset, size_t len)
+{
+    assert(dst && src);
+
+    if (offset > src->len || len > src->len - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dst->mem = ref(src->mem);
+    dst->data = src->data + offset;
+    dst->len = len;
+    return 0;
+}
+
+int rc_buf_split(rc_buf_t *buf, size_t at, rc_buf_t *tail)
+{
+    assert(buf && tail);
+
+    if (at > buf->len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc_buf_slice(tail, buf, at, buf->len - at);
+
+    buf->len = at;
+    return 0;
+}
+
+void rc_buf_release(rc_buf_t *buf)
+{
+    assert(buf);
+
+    deref(buf->mem);
+    buf->mem = NULL;
+    buf->data = NULL;
+    buf->len = 0;
+}
+
+static void chain_destroy(void *obj)
+{
+    rc_buf_chain_t *chain = (rc_buf_chain_t *)obj;
+    int i;
+
+    for (i = 0; i < chain->count; i++)
+        deref(chain->views[chain->head + i].mem);
+
+    if (chain->views != chain->inline_views)
+        free(chain->views);
+}
+
+rc_buf_chain_t *rc_buf_chain_create(void)
+{
+    rc_buf_chain_t *chain;
+
+    chain = (rc_buf_chain_t *)rc_zalloc(sizeof(rc_buf_chain_t), chain_destroy);
+    if (!chain)
+        return NULL;
+
+    chain->views = chain->inline_views;
+    chain->capacity = CHAIN_INLINE_VIEWS;
+    return chain;
+}
+
+/* Make room for n more views at the end */
+static int chain_reserve(rc_buf_chain_t *chain, int n)
+{
+    rc_buf_t *views;
+    int capacity;
+
+    if (chain->head + chain->count + n <= chain->capacity)
+        return 0;
+
+    // Reuse the room left by consumed views first.
+    if (chain->count + n <= chain->capacity) {
+        memmove(chain->views, chain->views + chain->head,
+                chain->count * sizeof(rc_buf_t));
+        chain->head = 0;
+        return 0;
+    }
+
+    capacity = chain->capacity * 2;
+    while (capacity < chain->count + n)
+        capacity *= 2;
+
+    views = (rc_buf_t *)malloc(capacity * sizeof(rc_buf_t));
+    if (!views) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memcpy(views, chain->views + chain->head, chain->count * sizeof(rc_buf_t));
+    if (chain->views != chain->inline_views)
+        free(chain->views);
+
+    chain->views = views;
+    chain->head = 0;
+    chain->capacity = capacity;
+    return 0;
+}
+
+static int chain_push(rc_buf_chain_t *chain, void *mem, uint8_t *data, size_t len)
+{
+    rc_buf_t *last;
+
+    if (!len)
+        return 0;
+
+    if (chain->count) {
+        last = &chain->views[chain->head + chain->count - 1];
+        if (last->mem == mem && last->data + last->len == data) {
+            last->len += len;
+            chain->length += len;
+            return 0;
+        }
+    }
+
+    if (chain_reserve(chain, 1) < 0)
+        return -1;
+
+    last = &chain->views[chain->head + chain->count++];
+    last->mem = ref(mem);
+    last->data = data;
+    last->len = len;
+    chain->length += len;
+    return 0;
+}
+
+int rc_buf_chain_append(rc_buf_chain_t *chain, const rc_buf_t *buf)
+{
+    assert(chain && buf);
+
+    return chain_push(chain, buf->mem, buf->data, buf->len);
+}
+
+int rc_buf_chain_append_chain(rc_buf_chain_t *dst, const rc_buf_chain_t *src)
+{
+    const rc_buf_t *view;
+    int i, count;
+
+    assert(dst && src);
+
+    // Appending a chain to itself must stop at its original end.
+    count = src->count;
+    if (chain_reserve(dst, count) < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        view = &src->views[src->head + i];
+        if (chain_push(dst, view->mem, view->data, view->len) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+size_t rc_buf_chain_length(const rc_buf_chain_t *chain)
+{
+    assert(chain);
+
+    return chain->length;
+}
+
+int rc_buf_chain_count(const rc_buf_chain_t *chain)
+{
+    assert(chain);
+
+    return chain->count;
+}
+
+const rc_buf_t *rc_buf_chain_get(const rc_buf_chain_t *chain, int index)
+{
+    assert(chain);
+
+    if (index < 0 || index >= chain->count)
+        return NULL;
+
+    return &chain->views[chain->head + index];
+}
+
+rc_buf_chain_t *rc_buf_chain_slice(const rc_buf_chain_t *chain,
+                                   size_t offset, size_t len)
+{
+    rc_buf_chain_t *slice;
+    const rc_buf_t *view;
+    size_t n;
+    int i;
+
+    assert(chain);
+
+    if (offset > chain->length || len > chain->length - offset) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    slice = rc_buf_chain_create();
+    if (!slice) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < chain->count && len; i++) {
+        view = &chain->views[chain->head + i];
+        if (offset >= view->len) {
+            offset -= view->len;
+            continue;
+        }
+
+        n = view->len - offset < len ? view->len - offset : len;
+        if (chain_push(slice, view->mem, view->data + offset, n) < 0) {
+            deref(slice);
+            return NULL;
+        }
+
+        offset = 0;
+        len -= n;
+    }
+
+    return slice;
+}
+
+rc_buf_chain_t *rc_buf_chain_split(rc_buf_chain_t *chain, size_t at)
+{
+    rc_buf_chain_t *tail;
+    rc_buf_t *view;
+    size_t acc = 0;
+    int i, n;
+
+    assert(chain);
+
+    if (at > chain->length) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tail = rc_buf_chain_create();
+    if (!tail) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = chain->head; i < chain->head + chain->count &&
+                          acc + chain->views[i].len <= at; i++)
+        acc += chain->views[i].len;
+
+    n = chain->head + chain->count - i;
+    if (!n)
+        return tail;
+
+    if (chain_reserve(tail, n) < 0) {
+        deref(tail);
+        return NULL;
+    }
+
+    // The view the split falls into is shared by both chains.
+    view = &chain->views[i];
+    if (at > acc) {
+        if (chain_push(tail, view->mem, view->data + (at - acc),
+                       view->len - (at - acc)) < 0) {
+            deref(tail);
+            return NULL;
+        }
+
+        view->len = at - acc;
+        i++;
+        n--;
+    }
+
+    // The views after it move over along with their references.
+    memcpy(tail->views + tail->count, chain->views + i, n * sizeof(rc_buf_t));
+    tail->count += n;
+    tail->length = chain->length - at;
+
+    chain->count = i - chain->head;
+    chain->length = at;
+    return tail;
+}
+
+int rc_buf_chain_consume(rc_buf_chain_t *chain, size_t len)
+{
+    rc_buf_t *view;
+
+    assert(chain);
+
+    if (len > chain->length) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    chain->length -= len;
+
+    while (len) {
+        view = &chain->views[chain->head];
+        if (view->len > len) {
+            view->data += len;
+            view->len -= len;
+            break;
+        }
+
+        len -= view->len;
+        rc_buf_release(view);
+        chain->head++;
+        chain->count--;
+    }
+
+    if (!chain->count)
+        chain->head = 0;
+
+    return 0;
+}
+
+size_t rc_buf_chain_copy(const rc_buf_chain_t *chain, size_t offset,
+                         void *dst, size_t len)
+{
+    const rc_buf_t *view;
+    size_t copied = 0;
+    size_t n;
+    int i;
+
+    assert(chain);
+    assert(dst || !len);
+
+    for (i = 0; i < chain->count && copied < len; i++) {
+        view = &chain->views[chain->head + i];
+        if (offset >= view->len) {
+            offset -= view->len;
+            continue;
+        }
+
+        n = view->len - offset < len - copied ? view->len - offset : len - copied;
+        memcpy((uint8_t *)dst + copied, view->data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+int rc_buf_chain_iovec(const rc_buf_chain_t *chain, struct iovec *iov, int iovcnt)
+{
+    const rc_buf_t *view;
+    int i;
+
+    assert(chain);
+    assert(iov || iovcnt <= 0);
+
+    for (i = 0; i < chain->count && i < iovcnt; i++) {
+        view = &chain->views[chain->head + i];
+        iov[i].iov_base = view->data;
+        iov[i].iov_len = view->len;
+    }
+
+    return i;
+}
@@ -24,20 +24,47 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #ifdef _MSC_VER
 #include "crystal/builtins.h"
 #endif
 
 #include "crystal/rc_mem.h"
+#include "epoch.h"
+
+#ifdef RC_MEM_POOL
+#include "rc_pool.h"
+#endif
+
+#include "rc_track.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#else
+#define THREAD_LOCAL        __thread
+#endif
+
+struct rc_owner;
 
 /** Defines a reference-counting memory object */
 struct rc_mem {
-    uint32_t nrefs;                 /**< Number of references  */
-    rc_mem_destructor *destructor;  /**< destructor            */
+    uint32_t biased;                /**< References of the owner thread */
+    int32_t  shared;                /**< Other references, merge flags */
+    uint32_t info;                  /**< Pool class, weak references */
 #ifndef NDEBUG
     uint32_t magic;                 /**< Magic number          */
 #endif
+    struct rc_owner *owner;         /**< Allocating thread, or NULL */
+    rc_mem_destructor *destructor;  /**< destructor            */
 };
 
 #ifndef NDEBUG
@@ -49,19 +76,839 @@ static const uint32_t mem_magic = 0xa9b8ada8;
 #define MAGIC_CHECK(m)
 #endif
 
-void *rc_alloc(size_t size, rc_mem_destructor *destructor)
+/*
+ * rc_mem::info holds the pool size class of the object in the low bits,
+ * 0 if it was malloc'd, whether allocation tracking sampled the object,
+ * and the number of weak references above. All
+ * strong references together hold one weak reference, so the memory is
+ * released by whoever drops the weak count to zero.
+ */
+#define RC_MEM_POOL_MASK    0xffu
+#define RC_MEM_SAMPLED      0x100u
+#define RC_MEM_WEAK_ONE     0x200u
+#define RC_MEM_WEAK_MAX     (UINT32_MAX / RC_MEM_WEAK_ONE)
+
+#define RC_MEM_POOL_OF(m)   ((m)->info & RC_MEM_POOL_MASK)
+#define RC_MEM_WEAK_OF(i)   ((i) / RC_MEM_WEAK_ONE)
+
+/* Pool class of objects allocated from an rc_arena_t */
+#define RC_MEM_ARENA        RC_MEM_POOL_MASK
+
+/* Pool class of objects with an rc_mem_prefix, aligned or mmap'd */
+#define RC_MEM_ALIGNED      (RC_MEM_POOL_MASK - 1)
+
+/*
+ * Objects of class RC_MEM_ALIGNED do not start their block: the header
+ * sits right in front of the aligned payload, and the prefix right in
+ * front of the header.
+ */
+struct rc_mem_prefix {
+    void   *base;       /* Start of the block */
+    size_t size;        /* Payload bytes available */
+    size_t align;       /* Payload alignment */
+    size_t maplen;      /* Length of the mapping, 0 if not mmap'd */
+};
+
+#define RC_MEM_PREFIX_OF(m) (((struct rc_mem_prefix *)(m)) - 1)
+
+/* Alignment of objects rc_alloc() backs with huge pages */
+#define RC_MEM_CACHE_LINE   64
+
+/* Huge page size assumed for MAP_HUGETLB mappings */
+#define RC_MEM_HUGEPAGE     (2 * 1024 * 1024)
+
+/*
+ * Biased reference counting. The thread that allocated an object, its
+ * owner, counts its own references in rc_mem::biased with plain loads
+ * and stores; every other thread counts in rc_mem::shared atomically.
+ * When the owner drops its last reference it merges the two by setting
+ * RC_SHARED_MERGED, and from then on only 'shared' is used. 'shared' may
+ * go below zero while the owner still holds references: the thread that
+ * takes it there queues the object for the owner to merge, since only
+ * the owner may touch 'biased'. Other threads may still read it: once
+ * the references the owner handed out are released, the two counts tell
+ * whether the object is dead, and then any thread can merge it, so that
+ * an idle owner does not keep it (see rc_mem_try_merge()).
+ *
+ * An owner is a per-thread record rather than the thread itself: records
+ * of exited threads are adopted by new threads, along with the biased
+ * references they hold, and never freed.
+ */
+#define RC_SHARED_MERGED    0x1
+#define RC_SHARED_QUEUED    0x2
+#define RC_SHARED_ONE       0x4
+#define RC_SHARED_COUNT(s)  ((int32_t)((s) & ~(RC_SHARED_ONE - 1)) / RC_SHARED_ONE)
+
+/*
+ * The owner and another thread releasing the last references at the same
+ * time may both miss that the object died. Every so many objects queued
+ * to an owner, its whole queue is checked anyway, which bounds those.
+ */
+#define RC_OWNER_HELP_EVERY 64
+
+typedef struct rc_owner_node {
+    struct rc_mem *m;
+    struct rc_owner_node *next;
+} rc_owner_node;
+
+typedef struct rc_owner {
+    int             in_use;
+    rc_owner_node   *queue;     /* Objects to merge, pushed by any thread */
+    int             help;       /* Queued objects may have died meanwhile */
+    unsigned int    queued;     /* Objects queued so far */
+    struct rc_owner *next;
+} rc_owner;
+
+static rc_owner *owners;
+
+static pthread_once_t owner_once = PTHREAD_ONCE_INIT;
+static pthread_key_t owner_key;
+static THREAD_LOCAL rc_owner *local_owner;
+
+/*
+ * Deferred destruction. A thread in deferred mode collects the objects it
+ * dropped the last reference to in batches instead of destroying them.
+ * Batches are handed to the reclaimer thread if one runs, or else retired
+ * to the epochs of the thread itself; either way they are destroyed only
+ * after a grace period, so no reader inside rc_epoch_enter() sees them go.
+ */
+#define RC_DEFER_BATCH      64
+
+typedef struct rc_defer_batch {
+    struct rc_defer_batch *next;
+    size_t          count;
+    struct rc_mem   *objs[RC_DEFER_BATCH];
+} rc_defer_batch;
+
+static THREAD_LOCAL int defer_enabled;
+static THREAD_LOCAL rc_defer_batch *defer_pending;
+
+static pthread_mutex_t reclaimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaimer_thread;
+static int reclaimer_running;
+static int reclaimer_stopping;
+static rc_defer_batch *reclaimer_queue;
+
+#ifdef RC_MEM_POOL
+static int pool_enabled;
+#endif
+
+static size_t hugepage_threshold;
+static int hugepage_flags;
+
+int rc_mem_pool_enable(int enable)
+{
+#ifdef RC_MEM_POOL
+    __atomic_store_n(&pool_enabled, enable != 0, __ATOMIC_RELAXED);
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int rc_mem_hugepage_enable(size_t threshold, int flags)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    errno = ENOSYS;
+    return -1;
+#else
+    if (threshold && !(flags & (RC_MEM_HUGEPAGE_THP | RC_MEM_HUGEPAGE_HUGETLB))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&hugepage_flags, flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&hugepage_threshold, threshold, __ATOMIC_RELAXED);
+    return 0;
+#endif
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/* Map len bytes, backed by huge pages as far as the system allows */
+static void *rc_mem_map(size_t *len)
+{
+    int flags = __atomic_load_n(&hugepage_flags, __ATOMIC_RELAXED);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *p;
+
+#ifdef MAP_HUGETLB
+    if (flags & RC_MEM_HUGEPAGE_HUGETLB) {
+        size_t hlen = (*len + RC_MEM_HUGEPAGE - 1) & ~((size_t)RC_MEM_HUGEPAGE - 1);
+
+        // Fails unless huge pages were reserved, fall back to THP then.
+        p = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *len = hlen;
+            return p;
+        }
+    }
+#endif
+
+    *len = (*len + page - 1) & ~(page - 1);
+    p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    madvise(p, *len, MADV_HUGEPAGE);
+#endif
+    (void)flags;
+
+    return p;
+}
+#endif
+
+/*
+ * Allocate a block with room for the prefix and the header in front of a
+ * payload aligned to 'align', a power of two. Returns the header.
+ */
+static struct rc_mem *rc_mem_alloc_aligned(size_t size, size_t align)
 {
+    struct rc_mem_prefix *prefix;
     struct rc_mem *m;
+    size_t offset, total, maplen = 0;
+    size_t threshold;
+    void *base = NULL;
 
-    m = malloc(sizeof(struct rc_mem) + size);
-    if (!m)
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    offset = (sizeof(struct rc_mem_prefix) + sizeof(struct rc_mem) + align - 1) &
+             ~(align - 1);
+    if (size > SIZE_MAX - offset - align) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    total = offset + size;
+
+#if defined(_WIN32) || defined(_WIN64)
+    (void)threshold;
+    base = _aligned_malloc(total, align);
+#else
+    // Mappings are page aligned, larger alignments go to posix_memalign().
+    threshold = __atomic_load_n(&hugepage_threshold, __ATOMIC_RELAXED);
+    if (threshold && total >= threshold && align <= (size_t)sysconf(_SC_PAGESIZE)) {
+        maplen = total;
+        base = rc_mem_map(&maplen);
+        if (!base)
+            maplen = 0;
+    }
+
+    if (!base && posix_memalign(&base, align, total) != 0)
+        base = NULL;
+#endif
+
+    if (!base) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    m = (struct rc_mem *)((uint8_t *)base + offset) - 1;
+    prefix = RC_MEM_PREFIX_OF(m);
+    prefix->base = base;
+    prefix->size = maplen ? maplen - offset : size;
+    prefix->align = align;
+    prefix->maplen = maplen;
+
+    return m;
+}
+
+static void rc_mem_free_aligned(struct rc_mem *m)
+{
+    struct rc_mem_prefix *prefix = RC_MEM_PREFIX_OF(m);
+
+#if defined(_WIN32) || defined(_WIN64)
+    _aligned_free(prefix->base);
+#else
+    if (prefix->maplen)
+        munmap(prefix->base, prefix->maplen);
+    else
+        free(prefix->base);
+#endif
+}
+
+static void rc_mem_free(struct rc_mem *m)
+{
+    if (m->info & RC_MEM_SAMPLED)
+        rc_track_free(m);
+
+    // The memory goes with the arena, only its destructor must not run again.
+    if (RC_MEM_POOL_OF(m) == RC_MEM_ARENA) {
+        m->destructor = NULL;
+        return;
+    }
+
+    if (RC_MEM_POOL_OF(m) == RC_MEM_ALIGNED) {
+        rc_mem_free_aligned(m);
+        return;
+    }
+
+#ifdef RC_MEM_POOL
+    if (RC_MEM_POOL_OF(m)) {
+        rc_pool_free(m, RC_MEM_POOL_OF(m));
+        return;
+    }
+#endif
+
+    free(m);
+}
+
+/* The last strong reference is gone, drop the weak one they held */
+static void rc_mem_release(struct rc_mem *m)
+{
+    uint32_t info;
+
+    // Nobody can take a new weak reference without a strong one.
+    info = __atomic_load_n(&m->info, __ATOMIC_ACQUIRE);
+    if (RC_MEM_WEAK_OF(info) > 1) {
+        info = __atomic_fetch_add(&m->info, (uint32_t)-RC_MEM_WEAK_ONE,
+                                  __ATOMIC_ACQ_REL);
+        if (RC_MEM_WEAK_OF(info) > 1)
+            return;
+    }
+
+    rc_mem_free(m);
+}
+
+static int rc_defer(struct rc_mem *m);
+
+static void rc_mem_destroy_now(struct rc_mem *m)
+{
+    if (m->destructor)
+        m->destructor(m + 1);
+
+    /* NOTE: check if the destructor called ref() */
+    if (RC_SHARED_COUNT(__atomic_load_n(&m->shared, __ATOMIC_ACQUIRE)) > 0)
+        return;
+
+    rc_mem_release(m);
+}
+
+static void rc_mem_destroy(struct rc_mem *m)
+{
+    if (defer_enabled && RC_MEM_POOL_OF(m) != RC_MEM_ARENA && rc_defer(m) == 0)
+        return;
+
+    rc_mem_destroy_now(m);
+}
+
+/* Caller holds the owner record */
+static void rc_owner_drain(rc_owner *owner)
+{
+    rc_owner_node *node, *next;
+    struct rc_mem *m;
+    uint32_t biased;
+    int32_t shared, merged;
+
+    for (;;) {
+        node = __atomic_load_n(&owner->queue, __ATOMIC_RELAXED);
+        while (node && !__atomic_compare_exchange_n(&owner->queue, &node, NULL, 1,
+                                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            ;
+        if (!node)
+            break;
+
+        for (; node; node = next) {
+            next = node->next;
+            m = node->m;
+            free(node);
+
+            // Possibly merged already, when the owner dropped its last one.
+            biased = __atomic_load_n(&m->biased, __ATOMIC_RELAXED);
+            __atomic_store_n(&m->biased, 0, __ATOMIC_RELAXED);
+
+            shared = __atomic_load_n(&m->shared, __ATOMIC_RELAXED);
+            do {
+                merged = ((shared + (int32_t)biased * RC_SHARED_ONE) |
+                          RC_SHARED_MERGED) & ~RC_SHARED_QUEUED;
+            } while (!__atomic_compare_exchange_n(&m->shared, &shared, merged, 1,
+                                                  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+            if (RC_SHARED_COUNT(merged) == 0)
+                rc_mem_destroy(m);
+        }
+    }
+}
+
+/* Drain the queue of an owner whose thread exited, if nobody holds it */
+static void rc_owner_try_drain(rc_owner *owner)
+{
+    int unused;
+
+    while (__atomic_load_n(&owner->queue, __ATOMIC_SEQ_CST)) {
+        unused = 0;
+        if (!__atomic_compare_exchange_n(&owner->in_use, &unused, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+
+        rc_owner_drain(owner);
+        __atomic_store_n(&owner->in_use, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Merge a queued object on any thread, the one holding its queue node.
+ * That is possible once it is dead, or merged by the owner already; the
+ * owner can not touch 'biased' then. 'biased' is read after 'shared' is
+ * acquired, so it includes every owner reference released into it.
+ * Returns 0 if the object was merged, and destroyed if dead, or -1 if the
+ * owner still holds references and the object has to stay queued.
+ */
+static int rc_mem_try_merge(struct rc_mem *m)
+{
+    uint32_t biased;
+    int32_t shared, merged;
+
+    shared = __atomic_load_n(&m->shared, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (shared & RC_SHARED_MERGED) {
+            merged = shared & ~RC_SHARED_QUEUED;
+        } else {
+            // Pairs with the release of deref() by the owner.
+            biased = __atomic_load_n(&m->biased, __ATOMIC_ACQUIRE);
+            if (biased == 0) {
+                // The owner dropped its last reference, and is merging.
+                shared = __atomic_load_n(&m->shared, __ATOMIC_SEQ_CST);
+                continue;
+            }
+
+            if (RC_SHARED_COUNT(shared) + (int32_t)biased > 0)
+                return -1;
+            merged = RC_SHARED_MERGED;
+        }
+
+        if (__atomic_compare_exchange_n(&m->shared, &shared, merged, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+    }
+
+    if (RC_SHARED_COUNT(merged) == 0)
+        rc_mem_destroy(m);
+
+    return 0;
+}
+
+static void rc_owner_push(rc_owner *owner, rc_owner_node *first, rc_owner_node *last)
+{
+    last->next = __atomic_load_n(&owner->queue, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->queue, &last->next, first, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+
+    // Pairs with the release in rc_owner_release(): one of us drains it.
+    if (__atomic_load_n(&owner->in_use, __ATOMIC_SEQ_CST) == 0)
+        rc_owner_try_drain(owner);
+}
+
+/*
+ * Merge the queued objects that died while their owner was busy with
+ * something else, or idle, when asked to through 'help'. Whoever changes
+ * a queued object sets it before looking at the queue, and whoever puts
+ * nodes back checks it after, so a node taken off the queue meanwhile is
+ * not missed.
+ */
+static void rc_owner_help(rc_owner *owner)
+{
+    rc_owner_node *node, *next;
+    rc_owner_node *live, *last;
+    int help = 1;
+
+    // Exchanges, written as compare-and-swaps for the MSVC shim.
+    while (__atomic_compare_exchange_n(&owner->help, &help, 0, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        node = __atomic_load_n(&owner->queue, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&owner->queue, &node, NULL, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+
+        for (live = last = NULL; node; node = next) {
+            next = node->next;
+            if (rc_mem_try_merge(node->m) == 0) {
+                free(node);
+                continue;
+            }
+
+            node->next = live;
+            live = node;
+            if (!last)
+                last = node;
+        }
+
+        if (live)
+            rc_owner_push(owner, live, last);
+    }
+}
+
+static void rc_owner_enqueue(rc_owner *owner, struct rc_mem *m)
+{
+    rc_owner_node *node;
+
+    // Out of memory: the object can not be merged any more, and leaks.
+    node = (rc_owner_node *)malloc(sizeof(rc_owner_node));
+    if (!node)
+        return;
+
+    node->m = m;
+    rc_owner_push(owner, node, node);
+
+    if (((__atomic_fetch_add(&owner->queued, 1, __ATOMIC_RELAXED) + 1) %
+         RC_OWNER_HELP_EVERY) == 0)
+        __atomic_store_n(&owner->help, 1, __ATOMIC_SEQ_CST);
+    rc_owner_help(owner);
+}
+
+/*
+ * Called by the owner once a queued object died: merge it, along with the
+ * rest of the queue. Its node may be off the queue, in the hands of a
+ * helper, which is told to check it again.
+ */
+static void rc_owner_collect(rc_owner *owner)
+{
+    __atomic_store_n(&owner->help, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&owner->queue, __ATOMIC_SEQ_CST))
+        rc_owner_drain(owner);
+}
+
+static void rc_defer_flush(void);
+
+static void rc_owner_release(void *arg)
+{
+    rc_owner *owner = (rc_owner *)arg;
+
+    rc_owner_drain(owner);
+
+    defer_enabled = 0;
+    rc_defer_flush();
+
+    local_owner = NULL;
+    __atomic_store_n(&owner->in_use, 0, __ATOMIC_SEQ_CST);
+
+    rc_owner_try_drain(owner);
+}
+
+static void rc_owner_init(void)
+{
+    pthread_key_create(&owner_key, rc_owner_release);
+}
+
+static rc_owner *rc_owner_get(void)
+{
+    rc_owner *owner;
+    int unused;
+
+    if (local_owner)
+        return local_owner;
+
+    pthread_once(&owner_once, rc_owner_init);
+
+    for (owner = __atomic_load_n(&owners, __ATOMIC_ACQUIRE); owner;
+         owner = owner->next) {
+        unused = 0;
+        if (__atomic_load_n(&owner->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&owner->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!owner) {
+        owner = (rc_owner *)calloc(1, sizeof(rc_owner));
+        if (!owner)
+            return NULL;
+
+        owner->in_use = 1;
+        owner->next = __atomic_load_n(&owners, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&owners, &owner->next, owner, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (pthread_setspecific(owner_key, owner) != 0) {
+        __atomic_store_n(&owner->in_use, 0, __ATOMIC_RELEASE);
         return NULL;
+    }
+
+    local_owner = owner;
+    return owner;
+}
+
+/* Destroy a chain of batches, retired two epochs ago or more */
+static void rc_defer_reclaim(void *ptr)
+{
+    rc_defer_batch *batch = (rc_defer_batch *)ptr;
+    rc_defer_batch *next;
+    size_t i;
+
+    for (; batch; batch = next) {
+        next = batch->next;
+        for (i = 0; i < batch->count; i++)
+            rc_mem_destroy_now(batch->objs[i]);
+        free(batch);
+    }
+}
+
+/* Hand the pending batches over, unless inside a read-side section */
+static void rc_defer_flush(void)
+{
+    rc_defer_batch *batch = defer_pending;
+    rc_defer_batch *tail;
+
+    if (!batch || epoch_active())
+        return;
+
+    defer_pending = NULL;
+
+    pthread_mutex_lock(&reclaimer_lock);
+    if (reclaimer_running) {
+        for (tail = batch; tail->next; tail = tail->next)
+            ;
+        tail->next = reclaimer_queue;
+        reclaimer_queue = batch;
+        pthread_cond_signal(&reclaimer_cond);
+        pthread_mutex_unlock(&reclaimer_lock);
+        return;
+    }
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    epoch_retire(batch, rc_defer_reclaim);
+}
+
+/* Returns -1 if out of memory, the object must be destroyed right away */
+static int rc_defer(struct rc_mem *m)
+{
+    rc_defer_batch *batch = defer_pending;
+
+    if (!batch || batch->count == RC_DEFER_BATCH) {
+        // The owner record flushes the batches when the thread exits.
+        if (!rc_owner_get())
+            return -1;
+
+        batch = (rc_defer_batch *)malloc(sizeof(rc_defer_batch));
+        if (!batch)
+            return -1;
+
+        batch->next = defer_pending;
+        batch->count = 0;
+        defer_pending = batch;
+    }
+
+    batch->objs[batch->count++] = m;
+    if (batch->count == RC_DEFER_BATCH)
+        rc_defer_flush();
+
+    return 0;
+}
+
+int rc_mem_defer(int enable)
+{
+    int prev = defer_enabled;
+
+    defer_enabled = enable != 0;
+    return prev;
+}
+
+void rc_mem_reclaim(void)
+{
+    int running;
+
+    rc_defer_flush();
+
+    pthread_mutex_lock(&reclaimer_lock);
+    running = reclaimer_running;
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    if (!running)
+        epoch_barrier();
+}
+
+static void *rc_reclaimer_routine(void *arg)
+{
+    rc_defer_batch *batch;
+
+    (void)arg;
+
+    pthread_mutex_lock(&reclaimer_lock);
+    for (;;) {
+        while (!reclaimer_queue && !reclaimer_stopping)
+            pthread_cond_wait(&reclaimer_cond, &reclaimer_lock);
+
+        batch = reclaimer_queue;
+        reclaimer_queue = NULL;
+        if (!batch)
+            break;
+
+        pthread_mutex_unlock(&reclaimer_lock);
+        epoch_retire(batch, rc_defer_reclaim);
+        epoch_barrier();
+        pthread_mutex_lock(&reclaimer_lock);
+    }
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    return NULL;
+}
+
+int rc_mem_reclaimer_start(void)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&reclaimer_lock);
+    if (reclaimer_stopping) {
+        rc = EBUSY;
+    } else if (!reclaimer_running) {
+        rc = pthread_create(&reclaimer_thread, NULL, rc_reclaimer_routine, NULL);
+        if (rc == 0)
+            reclaimer_running = 1;
+    }
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+void rc_mem_reclaimer_stop(void)
+{
+    pthread_mutex_lock(&reclaimer_lock);
+    if (!reclaimer_running) {
+        pthread_mutex_unlock(&reclaimer_lock);
+        return;
+    }
+
+    // Batches flushed from now on are retired by their own threads.
+    reclaimer_running = 0;
+    reclaimer_stopping = 1;
+    pthread_cond_signal(&reclaimer_cond);
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    pthread_join(reclaimer_thread, NULL);
+
+    pthread_mutex_lock(&reclaimer_lock);
+    reclaimer_stopping = 0;
+    pthread_mutex_unlock(&reclaimer_lock);
+}
+
+int rc_epoch_enter(void)
+{
+    return epoch_enter();
+}
+
+void rc_epoch_exit(void)
+{
+    epoch_exit();
+}
 
-    m->nrefs = 1;
+/* Whether the calling thread counts its references in 'biased' */
+static inline int rc_mem_biased(struct rc_mem *m)
+{
+    // Only the owner merges, so it can trust a relaxed load of the flag.
+    return m->owner && m->owner == local_owner &&
+           !(__atomic_load_n(&m->shared, __ATOMIC_RELAXED) & RC_SHARED_MERGED);
+}
+
+static inline void rc_mem_init(struct rc_mem *m, rc_owner *owner, uint32_t pool,
+                               rc_mem_destructor *destructor)
+{
+    if (owner) {
+        m->biased = 1;
+        m->shared = 0;
+    } else {
+        m->biased = 0;
+        m->shared = RC_SHARED_ONE | RC_SHARED_MERGED;
+    }
+    m->owner = owner;
+    m->info = pool | RC_MEM_WEAK_ONE;
     m->destructor = destructor;
 #ifndef NDEBUG
     m->magic = mem_magic;
 #endif
+}
+
+/* Sample a new object for allocation tracking */
+static inline void rc_mem_track(struct rc_mem *m, size_t size,
+                                rc_mem_destructor *destructor, const void *caller)
+{
+    double weight;
+
+    if (!__atomic_load_n(&rc_track_active, __ATOMIC_RELAXED))
+        return;
+
+    weight = rc_track_sample(size);
+    if (weight > 0) {
+        m->info |= RC_MEM_SAMPLED;
+        rc_track_alloc(m, size, weight, destructor, caller);
+    }
+}
+
+static void *rc_mem_alloc(size_t size, rc_mem_destructor *destructor,
+                          const void *caller)
+{
+    struct rc_mem *m = NULL;
+    unsigned int pool = 0;
+    size_t threshold;
+    rc_owner *owner;
+
+    // Merge what other threads queued for this one meanwhile.
+    owner = rc_owner_get();
+    if (owner && __atomic_load_n(&owner->queue, __ATOMIC_RELAXED))
+        rc_owner_drain(owner);
+
+#ifdef RC_MEM_POOL
+    if (sizeof(struct rc_mem) + size <= RC_POOL_MAX_BLOCK &&
+        __atomic_load_n(&pool_enabled, __ATOMIC_RELAXED))
+        m = rc_pool_alloc(sizeof(struct rc_mem) + size, &pool);
+#endif
+
+    threshold = __atomic_load_n(&hugepage_threshold, __ATOMIC_RELAXED);
+    if (!m && threshold && sizeof(struct rc_mem) + size >= threshold) {
+        m = rc_mem_alloc_aligned(size, RC_MEM_CACHE_LINE);
+        if (!m)
+            return NULL;
+        pool = RC_MEM_ALIGNED;
+    }
+
+    if (!m) {
+        m = malloc(sizeof(struct rc_mem) + size);
+        if (!m)
+            return NULL;
+    }
+
+    rc_mem_init(m, owner, pool, destructor);
+    rc_mem_track(m, size, destructor, caller);
+
+    return (void *)(m + 1);
+}
+
+void *rc_alloc(size_t size, rc_mem_destructor *destructor)
+{
+    return rc_mem_alloc(size, destructor, RC_TRACK_CALLER());
+}
+
+void *rc_alloc_aligned(size_t size, size_t align, rc_mem_destructor *destructor)
+{
+    struct rc_mem *m;
+    rc_owner *owner;
+
+    if (!align || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    owner = rc_owner_get();
+    if (owner && __atomic_load_n(&owner->queue, __ATOMIC_RELAXED))
+        rc_owner_drain(owner);
+
+    m = rc_mem_alloc_aligned(size, align);
+    if (!m)
+        return NULL;
+
+    rc_mem_init(m, owner, RC_MEM_ALIGNED, destructor);
+    rc_mem_track(m, size, destructor, RC_TRACK_CALLER());
 
     return (void *)(m + 1);
 }
@@ -70,7 +917,7 @@ void *rc_zalloc(size_t size, rc_mem_destructor *destructor)
 {
     void *p;
 
-    p = rc_alloc(size, destructor);
+    p = rc_mem_alloc(size, destructor, RC_TRACK_CALLER());
     if (!p)
         return NULL;
 
@@ -79,9 +926,55 @@ void *rc_zalloc(size_t size, rc_mem_destructor *destructor)
     return p;
 }
 
+static struct rc_mem *rc_mem_realloc(struct rc_mem *m, size_t size)
+{
+    struct rc_mem *m2;
+
+    // Aligned blocks stay in place while the new size fits, or move to a
+    // new block of the same alignment.
+    if (RC_MEM_POOL_OF(m) == RC_MEM_ALIGNED) {
+        struct rc_mem_prefix *prefix = RC_MEM_PREFIX_OF(m);
+
+        if (size <= prefix->size)
+            return m;
+
+        m2 = rc_mem_alloc_aligned(size, prefix->align);
+        if (!m2)
+            return NULL;
+
+        memcpy(m2, m, sizeof(struct rc_mem) + prefix->size);
+        rc_mem_free_aligned(m);
+
+        return m2;
+    }
+
+#ifdef RC_MEM_POOL
+    // Pool blocks stay in place while the new size fits, or move to malloc.
+    if (RC_MEM_POOL_OF(m)) {
+        size_t block_size = rc_pool_block_size(RC_MEM_POOL_OF(m));
+
+        if (sizeof(struct rc_mem) + size <= block_size)
+            return m;
+
+        m2 = malloc(sizeof(struct rc_mem) + size);
+        if (!m2)
+            return NULL;
+
+        memcpy(m2, m, block_size);
+        m2->info = RC_MEM_WEAK_ONE | (m->info & RC_MEM_SAMPLED);
+        rc_pool_free(m, RC_MEM_POOL_OF(m));
+
+        return m2;
+    }
+#endif
+
+    return (struct rc_mem *)realloc(m, sizeof(struct rc_mem) + size);
+}
+
 void *rc_realloc(void *data, size_t size)
 {
     struct rc_mem *m, *m2;
+    void *sample = NULL;
 
     if (!data)
         return NULL;
@@ -90,11 +983,29 @@ void *rc_realloc(void *data, size_t size)
 
     MAGIC_CHECK(m);
 
-    m2 = realloc(m, sizeof(struct rc_mem) + size);
+    if (RC_MEM_POOL_OF(m) == RC_MEM_ARENA) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Weak references and the owner's queue would keep pointing at the
+    // old location.
+    if (RC_MEM_WEAK_OF(__atomic_load_n(&m->info, __ATOMIC_ACQUIRE)) > 1 ||
+        (__atomic_load_n(&m->shared, __ATOMIC_ACQUIRE) & RC_SHARED_QUEUED)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    if (m->info & RC_MEM_SAMPLED)
+        sample = rc_track_detach(m);
+
+    m2 = rc_mem_realloc(m, size);
     if (!m2) {
+        rc_track_attach(sample, m, RC_TRACK_SAME_SIZE);
         return NULL;
     }
 
+    rc_track_attach(sample, m2, size);
     return (void *)(m2 + 1);
 }
 
@@ -109,7 +1020,10 @@ void *ref(void *data)
 
     MAGIC_CHECK(m);
 
-    __sync_add_and_fetch(&m->nrefs, 1);
+    if (rc_mem_biased(m))
+        __atomic_store_n(&m->biased, m->biased + 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&m->shared, RC_SHARED_ONE, __ATOMIC_RELAXED);
 
     return data;
 }
@@ -117,7 +1031,9 @@ void *ref(void *data)
 void *deref(void *data)
 {
     struct rc_mem *m;
-    uint32_t nrefs;
+    rc_owner *owner;
+    uint32_t biased;
+    int32_t shared, n;
 
     if (!data)
         return NULL;
@@ -126,25 +1042,227 @@ void *deref(void *data)
 
     MAGIC_CHECK(m);
 
-    nrefs = __sync_sub_and_fetch(&m->nrefs, 1);
-    if (nrefs > 0)
+    if (rc_mem_biased(m)) {
+        biased = m->biased - 1;
+        if (biased > 0) {
+            // The references handed to other threads may be gone already.
+            // Past the store, a helper may find the object dead and free it.
+            shared = __atomic_load_n(&m->shared, __ATOMIC_RELAXED);
+            __atomic_store_n(&m->biased, biased, __ATOMIC_RELEASE);
+            if ((shared & RC_SHARED_QUEUED) &&
+                RC_SHARED_COUNT(shared) + (int32_t)biased <= 0)
+                rc_owner_collect(local_owner);
+            return NULL;
+        }
+
+        __atomic_store_n(&m->biased, 0, __ATOMIC_RELAXED);
+
+        shared = __atomic_load_n(&m->shared, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&m->shared, &shared,
+                                            shared | RC_SHARED_MERGED, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+
+        if (shared & RC_SHARED_QUEUED)
+            rc_owner_collect(local_owner);
+        else if (__atomic_load_n(&local_owner->queue, __ATOMIC_RELAXED))
+            rc_owner_drain(local_owner);
+
+        // A queued object is destroyed when the queue is drained.
+        if ((shared & RC_SHARED_QUEUED) || RC_SHARED_COUNT(shared) != 0)
+            return NULL;
+    } else {
+        // Once queued, the object may be gone right after the decrement.
+        owner = m->owner;
+
+        shared = __atomic_load_n(&m->shared, __ATOMIC_RELAXED);
+        do {
+            n = shared - RC_SHARED_ONE;
+            if (!(n & RC_SHARED_MERGED) && RC_SHARED_COUNT(n) < 0)
+                n |= RC_SHARED_QUEUED;
+        } while (!__atomic_compare_exchange_n(&m->shared, &shared, n, 1,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        if ((n & RC_SHARED_QUEUED) && !(shared & RC_SHARED_QUEUED)) {
+            // Queued only while the owner still holds a reference.
+            if (rc_mem_try_merge(m) < 0)
+                rc_owner_enqueue(owner, m);
+            return NULL;
+        }
+
+        if ((n & RC_SHARED_QUEUED) && !(n & RC_SHARED_MERGED)) {
+            // Possibly the last reference, have the queue checked again.
+            __atomic_store_n(&owner->help, 1, __ATOMIC_SEQ_CST);
+            rc_owner_help(owner);
+            return NULL;
+        }
+
+        if (!(n & RC_SHARED_MERGED) || (n & RC_SHARED_QUEUED) ||
+            RC_SHARED_COUNT(n) != 0)
+            return NULL;
+    }
+
+    rc_mem_destroy(m);
+
+    return NULL;
+}
+
+uint32_t nrefs(const void *data)
+{
+    struct rc_mem *m;
+    int32_t shared;
+    int32_t count;
+
+    if (!data)
+        return 0;
+
+    m = ((struct rc_mem *)data) - 1;
+
+    MAGIC_CHECK(m);
+
+    // Exact for the owner, a snapshot for everybody else.
+    shared = __atomic_load_n(&m->shared, __ATOMIC_ACQUIRE);
+    count = RC_SHARED_COUNT(shared);
+    if (!(shared & RC_SHARED_MERGED))
+        count += (int32_t)__atomic_load_n(&m->biased, __ATOMIC_RELAXED);
+
+    return count > 0 ? (uint32_t)count : 0;
+}
+
+rc_weak_t *rc_weak_ref(void *data)
+{
+    struct rc_mem *m;
+    uint32_t info;
+
+    assert(data);
+    if (!data) {
+        errno = EINVAL;
         return NULL;
+    }
 
-    if (m->destructor)
-        m->destructor(data);
+    m = ((struct rc_mem *)data) - 1;
 
-    /* NOTE: check if the destructor called ref() */
-    if (m->nrefs > 0)
+    MAGIC_CHECK(m);
+    assert(nrefs(data) > 0);
+
+    info = __atomic_fetch_add(&m->info, RC_MEM_WEAK_ONE, __ATOMIC_RELAXED);
+    assert(RC_MEM_WEAK_OF(info) < RC_MEM_WEAK_MAX);
+    (void)info;
+
+    return (rc_weak_t *)data;
+}
+
+void *rc_weak_get(rc_weak_t *weak)
+{
+    struct rc_mem *m;
+    int32_t shared;
+    int32_t count;
+
+    if (!weak)
         return NULL;
 
-    free(m);
+    m = ((struct rc_mem *)weak) - 1;
+
+    MAGIC_CHECK(m);
+
+    // Before the merge the owner's count decides too: an object queued
+    // with all references released is dead, only not destroyed yet.
+    shared = __atomic_load_n(&m->shared, __ATOMIC_ACQUIRE);
+    do {
+        count = RC_SHARED_COUNT(shared);
+        if (!(shared & RC_SHARED_MERGED))
+            count += (int32_t)__atomic_load_n(&m->biased, __ATOMIC_RELAXED);
+        if (count <= 0)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&m->shared, &shared, shared + RC_SHARED_ONE,
+                                          1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return (void *)weak;
+}
+
+void rc_weak_deref(rc_weak_t *weak)
+{
+    struct rc_mem *m;
+    uint32_t info;
+
+    if (!weak)
+        return;
+
+    m = ((struct rc_mem *)weak) - 1;
+
+    MAGIC_CHECK(m);
+
+    info = __atomic_fetch_add(&m->info, (uint32_t)-RC_MEM_WEAK_ONE, __ATOMIC_ACQ_REL);
+    assert(RC_MEM_WEAK_OF(info) > 0);
+
+    if (RC_MEM_WEAK_OF(info) == 1)
+        rc_mem_free(m);
+}
+
+/* Copy functions registered per destructor, append only */
+#define RC_COPY_MAX         64
+
+typedef struct rc_copy_entry {
+    rc_mem_destructor   *destructor;
+    rc_mem_copy         *copy;
+} rc_copy_entry;
+
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static rc_copy_entry copy_entries[RC_COPY_MAX];
+static int ncopy_entries;
+
+int rc_mem_copy_register(rc_mem_destructor *destructor, rc_mem_copy *copy)
+{
+    int i, n;
+
+    if (!copy) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&copy_lock);
+
+    n = __atomic_load_n(&ncopy_entries, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++) {
+        if (copy_entries[i].destructor == destructor) {
+            __atomic_store_n(&copy_entries[i].copy, copy, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&copy_lock);
+            return 0;
+        }
+    }
+
+    if (n == RC_COPY_MAX) {
+        pthread_mutex_unlock(&copy_lock);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    copy_entries[n].destructor = destructor;
+    copy_entries[n].copy = copy;
+    __atomic_store_n(&ncopy_entries, n + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&copy_lock);
+    return 0;
+}
+
+static rc_mem_copy *rc_mem_copy_lookup(rc_mem_destructor *destructor)
+{
+    int i, n;
+
+    n = __atomic_load_n(&ncopy_entries, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+        if (copy_entries[i].destructor == destructor)
+            return __atomic_load_n(&copy_entries[i].copy, __ATOMIC_ACQUIRE);
+    }
 
     return NULL;
 }
 
-uint32_t nrefs(const void *data)
+int rc_unique(const void *data)
 {
     struct rc_mem *m;
+    int32_t shared;
+    int32_t count;
 
     if (!data)
         return 0;
@@ -153,5 +1271,223 @@ uint32_t nrefs(const void *data)
 
     MAGIC_CHECK(m);
 
-    return m->nrefs;
+    // A weak reference could be turned into a strong one at any time.
+    if (RC_MEM_WEAK_OF(__atomic_load_n(&m->info, __ATOMIC_ACQUIRE)) > 1)
+        return 0;
+
+    // Pairs with the release of deref(): others are done with the object.
+    shared = __atomic_load_n(&m->shared, __ATOMIC_ACQUIRE);
+    count = RC_SHARED_COUNT(shared);
+
+    if (shared & RC_SHARED_MERGED)
+        return count == 1;
+
+    // Before the merge the owner's count decides too. Read after 'shared',
+    // it includes every reference the owner handed out and got released,
+    // so the caller's reference handed over by the owner counts once.
+    return count + (int32_t)__atomic_load_n(&m->biased, __ATOMIC_ACQUIRE) == 1;
+}
+
+void *rc_cow(void *data, rc_mem_copy *copy)
+{
+    struct rc_mem *m;
+    void *clone;
+
+    if (!data)
+        return NULL;
+
+    if (rc_unique(data))
+        return data;
+
+    m = ((struct rc_mem *)data) - 1;
+
+    if (!copy)
+        copy = rc_mem_copy_lookup(m->destructor);
+    if (!copy) {
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    clone = copy(data);
+    if (!clone)
+        return NULL;
+
+    deref(data);
+    return clone;
+}
+
+#define ARENA_ALIGN             16
+#define ARENA_ROUND(n)          (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_DEFAULT_CHUNK     4096
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+} arena_chunk;
+
+/* Precedes the rc_mem header of arena objects that have a destructor */
+typedef struct arena_dtor {
+    struct arena_dtor *next;
+} arena_dtor;
+
+/*
+ * The first chunk follows the arena itself, so an arena that is reset
+ * and reused for every request does not need malloc() at all.
+ */
+struct rc_arena {
+    char        *bump;
+    char        *end;
+    size_t      chunk_size;
+    arena_chunk *chunks;        /* Chunks added after the first one */
+    arena_dtor  *dtors;         /* Most recent first */
+    char        *first;
+};
+
+static void arena_reset(rc_arena_t *arena)
+{
+    arena_chunk *chunk;
+    arena_dtor *dtor;
+    struct rc_mem *m;
+
+    // A destructor may allocate from the arena again: run until none is left.
+    while ((dtor = arena->dtors) != NULL) {
+        arena->dtors = dtor->next;
+
+        m = (struct rc_mem *)((char *)dtor + ARENA_ROUND(sizeof(arena_dtor)));
+        if (m->destructor) {
+            rc_mem_destructor *destructor = m->destructor;
+
+            m->destructor = NULL;
+            destructor(m + 1);
+        }
+    }
+
+    while ((chunk = arena->chunks) != NULL) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    arena->bump = arena->first;
+    arena->end = arena->first + arena->chunk_size;
+}
+
+static void arena_destroy(void *obj)
+{
+    arena_reset((rc_arena_t *)obj);
+}
+
+rc_arena_t *rc_arena_create(size_t chunk_size)
+{
+    rc_arena_t *arena;
+
+    chunk_size = ARENA_ROUND(chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK);
+
+    arena = (rc_arena_t *)rc_alloc(ARENA_ROUND(sizeof(rc_arena_t)) +
+                                   chunk_size + ARENA_ALIGN, arena_destroy);
+    if (!arena) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    arena->chunk_size = chunk_size;
+    arena->chunks = NULL;
+    arena->dtors = NULL;
+    arena->first = (char *)ARENA_ROUND((uintptr_t)(arena + 1));
+    arena->bump = arena->first;
+    arena->end = arena->first + chunk_size;
+
+    return arena;
+}
+
+static void *arena_chunk_alloc(rc_arena_t *arena, size_t size)
+{
+    arena_chunk *chunk;
+    size_t header = ARENA_ROUND(sizeof(arena_chunk));
+    char *p;
+
+    // Large objects get a chunk of their own, the current one stays open.
+    if (size > arena->chunk_size / 4) {
+        chunk = (arena_chunk *)malloc(header + size + ARENA_ALIGN);
+        if (!chunk)
+            return NULL;
+
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+
+        return (char *)ARENA_ROUND((uintptr_t)chunk + header);
+    }
+
+    chunk = (arena_chunk *)malloc(header + arena->chunk_size + ARENA_ALIGN);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    p = (char *)ARENA_ROUND((uintptr_t)chunk + header);
+    arena->bump = p + size;
+    arena->end = p + arena->chunk_size;
+
+    return p;
+}
+
+void *rc_arena_alloc(rc_arena_t *arena, size_t size, rc_mem_destructor *destructor)
+{
+    struct rc_mem *m;
+    arena_dtor *dtor = NULL;
+    size_t prefix = destructor ? ARENA_ROUND(sizeof(arena_dtor)) : 0;
+    size_t total = ARENA_ROUND(prefix + sizeof(struct rc_mem) + size);
+    char *p;
+
+    assert(arena);
+    if (!arena) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((size_t)(arena->end - arena->bump) >= total) {
+        p = arena->bump;
+        arena->bump += total;
+    } else {
+        p = (char *)arena_chunk_alloc(arena, total);
+        if (!p) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    if (destructor) {
+        dtor = (arena_dtor *)p;
+        dtor->next = arena->dtors;
+        arena->dtors = dtor;
+    }
+
+    // Without an owner: none of them may be queued when the arena is reset.
+    m = (struct rc_mem *)(p + prefix);
+    rc_mem_init(m, NULL, RC_MEM_ARENA, destructor);
+
+    return (void *)(m + 1);
+}
+
+void *rc_arena_zalloc(rc_arena_t *arena, size_t size, rc_mem_destructor *destructor)
+{
+    void *p;
+
+    p = rc_arena_alloc(arena, size, destructor);
+    if (!p)
+        return NULL;
+
+    memset(p, 0, size);
+
+    return p;
+}
+
+void rc_arena_reset(rc_arena_t *arena)
+{
+    assert(arena);
+    if (!arena) {
+        errno = EINVAL;
+        return;
+    }
+
+    arena_reset(arena);
 }
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <malloc.h>
+#endif
+
+#ifdef _MSC_VER
+#include "crystal/builtins.h"
+#endif
+
+#include "rc_pool.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#else
+#define THREAD_LOCAL        __thread
+#endif
+
+/*
+ * Slabs are aligned to their size, so the slab, and with it the owning
+ * cache, of any block is found by masking the block address.
+ */
+#define POOL_SLAB_SIZE      (64 * 1024)
+#define POOL_SLAB_HEADER    64
+
+/* Two classes per power of two: 32, 48, 64, 96, ... 1024 */
+#define POOL_CLASSES        12
+
+static const size_t class_sizes[POOL_CLASSES] = {
+    0, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block;
+
+typedef struct pool_class {
+    pool_block *free;
+    char       *bump;
+    char       *end;
+} pool_class;
+
+/*
+ * One cache per thread, reused by a later thread once its owner exited,
+ * never freed: blocks of its slabs may still be referenced anywhere.
+ * 'remote' is written by other threads and kept off the owner's lines.
+ */
+typedef struct pool_cache {
+    pool_class  classes[POOL_CLASSES];
+    int         in_use;
+    struct pool_cache *next;
+    char        __pad1[64];
+    pool_block *remote[POOL_CLASSES];
+    char        __pad2[64];
+} pool_cache;
+
+typedef struct pool_slab {
+    pool_cache *owner;
+} pool_slab;
+
+static pool_cache *caches;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static THREAD_LOCAL pool_cache *local_cache;
+
+static inline unsigned int pool_class_of(size_t size)
+{
+    size_t base;
+    int bits;
+
+    if (size <= 32)
+        return 1;
+
+    bits = 63 - __builtin_clzll((unsigned long long)(size - 1));
+    base = (size_t)1 << bits;
+
+    return (unsigned int)((bits - 5) * 2 + (size <= base + base / 2 ? 2 : 3));
+}
+
+static void pool_cache_release(void *arg)
+{
+    pool_cache *cache = (pool_cache *)arg;
+
+    __atomic_store_n(&cache->in_use, 0, __ATOMIC_RELEASE);
+    local_cache = NULL;
+}
+
+static void pool_init(void)
+{
+    pthread_key_create(&pool_key, pool_cache_release);
+}
+
+static pool_cache *pool_cache_get(void)
+{
+    pool_cache *cache;
+    int unused;
+
+    if (local_cache)
+        return local_cache;
+
+    pthread_once(&pool_once, pool_init);
+
+    for (cache = __atomic_load_n(&caches, __ATOMIC_ACQUIRE); cache;
+         cache = cache->next) {
+        unused = 0;
+        if (__atomic_load_n(&cache->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&cache->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!cache) {
+        cache = (pool_cache *)calloc(1, sizeof(pool_cache));
+        if (!cache)
+            return NULL;
+
+        cache->in_use = 1;
+        cache->next = __atomic_load_n(&caches, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&caches, &cache->next, cache, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (pthread_setspecific(pool_key, cache) != 0) {
+        __atomic_store_n(&cache->in_use, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    local_cache = cache;
+    return cache;
+}
+
+/* Never freed, see rc_pool.h */
+static pool_slab *pool_slab_new(pool_cache *cache)
+{
+    pool_slab *slab;
+
+#if defined(_WIN32) || defined(_WIN64)
+    slab = (pool_slab *)_aligned_malloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+#else
+    if (posix_memalign((void **)&slab, POOL_SLAB_SIZE, POOL_SLAB_SIZE) != 0)
+        slab = NULL;
+#endif
+    if (!slab)
+        return NULL;
+
+    slab->owner = cache;
+    return slab;
+}
+
+void *rc_pool_alloc(size_t size, unsigned int *cls)
+{
+    pool_cache *cache;
+    pool_class *pc;
+    pool_block *block;
+    pool_slab *slab;
+    unsigned int c;
+
+    assert(size <= RC_POOL_MAX_BLOCK);
+
+    cache = pool_cache_get();
+    if (!cache)
+        return NULL;
+
+    c = pool_class_of(size);
+    pc = &cache->classes[c];
+
+    if (!pc->free && __atomic_load_n(&cache->remote[c], __ATOMIC_RELAXED)) {
+        // Take everything freed by other threads at once.
+        block = __atomic_load_n(&cache->remote[c], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&cache->remote[c], &block, NULL, 1,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            ;
+        pc->free = block;
+    }
+
+    if (pc->free) {
+        block = pc->free;
+        pc->free = block->next;
+    } else {
+        if (!pc->bump || pc->bump + class_sizes[c] > pc->end) {
+            slab = pool_slab_new(cache);
+            if (!slab)
+                return NULL;
+
+            pc->bump = (char *)slab + POOL_SLAB_HEADER;
+            pc->end = (char *)slab + POOL_SLAB_SIZE;
+        }
+
+        block = (pool_block *)pc->bump;
+        pc->bump += class_sizes[c];
+    }
+
+    *cls = c;
+    return block;
+}
+
+void rc_pool_free(void *ptr, unsigned int cls)
+{
+    pool_block *block = (pool_block *)ptr;
+    pool_cache *owner;
+
+    assert(cls > 0 && cls < POOL_CLASSES);
+
+    owner = ((pool_slab *)((uintptr_t)ptr & ~(uintptr_t)(POOL_SLAB_SIZE - 1)))->owner;
+
+    if (owner == local_cache) {
+        block->next = owner->classes[cls].free;
+        owner->classes[cls].free = block;
+        return;
+    }
+
+    block->next = __atomic_load_n(&owner->remote[cls], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote[cls], &block->next, block, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+size_t rc_pool_block_size(unsigned int cls)
+{
+    assert(cls > 0 && cls < POOL_CLASSES);
+
+    return class_sizes[cls];
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_RC_POOL_H__
+#define __CRYSTAL_RC_POOL_H__
+
+#include <stddef.h>
+
+/*
+ * Size class pool behind rc_alloc(), internal to the library.
+ *
+ * Blocks are carved out of slabs owned by one thread each. The owner
+ * allocates and frees without any atomic operation; a block freed by
+ * another thread is pushed onto a lock-free list of the owner, which
+ * takes the whole list back once its own free list runs dry.
+ *
+ * Slabs are never returned to the system, even once all their blocks are
+ * free again. A free list mixes the blocks of all slabs of its class, so
+ * telling that a slab is empty would take a per-slab count updated by
+ * every free, atomically for the ones from other threads. The price is
+ * retained memory: each cache keeps the peak of every size class it has
+ * served, which a later thread taking over the cache reuses. Workloads
+ * with short bursts of many small objects should leave the pool disabled.
+ */
+
+/* Largest block served by the pool, header included */
+#define RC_POOL_MAX_BLOCK   1024
+
+/**
+ * Allocate a block of at least 'size' bytes.
+ *
+ * @param
+ *      size    Block size, at most RC_POOL_MAX_BLOCK
+ * @param
+ *      cls     Receives the size class of the block, never 0
+ *
+ * @return The block, or NULL when out of memory
+ */
+void *rc_pool_alloc(size_t size, unsigned int *cls);
+
+/**
+ * Return a block to the cache of the thread that allocated it.
+ */
+void rc_pool_free(void *block, unsigned int cls);
+
+/**
+ * Usable size of the blocks of a size class.
+ */
+size_t rc_pool_block_size(unsigned int cls);
+
+#endif /* __CRYSTAL_RC_POOL_H__ */
@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef _MSC_VER
+#include "crystal/builtins.h"
+#endif
+
+#include "crystal/rc_mem.h"
+#include "crystal/time_util.h"
+#include "rc_track.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#else
+#define THREAD_LOCAL        __thread
+#endif
+
+#define TRACK_INITIAL_BUCKETS   256
+
+typedef struct track_site {
+    rc_mem_destructor   *destructor;
+    const void          *caller;
+    double              live_objects;
+    double              live_bytes;
+    double              peak_bytes;
+    double              total_objects;
+    double              total_bytes;
+    struct track_site   *next;
+} track_site;
+
+typedef struct track_sample {
+    const void          *key;
+    size_t              size;
+    double              weight;
+    track_site          *site;
+    struct track_sample *next;
+} track_sample;
+
+typedef struct track_table {
+    void    **buckets;
+    size_t  nbuckets;
+    size_t  count;
+} track_table;
+
+int rc_track_active;
+
+static size_t track_period;
+static unsigned int track_generation;
+
+static pthread_mutex_t track_lock = PTHREAD_MUTEX_INITIALIZER;
+static track_table samples;
+static track_table sites;
+static double live_objects;
+static double live_bytes;
+static double peak_bytes;
+static double total_objects;
+static double total_bytes;
+static uint64_t track_start;
+
+static THREAD_LOCAL unsigned int local_generation;
+static THREAD_LOCAL int64_t local_countdown;
+static THREAD_LOCAL uint64_t local_random;
+
+static inline size_t track_hash(const void *a, const void *b, size_t nbuckets)
+{
+    uint64_t h = ((uint64_t)(uintptr_t)a ^ ((uint64_t)(uintptr_t)b << 1)) *
+                 0x9E3779B97F4A7C15ULL;
+
+    return (size_t)(h >> 32) & (nbuckets - 1);
+}
+
+static inline size_t sample_bucket(const void *key, size_t nbuckets)
+{
+    return track_hash(key, NULL, nbuckets);
+}
+
+static inline size_t site_bucket(const track_site *site, size_t nbuckets)
+{
+    return track_hash((const void *)site->destructor, site->caller, nbuckets);
+}
+
+/* Double the buckets once the table is full, caller holds the lock */
+static void track_table_grow(track_table *table, int is_site)
+{
+    void **buckets;
+    size_t nbuckets, i, idx;
+
+    if (table->count < table->nbuckets)
+        return;
+
+    nbuckets = table->nbuckets ? table->nbuckets * 2 : TRACK_INITIAL_BUCKETS;
+    buckets = (void **)calloc(nbuckets, sizeof(void *));
+    if (!buckets)
+        return;     // Longer chains then, still correct.
+
+    for (i = 0; i < table->nbuckets; i++) {
+        if (is_site) {
+            track_site *site, *next;
+
+            for (site = (track_site *)table->buckets[i]; site; site = next) {
+                next = site->next;
+                idx = site_bucket(site, nbuckets);
+                site->next = (track_site *)buckets[idx];
+                buckets[idx] = site;
+            }
+        } else {
+            track_sample *sample, *next;
+
+            for (sample = (track_sample *)table->buckets[i]; sample; sample = next) {
+                next = sample->next;
+                idx = sample_bucket(sample->key, nbuckets);
+                sample->next = (track_sample *)buckets[idx];
+                buckets[idx] = sample;
+            }
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+}
+
+static track_site *site_get(rc_mem_destructor *destructor, const void *caller)
+{
+    track_site *site;
+    size_t idx;
+
+    if (sites.nbuckets) {
+        idx = track_hash((const void *)destructor, caller, sites.nbuckets);
+        for (site = (track_site *)sites.buckets[idx]; site; site = site->next) {
+            if (site->destructor == destructor && site->caller == caller)
+                return site;
+        }
+    }
+
+    track_table_grow(&sites, 1);
+    if (!sites.nbuckets)
+        return NULL;
+
+    site = (track_site *)calloc(1, sizeof(track_site));
+    if (!site)
+        return NULL;
+
+    site->destructor = destructor;
+    site->caller = caller;
+
+    idx = site_bucket(site, sites.nbuckets);
+    site->next = (track_site *)sites.buckets[idx];
+    sites.buckets[idx] = site;
+    sites.count++;
+
+    return site;
+}
+
+static track_sample *sample_unlink(const void *key)
+{
+    track_sample **pp, *sample;
+
+    if (!samples.nbuckets)
+        return NULL;
+
+    pp = (track_sample **)&samples.buckets[sample_bucket(key, samples.nbuckets)];
+    for (; (sample = *pp) != NULL; pp = &sample->next) {
+        if (sample->key == key) {
+            *pp = sample->next;
+            samples.count--;
+            return sample;
+        }
+    }
+
+    return NULL;
+}
+
+static void sample_link(track_sample *sample)
+{
+    size_t idx;
+
+    track_table_grow(&samples, 0);
+
+    idx = sample_bucket(sample->key, samples.nbuckets);
+    sample->next = (track_sample *)samples.buckets[idx];
+    samples.buckets[idx] = sample;
+    samples.count++;
+}
+
+/* Account for 'objects' more objects of 'size' bytes, caller holds the lock */
+static void track_account(track_site *site, double objects, double bytes)
+{
+    site->live_objects += objects;
+    site->live_bytes += bytes;
+    if (site->live_bytes > site->peak_bytes)
+        site->peak_bytes = site->live_bytes;
+
+    live_objects += objects;
+    live_bytes += bytes;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+int rc_mem_track_enable(int enable, size_t sample_period)
+{
+    pthread_mutex_lock(&track_lock);
+    if (enable && !__atomic_load_n(&rc_track_active, __ATOMIC_RELAXED) &&
+        !track_start)
+        track_start = get_monotonic_time();
+
+    __atomic_store_n(&track_period, sample_period, __ATOMIC_RELAXED);
+    __atomic_store_n(&track_generation, track_generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&rc_track_active, enable != 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&track_lock);
+
+    return 0;
+}
+
+/* Exponentially distributed byte count with the given mean */
+static int64_t track_draw(size_t period)
+{
+    uint64_t x = local_random;
+    double u;
+
+    if (!x)
+        x = (uint64_t)(uintptr_t)&local_random ^ get_monotonic_time() ^
+            0x9E3779B97F4A7C15ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    local_random = x;
+
+    // Uniform in (0, 1]
+    u = (double)((x >> 11) + 1) / 9007199254740992.0;
+    return (int64_t)(-log(u) * (double)period) + 1;
+}
+
+double rc_track_sample(size_t size)
+{
+    size_t period = __atomic_load_n(&track_period, __ATOMIC_RELAXED);
+    unsigned int generation = __atomic_load_n(&track_generation, __ATOMIC_RELAXED);
+
+    if (!period)
+        return 1.0;
+
+    if (local_generation != generation) {
+        local_generation = generation;
+        local_countdown = track_draw(period);
+    }
+
+    local_countdown -= (int64_t)size;
+    if (local_countdown > 0)
+        return 0.0;
+
+    local_countdown = track_draw(period);
+
+    if (!size)
+        size = 1;
+    return 1.0 / (1.0 - exp(-(double)size / (double)period));
+}
+
+void rc_track_alloc(const void *key, size_t size, double weight,
+                    rc_mem_destructor *destructor, const void *caller)
+{
+    track_sample *sample;
+    track_site *site;
+
+    // Out of memory: the object is not tracked, rc_track_free() ignores it.
+    sample = (track_sample *)malloc(sizeof(track_sample));
+    if (!sample)
+        return;
+
+    pthread_mutex_lock(&track_lock);
+
+    site = site_get(destructor, caller);
+    if (!site) {
+        pthread_mutex_unlock(&track_lock);
+        free(sample);
+        return;
+    }
+
+    sample->key = key;
+    sample->size = size;
+    sample->weight = weight;
+    sample->site = site;
+    sample_link(sample);
+
+    track_account(site, weight, weight * size);
+    site->total_objects += weight;
+    site->total_bytes += weight * size;
+    total_objects += weight;
+    total_bytes += weight * size;
+
+    pthread_mutex_unlock(&track_lock);
+}
+
+void rc_track_free(const void *key)
+{
+    track_sample *sample;
+
+    pthread_mutex_lock(&track_lock);
+    sample = sample_unlink(key);
+    if (sample)
+        track_account(sample->site, -sample->weight,
+                      -sample->weight * sample->size);
+    pthread_mutex_unlock(&track_lock);
+
+    free(sample);
+}
+
+void *rc_track_detach(const void *key)
+{
+    track_sample *sample;
+
+    pthread_mutex_lock(&track_lock);
+    sample = sample_unlink(key);
+    pthread_mutex_unlock(&track_lock);
+
+    return sample;
+}
+
+void rc_track_attach(void *ptr, const void *key, size_t size)
+{
+    track_sample *sample = (track_sample *)ptr;
+
+    if (!sample)
+        return;
+
+    if (size == RC_TRACK_SAME_SIZE)
+        size = sample->size;
+
+    pthread_mutex_lock(&track_lock);
+    track_account(sample->site, 0,
+                  sample->weight * ((double)size - (double)sample->size));
+    sample->key = key;
+    sample->size = size;
+    sample_link(sample);
+    pthread_mutex_unlock(&track_lock);
+}
+
+static inline uint64_t track_round(double v)
+{
+    return v > 0.5 ? (uint64_t)(v + 0.5) : 0;
+}
+
+static void site_stats_get(const track_site *site, rc_mem_site_stats_t *stats)
+{
+    stats->destructor = site->destructor;
+    stats->caller = site->caller;
+    stats->live_objects = (size_t)track_round(site->live_objects);
+    stats->live_bytes = (size_t)track_round(site->live_bytes);
+    stats->peak_bytes = (size_t)track_round(site->peak_bytes);
+    stats->total_objects = track_round(site->total_objects);
+    stats->total_bytes = track_round(site->total_bytes);
+}
+
+static int site_compare(const void *a, const void *b)
+{
+    const rc_mem_site_stats_t *sa = (const rc_mem_site_stats_t *)a;
+    const rc_mem_site_stats_t *sb = (const rc_mem_site_stats_t *)b;
+
+    if (sa->live_bytes != sb->live_bytes)
+        return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    if (sa->total_bytes != sb->total_bytes)
+        return sa->total_bytes < sb->total_bytes ? 1 : -1;
+    return 0;
+}
+
+int rc_mem_track_stats(rc_mem_track_stats_t *stats,
+                       rc_mem_site_stats_t *site_stats, size_t *nsites)
+{
+    rc_mem_site_stats_t *all = NULL;
+    track_site *site;
+    size_t i, n = 0;
+    uint64_t now;
+
+    if (!stats || (site_stats && !nsites)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&track_lock);
+
+    if (site_stats && sites.count) {
+        all = (rc_mem_site_stats_t *)malloc(sites.count * sizeof(*all));
+        if (!all) {
+            pthread_mutex_unlock(&track_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for (i = 0; i < sites.nbuckets; i++) {
+            for (site = (track_site *)sites.buckets[i]; site; site = site->next)
+                site_stats_get(site, &all[n++]);
+        }
+    }
+
+    stats->live_objects = (size_t)track_round(live_objects);
+    stats->live_bytes = (size_t)track_round(live_bytes);
+    stats->peak_bytes = (size_t)track_round(peak_bytes);
+    stats->total_objects = track_round(total_objects);
+    stats->total_bytes = track_round(total_bytes);
+    stats->nsites = sites.count;
+
+    now = get_monotonic_time();
+    stats->elapsed = track_start ? now - track_start : 0;
+    stats->alloc_rate = stats->elapsed ?
+                        total_bytes * 1000000.0 / (double)stats->elapsed : 0.0;
+
+    pthread_mutex_unlock(&track_lock);
+
+    if (site_stats) {
+        qsort(all, n, sizeof(*all), site_compare);
+        if (n > *nsites)
+            n = *nsites;
+        if (n)
+            memcpy(site_stats, all, n * sizeof(*all));
+        *nsites = n;
+        free(all);
+    }
+
+    return 0;
+}
+
+void rc_mem_track_reset(void)
+{
+    track_site *site;
+    size_t i;
+
+    pthread_mutex_lock(&track_lock);
+
+    for (i = 0; i < sites.nbuckets; i++) {
+        for (site = (track_site *)sites.buckets[i]; site; site = site->next) {
+            site->peak_bytes = site->live_bytes;
+            site->total_objects = 0;
+            site->total_bytes = 0;
+        }
+    }
+
+    peak_bytes = live_bytes;
+    total_objects = 0;
+    total_bytes = 0;
+    track_start = get_monotonic_time();
+
+    pthread_mutex_unlock(&track_lock);
+}
+
+int rc_mem_track_dump(FILE *fp, size_t max_sites)
+{
+    rc_mem_track_stats_t stats;
+    rc_mem_site_stats_t *sites;
+    size_t i, n;
+
+    if (!fp) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = max_sites ? max_sites : 1;
+    sites = (rc_mem_site_stats_t *)calloc(n, sizeof(*sites));
+    if (!sites) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (rc_mem_track_stats(&stats, max_sites ? sites : NULL, &n) < 0) {
+        free(sites);
+        return -1;
+    }
+
+    fprintf(fp, "rc_mem: %zu live objects, %zu live bytes, peak %zu bytes\n",
+            stats.live_objects, stats.live_bytes, stats.peak_bytes);
+    fprintf(fp, "rc_mem: %llu objects, %llu bytes allocated in %.3f s, %.0f bytes/s\n",
+            (unsigned long long)stats.total_objects,
+            (unsigned long long)stats.total_bytes,
+            (double)stats.elapsed / 1000000.0, stats.alloc_rate);
+
+    if (max_sites) {
+        fprintf(fp, "%14s %14s %14s %14s  %-18s %s\n", "live objects",
+                "live bytes", "peak bytes", "total bytes", "caller", "destructor");
+        for (i = 0; i < n; i++)
+            fprintf(fp, "%14zu %14zu %14zu %14llu  %-18p %p\n",
+                    sites[i].live_objects, sites[i].live_bytes,
+                    sites[i].peak_bytes,
+                    (unsigned long long)sites[i].total_bytes,
+                    sites[i].caller,
+                    *(void **)&sites[i].destructor);
+    }
+
+    free(sites);
+    return 0;
+}
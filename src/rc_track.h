@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017-2018 iwhisper.io
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRYSTAL_RC_TRACK_H__
+#define __CRYSTAL_RC_TRACK_H__
+
+#include <stddef.h>
+
+#include "crystal/rc_mem.h"
+
+/*
+ * Sampled allocation tracking behind rc_alloc(), internal to the library.
+ *
+ * Each thread counts down the bytes it allocates and samples the
+ * allocation that takes the count below zero, then draws a new
+ * exponentially distributed count. A sample stands for 1 / p objects of
+ * its size, p being the probability that an object of that size was
+ * sampled, so per site sums of the weights estimate the real numbers.
+ * Samples are kept in a table keyed by the object header, and are looked
+ * up only for objects flagged as sampled.
+ */
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RC_TRACK_CALLER()   _ReturnAddress()
+#else
+#define RC_TRACK_CALLER()   __builtin_return_address(0)
+#endif
+
+/* Size argument of rc_track_attach() when the reallocation failed */
+#define RC_TRACK_SAME_SIZE  ((size_t)-1)
+
+/* Whether tracking is on, read without a lock */
+extern int rc_track_active;
+
+/**
+ * Decide whether an allocation of 'size' bytes by the calling thread is
+ * sampled. Call only while rc_track_active is set.
+ *
+ * @return The weight of the sample, or 0 if not sampled
+ */
+double rc_track_sample(size_t size);
+
+/**
+ * Record a sampled allocation.
+ *
+ * @param
+ *      key         Object header, the key of the sample
+ * @param
+ *      size        Size of the object
+ * @param
+ *      weight      Weight returned by rc_track_sample()
+ * @param
+ *      destructor  Destructor of the object, its type tag
+ * @param
+ *      caller      Return address of the allocating call
+ */
+void rc_track_alloc(const void *key, size_t size, double weight,
+                    rc_mem_destructor *destructor, const void *caller);
+
+/**
+ * Forget a sampled object being freed.
+ */
+void rc_track_free(const void *key);
+
+/**
+ * Take the sample of an object out of the table before reallocating it,
+ * as the old block may be handed out again right when it is released.
+ *
+ * @return The sample, to be passed to rc_track_attach()
+ */
+void *rc_track_detach(const void *key);
+
+/**
+ * Put a detached sample back, for the object at its new location.
+ *
+ * @param
+ *      sample      Sample returned by rc_track_detach(), may be NULL
+ * @param
+ *      key         New object header, or the old one if not moved
+ * @param
+ *      size        Size of the object now, or RC_TRACK_SAME_SIZE
+ */
+void rc_track_attach(void *sample, const void *key, size_t size);
+
+#endif /* __CRYSTAL_RC_TRACK_H__ */
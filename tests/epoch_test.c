@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <CUnit/Basic.h>
+
+#include "epoch.h"
+
+#define IDLE_OBJECTS    3
+#define POLL_LIMIT      100000
+
+static int reclaimed;
+
+static void count_reclaim(void *ptr)
+{
+    __atomic_fetch_add(&reclaimed, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static int reclaimed_count(void)
+{
+    return __atomic_load_n(&reclaimed, __ATOMIC_RELAXED);
+}
+
+/* Enter and leave sections until 'expected' objects are reclaimed */
+static int poll_reclaimed(int expected)
+{
+    int i;
+
+    for (i = 0; i < POLL_LIMIT && reclaimed_count() < expected; i++) {
+        CU_ASSERT_EQUAL(epoch_enter(), 0);
+        epoch_exit();
+    }
+
+    return reclaimed_count();
+}
+
+static void epoch_section_test(void)
+{
+    CU_ASSERT_FALSE(epoch_active());
+
+    CU_ASSERT_EQUAL(epoch_enter(), 0);
+    CU_ASSERT_TRUE(epoch_active());
+    CU_ASSERT_EQUAL(epoch_enter(), 0);
+    epoch_exit();
+    CU_ASSERT_TRUE(epoch_active());
+    epoch_exit();
+
+    CU_ASSERT_FALSE(epoch_active());
+}
+
+static void epoch_barrier_test(void)
+{
+    int i;
+
+    reclaimed = 0;
+
+    for (i = 0; i < 10; i++)
+        epoch_retire(malloc(16), count_reclaim);
+
+    epoch_barrier();
+    CU_ASSERT_EQUAL(reclaimed_count(), 10);
+}
+
+typedef struct idle_args {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int retired;
+    int done;
+} idle_args;
+
+static void *idle_routine(void *arg)
+{
+    idle_args *args = (idle_args *)arg;
+    int i;
+
+    for (i = 0; i < IDLE_OBJECTS; i++)
+        epoch_retire(malloc(16), count_reclaim);
+
+    // Stay alive, but never touch the epoch again.
+    pthread_mutex_lock(&args->lock);
+    args->retired = 1;
+    pthread_cond_broadcast(&args->cond);
+    while (!args->done)
+        pthread_cond_wait(&args->cond, &args->lock);
+    pthread_mutex_unlock(&args->lock);
+
+    return NULL;
+}
+
+static void epoch_idle_thread_test(void)
+{
+    idle_args args;
+    pthread_t thread;
+
+    reclaimed = 0;
+
+    pthread_mutex_init(&args.lock, NULL);
+    pthread_cond_init(&args.cond, NULL);
+    args.retired = 0;
+    args.done = 0;
+
+    CU_ASSERT_FATAL(pthread_create(&thread, NULL, idle_routine, &args) == 0);
+
+    pthread_mutex_lock(&args.lock);
+    while (!args.retired)
+        pthread_cond_wait(&args.cond, &args.lock);
+    pthread_mutex_unlock(&args.lock);
+
+    // Readers alone reclaim what the idle thread retired.
+    CU_ASSERT_EQUAL(poll_reclaimed(IDLE_OBJECTS), IDLE_OBJECTS);
+
+    pthread_mutex_lock(&args.lock);
+    args.done = 1;
+    pthread_cond_broadcast(&args.cond);
+    pthread_mutex_unlock(&args.lock);
+
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&args.cond);
+    pthread_mutex_destroy(&args.lock);
+}
+
+typedef struct reader_args {
+    int entered;
+    int leave;
+} reader_args;
+
+static void *reader_routine(void *arg)
+{
+    reader_args *args = (reader_args *)arg;
+
+    if (epoch_enter() != 0)
+        return NULL;
+
+    __atomic_store_n(&args->entered, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&args->leave, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    epoch_exit();
+    return NULL;
+}
+
+static void epoch_reader_test(void)
+{
+    reader_args args = { 0, 0 };
+    pthread_t thread;
+
+    reclaimed = 0;
+
+    CU_ASSERT_FATAL(pthread_create(&thread, NULL, reader_routine, &args) == 0);
+    while (!__atomic_load_n(&args.entered, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    epoch_retire(malloc(16), count_reclaim);
+
+    // Nothing goes while a reader is still inside its section.
+    CU_ASSERT_EQUAL(poll_reclaimed(1), 0);
+
+    __atomic_store_n(&args.leave, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    CU_ASSERT_EQUAL(poll_reclaimed(1), 1);
+}
+
+static int epoch_test_suite_init(void)
+{
+    return 0;
+}
+
+static int epoch_test_suite_cleanup(void)
+{
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "epoch_section_test", epoch_section_test },
+    { "epoch_barrier_test", epoch_barrier_test },
+    { "epoch_idle_thread_test", epoch_idle_thread_test },
+    { "epoch_reader_test", epoch_reader_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "epoch test",
+        epoch_test_suite_init,
+        epoch_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* epoch_test_suite_info(void)
+{
+    return suite;
+}
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <CUnit/Basic.h>
+
+#include "crystal.h"
+
+#define MAP_ITEMS       10000
+#define MAP_FILE        "linkedhashtable_map_test.dat"
+
+typedef struct map_item {
+    linked_hash_entry_t he;
+    char key[32];
+    char value[32];
+} map_item;
+
+static void put_item(linked_hashtable_t *htab, int index)
+{
+    map_item *item = (map_item *)rc_zalloc(sizeof(map_item), NULL);
+
+    if (!item)
+        return;
+
+    sprintf(item->key, "key-%d", index);
+    sprintf(item->value, "value-%d", index);
+
+    item->he.key = item->key;
+    item->he.keylen = strlen(item->key);
+    item->he.data = item;
+
+    linked_hashtable_put(htab, &item->he);
+    deref(item);
+}
+
+static const void *item_value(void *data, size_t *len, void *context)
+{
+    map_item *item = (map_item *)data;
+
+    (void)context;
+
+    *len = strlen(item->value) + 1;
+    return item->value;
+}
+
+static int count_cb(const void *key, size_t keylen, void *val, size_t vallen,
+                    void *context)
+{
+    int *count = (int *)context;
+
+    CU_ASSERT_EQUAL(memcmp(key, "key-", 4), 0);
+    CU_ASSERT_EQUAL(strncmp((const char *)val, "value-", 6), 0);
+    CU_ASSERT_EQUAL(vallen, strlen((const char *)val) + 1);
+    CU_ASSERT_EQUAL(keylen, vallen - 3);
+
+    (*count)++;
+    return 1;
+}
+
+static void check_map(linked_hashtable_map_t *map, int count)
+{
+    char key[32];
+    char value[32];
+    char *val;
+    size_t vallen;
+    int i;
+
+    CU_ASSERT_EQUAL(linked_hashtable_map_count(map), count);
+
+    for (i = 0; i < count; i++) {
+        sprintf(key, "key-%d", i);
+        sprintf(value, "value-%d", i);
+
+        val = (char *)linked_hashtable_map_get(map, key, strlen(key), &vallen);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(val);
+        CU_ASSERT_STRING_EQUAL(val, value);
+        CU_ASSERT_EQUAL(vallen, strlen(value) + 1);
+        CU_ASSERT_EQUAL((uintptr_t)val % 8, 0);
+    }
+
+    sprintf(key, "key-%d", count);
+    CU_ASSERT_PTR_NULL(linked_hashtable_map_get(map, key, strlen(key), NULL));
+}
+
+static void map_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_map_t *map;
+    char *val;
+    int count = 0;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < MAP_ITEMS; i++)
+        put_item(htab, i);
+
+    CU_ASSERT_EQUAL(linked_hashtable_save(htab, MAP_FILE, item_value, NULL), MAP_ITEMS);
+    deref(htab);
+
+    map = linked_hashtable_map(MAP_FILE, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+
+    check_map(map, MAP_ITEMS);
+    CU_ASSERT_EQUAL(linked_hashtable_map_foreach(map, count_cb, &count), MAP_ITEMS);
+    CU_ASSERT_EQUAL(count, MAP_ITEMS);
+
+    deref(map);
+
+    // Changes to a private mapping never reach the file
+    map = linked_hashtable_map(MAP_FILE, LINKED_HASHTABLE_MAP_PRIVATE);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+
+    val = (char *)linked_hashtable_map_get(map, "key-0", 5, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(val);
+    val[0] = 'V';
+    CU_ASSERT_STRING_EQUAL(linked_hashtable_map_get(map, "key-0", 5, NULL), "Value-0");
+    deref(map);
+
+    map = linked_hashtable_map(MAP_FILE, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+    check_map(map, MAP_ITEMS);
+    deref(map);
+
+    unlink(MAP_FILE);
+}
+
+static void hashtable_map_test(void)
+{
+    map_test(0);
+    map_test(LINKED_HASHTABLE_STRIPED);
+    map_test(LINKED_HASHTABLE_OPEN_ADDRESSING | LINKED_HASHTABLE_RANDOM_SEED);
+}
+
+static void hashtable_map_invalid_test(void)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_map_t *map;
+    FILE *fp;
+
+    htab = linked_hashtable_create(8, 0, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    // An empty table
+    CU_ASSERT_EQUAL(linked_hashtable_save(htab, MAP_FILE, item_value, NULL), 0);
+    map = linked_hashtable_map(MAP_FILE, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(map);
+    check_map(map, 0);
+    deref(map);
+
+    put_item(htab, 0);
+    put_item(htab, 1);
+    CU_ASSERT_EQUAL(linked_hashtable_save(htab, MAP_FILE, item_value, NULL), 2);
+    deref(htab);
+
+    // A truncated file is refused
+    CU_ASSERT_EQUAL(truncate(MAP_FILE, 100), 0);
+    CU_ASSERT_PTR_NULL(linked_hashtable_map(MAP_FILE, 0));
+
+    fp = fopen(MAP_FILE, "wb");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    fprintf(fp, "this is not a linked_hashtable map file, but long enough for a header");
+    fclose(fp);
+    CU_ASSERT_PTR_NULL(linked_hashtable_map(MAP_FILE, 0));
+
+    unlink(MAP_FILE);
+    CU_ASSERT_PTR_NULL(linked_hashtable_map(MAP_FILE, 0));
+}
+
+static int linkedhashtable_map_test_suite_init(void)
+{
+    return 0;
+}
+
+static int linkedhashtable_map_test_suite_cleanup(void)
+{
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "hashtable_map_test", hashtable_map_test },
+    { "hashtable_map_invalid_test", hashtable_map_invalid_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "linkedhashtable_map test",
+        linkedhashtable_map_test_suite_init,
+        linkedhashtable_map_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* linkedhashtable_map_test_suite_info(void)
+{
+    return suite;
+}
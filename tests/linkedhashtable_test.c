@@ -0,0 +1,1747 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <CUnit/Basic.h>
+
+#include "crystal.h"
+
+typedef struct test_item {
+    linked_hash_entry_t he;
+    int index;
+    char key[32];
+} test_item;
+
+static test_item *item_new(int index)
+{
+    test_item *item = (test_item *)rc_zalloc(sizeof(test_item), NULL);
+
+    if (!item)
+        return NULL;
+
+    item->index = index;
+    sprintf(item->key, "key-%d", index);
+
+    item->he.key = item->key;
+    item->he.keylen = strlen(item->key);
+    item->he.data = item;
+
+    return item;
+}
+
+static void *put_item(linked_hashtable_t *htab, int index)
+{
+    test_item *item = item_new(index);
+    void *rc;
+
+    rc = linked_hashtable_put(htab, &item->he);
+    deref(item);
+
+    return rc;
+}
+
+static test_item *get_item(linked_hashtable_t *htab, int index)
+{
+    char key[32];
+
+    sprintf(key, "key-%d", index);
+    return (test_item *)linked_hashtable_get(htab, key, strlen(key));
+}
+
+static int remove_item(linked_hashtable_t *htab, int index)
+{
+    char key[32];
+    void *val;
+
+    sprintf(key, "key-%d", index);
+    val = linked_hashtable_remove(htab, key, strlen(key));
+    deref(val);
+
+    return val != NULL;
+}
+
+static void check_items(linked_hashtable_t *htab, int start, int end, int step)
+{
+    int i;
+    test_item *item;
+
+    for (i = start; i < end; i += step) {
+        item = get_item(htab, i);
+        CU_ASSERT_PTR_NOT_NULL(item);
+        if (item) {
+            CU_ASSERT_EQUAL(item->index, i);
+            deref(item);
+        }
+    }
+}
+
+static void check_order(linked_hashtable_t *htab, int start, int end, int step)
+{
+    linked_hashtable_iterator_t it;
+    test_item *item;
+    int expected = start;
+    int rc;
+
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_has_next(&it)) {
+        rc = linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item);
+        CU_ASSERT_EQUAL(rc, 1);
+        if (rc != 1)
+            break;
+
+        CU_ASSERT_EQUAL(item->index, expected);
+        expected += step;
+        deref(item);
+    }
+
+    CU_ASSERT_EQUAL(expected, end);
+}
+
+static void basic_test(int flags)
+{
+    linked_hashtable_t *htab;
+    test_item *item;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+
+    for (i = 0; i < 100; i++)
+        CU_ASSERT_PTR_NOT_NULL(put_item(htab, i));
+
+    CU_ASSERT_FALSE(linked_hashtable_is_empty(htab));
+    check_items(htab, 0, 100, 1);
+    check_order(htab, 0, 100, 1);
+
+    CU_ASSERT_TRUE(linked_hashtable_exist(htab, "key-42", 6));
+    CU_ASSERT_FALSE(linked_hashtable_exist(htab, "key-100", 7));
+
+    // Replace keeps the position in the insertion order
+    item = item_new(42);
+    linked_hashtable_put(htab, &item->he);
+    CU_ASSERT_EQUAL(nrefs(item), 2);
+    deref(item);
+    check_order(htab, 0, 100, 1);
+
+    for (i = 1; i < 100; i += 2)
+        CU_ASSERT_TRUE(remove_item(htab, i));
+    CU_ASSERT_FALSE(remove_item(htab, 1));
+
+    check_items(htab, 0, 100, 2);
+    check_order(htab, 0, 100, 2);
+
+    linked_hashtable_clear(htab);
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+    CU_ASSERT_PTR_NULL(get_item(htab, 0));
+
+    deref(htab);
+}
+
+static void hashtable_iterator_test(void)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_iterator_t it;
+    test_item *item;
+    int i, rc;
+
+    htab = linked_hashtable_create(8, 0, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < 20; i++)
+        put_item(htab, i);
+
+    // Remove every entry through the iterator
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_has_next(&it)) {
+        rc = linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item);
+        CU_ASSERT_EQUAL(rc, 1);
+        deref(item);
+
+        CU_ASSERT_EQUAL(linked_hashtable_iterator_remove(&it), 1);
+    }
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+
+    // Concurrent modification is reported
+    put_item(htab, 0);
+    put_item(htab, 1);
+    linked_hashtable_iterate(htab, &it);
+    put_item(htab, 2);
+    rc = linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item);
+    CU_ASSERT_EQUAL(rc, -1);
+
+    deref(htab);
+}
+
+static void grow_test(int flags)
+{
+    linked_hashtable_t *htab;
+    int count = 200000;
+    int i;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < count; i++) {
+        put_item(htab, i);
+
+        // Lookups have to succeed in the middle of a resize too
+        if (i % 997 == 0)
+            check_items(htab, 0, i + 1, 97);
+    }
+
+    check_items(htab, 0, count, 1);
+    check_order(htab, 0, count, 1);
+
+    deref(htab);
+}
+
+static void shrink_test(int flags)
+{
+    linked_hashtable_t *htab;
+    int count = 100000;
+    int i;
+
+    htab = linked_hashtable_create(16, flags | LINKED_HASHTABLE_AUTO_SHRINK,
+                                   NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < count; i++)
+        put_item(htab, i);
+
+    for (i = 0; i < count; i++) {
+        if (i % 100 == 0)
+            continue;
+
+        CU_ASSERT_TRUE(remove_item(htab, i));
+    }
+
+    check_items(htab, 0, count, 100);
+    check_order(htab, 0, count, 100);
+
+    for (i = 0; i < count; i += 100)
+        CU_ASSERT_TRUE(remove_item(htab, i));
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+
+    // Still usable after shrinking down to the initial size
+    for (i = 0; i < 1000; i++)
+        put_item(htab, i);
+    check_items(htab, 0, 1000, 1);
+
+    deref(htab);
+}
+
+static uint32_t colliding_hash_code(const void *key, size_t len)
+{
+    return (uint32_t)len;
+}
+
+static void churn_test(int flags)
+{
+    linked_hashtable_t *htab;
+    int i, j;
+
+    // Few distinct hash codes: long chains, or long probe sequences
+    htab = linked_hashtable_create(16, flags, colliding_hash_code, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < 2000; i++)
+        put_item(htab, i);
+
+    // Remove and re-add repeatedly to pile up deleted slots
+    for (j = 0; j < 5; j++) {
+        for (i = 0; i < 2000; i += 3)
+            CU_ASSERT_TRUE(remove_item(htab, i));
+
+        check_items(htab, 1, 2000, 3);
+
+        for (i = 0; i < 2000; i += 3)
+            put_item(htab, i);
+    }
+
+    check_items(htab, 0, 2000, 1);
+
+    deref(htab);
+}
+
+#define THREADS             4
+#define ITEMS_PER_THREAD    20000
+
+typedef struct thread_args {
+    linked_hashtable_t *htab;
+    int base;
+    int errors;
+} thread_args;
+
+static void *writer_routine(void *arg)
+{
+    thread_args *args = (thread_args *)arg;
+    test_item *item;
+    int i;
+
+    for (i = args->base; i < args->base + ITEMS_PER_THREAD; i++) {
+        put_item(args->htab, i);
+
+        item = get_item(args->htab, i);
+        if (!item || item->index != i)
+            args->errors++;
+        deref(item);
+
+        // Also read what the other threads are writing
+        deref(get_item(args->htab, (i + ITEMS_PER_THREAD) %
+                                   (THREADS * ITEMS_PER_THREAD)));
+
+        if (i % 2 && !remove_item(args->htab, i))
+            args->errors++;
+    }
+
+    return NULL;
+}
+
+static void *iterator_routine(void *arg)
+{
+    thread_args *args = (thread_args *)arg;
+    linked_hashtable_iterator_t it;
+    test_item *item;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        linked_hashtable_iterate(args->htab, &it);
+        while (linked_hashtable_iterator_has_next(&it)) {
+            if (linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item) != 1)
+                break;
+            deref(item);
+        }
+    }
+
+    return NULL;
+}
+
+static void concurrent_test(int flags)
+{
+    linked_hashtable_t *htab;
+    pthread_t threads[THREADS + 1];
+    thread_args args[THREADS + 1];
+    test_item *item;
+    int i;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i <= THREADS; i++) {
+        args[i].htab = htab;
+        args[i].base = i * ITEMS_PER_THREAD;
+        args[i].errors = 0;
+
+        pthread_create(&threads[i], NULL,
+                       i < THREADS ? writer_routine : iterator_routine, &args[i]);
+    }
+
+    for (i = 0; i <= THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(args[i].errors, 0);
+    }
+
+    check_items(htab, 0, THREADS * ITEMS_PER_THREAD, 2);
+    for (i = 1; i < THREADS * ITEMS_PER_THREAD; i += 2) {
+        item = get_item(htab, i);
+        CU_ASSERT_PTR_NULL(item);
+        deref(item);
+    }
+
+    deref(htab);
+}
+
+static void hashtable_basic_test(void)
+{
+    basic_test(LINKED_HASHTABLE_SYNCED);
+}
+
+static void hashtable_grow_test(void)
+{
+    grow_test(LINKED_HASHTABLE_SYNCED);
+}
+
+static void hashtable_shrink_test(void)
+{
+    shrink_test(LINKED_HASHTABLE_SYNCED);
+}
+
+static void hashtable_churn_test(void)
+{
+    churn_test(0);
+}
+
+static void hashtable_open_addressing_test(void)
+{
+    basic_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    grow_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    shrink_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    churn_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+}
+
+static void hashtable_concurrent_test(void)
+{
+    concurrent_test(LINKED_HASHTABLE_SYNCED);
+    concurrent_test(LINKED_HASHTABLE_SYNCED | LINKED_HASHTABLE_OPEN_ADDRESSING);
+}
+
+static void hashtable_striped_test(void)
+{
+    basic_test(LINKED_HASHTABLE_STRIPED);
+    grow_test(LINKED_HASHTABLE_STRIPED);
+    shrink_test(LINKED_HASHTABLE_STRIPED);
+    concurrent_test(LINKED_HASHTABLE_STRIPED);
+    concurrent_test(LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_OPEN_ADDRESSING);
+}
+
+/* Binary keys of every length up to 64 bytes, sharing long prefixes */
+static void binary_key_test(int flags)
+{
+    linked_hashtable_t *htab;
+    static uint8_t keys[64][64];
+    test_item *item;
+    int i, j;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < 64; i++) {
+        for (j = 0; j <= i; j++)
+            keys[i][j] = (uint8_t)(j == i ? 0x80 + i : j * 2);
+
+        item = item_new(i);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+        item->he.key = keys[i];
+        item->he.keylen = i + 1;
+
+        linked_hashtable_put(htab, &item->he);
+        deref(item);
+    }
+
+    for (i = 0; i < 64; i++) {
+        item = (test_item *)linked_hashtable_get(htab, keys[i], i + 1);
+        CU_ASSERT_PTR_NOT_NULL(item);
+        if (item) {
+            CU_ASSERT_EQUAL(item->index, i);
+            deref(item);
+        }
+
+        // Same bytes, one shorter: a different key
+        if (i > 0)
+            CU_ASSERT_FALSE(linked_hashtable_exist(htab, keys[i], i));
+    }
+
+    deref(htab);
+}
+
+static void hashtable_hash_test(void)
+{
+    binary_key_test(0);
+    binary_key_test(LINKED_HASHTABLE_RANDOM_SEED);
+    basic_test(LINKED_HASHTABLE_RANDOM_SEED);
+    grow_test(LINKED_HASHTABLE_RANDOM_SEED);
+}
+
+static void hashtable_lockfree_read_test(void)
+{
+    linked_hashtable_t *htab;
+
+    basic_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    grow_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    shrink_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    churn_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    concurrent_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    concurrent_test(LINKED_HASHTABLE_LOCKFREE_READ | LINKED_HASHTABLE_STRIPED);
+
+    htab = linked_hashtable_create(16, LINKED_HASHTABLE_LOCKFREE_READ |
+                                   LINKED_HASHTABLE_OPEN_ADDRESSING, NULL, NULL);
+    CU_ASSERT_PTR_NULL(htab);
+}
+
+typedef struct evict_log {
+    int count;
+    int last;
+} evict_log;
+
+static void evicted_cb(linked_hash_entry_t *entry, void *context)
+{
+    evict_log *log = (evict_log *)context;
+
+    __sync_add_and_fetch(&log->count, 1);
+    __sync_lock_test_and_set(&log->last, ((test_item *)entry->data)->index);
+}
+
+/* Cost of an item is its index modulo 10, plus one */
+static size_t item_cost(linked_hash_entry_t *entry)
+{
+    return ((test_item *)entry->data)->index % 10 + 1;
+}
+
+static int count_items(linked_hashtable_t *htab)
+{
+    linked_hashtable_iterator_t it;
+    test_item *item;
+    int count = 0;
+
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item) == 1) {
+        deref(item);
+        count++;
+    }
+
+    return count;
+}
+
+static void *bounded_writer_routine(void *arg)
+{
+    thread_args *args = (thread_args *)arg;
+    int i;
+
+    for (i = args->base; i < args->base + ITEMS_PER_THREAD; i++) {
+        put_item(args->htab, i);
+        deref(get_item(args->htab, i - 500));
+    }
+
+    return NULL;
+}
+
+static void bounded_concurrent_test(int flags)
+{
+    linked_hashtable_t *htab;
+    pthread_t threads[THREADS];
+    thread_args args[THREADS];
+    evict_log log = { 0, -1 };
+    int i;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    linked_hashtable_set_limit(htab, 1000, 0, NULL, evicted_cb, &log);
+
+    for (i = 0; i < THREADS; i++) {
+        args[i].htab = htab;
+        args[i].base = i * ITEMS_PER_THREAD;
+        pthread_create(&threads[i], NULL, bounded_writer_routine, &args[i]);
+    }
+
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    CU_ASSERT_EQUAL(count_items(htab), 1000);
+    CU_ASSERT_EQUAL(log.count, THREADS * ITEMS_PER_THREAD - 1000);
+
+    deref(htab);
+}
+
+static void lru_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_iterator_t it;
+    evict_log log = { 0, -1 };
+    int order[] = { 4, 5, 6, 7, 8, 9, 0, 10, 2, 11 };
+    test_item *item;
+    int i;
+
+    htab = linked_hashtable_create(16, flags | LINKED_HASHTABLE_ACCESS_ORDER,
+                                   NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    CU_ASSERT_EQUAL(linked_hashtable_set_limit(htab, 10, 0, NULL, evicted_cb, &log), 0);
+
+    for (i = 0; i < 10; i++)
+        put_item(htab, i);
+    CU_ASSERT_EQUAL(log.count, 0);
+
+    // A hit makes 0 the most recently used entry, so 1 goes first
+    deref(get_item(htab, 0));
+    put_item(htab, 10);
+    CU_ASSERT_EQUAL(log.count, 1);
+    CU_ASSERT_EQUAL(log.last, 1);
+    CU_ASSERT_FALSE(linked_hashtable_exist(htab, "key-1", 5));
+    CU_ASSERT_TRUE(linked_hashtable_exist(htab, "key-0", 5));
+
+    // Replacing an entry counts as an access too
+    put_item(htab, 2);
+    put_item(htab, 11);
+    CU_ASSERT_EQUAL(log.last, 3);
+
+    i = 0;
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item) == 1) {
+        CU_ASSERT(i < 10 && item->index == order[i]);
+        deref(item);
+        i++;
+    }
+    CU_ASSERT_EQUAL(i, 10);
+
+    // Lowering the limit evicts right away, in LRU order
+    CU_ASSERT_EQUAL(linked_hashtable_set_limit(htab, 3, 0, NULL, evicted_cb, &log), 0);
+    CU_ASSERT_EQUAL(log.count, 9);
+    CU_ASSERT_EQUAL(count_items(htab), 3);
+    check_items(htab, 10, 12, 1);
+    check_items(htab, 2, 3, 1);
+
+    deref(htab);
+}
+
+static void hashtable_lru_test(void)
+{
+    linked_hashtable_t *htab;
+    evict_log log = { 0, -1 };
+    int i;
+
+    lru_test(0);
+    lru_test(LINKED_HASHTABLE_SYNCED);
+    lru_test(LINKED_HASHTABLE_STRIPED);
+    lru_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+
+    // Without access order the oldest entry is evicted, hits or not
+    htab = linked_hashtable_create(16, 0, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    linked_hashtable_set_limit(htab, 100, 0, NULL, evicted_cb, &log);
+
+    for (i = 0; i < 1000; i++) {
+        put_item(htab, i);
+        deref(get_item(htab, 0));
+    }
+    CU_ASSERT_EQUAL(log.count, 900);
+    check_order(htab, 900, 1000, 1);
+    deref(htab);
+
+    // Bounded by cost: items 0..9 cost 1..10, 55 in total
+    log.count = 0;
+    htab = linked_hashtable_create(16, 0, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    linked_hashtable_set_limit(htab, 0, 55, item_cost, evicted_cb, &log);
+
+    for (i = 0; i < 10; i++)
+        put_item(htab, i);
+    CU_ASSERT_EQUAL(log.count, 0);
+
+    put_item(htab, 10);     // cost 1
+    CU_ASSERT_EQUAL(log.count, 1);
+    put_item(htab, 19);     // cost 10, evicts items 1..4
+    CU_ASSERT_EQUAL(log.count, 5);
+    CU_ASSERT_EQUAL(log.last, 4);
+    check_items(htab, 5, 11, 1);
+
+    // A single entry above the bound does not stay either
+    linked_hashtable_set_limit(htab, 0, 5, item_cost, NULL, NULL);
+    put_item(htab, 29);
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+
+    deref(htab);
+
+    concurrent_test(LINKED_HASHTABLE_SYNCED | LINKED_HASHTABLE_ACCESS_ORDER);
+    concurrent_test(LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_ACCESS_ORDER);
+    bounded_concurrent_test(LINKED_HASHTABLE_SYNCED | LINKED_HASHTABLE_ACCESS_ORDER);
+    bounded_concurrent_test(LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_ACCESS_ORDER);
+    bounded_concurrent_test(LINKED_HASHTABLE_LOCKFREE_READ);
+
+    htab = linked_hashtable_create(16, LINKED_HASHTABLE_LOCKFREE_READ |
+                                   LINKED_HASHTABLE_ACCESS_ORDER, NULL, NULL);
+    CU_ASSERT_PTR_NULL(htab);
+}
+
+static void *put_item_ttl(linked_hashtable_t *htab, int index, uint32_t ttl)
+{
+    test_item *item = item_new(index);
+    void *rc;
+
+    rc = linked_hashtable_put_ttl(htab, &item->he, ttl);
+    deref(item);
+
+    return rc;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    uint64_t now;
+
+    while ((now = get_monotonic_time()) < deadline)
+        usleep((useconds_t)(deadline - now));
+}
+
+/*
+ * Returns -1 without checking anything if the puts alone took so long, on
+ * a loaded machine, that the entries could have expired already.
+ */
+static int ttl_round(int flags, uint32_t ttl)
+{
+    linked_hashtable_t *htab;
+    evict_log log = { 0, -1 };
+    uint64_t start;
+    int i;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    linked_hashtable_set_limit(htab, 0, 0, NULL, evicted_cb, &log);
+
+    CU_ASSERT_PTR_NULL(put_item_ttl(htab, 0, 0));
+
+    start = get_monotonic_time();
+    for (i = 0; i < 10; i++)
+        CU_ASSERT_PTR_NOT_NULL(put_item_ttl(htab, i, ttl));
+    for (i = 10; i < 20; i++)
+        put_item(htab, i);
+    put_item_ttl(htab, 20, 60000);
+
+    if (get_monotonic_time() - start >= (uint64_t)ttl * 1000 / 2) {
+        deref(htab);
+        return -1;
+    }
+
+    check_items(htab, 0, 21, 1);
+
+    // Putting the key again without a TTL makes it permanent
+    put_item(htab, 5);
+
+    sleep_until(get_monotonic_time() + ((uint64_t)ttl + 2) * 1000);
+
+    // Expired entries are misses, and removed on access
+    CU_ASSERT_PTR_NULL(get_item(htab, 0));
+    CU_ASSERT_FALSE(linked_hashtable_exist(htab, "key-1", 5));
+    CU_ASSERT_EQUAL(log.count, 2);
+    CU_ASSERT_EQUAL(count_items(htab), 12);
+
+    CU_ASSERT_EQUAL(linked_hashtable_expire(htab), 7);
+    CU_ASSERT_EQUAL(log.count, 9);
+    CU_ASSERT_EQUAL(linked_hashtable_expire(htab), 0);
+    check_items(htab, 10, 21, 1);
+    check_items(htab, 5, 6, 1);
+
+    // Puts remove a few expired entries each
+    for (i = 100; i < 200; i++)
+        put_item_ttl(htab, i, ttl / 2);
+    sleep_until(get_monotonic_time() + ((uint64_t)ttl / 2 + 2) * 1000);
+    for (i = 200; i < 230; i++)
+        put_item(htab, i);
+    CU_ASSERT_EQUAL(log.count, 109);
+    CU_ASSERT_EQUAL(count_items(htab), 42);
+
+    deref(htab);
+    return 0;
+}
+
+static void ttl_test(int flags)
+{
+    uint32_t ttl;
+
+    // Retry with a longer TTL rather than fail on a slow machine
+    for (ttl = 100; ttl < 100000; ttl *= 4) {
+        if (ttl_round(flags, ttl) == 0)
+            break;
+    }
+
+    CU_ASSERT_TRUE(ttl < 100000);
+}
+
+#define TTL_ITEMS_PER_THREAD    5000
+
+static void *ttl_writer_routine(void *arg)
+{
+    thread_args *args = (thread_args *)arg;
+    int i;
+
+    // Odd items expire right away, even ones are removed before they do.
+    for (i = args->base; i < args->base + TTL_ITEMS_PER_THREAD; i++) {
+        put_item_ttl(args->htab, i, (i & 1) ? 1 : 60000);
+        if (!(i & 1) && remove_item(args->htab, i) != 1)
+            args->errors++;
+    }
+
+    return NULL;
+}
+
+static void ttl_concurrent_test(int flags)
+{
+    linked_hashtable_t *htab;
+    pthread_t threads[THREADS];
+    thread_args args[THREADS];
+    int i;
+
+    htab = linked_hashtable_create(16, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < THREADS; i++) {
+        args[i].htab = htab;
+        args[i].base = i * TTL_ITEMS_PER_THREAD;
+        args[i].errors = 0;
+        pthread_create(&threads[i], NULL, ttl_writer_routine, &args[i]);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(args[i].errors, 0);
+    }
+
+    // Whatever the puts did not remove yet leaves through the expiry heap.
+    sleep_until(get_monotonic_time() + 5000);
+    linked_hashtable_expire(htab);
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+    CU_ASSERT_EQUAL(count_items(htab), 0);
+
+    deref(htab);
+}
+
+static void hashtable_ttl_test(void)
+{
+    ttl_test(0);
+    ttl_test(LINKED_HASHTABLE_SYNCED);
+    ttl_test(LINKED_HASHTABLE_STRIPED);
+    ttl_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    ttl_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    ttl_test(LINKED_HASHTABLE_ACCESS_ORDER);
+
+    ttl_concurrent_test(LINKED_HASHTABLE_SYNCED);
+    ttl_concurrent_test(LINKED_HASHTABLE_STRIPED);
+}
+
+#define BATCH_ITEMS     200
+
+static void batch_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_iterator_t it;
+    linked_hash_entry_t *entries[BATCH_ITEMS];
+    test_item *items[BATCH_ITEMS];
+    char key_buf[BATCH_ITEMS][32];
+    const void *keys[BATCH_ITEMS];
+    size_t keylens[BATCH_ITEMS];
+    uint32_t hash_codes[BATCH_ITEMS];
+    void *vals[BATCH_ITEMS];
+    test_item *item;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    // Even items first, then all of them: odd ones are new, even ones replaced
+    for (i = 0; i < BATCH_ITEMS; i++) {
+        items[i] = item_new(i);
+        entries[i] = &items[i]->he;
+        strcpy(key_buf[i], items[i]->key);
+        keys[i] = key_buf[i];
+        keylens[i] = strlen(key_buf[i]);
+    }
+
+    for (i = 0; i < BATCH_ITEMS / 2; i++)
+        entries[i] = &items[i * 2]->he;
+    CU_ASSERT_EQUAL(linked_hashtable_put_many(htab, entries, NULL, BATCH_ITEMS / 2),
+                    BATCH_ITEMS / 2);
+    check_order(htab, 0, BATCH_ITEMS, 2);
+
+    for (i = 0; i < BATCH_ITEMS; i++) {
+        entries[i] = &items[i]->he;
+        hash_codes[i] = linked_hashtable_hash_code(htab, keys[i], keylens[i]);
+    }
+    CU_ASSERT_EQUAL(linked_hashtable_put_many(htab, entries, hash_codes, BATCH_ITEMS),
+                    BATCH_ITEMS);
+    CU_ASSERT_EQUAL(count_items(htab), BATCH_ITEMS);
+    check_items(htab, 0, BATCH_ITEMS, 1);
+
+    // A later entry of the same key wins
+    item = item_new(7);
+    item->index = -7;
+    entries[0] = &items[7]->he;
+    entries[1] = &item->he;
+    CU_ASSERT_EQUAL(linked_hashtable_put_many(htab, entries, NULL, 2), 2);
+    deref(item);
+    item = get_item(htab, 7);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+    CU_ASSERT_EQUAL(item->index, -7);
+    deref(item);
+
+    for (i = 0; i < BATCH_ITEMS; i++)
+        deref(items[i]);
+
+    deref(linked_hashtable_remove(htab, "key-42", 6));
+    CU_ASSERT_EQUAL(linked_hashtable_get_many(htab, keys, keylens, NULL,
+                                              BATCH_ITEMS, vals), BATCH_ITEMS - 1);
+    for (i = 0; i < BATCH_ITEMS; i++) {
+        item = (test_item *)vals[i];
+        if (i == 42) {
+            CU_ASSERT_PTR_NULL(item);
+        } else {
+            CU_ASSERT_PTR_NOT_NULL(item);
+            if (item)
+                CU_ASSERT_EQUAL(item->index, i == 7 ? -7 : i);
+        }
+        deref(item);
+    }
+
+    CU_ASSERT_EQUAL(linked_hashtable_get_many(htab, keys, keylens, hash_codes,
+                                              BATCH_ITEMS, vals), BATCH_ITEMS - 1);
+    for (i = 0; i < BATCH_ITEMS; i++)
+        deref(vals[i]);
+
+    // Remove the first half handing the data over, the rest without
+    CU_ASSERT_EQUAL(linked_hashtable_remove_many(htab, keys, keylens, hash_codes,
+                                                 BATCH_ITEMS / 2, vals),
+                    BATCH_ITEMS / 2 - 1);
+    for (i = 0; i < BATCH_ITEMS / 2; i++) {
+        CU_ASSERT((i == 42) == (vals[i] == NULL));
+        // Lock-free tables drop their reference a grace period later
+        if (vals[i] && !(flags & LINKED_HASHTABLE_LOCKFREE_READ))
+            CU_ASSERT_EQUAL(nrefs(vals[i]), 1);
+        deref(vals[i]);
+    }
+    // The replaced even items kept their place ahead of the odd ones
+    if (!(flags & LINKED_HASHTABLE_ACCESS_ORDER)) {
+        i = BATCH_ITEMS / 2;
+        linked_hashtable_iterate(htab, &it);
+        while (linked_hashtable_iterator_next(&it, NULL, NULL, (void **)&item) == 1) {
+            CU_ASSERT_EQUAL(item->index, i);
+            i += 2;
+            if (i == BATCH_ITEMS)
+                i = BATCH_ITEMS / 2 + 1;
+            deref(item);
+        }
+        CU_ASSERT_EQUAL(i, BATCH_ITEMS + 1);
+    }
+
+    CU_ASSERT_EQUAL(linked_hashtable_remove_many(htab, keys, keylens, NULL,
+                                                 BATCH_ITEMS, NULL), BATCH_ITEMS / 2);
+    CU_ASSERT_TRUE(linked_hashtable_is_empty(htab));
+
+    CU_ASSERT_EQUAL(linked_hashtable_get_many(htab, keys, keylens, NULL, 0, vals), 0);
+    keylens[3] = 0;
+    CU_ASSERT_EQUAL(linked_hashtable_get_many(htab, keys, keylens, NULL, 5, vals), -1);
+
+    deref(htab);
+}
+
+static void hashtable_batch_test(void)
+{
+    batch_test(0);
+    batch_test(LINKED_HASHTABLE_SYNCED);
+    batch_test(LINKED_HASHTABLE_STRIPED);
+    batch_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    batch_test(LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_OPEN_ADDRESSING);
+    batch_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    batch_test(LINKED_HASHTABLE_ACCESS_ORDER);
+    batch_test(LINKED_HASHTABLE_RANDOM_SEED);
+}
+
+typedef struct visit_log {
+    int count;
+    int last;
+    int nrefs;
+    int stop;
+} visit_log;
+
+static void visit_cb(const void *key, size_t keylen, void *data, void *context)
+{
+    visit_log *log = (visit_log *)context;
+    test_item *item = (test_item *)data;
+
+    CU_ASSERT_EQUAL(keylen, strlen(item->key));
+    CU_ASSERT_EQUAL(memcmp(key, item->key, keylen), 0);
+
+    log->count++;
+    log->last = item->index;
+    log->nrefs = nrefs(item);
+}
+
+static int foreach_cb(const void *key, size_t keylen, void *data, void *context)
+{
+    visit_log *log = (visit_log *)context;
+
+    visit_cb(key, keylen, data, context);
+    return log->count == log->stop;
+}
+
+static void visit_test(int flags)
+{
+    linked_hashtable_t *htab;
+    visit_log log = { 0, -1, 0, 0 };
+    test_item *item;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < 100; i++)
+        put_item(htab, i);
+
+    // The data is borrowed, the table holds the only reference
+    CU_ASSERT_EQUAL(linked_hashtable_visit(htab, "key-42", 6, visit_cb, &log), 1);
+    CU_ASSERT_EQUAL(log.count, 1);
+    CU_ASSERT_EQUAL(log.last, 42);
+    CU_ASSERT_EQUAL(log.nrefs, 1);
+
+    CU_ASSERT_EQUAL(linked_hashtable_visit(htab, "key-100", 7, visit_cb, &log), 0);
+    CU_ASSERT_EQUAL(log.count, 1);
+
+    log.count = 0;
+    CU_ASSERT_EQUAL(linked_hashtable_foreach(htab, foreach_cb, &log), 100);
+    CU_ASSERT_EQUAL(log.count, 100);
+    CU_ASSERT_EQUAL(log.last, (flags & LINKED_HASHTABLE_ACCESS_ORDER) ? 42 : 99);
+
+    log.count = 0;
+    log.stop = 10;
+    CU_ASSERT_EQUAL(linked_hashtable_foreach(htab, foreach_cb, &log), 10);
+    CU_ASSERT_EQUAL(log.last, 9);
+
+    // Expired entries are skipped
+    item = item_new(100);
+    linked_hashtable_put_ttl(htab, &item->he, 1);
+    deref(item);
+    usleep(10000);
+
+    log.count = 0;
+    log.stop = 0;
+    CU_ASSERT_EQUAL(linked_hashtable_visit(htab, "key-100", 7, visit_cb, &log), 0);
+    CU_ASSERT_EQUAL(linked_hashtable_foreach(htab, foreach_cb, &log), 100);
+
+    deref(htab);
+}
+
+static void hashtable_visit_test(void)
+{
+    visit_test(0);
+    visit_test(LINKED_HASHTABLE_SYNCED);
+    visit_test(LINKED_HASHTABLE_STRIPED);
+    visit_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    visit_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    visit_test(LINKED_HASHTABLE_ACCESS_ORDER);
+}
+
+typedef struct inline_item {
+    linked_hash_inline_entry_t he;
+    int index;
+} inline_item;
+
+static void inline_key_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_iterator_t it;
+    inline_item *item;
+    char key[64];
+    void *k;
+    size_t keylen;
+    int i;
+
+    htab = linked_hashtable_create(8, flags | LINKED_HASHTABLE_INLINE_KEYS,
+                                   NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    // No puts before the table knows how much room the entries have
+    item = (inline_item *)rc_zalloc(sizeof(inline_item), NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+    item->he.entry.key = "inline-key";
+    item->he.entry.keylen = 10;
+    item->he.entry.data = item;
+    CU_ASSERT_PTR_NULL(linked_hashtable_put(htab, &item->he.entry));
+    CU_ASSERT_EQUAL(errno, EINVAL);
+
+    CU_ASSERT_EQUAL(linked_hashtable_set_entry_size(htab, sizeof(linked_hash_entry_t)), -1);
+    CU_ASSERT_EQUAL(linked_hashtable_set_entry_size(htab,
+                        sizeof(linked_hash_inline_entry_t)), 0);
+    CU_ASSERT_PTR_NOT_NULL(linked_hashtable_put(htab, &item->he.entry));
+    CU_ASSERT_EQUAL(linked_hashtable_set_entry_size(htab,
+                        sizeof(linked_hash_inline_entry_t)), -1);
+    CU_ASSERT_EQUAL(errno, EBUSY);
+    CU_ASSERT_PTR_EQUAL(linked_hashtable_remove(htab, "inline-key", 10), item);
+    deref(item);
+    deref(item);
+
+    // Every fourth key is too long to be copied, and stays with the caller
+    for (i = 0; i < 100; i++) {
+        item = (inline_item *)rc_zalloc(sizeof(inline_item), NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+        item->index = i;
+
+        if (i % 4 == 3) {
+            sprintf(key, "long-inline-key-%030d", i);
+            item->he.entry.key = strdup(key);
+        } else {
+            sprintf(key, "inline-key-%d", i);
+            item->he.entry.key = key;
+        }
+        item->he.entry.keylen = strlen(key);
+        item->he.entry.data = item;
+
+        linked_hashtable_put(htab, &item->he.entry);
+        memset(key, 0, sizeof(key));
+
+        CU_ASSERT((i % 4 == 3) == (item->he.entry.key != item->he.__key));
+        deref(item);
+    }
+
+    for (i = 0; i < 100; i++) {
+        if (i % 4 == 3)
+            sprintf(key, "long-inline-key-%030d", i);
+        else
+            sprintf(key, "inline-key-%d", i);
+        item = (inline_item *)linked_hashtable_get(htab, key, strlen(key));
+        CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+        CU_ASSERT_EQUAL(item->index, i);
+        deref(item);
+    }
+
+    i = 0;
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_next(&it, &k, &keylen, (void **)&item) == 1) {
+        CU_ASSERT_EQUAL(item->index, i);
+        CU_ASSERT_PTR_EQUAL(k, item->he.entry.key);
+        if (i % 4 == 3)
+            sprintf(key, "long-inline-key-%030d", i);
+        else
+            sprintf(key, "inline-key-%d", i);
+        CU_ASSERT_EQUAL(keylen, strlen(key));
+        CU_ASSERT_EQUAL(memcmp(k, key, keylen), 0);
+        deref(item);
+        i++;
+    }
+    CU_ASSERT_EQUAL(i, 100);
+
+    for (i = 0; i < 100; i += 4) {
+        sprintf(key, "inline-key-%d", i);
+        deref(linked_hashtable_remove(htab, key, strlen(key)));
+    }
+    CU_ASSERT_EQUAL(count_items(htab), 75);
+
+    linked_hashtable_iterate(htab, &it);
+    while (linked_hashtable_iterator_next(&it, &k, &keylen, (void **)&item) == 1) {
+        if (item->index % 4 == 3)
+            free(k);
+        deref(item);
+    }
+
+    deref(htab);
+}
+
+static void hashtable_inline_key_test(void)
+{
+    inline_key_test(0);
+    inline_key_test(LINKED_HASHTABLE_SYNCED);
+    inline_key_test(LINKED_HASHTABLE_STRIPED);
+    inline_key_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    inline_key_test(LINKED_HASHTABLE_LOCKFREE_READ);
+}
+
+#define KEY_LENGTHS     40
+
+static void hashtable_key_length_test(void)
+{
+    linked_hashtable_t *htab;
+    inline_item *items[KEY_LENGTHS + 1];
+    char keys[KEY_LENGTHS + 1][KEY_LENGTHS];
+    char key[KEY_LENGTHS];
+    size_t len, i;
+
+    htab = linked_hashtable_create(8, LINKED_HASHTABLE_INLINE_KEYS, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    CU_ASSERT_EQUAL(linked_hashtable_set_entry_size(htab,
+                        sizeof(linked_hash_inline_entry_t)), 0);
+
+    // Keys of every length around the compare fast paths, inline or not
+    for (len = 1; len <= KEY_LENGTHS; len++) {
+        for (i = 0; i < len; i++)
+            keys[len][i] = (char)('a' + (len + i) % 26);
+
+        items[len] = (inline_item *)rc_zalloc(sizeof(inline_item), NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(items[len]);
+        items[len]->he.entry.key = keys[len];
+        items[len]->he.entry.keylen = len;
+        items[len]->he.entry.data = items[len];
+        linked_hashtable_put(htab, &items[len]->he.entry);
+    }
+
+    for (len = 1; len <= KEY_LENGTHS; len++) {
+        memcpy(key, keys[len], len);
+        CU_ASSERT_PTR_EQUAL(linked_hashtable_get(htab, key, len), items[len]);
+        deref(items[len]);
+
+        // A difference at any position is a miss.
+        for (i = 0; i < len; i++) {
+            key[i] ^= 0x20;
+            CU_ASSERT_FALSE(linked_hashtable_exist(htab, key, len));
+            key[i] ^= 0x20;
+        }
+    }
+
+    for (len = 1; len <= KEY_LENGTHS; len++)
+        deref(items[len]);
+
+    deref(htab);
+}
+
+#define SPLIT_ITEMS     1000
+#define SPLIT_RANGES    4
+
+typedef struct range_args {
+    linked_hashtable_range_t *range;
+    int *seen;
+    int rc;
+} range_args;
+
+static void *range_routine(void *arg)
+{
+    range_args *args = (range_args *)arg;
+    void *data[7];
+    void *keys[7];
+    size_t keylens[7];
+    test_item *item;
+    int rc;
+    int i;
+
+    while ((rc = linked_hashtable_range_next(args->range, keys, keylens, data, 7)) > 0) {
+        for (i = 0; i < rc; i++) {
+            item = (test_item *)data[i];
+            if (keys[i] != item->key || keylens[i] != strlen(item->key))
+                args->rc = -1;
+
+            __atomic_fetch_add(&args->seen[item->index], 1, __ATOMIC_RELAXED);
+            deref(item);
+        }
+    }
+
+    if (rc < 0)
+        args->rc = -1;
+
+    return NULL;
+}
+
+static void split_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_iterator_t it;
+    linked_hashtable_range_t ranges[SPLIT_RANGES];
+    range_args args[SPLIT_RANGES];
+    pthread_t threads[SPLIT_RANGES];
+    void *data[16];
+    int seen[SPLIT_ITEMS];
+    int total = 0;
+    int rc;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < SPLIT_ITEMS; i++)
+        put_item(htab, i);
+
+    // Concurrent scan of disjoint ranges sees every entry exactly once
+    memset(seen, 0, sizeof(seen));
+    CU_ASSERT_EQUAL(linked_hashtable_split(htab, ranges, SPLIT_RANGES), SPLIT_RANGES);
+
+    for (i = 0; i < SPLIT_RANGES; i++) {
+        args[i].range = &ranges[i];
+        args[i].seen = seen;
+        args[i].rc = 0;
+        pthread_create(&threads[i], NULL, range_routine, &args[i]);
+    }
+
+    for (i = 0; i < SPLIT_RANGES; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(args[i].rc, 0);
+    }
+
+    for (i = 0; i < SPLIT_ITEMS; i++)
+        CU_ASSERT_EQUAL(seen[i], 1);
+
+    // Bulk iteration keeps the list order
+    linked_hashtable_iterate(htab, &it);
+    while ((rc = linked_hashtable_iterator_next_n(&it, NULL, NULL, data, 16)) > 0) {
+        for (i = 0; i < rc; i++) {
+            CU_ASSERT_EQUAL(((test_item *)data[i])->index, total + i);
+            deref(data[i]);
+        }
+        total += rc;
+    }
+    CU_ASSERT_EQUAL(rc, 0);
+    CU_ASSERT_EQUAL(total, SPLIT_ITEMS);
+
+    linked_hashtable_iterate(htab, &it);
+    CU_ASSERT_EQUAL(linked_hashtable_iterator_next_n(&it, NULL, NULL, data, 16), 16);
+    for (i = 0; i < 16; i++)
+        deref(data[i]);
+    remove_item(htab, 0);
+    CU_ASSERT_EQUAL(linked_hashtable_iterator_next_n(&it, NULL, NULL, data, 16), -1);
+
+    // A resize in the middle of a range scan is reported
+    CU_ASSERT_EQUAL(linked_hashtable_split(htab, ranges, 1), 1);
+    CU_ASSERT_EQUAL(linked_hashtable_range_next(&ranges[0], NULL, NULL, data, 1), 1);
+    deref(data[0]);
+
+    for (i = SPLIT_ITEMS; i < SPLIT_ITEMS * 4; i++)
+        put_item(htab, i);
+
+    CU_ASSERT_EQUAL(linked_hashtable_range_next(&ranges[0], NULL, NULL, data, 1), -1);
+
+    deref(htab);
+}
+
+#define SPLIT_GROWTH    40
+
+/* Chained tables grow incrementally, a few buckets per put */
+static void split_growth_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_range_t ranges[SPLIT_RANGES];
+    range_args args[SPLIT_RANGES];
+    void *data[1];
+    int seen[SPLIT_ITEMS + SPLIT_GROWTH];
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < SPLIT_ITEMS; i++)
+        put_item(htab, i);
+
+    memset(seen, 0, sizeof(seen));
+    CU_ASSERT_EQUAL(linked_hashtable_split(htab, ranges, SPLIT_RANGES), SPLIT_RANGES);
+    CU_ASSERT_EQUAL(linked_hashtable_range_next(&ranges[0], NULL, NULL, data, 1), 1);
+    deref(data[0]);
+    CU_ASSERT_EQUAL(linked_hashtable_range_next(&ranges[SPLIT_RANGES - 1], NULL, NULL,
+                                                data, 1), 1);
+    seen[((test_item *)data[0])->index]++;
+    deref(data[0]);
+
+    // Start growing, the first buckets move to the new bucket array.
+    for (i = SPLIT_ITEMS; i < SPLIT_ITEMS + SPLIT_GROWTH; i++)
+        put_item(htab, i);
+
+    CU_ASSERT_EQUAL(linked_hashtable_range_next(&ranges[0], NULL, NULL, data, 1), -1);
+    CU_ASSERT_EQUAL(errno, EAGAIN);
+
+    // The last range has not been reached yet and goes on.
+    args[0].range = &ranges[SPLIT_RANGES - 1];
+    args[0].seen = seen;
+    args[0].rc = 0;
+    range_routine(&args[0]);
+    CU_ASSERT_EQUAL(args[0].rc, 0);
+    for (i = 0; i < SPLIT_ITEMS + SPLIT_GROWTH; i++)
+        CU_ASSERT(seen[i] <= 1);
+
+    // Ranges split in the middle of growing see every entry once.
+    memset(seen, 0, sizeof(seen));
+    CU_ASSERT_EQUAL(linked_hashtable_split(htab, ranges, SPLIT_RANGES), SPLIT_RANGES);
+    for (i = 0; i < SPLIT_RANGES; i++) {
+        args[i].range = &ranges[i];
+        args[i].seen = seen;
+        args[i].rc = 0;
+        range_routine(&args[i]);
+        CU_ASSERT_EQUAL(args[i].rc, 0);
+    }
+
+    for (i = 0; i < SPLIT_ITEMS + SPLIT_GROWTH; i++)
+        CU_ASSERT_EQUAL(seen[i], 1);
+
+    deref(htab);
+}
+
+static void hashtable_split_test(void)
+{
+    split_test(0);
+    split_test(LINKED_HASHTABLE_SYNCED);
+    split_test(LINKED_HASHTABLE_STRIPED);
+    split_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    split_test(LINKED_HASHTABLE_STRIPED | LINKED_HASHTABLE_OPEN_ADDRESSING);
+    split_test(LINKED_HASHTABLE_LOCKFREE_READ);
+
+    split_growth_test(0);
+    split_growth_test(LINKED_HASHTABLE_LOCKFREE_READ);
+}
+
+#define SNAPSHOT_ITEMS  1000
+
+typedef struct snapshot_args {
+    linked_hashtable_t *htab;
+    int stop;
+} snapshot_args;
+
+static void *snapshot_writer_routine(void *arg)
+{
+    snapshot_args *args = (snapshot_args *)arg;
+    int i = 0;
+
+    // At any time there are SNAPSHOT_ITEMS - 1 or SNAPSHOT_ITEMS entries
+    while (!__atomic_load_n(&args->stop, __ATOMIC_ACQUIRE)) {
+        remove_item(args->htab, i % SNAPSHOT_ITEMS);
+        put_item(args->htab, i % SNAPSHOT_ITEMS);
+        put_item(args->htab, (i + 1) % SNAPSHOT_ITEMS);
+        i += 7;
+    }
+
+    return NULL;
+}
+
+/* Returns the number of entries, which have to be original and unique */
+static int snapshot_scan(linked_hashtable_snapshot_t *snap, int ordered)
+{
+    char seen[SNAPSHOT_ITEMS];
+    test_item *item;
+    void *data;
+    void *key;
+    size_t keylen;
+    int last = -1;
+    int count = 0;
+    int rc;
+
+    memset(seen, 0, sizeof(seen));
+
+    while ((rc = linked_hashtable_snapshot_next(snap, &key, &keylen, &data)) == 1) {
+        item = (test_item *)data;
+        CU_ASSERT_PTR_EQUAL(key, item->key);
+        CU_ASSERT_EQUAL(keylen, strlen(item->key));
+        CU_ASSERT_FATAL(item->index >= 0 && item->index < SNAPSHOT_ITEMS);
+        CU_ASSERT_EQUAL(seen[item->index]++, 0);
+        if (ordered)
+            CU_ASSERT(item->index > last);
+
+        last = item->index;
+        count++;
+        deref(item);
+    }
+    CU_ASSERT_EQUAL(rc, 0);
+
+    return count;
+}
+
+static void snapshot_test(int flags)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_snapshot_t *snap;
+    linked_hashtable_snapshot_t *snap2;
+    snapshot_args args;
+    pthread_t thread;
+    test_item *item;
+    void *data;
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < SNAPSHOT_ITEMS; i++)
+        put_item(htab, i);
+
+    // Changes after the snapshot was taken are not seen
+    snap = linked_hashtable_snapshot(htab);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(snap);
+
+    for (i = 0; i < 100; i++) {
+        CU_ASSERT_EQUAL(linked_hashtable_snapshot_next(snap, NULL, NULL, &data), 1);
+        deref(data);
+    }
+
+    for (i = 0; i < SNAPSHOT_ITEMS; i += 2)
+        remove_item(htab, i);
+    for (i = 501; i < SNAPSHOT_ITEMS; i += 2) {
+        item = item_new(i);
+        item->index = -1;
+        linked_hashtable_put(htab, &item->he);
+        deref(item);
+    }
+    for (i = SNAPSHOT_ITEMS; i < SNAPSHOT_ITEMS * 2; i++)
+        put_item(htab, i);
+    if (flags & LINKED_HASHTABLE_ACCESS_ORDER) {
+        for (i = 1; i < 500; i += 2)
+            deref(get_item(htab, i));
+    }
+
+    snap2 = linked_hashtable_snapshot(htab);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(snap2);
+
+    CU_ASSERT_EQUAL(snapshot_scan(snap, 1) + 100, SNAPSHOT_ITEMS);
+    CU_ASSERT_EQUAL(linked_hashtable_snapshot_next(snap, NULL, NULL, &data), 0);
+    deref(snap);
+
+    linked_hashtable_clear(htab);
+    CU_ASSERT_EQUAL(linked_hashtable_snapshot_next(snap2, NULL, NULL, &data), 1);
+    deref(data);
+    deref(snap2);
+
+    // Scans see a consistent view while a writer keeps going
+    for (i = 0; i < SNAPSHOT_ITEMS; i++)
+        put_item(htab, i);
+
+    if (flags & LINKED_HASHTABLE_SYNCED) {
+        args.htab = htab;
+        args.stop = 0;
+        pthread_create(&thread, NULL, snapshot_writer_routine, &args);
+
+        for (i = 0; i < 20; i++) {
+            snap = linked_hashtable_snapshot(htab);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(snap);
+            CU_ASSERT(snapshot_scan(snap, 0) >= SNAPSHOT_ITEMS - 1);
+            deref(snap);
+        }
+
+        __atomic_store_n(&args.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+    }
+
+    deref(htab);
+}
+
+static void hashtable_snapshot_test(void)
+{
+    snapshot_test(0);
+    snapshot_test(LINKED_HASHTABLE_SYNCED);
+    snapshot_test(LINKED_HASHTABLE_STRIPED);
+    snapshot_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    snapshot_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    snapshot_test(LINKED_HASHTABLE_ACCESS_ORDER);
+}
+
+static int case_compare(const void *key1, size_t len1, const void *key2, size_t len2)
+{
+    return len1 == len2 ? strncasecmp((const char *)key1, (const char *)key2, len1) :
+                          (int)len1 - (int)len2;
+}
+
+static void freeze_test(int flags, int count)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_frozen_t *frozen;
+    test_item *item;
+    char key[32];
+    int i;
+
+    htab = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < count; i++)
+        put_item(htab, i);
+
+    frozen = linked_hashtable_freeze(htab);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(frozen);
+    CU_ASSERT_EQUAL(linked_hashtable_frozen_count(frozen), count);
+
+    // The frozen table does not change with the table
+    linked_hashtable_clear(htab);
+    deref(htab);
+
+    for (i = 0; i < count; i++) {
+        sprintf(key, "key-%d", i);
+        item = (test_item *)linked_hashtable_frozen_get(frozen, key, strlen(key));
+        CU_ASSERT_PTR_NOT_NULL_FATAL(item);
+        CU_ASSERT_EQUAL(item->index, i);
+        CU_ASSERT_EQUAL(nrefs(item), 1);
+    }
+
+    for (i = count; i < count * 2 + 10; i++) {
+        sprintf(key, "key-%d", i);
+        CU_ASSERT_FALSE(linked_hashtable_frozen_exist(frozen, key, strlen(key)));
+    }
+
+    deref(frozen);
+}
+
+static void hashtable_freeze_test(void)
+{
+    linked_hashtable_t *htab;
+
+    freeze_test(0, 0);
+    freeze_test(0, 1);
+    freeze_test(0, 2);
+    freeze_test(0, 1000);
+    freeze_test(0, 100000);
+    freeze_test(0, 1000000);
+    freeze_test(LINKED_HASHTABLE_STRIPED, 1000);
+    freeze_test(LINKED_HASHTABLE_OPEN_ADDRESSING | LINKED_HASHTABLE_RANDOM_SEED, 1000);
+
+    htab = linked_hashtable_create(8, 0, NULL, case_compare);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    CU_ASSERT_PTR_NULL(linked_hashtable_freeze(htab));
+    deref(htab);
+}
+
+#define STATS_THREADS   4
+#define STATS_OPS       10000
+
+static void *stats_routine(void *arg)
+{
+    linked_hashtable_t *htab = (linked_hashtable_t *)arg;
+    char key[32];
+    int i;
+
+    for (i = 0; i < STATS_OPS; i++) {
+        sprintf(key, "key-%d", i % 200);
+        linked_hashtable_exist(htab, key, strlen(key));
+    }
+
+    return NULL;
+}
+
+static void stats_test(int flags)
+{
+    linked_hashtable_t *htab, *plain;
+    linked_hashtable_stats_t stats, walked;
+    pthread_t threads[STATS_THREADS];
+    test_item *item;
+    size_t sum;
+    int i;
+
+    htab = linked_hashtable_create(8, flags | LINKED_HASHTABLE_STATS, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    // Same changes without STATS, its histogram is walked.
+    plain = linked_hashtable_create(8, flags, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(plain);
+
+    for (i = 0; i < 1000; i++) {
+        put_item(htab, i);
+        put_item(plain, i);
+    }
+
+    for (i = 0; i < 1500; i++) {
+        item = get_item(htab, i);
+        CU_ASSERT_EQUAL(item != NULL, i < 1000);
+        deref(item);
+    }
+
+    for (i = 0; i < 100; i++) {
+        CU_ASSERT_TRUE(remove_item(htab, i));
+        CU_ASSERT_TRUE(remove_item(plain, i));
+    }
+
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(htab, &stats), 0);
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(plain, &walked), 0);
+    CU_ASSERT_EQUAL(stats.capacity, walked.capacity);
+    CU_ASSERT_EQUAL(stats.max_chain, walked.max_chain);
+    CU_ASSERT_EQUAL(memcmp(stats.histogram, walked.histogram,
+                           sizeof(stats.histogram)), 0);
+    CU_ASSERT_EQUAL(stats.count, 900);
+    CU_ASSERT_TRUE(stats.capacity >= 900 / 4);
+    CU_ASSERT_TRUE(stats.load_factor > 0);
+    CU_ASSERT_EQUAL(stats.puts, 1000);
+    CU_ASSERT_EQUAL(stats.gets, 1500);
+    CU_ASSERT_EQUAL(stats.hits, 1000);
+    CU_ASSERT_EQUAL(stats.misses, 500);
+    CU_ASSERT_EQUAL(stats.removes, 100);
+    CU_ASSERT_TRUE(stats.probes >= stats.hits + stats.removes);
+    CU_ASSERT_TRUE(stats.max_chain > 0);
+
+    for (sum = 0, i = 0; i < LINKED_HASHTABLE_STATS_BINS; i++)
+        sum += stats.histogram[i];
+    // Entries by probe length, or buckets by chain length
+    CU_ASSERT_EQUAL(sum, (flags & LINKED_HASHTABLE_OPEN_ADDRESSING) ?
+                         stats.count : stats.capacity);
+
+    linked_hashtable_stats_reset(htab);
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(htab, &stats), 0);
+    CU_ASSERT_EQUAL(stats.count, 900);
+    CU_ASSERT_EQUAL(stats.gets, 0);
+    CU_ASSERT_EQUAL(stats.puts, 0);
+    CU_ASSERT_EQUAL(stats.probes, 0);
+
+    if (flags & LINKED_HASHTABLE_SYNCED) {
+        for (i = 0; i < STATS_THREADS; i++)
+            pthread_create(&threads[i], NULL, stats_routine, htab);
+        for (i = 0; i < STATS_THREADS; i++)
+            pthread_join(threads[i], NULL);
+
+        CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(htab, &stats), 0);
+        CU_ASSERT_EQUAL(stats.gets, STATS_THREADS * STATS_OPS);
+        CU_ASSERT_EQUAL(stats.hits, STATS_THREADS * STATS_OPS / 2);
+    }
+
+    linked_hashtable_clear(htab);
+    linked_hashtable_clear(plain);
+    for (i = 0; i < 50; i++) {
+        put_item(htab, i);
+        put_item(plain, i);
+    }
+
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(htab, &stats), 0);
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(plain, &walked), 0);
+    CU_ASSERT_EQUAL(stats.max_chain, walked.max_chain);
+    CU_ASSERT_EQUAL(memcmp(stats.histogram, walked.histogram,
+                           sizeof(stats.histogram)), 0);
+
+    deref(plain);
+    deref(htab);
+}
+
+static void hashtable_stats_test(void)
+{
+    linked_hashtable_t *htab;
+    linked_hashtable_stats_t stats;
+    size_t sum;
+    int i;
+
+    stats_test(0);
+    stats_test(LINKED_HASHTABLE_OPEN_ADDRESSING);
+    stats_test(LINKED_HASHTABLE_STRIPED);
+    stats_test(LINKED_HASHTABLE_LOCKFREE_READ);
+    stats_test(LINKED_HASHTABLE_SYNCED | LINKED_HASHTABLE_ACCESS_ORDER);
+
+    // Without the flag only the structure is reported
+    htab = linked_hashtable_create(8, 0, NULL, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < 100; i++)
+        put_item(htab, i);
+    deref(get_item(htab, 1));
+
+    CU_ASSERT_EQUAL_FATAL(linked_hashtable_stats(htab, &stats), 0);
+    CU_ASSERT_EQUAL(stats.count, 100);
+    CU_ASSERT_EQUAL(stats.gets, 0);
+    CU_ASSERT_EQUAL(stats.puts, 0);
+    CU_ASSERT_EQUAL(stats.probes, 0);
+
+    for (sum = 0, i = 0; i < LINKED_HASHTABLE_STATS_BINS; i++)
+        sum += stats.histogram[i];
+    CU_ASSERT_EQUAL(sum, stats.capacity);
+
+    deref(htab);
+}
+
+static int linkedhashtable_test_suite_init(void)
+{
+    return 0;
+}
+
+static int linkedhashtable_test_suite_cleanup(void)
+{
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "hashtable_basic_test", hashtable_basic_test },
+    { "hashtable_iterator_test", hashtable_iterator_test },
+    { "hashtable_grow_test", hashtable_grow_test },
+    { "hashtable_shrink_test", hashtable_shrink_test },
+    { "hashtable_churn_test", hashtable_churn_test },
+    { "hashtable_open_addressing_test", hashtable_open_addressing_test },
+    { "hashtable_concurrent_test", hashtable_concurrent_test },
+    { "hashtable_striped_test", hashtable_striped_test },
+    { "hashtable_lockfree_read_test", hashtable_lockfree_read_test },
+    { "hashtable_hash_test", hashtable_hash_test },
+    { "hashtable_lru_test", hashtable_lru_test },
+    { "hashtable_ttl_test", hashtable_ttl_test },
+    { "hashtable_batch_test", hashtable_batch_test },
+    { "hashtable_visit_test", hashtable_visit_test },
+    { "hashtable_inline_key_test", hashtable_inline_key_test },
+    { "hashtable_key_length_test", hashtable_key_length_test },
+    { "hashtable_split_test", hashtable_split_test },
+    { "hashtable_snapshot_test", hashtable_snapshot_test },
+    { "hashtable_freeze_test", hashtable_freeze_test },
+    { "hashtable_stats_test", hashtable_stats_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "linkedhashtable test",
+        linkedhashtable_test_suite_init,
+        linkedhashtable_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* linkedhashtable_test_suite_info(void)
+{
+    return suite;
+}
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <CUnit/Basic.h>
+
+#include "crystal.h"
+
+typedef struct u64_item {
+    linked_hash_u64_entry_t he;
+    int index;
+} u64_item;
+
+/* Keys that differ only in the high bits, to exercise the mixer */
+static uint64_t item_key(int index)
+{
+    return ((uint64_t)index << 40) | 0x5;
+}
+
+static void *put_item(linked_hashtable_u64_t *htab, int index)
+{
+    u64_item *item = (u64_item *)rc_zalloc(sizeof(u64_item), NULL);
+    void *rc;
+
+    if (!item)
+        return NULL;
+
+    item->index = index;
+    item->he.key = item_key(index);
+    item->he.data = item;
+
+    rc = linked_hashtable_u64_put(htab, &item->he);
+    deref(item);
+
+    return rc;
+}
+
+static void check_items(linked_hashtable_u64_t *htab, int start, int end, int step)
+{
+    u64_item *item;
+    int i;
+
+    for (i = start; i < end; i += step) {
+        item = (u64_item *)linked_hashtable_u64_get(htab, item_key(i));
+        CU_ASSERT_PTR_NOT_NULL(item);
+        if (item) {
+            CU_ASSERT_EQUAL(item->index, i);
+            deref(item);
+        }
+    }
+}
+
+static void check_order(linked_hashtable_u64_t *htab, int start, int end, int step)
+{
+    linked_hashtable_u64_iterator_t it;
+    u64_item *item;
+    uint64_t key;
+    int expected = start;
+
+    linked_hashtable_u64_iterate(htab, &it);
+    while (linked_hashtable_u64_iterator_has_next(&it)) {
+        if (linked_hashtable_u64_iterator_next(&it, &key, (void **)&item) != 1)
+            break;
+
+        CU_ASSERT_EQUAL(item->index, expected);
+        CU_ASSERT_EQUAL(key, item_key(expected));
+        expected += step;
+        deref(item);
+    }
+
+    CU_ASSERT_EQUAL(expected, end);
+}
+
+static void basic_test(int flags)
+{
+    linked_hashtable_u64_t *htab;
+    linked_hashtable_u64_iterator_t it;
+    u64_item *item;
+    int i;
+
+    htab = linked_hashtable_u64_create(8, flags);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+    CU_ASSERT_TRUE(linked_hashtable_u64_is_empty(htab));
+
+    for (i = 0; i < 10000; i++)
+        CU_ASSERT_PTR_NOT_NULL(put_item(htab, i));
+
+    check_items(htab, 0, 10000, 1);
+    check_order(htab, 0, 10000, 1);
+    CU_ASSERT_TRUE(linked_hashtable_u64_exist(htab, item_key(42)));
+    CU_ASSERT_FALSE(linked_hashtable_u64_exist(htab, item_key(10000)));
+    CU_ASSERT_FALSE(linked_hashtable_u64_exist(htab, 42));
+
+    // Replace keeps the position in the insertion order
+    put_item(htab, 42);
+    check_order(htab, 0, 10000, 1);
+
+    for (i = 1; i < 10000; i += 2) {
+        item = (u64_item *)linked_hashtable_u64_remove(htab, item_key(i));
+        CU_ASSERT_PTR_NOT_NULL(item);
+        if (item) {
+            CU_ASSERT_EQUAL(nrefs(item), 1);
+            deref(item);
+        }
+    }
+    CU_ASSERT_PTR_NULL(linked_hashtable_u64_remove(htab, item_key(1)));
+
+    check_items(htab, 0, 10000, 2);
+    check_order(htab, 0, 10000, 2);
+
+    // Remove all but the last 10 while iterating
+    i = 0;
+    linked_hashtable_u64_iterate(htab, &it);
+    while (linked_hashtable_u64_iterator_next(&it, NULL, (void **)&item) == 1) {
+        if (item->index < 9980)
+            CU_ASSERT_EQUAL(linked_hashtable_u64_iterator_remove(&it), 1);
+        deref(item);
+        i++;
+    }
+    CU_ASSERT_EQUAL(i, 5000);
+    check_order(htab, 9980, 10000, 2);
+    check_items(htab, 9980, 10000, 2);
+
+    linked_hashtable_u64_clear(htab);
+    CU_ASSERT_TRUE(linked_hashtable_u64_is_empty(htab));
+    CU_ASSERT_PTR_NULL(linked_hashtable_u64_get(htab, item_key(9998)));
+
+    deref(htab);
+}
+
+static void hashtable_u64_basic_test(void)
+{
+    basic_test(0);
+    basic_test(LINKED_HASHTABLE_SYNCED);
+    basic_test(LINKED_HASHTABLE_AUTO_SHRINK);
+
+    CU_ASSERT_PTR_NULL(linked_hashtable_u64_create(8, LINKED_HASHTABLE_STRIPED));
+}
+
+#define THREADS             4
+#define ITEMS_PER_THREAD    20000
+
+typedef struct thread_args {
+    linked_hashtable_u64_t *htab;
+    int base;
+    int errors;
+} thread_args;
+
+static void *writer_routine(void *arg)
+{
+    thread_args *args = (thread_args *)arg;
+    u64_item *item;
+    int i;
+
+    for (i = args->base; i < args->base + ITEMS_PER_THREAD; i++) {
+        put_item(args->htab, i);
+
+        item = (u64_item *)linked_hashtable_u64_get(args->htab, item_key(i));
+        if (!item || item->index != i)
+            args->errors++;
+        deref(item);
+
+        if (i % 2) {
+            item = (u64_item *)linked_hashtable_u64_remove(args->htab, item_key(i));
+            if (!item)
+                args->errors++;
+            deref(item);
+        }
+    }
+
+    return NULL;
+}
+
+static void hashtable_u64_concurrent_test(void)
+{
+    linked_hashtable_u64_t *htab;
+    linked_hashtable_u64_iterator_t it;
+    pthread_t threads[THREADS];
+    u64_item *item;
+    thread_args args[THREADS];
+    int i;
+
+    htab = linked_hashtable_u64_create(16, LINKED_HASHTABLE_SYNCED |
+                                       LINKED_HASHTABLE_AUTO_SHRINK);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(htab);
+
+    for (i = 0; i < THREADS; i++) {
+        args[i].htab = htab;
+        args[i].base = i * ITEMS_PER_THREAD;
+        args[i].errors = 0;
+        pthread_create(&threads[i], NULL, writer_routine, &args[i]);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(args[i].errors, 0);
+    }
+
+    check_items(htab, 0, THREADS * ITEMS_PER_THREAD, 2);
+
+    i = 0;
+    linked_hashtable_u64_iterate(htab, &it);
+    while (linked_hashtable_u64_iterator_next(&it, NULL, (void **)&item) == 1) {
+        CU_ASSERT_EQUAL(item->index % 2, 0);
+        deref(item);
+        i++;
+    }
+    CU_ASSERT_EQUAL(i, THREADS * ITEMS_PER_THREAD / 2);
+
+    deref(htab);
+}
+
+static int linkedhashtable_u64_test_suite_init(void)
+{
+    return 0;
+}
+
+static int linkedhashtable_u64_test_suite_cleanup(void)
+{
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "hashtable_u64_basic_test", hashtable_u64_basic_test },
+    { "hashtable_u64_concurrent_test", hashtable_u64_concurrent_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "linkedhashtable_u64 test",
+        linkedhashtable_u64_test_suite_init,
+        linkedhashtable_u64_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* linkedhashtable_u64_test_suite_info(void)
+{
+    return suite;
+}
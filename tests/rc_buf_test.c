@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <CUnit/Basic.h>
+
+#include "crystal.h"
+
+static int destroyed;
+
+static void count_destructor(void *data)
+{
+    destroyed++;
+}
+
+static void *message_create(const char *text)
+{
+    void *mem = rc_alloc(strlen(text), count_destructor);
+
+    if (mem)
+        memcpy(mem, text, strlen(text));
+
+    return mem;
+}
+
+static int view_equal(const rc_buf_t *buf, const char *text)
+{
+    return buf->len == strlen(text) && memcmp(buf->data, text, buf->len) == 0;
+}
+
+static int chain_equal(const rc_buf_chain_t *chain, const char *text)
+{
+    char out[256];
+    size_t len = rc_buf_chain_length(chain);
+
+    if (len != strlen(text) || len > sizeof(out))
+        return 0;
+
+    return rc_buf_chain_copy(chain, 0, out, len) == len &&
+           memcmp(out, text, len) == 0;
+}
+
+static void rc_buf_view_test(void)
+{
+    rc_buf_t buf, slice, tail;
+    void *mem;
+
+    destroyed = 0;
+    mem = message_create("header:payload");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(mem);
+
+    rc_buf_init(&buf, mem, 0, 14);
+    CU_ASSERT_EQUAL(nrefs(mem), 2);
+    deref(mem);
+
+    CU_ASSERT_EQUAL(rc_buf_slice(&slice, &buf, 7, 7), 0);
+    CU_ASSERT_PTR_EQUAL(slice.mem, mem);
+    CU_ASSERT_TRUE(view_equal(&slice, "payload"));
+    CU_ASSERT_EQUAL(rc_buf_slice(&tail, &buf, 7, 8), -1);
+    CU_ASSERT_EQUAL(rc_buf_slice(&tail, &buf, 15, 0), -1);
+
+    CU_ASSERT_EQUAL(rc_buf_split(&buf, 6, &tail), 0);
+    CU_ASSERT_TRUE(view_equal(&buf, "header"));
+    CU_ASSERT_TRUE(view_equal(&tail, ":payload"));
+    CU_ASSERT_EQUAL(rc_buf_split(&buf, 7, &tail), -1);
+    CU_ASSERT_EQUAL(nrefs(mem), 3);
+
+    // The memory lives as long as any view of it.
+    rc_buf_release(&buf);
+    rc_buf_release(&tail);
+    CU_ASSERT_EQUAL(destroyed, 0);
+    CU_ASSERT_PTR_NULL(buf.mem);
+    rc_buf_release(&slice);
+    CU_ASSERT_EQUAL(destroyed, 1);
+
+    CU_ASSERT_EQUAL(rc_buf_alloc(&buf, 32), 0);
+    CU_ASSERT_EQUAL(buf.len, 32);
+    CU_ASSERT_EQUAL(nrefs(buf.mem), 1);
+    rc_buf_release(&buf);
+}
+
+static void rc_buf_chain_test(void)
+{
+    rc_buf_chain_t *chain, *other, *tail;
+    rc_buf_t buf, part;
+    struct iovec iov[8];
+    char out[32];
+    void *mem1, *mem2;
+    int i, n;
+
+    destroyed = 0;
+    mem1 = message_create("HEADpayload");
+    mem2 = message_create("-trailer-");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(mem1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(mem2);
+
+    chain = rc_buf_chain_create();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(chain);
+    CU_ASSERT_EQUAL(rc_buf_chain_length(chain), 0);
+
+    // Adjacent views of the same object merge.
+    rc_buf_init(&buf, mem1, 0, 11);
+    rc_buf_slice(&part, &buf, 0, 4);
+    CU_ASSERT_EQUAL(rc_buf_chain_append(chain, &part), 0);
+    rc_buf_release(&part);
+    rc_buf_slice(&part, &buf, 4, 7);
+    CU_ASSERT_EQUAL(rc_buf_chain_append(chain, &part), 0);
+    rc_buf_release(&part);
+    rc_buf_release(&buf);
+    CU_ASSERT_EQUAL(rc_buf_chain_count(chain), 1);
+
+    rc_buf_init(&buf, mem2, 1, 7);
+    CU_ASSERT_EQUAL(rc_buf_chain_append(chain, &buf), 0);
+    rc_buf_release(&buf);
+    deref(mem1);
+    deref(mem2);
+
+    CU_ASSERT_EQUAL(rc_buf_chain_count(chain), 2);
+    CU_ASSERT_TRUE(chain_equal(chain, "HEADpayloadtrailer"));
+    CU_ASSERT_TRUE(view_equal(rc_buf_chain_get(chain, 1), "trailer"));
+    CU_ASSERT_PTR_NULL(rc_buf_chain_get(chain, 2));
+
+    // Copy across the view boundary
+    CU_ASSERT_EQUAL(rc_buf_chain_copy(chain, 8, out, 6), 6);
+    CU_ASSERT_EQUAL(memcmp(out, "oadtra", 6), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_copy(chain, 16, out, 6), 2);
+
+    other = rc_buf_chain_slice(chain, 4, 10);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+    CU_ASSERT_TRUE(chain_equal(other, "payloadtra"));
+    CU_ASSERT_PTR_NULL(rc_buf_chain_slice(chain, 10, 9));
+
+    // Grow past the inline views
+    for (i = 0; i < 6; i++)
+        CU_ASSERT_EQUAL(rc_buf_chain_append_chain(other, chain), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_length(other), 10 + 6 * 18);
+    CU_ASSERT_EQUAL(rc_buf_chain_append_chain(other, other), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_length(other), 2 * (10 + 6 * 18));
+    deref(other);
+
+    // Split inside a view, then at a view boundary
+    tail = rc_buf_chain_split(chain, 6);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tail);
+    CU_ASSERT_TRUE(chain_equal(chain, "HEADpa"));
+    CU_ASSERT_TRUE(chain_equal(tail, "yloadtrailer"));
+    CU_ASSERT_PTR_NULL(rc_buf_chain_split(chain, 7));
+
+    other = rc_buf_chain_split(tail, 5);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+    CU_ASSERT_EQUAL(rc_buf_chain_count(tail), 1);
+    CU_ASSERT_EQUAL(rc_buf_chain_count(other), 1);
+    CU_ASSERT_TRUE(chain_equal(other, "trailer"));
+
+    CU_ASSERT_EQUAL(rc_buf_chain_append_chain(chain, tail), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_append_chain(chain, other), 0);
+    deref(tail);
+    deref(other);
+    CU_ASSERT_EQUAL(rc_buf_chain_count(chain), 2);
+    CU_ASSERT_EQUAL(destroyed, 0);
+
+    n = rc_buf_chain_iovec(chain, iov, 8);
+    CU_ASSERT_EQUAL(n, 2);
+    CU_ASSERT_EQUAL(iov[0].iov_len, 11);
+    CU_ASSERT_EQUAL(memcmp(iov[0].iov_base, "HEADpayload", 11), 0);
+    CU_ASSERT_EQUAL(iov[1].iov_len, 7);
+    CU_ASSERT_EQUAL(memcmp(iov[1].iov_base, "trailer", 7), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_iovec(chain, iov, 1), 1);
+
+    // Consuming what was sent releases the first object.
+    CU_ASSERT_EQUAL(rc_buf_chain_consume(chain, 13), 0);
+    CU_ASSERT_EQUAL(destroyed, 1);
+    CU_ASSERT_TRUE(chain_equal(chain, "ailer"));
+    CU_ASSERT_EQUAL(rc_buf_chain_consume(chain, 6), -1);
+    CU_ASSERT_EQUAL(rc_buf_chain_consume(chain, 5), 0);
+    CU_ASSERT_EQUAL(rc_buf_chain_count(chain), 0);
+    CU_ASSERT_EQUAL(destroyed, 2);
+
+    deref(chain);
+}
+
+static int rc_buf_test_suite_init(void)
+{
+    return 0;
+}
+
+static int rc_buf_test_suite_cleanup(void)
+{
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "rc_buf_view_test", rc_buf_view_test },
+    { "rc_buf_chain_test", rc_buf_chain_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "rc_buf test",
+        rc_buf_test_suite_init,
+        rc_buf_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* rc_buf_test_suite_info(void)
+{
+    return suite;
+}
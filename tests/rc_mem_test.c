@@ -0,0 +1,945 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <CUnit/Basic.h>
+
+#include "crystal.h"
+
+#define POOL_OBJECTS    2000
+#define POOL_THREADS    4
+
+static int destroyed;
+
+static void count_destructor(void *data)
+{
+    __atomic_fetch_add(&destroyed, 1, __ATOMIC_RELAXED);
+}
+
+static void fill(void *data, size_t size, int seed)
+{
+    memset(data, seed & 0xff, size);
+}
+
+static int check(const void *data, size_t size, int seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (p[i] != (unsigned char)(seed & 0xff))
+            return 0;
+    }
+
+    return 1;
+}
+
+static size_t object_size(int i)
+{
+    // Every pool class, and some objects too large for the pool
+    return (size_t)(i * 37) % 1200 + 1;
+}
+
+static void rc_mem_basic_test(void)
+{
+    char *p;
+    int i;
+
+    destroyed = 0;
+
+    p = (char *)rc_zalloc(64, count_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    for (i = 0; i < 64; i++)
+        CU_ASSERT_EQUAL(p[i], 0);
+    CU_ASSERT_EQUAL(nrefs(p), 1);
+
+    CU_ASSERT_PTR_EQUAL(ref(p), p);
+    CU_ASSERT_EQUAL(nrefs(p), 2);
+    deref(p);
+    CU_ASSERT_EQUAL(destroyed, 0);
+
+    fill(p, 64, 7);
+    p = (char *)rc_realloc(p, 4096);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    CU_ASSERT_TRUE(check(p, 64, 7));
+    CU_ASSERT_EQUAL(nrefs(p), 1);
+
+    deref(p);
+    CU_ASSERT_EQUAL(destroyed, 1);
+}
+
+static void pool_alloc_test(void)
+{
+    void *objects[POOL_OBJECTS];
+    char *p;
+    int i;
+
+    destroyed = 0;
+
+    for (i = 0; i < POOL_OBJECTS; i++) {
+        objects[i] = rc_alloc(object_size(i), count_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+        CU_ASSERT_EQUAL(((uintptr_t)objects[i]) % sizeof(void *), 0);
+        fill(objects[i], object_size(i), i);
+    }
+
+    // Free every other object, the next ones reuse their blocks
+    for (i = 0; i < POOL_OBJECTS; i += 2)
+        deref(objects[i]);
+    CU_ASSERT_EQUAL(destroyed, POOL_OBJECTS / 2);
+
+    for (i = 0; i < POOL_OBJECTS; i += 2) {
+        objects[i] = rc_zalloc(object_size(i), count_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+        CU_ASSERT_TRUE(check(objects[i], object_size(i), 0));
+        fill(objects[i], object_size(i), i);
+    }
+
+    for (i = 0; i < POOL_OBJECTS; i++)
+        CU_ASSERT_TRUE(check(objects[i], object_size(i), i));
+
+    // Grow within the block, then out of it
+    p = (char *)rc_alloc(40, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    fill(p, 40, 3);
+    p = (char *)rc_realloc(p, 44);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    CU_ASSERT_TRUE(check(p, 40, 3));
+    p = (char *)rc_realloc(p, 5000);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    CU_ASSERT_TRUE(check(p, 40, 3));
+    deref(p);
+
+    for (i = 0; i < POOL_OBJECTS; i++)
+        deref(objects[i]);
+    CU_ASSERT_EQUAL(destroyed, POOL_OBJECTS * 3 / 2);
+}
+
+typedef struct pool_args {
+    void **objects;
+    int base;
+    int rc;
+} pool_args;
+
+/* Free the objects of another thread, and allocate new ones for it */
+static void *pool_routine(void *arg)
+{
+    pool_args *args = (pool_args *)arg;
+    int round, i;
+
+    for (round = 0; round < 10; round++) {
+        for (i = 0; i < POOL_OBJECTS; i++) {
+            if (!check(args->objects[i], object_size(i), args->base + i))
+                args->rc = -1;
+
+            deref(args->objects[i]);
+            args->objects[i] = rc_alloc(object_size(i), count_destructor);
+            if (!args->objects[i]) {
+                args->rc = -1;
+                return NULL;
+            }
+            fill(args->objects[i], object_size(i), args->base + i);
+        }
+    }
+
+    return NULL;
+}
+
+static void pool_remote_free_test(void)
+{
+    static void *objects[POOL_THREADS][POOL_OBJECTS];
+    pthread_t threads[POOL_THREADS];
+    pool_args args[POOL_THREADS];
+    int i, j;
+
+    destroyed = 0;
+
+    for (i = 0; i < POOL_THREADS; i++) {
+        for (j = 0; j < POOL_OBJECTS; j++) {
+            objects[i][j] = rc_alloc(object_size(j), count_destructor);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i][j]);
+            fill(objects[i][j], object_size(j), i * POOL_OBJECTS + j);
+        }
+
+        args[i].objects = objects[i];
+        args[i].base = i * POOL_OBJECTS;
+        args[i].rc = 0;
+    }
+
+    for (i = 0; i < POOL_THREADS; i++)
+        pthread_create(&threads[i], NULL, pool_routine, &args[i]);
+    for (i = 0; i < POOL_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    // The objects of exited threads go back to caches nobody owns now
+    for (i = 0; i < POOL_THREADS; i++) {
+        CU_ASSERT_EQUAL(args[i].rc, 0);
+        for (j = 0; j < POOL_OBJECTS; j++) {
+            CU_ASSERT_TRUE(check(objects[i][j], object_size(j), i * POOL_OBJECTS + j));
+            deref(objects[i][j]);
+        }
+    }
+
+    // Objects of this thread released elsewhere are merged on its next alloc
+    deref(rc_alloc(1, NULL));
+
+    CU_ASSERT_EQUAL(destroyed, POOL_THREADS * POOL_OBJECTS * 11);
+}
+
+static void rc_mem_pool_test(void)
+{
+    if (rc_mem_pool_enable(1) < 0)
+        return;
+
+    rc_mem_basic_test();
+    pool_alloc_test();
+    pool_remote_free_test();
+
+    // Pool objects are still freed correctly with the pool disabled
+    rc_mem_pool_enable(0);
+    pool_alloc_test();
+}
+
+#define ARENA_OBJECTS   1000
+
+static int dtor_order[ARENA_OBJECTS];
+static int ndtors;
+
+static void arena_destructor(void *data)
+{
+    dtor_order[ndtors++] = *(int *)data;
+}
+
+static void rc_arena_test(void)
+{
+    void *objects[ARENA_OBJECTS];
+    rc_arena_t *arena;
+    size_t size;
+    int round, i;
+
+    arena = rc_arena_create(256);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(arena);
+
+    for (round = 0; round < 3; round++) {
+        ndtors = 0;
+
+        for (i = 0; i < ARENA_OBJECTS; i++) {
+            size = i % 10 == 0 ? 200 + i : sizeof(int) + i % 24;
+            objects[i] = rc_arena_zalloc(arena, size,
+                                         i % 2 ? arena_destructor : NULL);
+            CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+            CU_ASSERT_EQUAL(((uintptr_t)objects[i]) % sizeof(void *), 0);
+            CU_ASSERT_TRUE(check((char *)objects[i] + sizeof(int),
+                                 size - sizeof(int), 0));
+            *(int *)objects[i] = i;
+            fill((char *)objects[i] + sizeof(int), size - sizeof(int), i);
+        }
+
+        for (i = 0; i < ARENA_OBJECTS; i++) {
+            size = i % 10 == 0 ? 200 + i : sizeof(int) + i % 24;
+            CU_ASSERT_EQUAL(*(int *)objects[i], i);
+            CU_ASSERT_TRUE(check((char *)objects[i] + sizeof(int),
+                                 size - sizeof(int), i));
+        }
+
+        CU_ASSERT_PTR_NULL(rc_realloc(objects[1], 64));
+
+        // Dropping the last reference runs the destructor once, right away
+        CU_ASSERT_PTR_EQUAL(ref(objects[1]), objects[1]);
+        deref(objects[1]);
+        CU_ASSERT_EQUAL(ndtors, 0);
+        deref(objects[1]);
+        CU_ASSERT_EQUAL(ndtors, 1);
+        CU_ASSERT_EQUAL(dtor_order[0], 1);
+
+        rc_arena_reset(arena);
+        CU_ASSERT_EQUAL(ndtors, ARENA_OBJECTS / 2);
+        for (i = 1; i < ndtors; i++)
+            CU_ASSERT_EQUAL(dtor_order[i], ARENA_OBJECTS - 2 * i + 1);
+    }
+
+    ndtors = 0;
+    objects[0] = rc_arena_alloc(arena, sizeof(int), arena_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(objects[0]);
+    *(int *)objects[0] = 7;
+
+    deref(arena);
+    CU_ASSERT_EQUAL(ndtors, 1);
+    CU_ASSERT_EQUAL(dtor_order[0], 7);
+}
+
+#define WEAK_THREADS    4
+#define WEAK_ROUNDS     2000
+
+#define WEAK_MAGIC      0x5a5a5a5a
+
+typedef struct weak_args {
+    rc_weak_t *slot;
+    int rc;
+} weak_args;
+
+/* Take each weak reference handed over, and try to upgrade it */
+static void *weak_routine(void *arg)
+{
+    weak_args *args = (weak_args *)arg;
+    rc_weak_t *weak;
+    int round;
+    int *obj;
+
+    for (round = 0; round < WEAK_ROUNDS; round++) {
+        while (!(weak = __atomic_load_n(&args->slot, __ATOMIC_ACQUIRE)))
+            sched_yield();
+        __atomic_store_n(&args->slot, NULL, __ATOMIC_RELEASE);
+
+        obj = (int *)rc_weak_get(weak);
+        if (obj) {
+            if (*obj != WEAK_MAGIC)
+                args->rc = -1;
+            deref(obj);
+        }
+
+        rc_weak_deref(weak);
+    }
+
+    return NULL;
+}
+
+static void rc_weak_test(void)
+{
+    pthread_t threads[WEAK_THREADS];
+    weak_args args[WEAK_THREADS];
+    rc_weak_t *weak, *weak2;
+    int *obj;
+    int i, round;
+
+    destroyed = 0;
+
+    obj = (int *)rc_alloc(sizeof(int), count_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+    *obj = 42;
+
+    weak = rc_weak_ref(obj);
+    weak2 = rc_weak_ref(obj);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(weak);
+    CU_ASSERT_EQUAL(nrefs(obj), 1);
+    CU_ASSERT_PTR_NULL(rc_realloc(obj, 64));
+
+    CU_ASSERT_PTR_EQUAL(rc_weak_get(weak), obj);
+    CU_ASSERT_EQUAL(nrefs(obj), 2);
+    deref(obj);
+    rc_weak_deref(weak2);
+
+    // The memory stays until the last weak reference is gone
+    deref(obj);
+    CU_ASSERT_EQUAL(destroyed, 1);
+    CU_ASSERT_PTR_NULL(rc_weak_get(weak));
+    CU_ASSERT_PTR_NULL(rc_weak_get(weak));
+    rc_weak_deref(weak);
+
+    // Weak references dropped before the object
+    obj = (int *)rc_alloc(sizeof(int), count_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+    rc_weak_deref(rc_weak_ref(obj));
+    deref(obj);
+    CU_ASSERT_EQUAL(destroyed, 2);
+
+    // Readers upgrade while the owner destroys the object
+    memset(args, 0, sizeof(args));
+    for (i = 0; i < WEAK_THREADS; i++)
+        pthread_create(&threads[i], NULL, weak_routine, &args[i]);
+
+    for (round = 0; round < WEAK_ROUNDS; round++) {
+        obj = (int *)rc_alloc(sizeof(int), count_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+        *obj = WEAK_MAGIC;
+
+        for (i = 0; i < WEAK_THREADS; i++) {
+            while (__atomic_load_n(&args[i].slot, __ATOMIC_ACQUIRE))
+                sched_yield();
+            __atomic_store_n(&args[i].slot, rc_weak_ref(obj), __ATOMIC_RELEASE);
+        }
+
+        deref(obj);
+    }
+
+    for (i = 0; i < WEAK_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT_EQUAL(args[i].rc, 0);
+    }
+
+    CU_ASSERT_EQUAL(destroyed, 2 + WEAK_ROUNDS);
+}
+
+#define BIASED_OBJECTS  1000
+
+typedef struct biased_args {
+    void **objects;
+    int op;
+} biased_args;
+
+/* Release, share or create objects on a thread other than their owner */
+static void *biased_routine(void *arg)
+{
+    biased_args *args = (biased_args *)arg;
+    int i, j;
+
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        switch (args->op) {
+        case 0:
+            deref(args->objects[i]);
+            break;
+
+        case 1:
+            for (j = 0; j < 3; j++)
+                ref(args->objects[i]);
+            deref(args->objects[i]);
+            break;
+
+        case 2:
+            for (j = 0; j < 2; j++)
+                deref(args->objects[i]);
+            break;
+
+        case 3:
+            args->objects[i] = rc_alloc(sizeof(int), count_destructor);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void biased_run(void **objects, int op)
+{
+    biased_args args;
+    pthread_t thread;
+
+    args.objects = objects;
+    args.op = op;
+
+    pthread_create(&thread, NULL, biased_routine, &args);
+    pthread_join(thread, NULL);
+}
+
+static void rc_biased_test(void)
+{
+    static void *objects[BIASED_OBJECTS];
+    static rc_weak_t *weaks[BIASED_OBJECTS];
+    biased_args args;
+    pthread_t thread;
+    int i;
+
+    destroyed = 0;
+
+    // Owner only
+    objects[0] = rc_alloc(sizeof(int), count_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(objects[0]);
+    for (i = 0; i < 100; i++)
+        ref(objects[0]);
+    CU_ASSERT_EQUAL(nrefs(objects[0]), 101);
+    for (i = 0; i < 100; i++)
+        deref(objects[0]);
+    CU_ASSERT_EQUAL(nrefs(objects[0]), 1);
+    CU_ASSERT_EQUAL(destroyed, 0);
+    deref(objects[0]);
+    CU_ASSERT_EQUAL(destroyed, 1);
+
+    // The last reference handed to another thread, the owner stays idle
+    destroyed = 0;
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        objects[i] = rc_alloc(sizeof(int), count_destructor);
+        weaks[i] = rc_weak_ref(objects[i]);
+    }
+    biased_run(objects, 0);
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        CU_ASSERT_PTR_NULL(rc_weak_get(weaks[i]));
+        rc_weak_deref(weaks[i]);
+    }
+
+    // Two references handed over, queued after the first release
+    destroyed = 0;
+    for (i = 0; i < BIASED_OBJECTS; i++)
+        objects[i] = ref(rc_alloc(sizeof(int), count_destructor));
+    biased_run(objects, 2);
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+
+    // One of two handed over, the owner releases its own afterwards
+    destroyed = 0;
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        objects[i] = ref(rc_alloc(sizeof(int), count_destructor));
+        weaks[i] = rc_weak_ref(objects[i]);
+    }
+    biased_run(objects, 0);
+    CU_ASSERT_EQUAL(destroyed, 0);
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        CU_ASSERT_EQUAL(nrefs(objects[i]), 1);
+        deref(objects[i]);
+        CU_ASSERT_PTR_NULL(rc_weak_get(weaks[i]));
+        rc_weak_deref(weaks[i]);
+    }
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+
+    // Both release at the same time, what is left is merged by the owner
+    destroyed = 0;
+    for (i = 0; i < BIASED_OBJECTS; i++)
+        objects[i] = ref(rc_alloc(sizeof(int), count_destructor));
+    args.objects = objects;
+    args.op = 0;
+    pthread_create(&thread, NULL, biased_routine, &args);
+    for (i = 0; i < BIASED_OBJECTS; i++)
+        deref(objects[i]);
+    pthread_join(thread, NULL);
+    deref(rc_alloc(1, NULL));
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+
+    // Shared between threads, last released by the other one
+    destroyed = 0;
+    for (i = 0; i < BIASED_OBJECTS; i++)
+        objects[i] = rc_alloc(sizeof(int), count_destructor);
+    biased_run(objects, 1);
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        CU_ASSERT_EQUAL(nrefs(objects[i]), 3);
+        deref(objects[i]);
+    }
+    CU_ASSERT_EQUAL(destroyed, 0);
+    biased_run(objects, 2);
+    deref(rc_alloc(1, NULL));
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+
+    // Objects of a thread that exited
+    destroyed = 0;
+    biased_run(objects, 3);
+    for (i = 0; i < BIASED_OBJECTS; i++) {
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+        CU_ASSERT_EQUAL(nrefs(objects[i]), 1);
+        ref(objects[i]);
+        deref(objects[i]);
+        deref(objects[i]);
+    }
+    CU_ASSERT_EQUAL(destroyed, BIASED_OBJECTS);
+}
+
+#define DEFER_OBJECTS   1000
+
+static int defer_reader_state;
+
+/* Stays inside a read-side section until told to leave */
+static void *defer_reader_routine(void *arg)
+{
+    (void)arg;
+
+    rc_epoch_enter();
+    __atomic_store_n(&defer_reader_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&defer_reader_state, __ATOMIC_ACQUIRE) != 2)
+        sched_yield();
+    rc_epoch_exit();
+
+    return NULL;
+}
+
+static void rc_defer_test(void)
+{
+    pthread_t thread;
+    void *obj;
+    int i;
+
+    CU_ASSERT_EQUAL(rc_mem_defer(1), 0);
+    CU_ASSERT_EQUAL(rc_mem_defer(1), 1);
+
+    // Destroyed at the safe point only
+    destroyed = 0;
+    for (i = 0; i < 10; i++)
+        deref(rc_alloc(sizeof(int), count_destructor));
+    CU_ASSERT_EQUAL(destroyed, 0);
+    rc_mem_reclaim();
+    CU_ASSERT_EQUAL(destroyed, 10);
+
+    // Full batches retired on the way
+    destroyed = 0;
+    for (i = 0; i < DEFER_OBJECTS; i++)
+        deref(rc_alloc(sizeof(int), count_destructor));
+    rc_mem_reclaim();
+    CU_ASSERT_EQUAL(destroyed, DEFER_OBJECTS);
+
+    // Held back by a reader, then destroyed by the reclaimer
+    CU_ASSERT_EQUAL(rc_mem_reclaimer_start(), 0);
+    CU_ASSERT_EQUAL(rc_mem_reclaimer_start(), 0);
+
+    defer_reader_state = 0;
+    pthread_create(&thread, NULL, defer_reader_routine, NULL);
+    while (__atomic_load_n(&defer_reader_state, __ATOMIC_ACQUIRE) != 1)
+        sched_yield();
+
+    destroyed = 0;
+    obj = rc_alloc(sizeof(int), count_destructor);
+    deref(obj);
+    rc_mem_reclaim();
+    for (i = 0; i < 1000; i++)
+        sched_yield();
+    CU_ASSERT_EQUAL(__atomic_load_n(&destroyed, __ATOMIC_RELAXED), 0);
+
+    __atomic_store_n(&defer_reader_state, 2, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    for (i = 0; i < DEFER_OBJECTS; i++)
+        deref(rc_alloc(sizeof(int), count_destructor));
+    rc_mem_reclaim();
+    rc_mem_reclaimer_stop();
+    CU_ASSERT_EQUAL(destroyed, DEFER_OBJECTS + 1);
+
+    // Back to immediate destruction
+    CU_ASSERT_EQUAL(rc_mem_defer(0), 1);
+    destroyed = 0;
+    deref(rc_alloc(sizeof(int), count_destructor));
+    CU_ASSERT_EQUAL(destroyed, 1);
+}
+
+static void rc_aligned_test(void)
+{
+    size_t align;
+    uint8_t *p;
+    int i;
+
+    destroyed = 0;
+    CU_ASSERT_PTR_NULL(rc_alloc_aligned(16, 48, NULL));
+
+    for (align = 1, i = 0; align <= 8192; align <<= 1, i++) {
+        p = (uint8_t *)rc_alloc_aligned(object_size(i), align, count_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+        CU_ASSERT_EQUAL((uintptr_t)p % align, 0);
+        fill(p, object_size(i), i);
+
+        ref(p);
+        CU_ASSERT_EQUAL(nrefs(p), 2);
+        deref(p);
+
+        // Grown past the block, the data and the alignment move along.
+        p = (uint8_t *)rc_realloc(p, object_size(i) + 4096);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+        CU_ASSERT_EQUAL((uintptr_t)p % align, 0);
+        CU_ASSERT_TRUE(check(p, object_size(i), i));
+        CU_ASSERT_EQUAL(nrefs(p), 1);
+        deref(p);
+    }
+    CU_ASSERT_EQUAL(destroyed, i);
+}
+
+static void rc_hugepage_test(void)
+{
+    size_t size = 4 * 1024 * 1024;
+    int flags[] = { RC_MEM_HUGEPAGE_THP, RC_MEM_HUGEPAGE_HUGETLB };
+    uint8_t *p, *small;
+    int i;
+
+    CU_ASSERT_EQUAL(rc_mem_hugepage_enable(1024 * 1024, 0), -1);
+
+    destroyed = 0;
+    for (i = 0; i < 2; i++) {
+        CU_ASSERT_EQUAL(rc_mem_hugepage_enable(1024 * 1024, flags[i]), 0);
+
+        p = (uint8_t *)rc_zalloc(size, count_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+        CU_ASSERT_EQUAL((uintptr_t)p % 64, 0);
+        CU_ASSERT_EQUAL(p[0] | p[size / 2] | p[size - 1], 0);
+        fill(p, size, i);
+
+        small = (uint8_t *)rc_alloc(64, NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(small);
+
+        p = (uint8_t *)rc_realloc(p, size * 2);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+        CU_ASSERT_TRUE(check(p, size, i));
+
+        deref(small);
+        deref(p);
+    }
+    CU_ASSERT_EQUAL(destroyed, 2);
+
+    // Objects mapped before stay valid after disabling.
+    p = (uint8_t *)rc_alloc(size, count_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+    CU_ASSERT_EQUAL(rc_mem_hugepage_enable(0, 0), 0);
+    fill(p, size, 3);
+    CU_ASSERT_TRUE(check(p, size, 3));
+    deref(p);
+    CU_ASSERT_EQUAL(destroyed, 3);
+}
+
+#define TRACK_OBJECTS   20000
+
+static void track_destructor(void *data)
+{
+}
+
+static int track_site_of(rc_mem_destructor *destructor, rc_mem_site_stats_t *site)
+{
+    rc_mem_site_stats_t sites[64];
+    rc_mem_track_stats_t stats;
+    size_t i, n = 64;
+
+    if (rc_mem_track_stats(&stats, sites, &n) < 0)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        if (sites[i].destructor == destructor) {
+            *site = sites[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void rc_track_test(void)
+{
+    static void *objects[TRACK_OBJECTS];
+    rc_mem_site_stats_t site;
+    rc_mem_track_stats_t stats;
+    double estimate;
+    FILE *fp;
+    int i;
+
+    // Every allocation
+    CU_ASSERT_EQUAL(rc_mem_track_enable(1, 0), 0);
+    for (i = 0; i < 100; i++) {
+        objects[i] = rc_alloc(100, track_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+    }
+
+    CU_ASSERT_FATAL(track_site_of(track_destructor, &site));
+    CU_ASSERT_PTR_NOT_NULL(site.caller);
+    CU_ASSERT_EQUAL(site.live_objects, 100);
+    CU_ASSERT_EQUAL(site.live_bytes, 100 * 100);
+    CU_ASSERT_EQUAL(site.total_objects, 100);
+
+    objects[0] = rc_realloc(objects[0], 2000);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(objects[0]);
+    for (i = 40; i < 100; i++)
+        deref(objects[i]);
+
+    CU_ASSERT_FATAL(track_site_of(track_destructor, &site));
+    CU_ASSERT_EQUAL(site.live_objects, 40);
+    CU_ASSERT_EQUAL(site.live_bytes, 39 * 100 + 2000);
+    CU_ASSERT_EQUAL(site.peak_bytes, 99 * 100 + 2000);
+
+    CU_ASSERT_EQUAL(rc_mem_track_stats(&stats, NULL, NULL), 0);
+    CU_ASSERT_TRUE(stats.live_bytes >= site.live_bytes);
+    CU_ASSERT_TRUE(stats.peak_bytes >= site.peak_bytes);
+    CU_ASSERT_TRUE(stats.nsites >= 1);
+
+    fp = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fp);
+    CU_ASSERT_EQUAL(rc_mem_track_dump(fp, 10), 0);
+    CU_ASSERT_TRUE(ftell(fp) > 0);
+    fclose(fp);
+
+    // Still accounted for after tracking stopped
+    CU_ASSERT_EQUAL(rc_mem_track_enable(0, 0), 0);
+    for (i = 0; i < 40; i++)
+        deref(objects[i]);
+    CU_ASSERT_FATAL(track_site_of(track_destructor, &site));
+    CU_ASSERT_EQUAL(site.live_objects, 0);
+    CU_ASSERT_EQUAL(site.live_bytes, 0);
+
+    // Sampled, about one allocation per 4 KiB
+    rc_mem_track_reset();
+    CU_ASSERT_EQUAL(rc_mem_track_enable(1, 4096), 0);
+    for (i = 0; i < TRACK_OBJECTS; i++) {
+        objects[i] = rc_alloc(256, track_destructor);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+    }
+    CU_ASSERT_EQUAL(rc_mem_track_enable(0, 0), 0);
+
+    CU_ASSERT_FATAL(track_site_of(track_destructor, &site));
+    estimate = (double)site.live_bytes / (TRACK_OBJECTS * 256.0);
+    CU_ASSERT_TRUE(estimate > 0.75 && estimate < 1.25);
+    CU_ASSERT_EQUAL(site.peak_bytes, site.live_bytes);
+    CU_ASSERT_EQUAL(site.total_bytes, site.live_bytes);
+
+    for (i = 0; i < TRACK_OBJECTS; i++)
+        deref(objects[i]);
+    CU_ASSERT_FATAL(track_site_of(track_destructor, &site));
+    CU_ASSERT_EQUAL(site.live_bytes, 0);
+}
+
+typedef struct cow_blob {
+    int version;
+    int values[64];
+} cow_blob;
+
+static int copies;
+
+static void cow_destructor(void *data)
+{
+    __atomic_fetch_add(&destroyed, 1, __ATOMIC_RELAXED);
+}
+
+static void *cow_copy(const void *data)
+{
+    cow_blob *blob = (cow_blob *)rc_alloc(sizeof(cow_blob), cow_destructor);
+
+    if (blob) {
+        memcpy(blob, data, sizeof(cow_blob));
+        copies++;
+    }
+
+    return blob;
+}
+
+static int cow_state;
+
+/* Takes a reference of its own, writes once the allocating thread let go */
+static void *cow_routine(void *arg)
+{
+    void *data = ref(arg);
+
+    __atomic_store_n(&cow_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&cow_state, __ATOMIC_ACQUIRE) != 2)
+        sched_yield();
+
+    return rc_cow(data, NULL);
+}
+
+static int cow_unique;
+
+/* Gets the allocating thread's reference handed over */
+static void *cow_handoff_routine(void *arg)
+{
+    cow_unique = rc_unique(arg);
+
+    return rc_cow(arg, NULL);
+}
+
+static void rc_cow_test(void)
+{
+    cow_blob *blob, *shared, *w;
+    rc_weak_t *weak;
+    pthread_t thread;
+    void *result;
+
+    destroyed = 0;
+    copies = 0;
+
+    blob = (cow_blob *)rc_zalloc(sizeof(cow_blob), cow_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(blob);
+    CU_ASSERT_TRUE(rc_unique(blob));
+
+    // Sole owner: written in place
+    w = (cow_blob *)rc_cow(blob, cow_copy);
+    CU_ASSERT_PTR_EQUAL(w, blob);
+    CU_ASSERT_EQUAL(copies, 0);
+
+    // Shared: the writer gets a copy, the reader keeps the original.
+    shared = (cow_blob *)ref(blob);
+    CU_ASSERT_FALSE(rc_unique(blob));
+    CU_ASSERT_PTR_NULL(rc_cow(blob, NULL));
+    CU_ASSERT_EQUAL(nrefs(blob), 2);
+
+    w = (cow_blob *)rc_cow(blob, cow_copy);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(w);
+    CU_ASSERT_PTR_NOT_EQUAL(w, shared);
+    CU_ASSERT_EQUAL(copies, 1);
+    CU_ASSERT_EQUAL(nrefs(shared), 1);
+    w->version = 1;
+    CU_ASSERT_EQUAL(shared->version, 0);
+
+    // Registered copy handler, and a weak reference counting as shared
+    CU_ASSERT_EQUAL(rc_mem_copy_register(cow_destructor, NULL), -1);
+    CU_ASSERT_EQUAL(rc_mem_copy_register(cow_destructor, cow_copy), 0);
+    weak = rc_weak_ref(w);
+    blob = (cow_blob *)rc_cow(w, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(blob);
+    CU_ASSERT_PTR_NOT_EQUAL(blob, w);
+    CU_ASSERT_EQUAL(blob->version, 1);
+    CU_ASSERT_EQUAL(copies, 2);
+    CU_ASSERT_EQUAL(destroyed, 1);
+    CU_ASSERT_PTR_NULL(rc_weak_get(weak));
+    rc_weak_deref(weak);
+    deref(blob);
+
+    // Handed over to another thread
+    cow_state = 0;
+    pthread_create(&thread, NULL, cow_routine, shared);
+    while (__atomic_load_n(&cow_state, __ATOMIC_ACQUIRE) != 1)
+        sched_yield();
+    CU_ASSERT_FALSE(rc_unique(shared));
+    deref(shared);
+    __atomic_store_n(&cow_state, 2, __ATOMIC_RELEASE);
+    pthread_join(thread, &result);
+    CU_ASSERT_PTR_EQUAL(result, shared);
+    CU_ASSERT_EQUAL(copies, 2);
+    deref(result);
+    CU_ASSERT_EQUAL(destroyed, 3);
+
+    // The only reference handed over before the allocating thread let go
+    blob = (cow_blob *)rc_zalloc(sizeof(cow_blob), cow_destructor);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(blob);
+    pthread_create(&thread, NULL, cow_handoff_routine, blob);
+    pthread_join(thread, &result);
+    CU_ASSERT_TRUE(cow_unique);
+    CU_ASSERT_PTR_EQUAL(result, blob);
+    CU_ASSERT_EQUAL(copies, 2);
+
+    // One of two handed over: the receiver writes to a copy.
+    ref(blob);
+    pthread_create(&thread, NULL, cow_handoff_routine, blob);
+    pthread_join(thread, &result);
+    CU_ASSERT_FALSE(cow_unique);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(result);
+    CU_ASSERT_PTR_NOT_EQUAL(result, blob);
+    CU_ASSERT_EQUAL(copies, 3);
+    CU_ASSERT_TRUE(rc_unique(blob));
+    deref(blob);
+    deref(result);
+
+    CU_ASSERT_EQUAL(destroyed, 5);
+}
+
+static int rc_mem_test_suite_init(void)
+{
+    return 0;
+}
+
+static int rc_mem_test_suite_cleanup(void)
+{
+    rc_mem_pool_enable(0);
+    rc_mem_hugepage_enable(0, 0);
+    rc_mem_track_enable(0, 0);
+    return 0;
+}
+
+static CU_TestInfo cases[] = {
+    { "rc_mem_basic_test", rc_mem_basic_test },
+    { "rc_mem_pool_test", rc_mem_pool_test },
+    { "rc_arena_test", rc_arena_test },
+    { "rc_weak_test", rc_weak_test },
+    { "rc_biased_test", rc_biased_test },
+    { "rc_defer_test", rc_defer_test },
+    { "rc_aligned_test", rc_aligned_test },
+    { "rc_hugepage_test", rc_hugepage_test },
+    { "rc_track_test", rc_track_test },
+    { "rc_cow_test", rc_cow_test },
+    { NULL, NULL }
+};
+
+static CU_SuiteInfo suite[] = {
+    {
+        "rc_mem test",
+        rc_mem_test_suite_init,
+        rc_mem_test_suite_cleanup,
+        NULL,
+        NULL,
+        cases
+    },
+    {
+        NULL
+    }
+};
+
+CU_SuiteInfo* rc_mem_test_suite_info(void)
+{
+    return suite;
+}
@@ -9,9 +9,21 @@ typedef struct TestSuite {
 
 CU_SuiteInfo* bitset_test_suite_info(void);
 CU_SuiteInfo* base58_test_suite_info(void);
+CU_SuiteInfo* epoch_test_suite_info(void);
+CU_SuiteInfo* linkedhashtable_test_suite_info(void);
+CU_SuiteInfo* linkedhashtable_map_test_suite_info(void);
+CU_SuiteInfo* linkedhashtable_u64_test_suite_info(void);
+CU_SuiteInfo* rc_buf_test_suite_info(void);
+CU_SuiteInfo* rc_mem_test_suite_info(void);
 
 TestSuite suites[] = {
     { "bitset_test.c", bitset_test_suite_info },
     { "base58_test.c", base58_test_suite_info },
+    { "epoch_test.c", epoch_test_suite_info },
+    { "linkedhashtable_test.c", linkedhashtable_test_suite_info },
+    { "linkedhashtable_map_test.c", linkedhashtable_map_test_suite_info },
+    { "linkedhashtable_u64_test.c", linkedhashtable_u64_test_suite_info },
+    { "rc_buf_test.c", rc_buf_test_suite_info },
+    { "rc_mem_test.c", rc_mem_test_suite_info },
     { NULL, NULL}
 };